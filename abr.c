@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "abr.h"
+
+// Decisions are made once per this interval
+#define INTERVAL_NSEC INT64_C(1000000000)
+
+// The outputs are congested when writing a frame takes more than this
+// fraction of the frame interval on average, and clear when it takes
+// less than CLEAR_RATIO. The bitrate is kept as is between the two.
+#define CONGESTED_RATIO 0.25f
+#define CLEAR_RATIO 0.05f
+
+// Multiplicative decrease per interval
+#define DECREASE_FACTOR 0.75f
+
+// Additive increase per interval as a fraction of max_bitrate
+#define INCREASE_STEP_RATIO 0.05f
+
+// Number of clear intervals in a row before the bitrate is increased
+#define CLEAR_INTERVALS_BEFORE_INCREASE 3
+
+// Number of intervals in which the bitrate is not increased after a decrease
+#define HOLD_INTERVALS_AFTER_DECREASE 5
+
+// A keyframe is requested when the bitrate has changed by this ratio
+#define KEYFRAME_CHANGE_RATIO 0.3f
+
+static int is_enabled = 0;
+static long min_bitrate;
+static long max_bitrate;
+static int64_t frame_interval_nsec;
+
+static long bitrate = 0; // chosen by the last decision
+static ABR_DECISION uncommitted_decision = ABR_DECISION_NONE;
+static long keyframe_bitrate = 0; // bitrate when the last keyframe was requested
+static int needs_keyframe = 0;
+
+static int64_t frame_write_nsec = 0;
+static int64_t interval_start_time = 0;
+static int64_t interval_write_nsec = 0;
+static int interval_frames = 0;
+static int64_t average_write_nsec = 0;
+static int clear_intervals = 0;
+static int hold_intervals = 0;
+
+void abr_init(long min, long max, float fps) {
+  min_bitrate = min;
+  max_bitrate = max;
+  frame_interval_nsec = (fps > 0.0f) ? 1000000000 / fps : 1000000000 / 30;
+  is_enabled = 1;
+}
+
+int64_t abr_now() {
+  struct timespec ts;
+  if (!is_enabled) {
+    return 0;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+void abr_add_write_time(int64_t start_time) {
+  if (!is_enabled || start_time == 0) {
+    return;
+  }
+  frame_write_nsec += abr_now() - start_time;
+}
+
+int64_t abr_take_write_time() {
+  int64_t write_nsec = frame_write_nsec;
+  frame_write_nsec = 0;
+  return write_nsec;
+}
+
+long abr_get_bitrate() {
+  return bitrate;
+}
+
+int64_t abr_get_write_time() {
+  return average_write_nsec;
+}
+
+int abr_needs_keyframe() {
+  int ret = needs_keyframe;
+  needs_keyframe = 0;
+  return ret;
+}
+
+ABR_DECISION abr_end_frame(long current_bitrate, int64_t now, int64_t write_nsec) {
+  ABR_DECISION decision = ABR_DECISION_NONE;
+
+  if (!is_enabled) {
+    return ABR_DECISION_NONE;
+  }
+  interval_write_nsec += write_nsec;
+  interval_frames++;
+
+  if (interval_start_time == 0) {
+    interval_start_time = now;
+    keyframe_bitrate = current_bitrate;
+    return ABR_DECISION_NONE;
+  }
+  if (now - interval_start_time < INTERVAL_NSEC) {
+    return ABR_DECISION_NONE;
+  }
+
+  average_write_nsec = interval_write_nsec / interval_frames;
+  interval_start_time = now;
+  interval_write_nsec = 0;
+  interval_frames = 0;
+  uncommitted_decision = ABR_DECISION_NONE;
+
+  // The bitrate may have been changed by the bitrate command,
+  // so decisions are always relative to the current bitrate.
+  bitrate = current_bitrate;
+  if (average_write_nsec > frame_interval_nsec * CONGESTED_RATIO) {
+    clear_intervals = 0;
+    if (current_bitrate > min_bitrate) {
+      bitrate = current_bitrate * DECREASE_FACTOR;
+      if (bitrate < min_bitrate) {
+        bitrate = min_bitrate;
+      }
+      decision = ABR_DECISION_DECREASE;
+    } else {
+      // Nothing to commit; hold the increase as abr_commit() would
+      hold_intervals = HOLD_INTERVALS_AFTER_DECREASE;
+    }
+  } else if (average_write_nsec < frame_interval_nsec * CLEAR_RATIO) {
+    if (hold_intervals > 0) {
+      hold_intervals--;
+    } else if (++clear_intervals >= CLEAR_INTERVALS_BEFORE_INCREASE &&
+        current_bitrate < max_bitrate) {
+      bitrate = current_bitrate + max_bitrate * INCREASE_STEP_RATIO;
+      if (bitrate > max_bitrate) {
+        bitrate = max_bitrate;
+      }
+      decision = ABR_DECISION_INCREASE;
+    }
+  } else {
+    clear_intervals = 0;
+  }
+
+  // The rest is done by abr_commit()
+  uncommitted_decision = decision;
+  return decision;
+}
+
+void abr_commit(long new_bitrate) {
+  if (uncommitted_decision == ABR_DECISION_DECREASE) {
+    hold_intervals = HOLD_INTERVALS_AFTER_DECREASE;
+  }
+  if (uncommitted_decision != ABR_DECISION_NONE &&
+      labs(new_bitrate - keyframe_bitrate) >= keyframe_bitrate * KEYFRAME_CHANGE_RATIO) {
+    needs_keyframe = 1;
+    keyframe_bitrate = new_bitrate;
+  }
+  uncommitted_decision = ABR_DECISION_NONE;
+}
@@ -0,0 +1,82 @@
+#ifndef PICAM_ABR_H
+#define PICAM_ABR_H
+
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+typedef enum ABR_DECISION {
+  ABR_DECISION_NONE = 0,
+  ABR_DECISION_DECREASE = 1,
+  ABR_DECISION_INCREASE = 2,
+} ABR_DECISION;
+
+/**
+ * Enables the adaptive bitrate controller. The bitrate is kept within
+ * min_bitrate and max_bitrate. fps is used to tell how long the outputs
+ * may take to write a frame.
+ */
+void abr_init(long min_bitrate, long max_bitrate, float fps);
+
+/**
+ * Returns the current time in nanoseconds for measuring output writes,
+ * or 0 if the controller is disabled.
+ */
+int64_t abr_now();
+
+/**
+ * Adds the time elapsed since start_time (returned by abr_now())
+ * to the write time of the current video frame.
+ */
+void abr_add_write_time(int64_t start_time);
+
+/**
+ * Returns the write time added by abr_add_write_time() since
+ * the last call in nanoseconds, and resets it.
+ */
+int64_t abr_take_write_time();
+
+/**
+ * Ends the current video frame at now (in nanoseconds), which took
+ * write_nsec to write to the outputs. Once per second, the controller
+ * decides whether current_bitrate should be changed. If the decision is
+ * not ABR_DECISION_NONE, the new bitrate is returned by abr_get_bitrate(),
+ * and the caller passes it to abr_commit() once the encoder has accepted
+ * it. A decision which is not committed leaves the controller as if it
+ * had not been made.
+ * The controller does not read the clock, so it can be driven by
+ * recorded traces (see tools/abr_sim.c).
+ * This must be called from a single thread.
+ */
+ABR_DECISION abr_end_frame(long current_bitrate, int64_t now, int64_t write_nsec);
+
+/**
+ * Returns the bitrate chosen by the last decision.
+ */
+long abr_get_bitrate();
+
+/**
+ * Records that the encoder is now running at new_bitrate as decided by
+ * the last abr_end_frame(). This must be called from the same thread.
+ */
+void abr_commit(long new_bitrate);
+
+/**
+ * Returns nonzero if the bitrate has changed so much since the last
+ * forced keyframe that a new keyframe should be requested.
+ * The flag is cleared by this call.
+ */
+int abr_needs_keyframe();
+
+/**
+ * Returns the average write time per frame in the last second in nanoseconds.
+ */
+int64_t abr_get_write_time();
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // PICAM_ABR_H
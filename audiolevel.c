@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "audiolevel.h"
+
+// Short-term loudness is measured over this duration (EBU R 128)
+#define SHORT_TERM_WINDOW_SEC 3
+
+#define MAX_CHANNELS 2
+
+// Biquad filter in direct form II transposed
+typedef struct biquad {
+  float b0, b1, b2, a1, a2;
+  float z1[MAX_CHANNELS];
+  float z2[MAX_CHANNELS];
+} biquad;
+
+static int channels;
+static int period_size;
+static int sample_rate;
+
+// K-weighting filter (high shelf followed by high pass)
+static biquad shelf_filter;
+static biquad highpass_filter;
+
+// Sum of squared K-weighted samples for each period in the window
+static double *window_energies = NULL;
+static int window_periods;
+static int window_index = 0;
+static int window_filled_periods = 0;
+static double window_energy_sum = 0.0;
+
+// Accumulated since the last audiolevel_read()
+static int32_t interval_peak = 0;
+static int64_t interval_square_sum = 0;
+static int64_t interval_samples = 0;
+
+// Silence detection
+static int is_silence_detection_enabled = 0;
+static int64_t silence_threshold_square_sum; // per period
+static int silence_periods_required;
+static int silent_periods = 0;
+static int is_silent = 0;
+
+static float amplitude_to_db(double amplitude) {
+  if (amplitude <= 0.0) {
+    return AUDIOLEVEL_MIN_DB;
+  }
+  float db = 20.0f * log10(amplitude);
+  if (db < AUDIOLEVEL_MIN_DB) {
+    return AUDIOLEVEL_MIN_DB;
+  }
+  return db;
+}
+
+// Coefficients are derived from the sample rate in the same way as
+// libebur128 does, so any sample rate gives ITU-R BS.1770 K-weighting.
+static void setup_k_weighting(int rate) {
+  double f0, G, Q, K, Vh, Vb, a0;
+
+  memset(&shelf_filter, 0, sizeof(biquad));
+  f0 = 1681.974450955533;
+  G = 3.999843853973347;
+  Q = 0.7071752369554196;
+  K = tan(M_PI * f0 / rate);
+  Vh = pow(10.0, G / 20.0);
+  Vb = pow(Vh, 0.4996667741545416);
+  a0 = 1.0 + K / Q + K * K;
+  shelf_filter.b0 = (Vh + Vb * K / Q + K * K) / a0;
+  shelf_filter.b1 = 2.0 * (K * K - Vh) / a0;
+  shelf_filter.b2 = (Vh - Vb * K / Q + K * K) / a0;
+  shelf_filter.a1 = 2.0 * (K * K - 1.0) / a0;
+  shelf_filter.a2 = (1.0 - K / Q + K * K) / a0;
+
+  memset(&highpass_filter, 0, sizeof(biquad));
+  f0 = 38.13547087602444;
+  Q = 0.5003270373238773;
+  K = tan(M_PI * f0 / rate);
+  a0 = 1.0 + K / Q + K * K;
+  highpass_filter.b0 = 1.0;
+  highpass_filter.b1 = -2.0;
+  highpass_filter.b2 = 1.0;
+  highpass_filter.a1 = 2.0 * (K * K - 1.0) / a0;
+  highpass_filter.a2 = (1.0 - K / Q + K * K) / a0;
+}
+
+static inline float biquad_process(biquad *f, int ch, float in) {
+  float out = f->b0 * in + f->z1[ch];
+  f->z1[ch] = f->b1 * in - f->a1 * out + f->z2[ch];
+  f->z2[ch] = f->b2 * in - f->a2 * out;
+  return out;
+}
+
+void audiolevel_init(int rate, int num_channels, int num_frames) {
+  sample_rate = rate;
+  channels = num_channels;
+  if (channels > MAX_CHANNELS) {
+    fprintf(stderr, "audiolevel: too many channels: %d\n", channels);
+    channels = MAX_CHANNELS;
+  }
+  period_size = num_frames;
+
+  setup_k_weighting(sample_rate);
+
+  window_periods = (SHORT_TERM_WINDOW_SEC * sample_rate + period_size - 1) / period_size;
+  window_energies = calloc(window_periods, sizeof(double));
+  if (window_energies == NULL) {
+    perror("calloc for window_energies");
+    exit(EXIT_FAILURE);
+  }
+  window_index = 0;
+  window_filled_periods = 0;
+  window_energy_sum = 0.0;
+
+  interval_peak = 0;
+  interval_square_sum = 0;
+  interval_samples = 0;
+}
+
+void audiolevel_teardown() {
+  free(window_energies);
+  window_energies = NULL;
+}
+
+void audiolevel_set_silence_detection(float threshold_dbfs, float duration_sec) {
+  double threshold_amplitude = 32768.0 * pow(10.0, threshold_dbfs / 20.0);
+
+  // Compare sum of squares directly to avoid sqrt per period
+  silence_threshold_square_sum = (int64_t)
+    (threshold_amplitude * threshold_amplitude * period_size * channels);
+  silence_periods_required = (int) ceil(duration_sec * sample_rate / period_size);
+  if (silence_periods_required < 1) {
+    silence_periods_required = 1;
+  }
+  silent_periods = 0;
+  is_silent = 0;
+  is_silence_detection_enabled = 1;
+}
+
+AUDIOLEVEL_EVENT audiolevel_process(const int16_t *samples) {
+  int total_samples = period_size * channels;
+  int32_t peak = 0;
+  int64_t square_sum = 0;
+  int i, ch;
+
+  // Plain loop so that the compiler can vectorize it
+  for (i = 0; i < total_samples; i++) {
+    int32_t value = samples[i];
+    int32_t abs_value = value < 0 ? -value : value;
+    if (abs_value > peak) {
+      peak = abs_value;
+    }
+    square_sum += value * value;
+  }
+
+  if (peak > interval_peak) {
+    interval_peak = peak;
+  }
+  interval_square_sum += square_sum;
+  interval_samples += total_samples;
+
+  // K-weighted energy for short-term loudness
+  double energy = 0.0;
+  for (ch = 0; ch < channels; ch++) {
+    float ch_energy = 0.0f;
+    for (i = 0; i < period_size; i++) {
+      float value = samples[i * channels + ch] * (1.0f / 32768.0f);
+      value = biquad_process(&shelf_filter, ch, value);
+      value = biquad_process(&highpass_filter, ch, value);
+      ch_energy += value * value;
+    }
+    energy += ch_energy;
+  }
+  window_energy_sum += energy - window_energies[window_index];
+  window_energies[window_index] = energy;
+  if (++window_index == window_periods) {
+    window_index = 0;
+  }
+  if (window_filled_periods < window_periods) {
+    window_filled_periods++;
+  }
+
+  if (!is_silence_detection_enabled) {
+    return AUDIOLEVEL_EVENT_NONE;
+  }
+  if (square_sum < silence_threshold_square_sum) {
+    if (silent_periods < silence_periods_required) {
+      silent_periods++;
+      if (silent_periods == silence_periods_required) {
+        is_silent = 1;
+        return AUDIOLEVEL_EVENT_SILENCE_START;
+      }
+    }
+  } else {
+    silent_periods = 0;
+    if (is_silent) {
+      is_silent = 0;
+      return AUDIOLEVEL_EVENT_SILENCE_END;
+    }
+  }
+  return AUDIOLEVEL_EVENT_NONE;
+}
+
+void audiolevel_read(audiolevel_stats *stats) {
+  stats->peak_dbfs = amplitude_to_db(interval_peak / 32768.0);
+  if (interval_samples > 0) {
+    stats->rms_dbfs = amplitude_to_db(
+        sqrt((double) interval_square_sum / interval_samples) / 32768.0);
+  } else {
+    stats->rms_dbfs = AUDIOLEVEL_MIN_DB;
+  }
+
+  // window_energy_sum may slightly drift below zero due to rounding
+  if (window_filled_periods > 0 && window_energy_sum > 0.0) {
+    double mean_square = window_energy_sum / ((double) window_filled_periods * period_size);
+    stats->loudness_lufs = -0.691f + 10.0f * log10(mean_square);
+    if (stats->loudness_lufs < AUDIOLEVEL_MIN_DB) {
+      stats->loudness_lufs = AUDIOLEVEL_MIN_DB;
+    }
+  } else {
+    stats->loudness_lufs = AUDIOLEVEL_MIN_DB;
+  }
+  stats->is_silent = is_silent;
+
+  interval_peak = 0;
+  interval_square_sum = 0;
+  interval_samples = 0;
+}
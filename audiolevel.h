@@ -0,0 +1,50 @@
+#ifndef PICAM_AUDIOLEVEL_H
+#define PICAM_AUDIOLEVEL_H
+
+#include <stdint.h>
+
+// Levels lower than this are reported as this value
+#define AUDIOLEVEL_MIN_DB -120.0f
+
+typedef enum AUDIOLEVEL_EVENT {
+  AUDIOLEVEL_EVENT_NONE = 0,
+  AUDIOLEVEL_EVENT_SILENCE_START = 1,
+  AUDIOLEVEL_EVENT_SILENCE_END = 2,
+} AUDIOLEVEL_EVENT;
+
+// Audio levels accumulated since the last call to audiolevel_read()
+typedef struct audiolevel_stats {
+  float peak_dbfs;     // sample peak
+  float rms_dbfs;      // RMS of all samples
+  float loudness_lufs; // short-term (3 seconds) K-weighted loudness
+  int is_silent;       // nonzero while silence is being detected
+} audiolevel_stats;
+
+/**
+ * Initializes the audio level meter.
+ */
+void audiolevel_init(int sample_rate, int channels, int period_size);
+
+/**
+ * Destroys the resources used by the audio level meter.
+ */
+void audiolevel_teardown();
+
+/**
+ * Enables silence detection. Silence is detected when RMS of every period
+ * stays below threshold_dbfs for duration_sec seconds.
+ */
+void audiolevel_set_silence_detection(float threshold_dbfs, float duration_sec);
+
+/**
+ * Measures one period of interleaved S16 samples.
+ * Returns an event if silence has started or ended with this period.
+ */
+AUDIOLEVEL_EVENT audiolevel_process(const int16_t *samples);
+
+/**
+ * Returns the levels accumulated since the previous call and resets them.
+ */
+void audiolevel_read(audiolevel_stats *stats);
+
+#endif // PICAM_AUDIOLEVEL_H
@@ -0,0 +1,417 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <alsa/asoundlib.h>
+
+#include "audiomix.h"
+
+// Capacity of the ring buffer for each device in periods
+#define RING_PERIODS 8
+
+// Mixing starts (or restarts after an underrun) once this many
+// periods are buffered. This is also the fill level that drift
+// compensation tries to keep.
+#define TARGET_PERIODS 2
+
+// ALSA buffer size for each device in periods
+#define ALSA_BUFFER_PERIODS 16
+
+// Gain is applied in fixed point with this many fractional bits
+#define GAIN_FRACTION_BITS 12
+
+typedef struct mix_device {
+  char name[256];
+  float gain;
+  int32_t gain_q;
+  snd_pcm_t *handle;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  int is_thread_started;
+
+  // ring buffer of interleaved S16 frames
+  int16_t *ring;
+  int ring_frames;
+  int read_pos;
+  int write_pos;
+  int buffered_frames;
+
+  int is_primed;
+  int correction; // -1: insert a frame, 0: none, 1: drop a frame
+  float average_fill;
+  int16_t *period_buf; // period_size + 1 frames
+
+  long overflow_frames;
+  long underrun_frames;
+  long corrected_frames;
+} mix_device;
+
+static mix_device devices[AUDIOMIX_MAX_DEVICES];
+static int device_count = 0;
+static int channels;
+static int period_size;
+static volatile int is_running = 0;
+
+int audiomix_add_device(const char *dev, float gain) {
+  mix_device *d;
+
+  if (device_count >= AUDIOMIX_MAX_DEVICES) {
+    return -1;
+  }
+  d = &devices[device_count];
+  memset(d, 0, sizeof(mix_device));
+  strncpy(d->name, dev, sizeof(d->name) - 1);
+  d->name[sizeof(d->name) - 1] = '\0';
+  d->gain = gain;
+  device_count++;
+
+  return 0;
+}
+
+int audiomix_set_last_gain(float gain) {
+  if (device_count == 0) {
+    return -1;
+  }
+  devices[device_count - 1].gain = gain;
+  return 0;
+}
+
+int audiomix_get_device_count() {
+  return device_count;
+}
+
+static int open_device(mix_device *d, int sample_rate) {
+  snd_pcm_hw_params_t *params;
+  snd_pcm_uframes_t frames;
+  unsigned int rate;
+  int dir = 0;
+  int err;
+
+  err = snd_pcm_open(&d->handle, d->name, SND_PCM_STREAM_CAPTURE, 0);
+  if (err < 0) {
+    fprintf(stderr, "error: cannot open audio capture device '%s': %s\n",
+        d->name, snd_strerror(err));
+    return -1;
+  }
+
+  err = snd_pcm_hw_params_malloc(&params);
+  if (err < 0) {
+    fprintf(stderr, "error: cannot allocate hardware parameters for %s: %s\n",
+        d->name, snd_strerror(err));
+    return -1;
+  }
+  err = snd_pcm_hw_params_any(d->handle, params);
+  if (err >= 0) {
+    err = snd_pcm_hw_params_set_access(d->handle, params, SND_PCM_ACCESS_MMAP_INTERLEAVED);
+  }
+  if (err >= 0) {
+    err = snd_pcm_hw_params_set_format(d->handle, params, SND_PCM_FORMAT_S16_LE);
+  }
+  if (err >= 0) {
+    err = snd_pcm_hw_params_set_channels(d->handle, params, channels);
+  }
+  if (err < 0) {
+    fprintf(stderr, "error: cannot configure %s for %d channel(s) S16_LE mmap capture: %s\n",
+        d->name, channels, snd_strerror(err));
+    fprintf(stderr, "hint: try plughw:<card>,<device> for %s\n", d->name);
+    snd_pcm_hw_params_free(params);
+    return -1;
+  }
+
+  rate = sample_rate;
+  err = snd_pcm_hw_params_set_rate_near(d->handle, params, &rate, 0);
+  if (err < 0 || rate != sample_rate) {
+    fprintf(stderr, "error: cannot set sample rate of %s to %d (got %u)\n",
+        d->name, sample_rate, rate);
+    snd_pcm_hw_params_free(params);
+    return -1;
+  }
+
+  frames = period_size;
+  err = snd_pcm_hw_params_set_period_size_near(d->handle, params, &frames, &dir);
+  if (err >= 0) {
+    frames = period_size * ALSA_BUFFER_PERIODS;
+    err = snd_pcm_hw_params_set_buffer_size_near(d->handle, params, &frames);
+  }
+  if (err >= 0) {
+    err = snd_pcm_hw_params(d->handle, params);
+  }
+  snd_pcm_hw_params_free(params);
+  if (err < 0) {
+    fprintf(stderr, "error: cannot set hardware parameters for %s: %s\n",
+        d->name, snd_strerror(err));
+    return -1;
+  }
+
+  err = snd_pcm_prepare(d->handle);
+  if (err < 0) {
+    fprintf(stderr, "error: cannot prepare %s: %s\n", d->name, snd_strerror(err));
+    return -1;
+  }
+
+  return 0;
+}
+
+static int recover_device(mix_device *d, int err) {
+  if (err == -EPIPE) { // overrun
+    fprintf(stderr, "%s: buffer overrun\n", d->name);
+    err = snd_pcm_prepare(d->handle);
+  } else if (err == -ESTRPIPE) { // suspended
+    while ((err = snd_pcm_resume(d->handle)) == -EAGAIN) {
+      sleep(1);
+    }
+    if (err < 0) {
+      err = snd_pcm_prepare(d->handle);
+    }
+  }
+  if (err < 0) {
+    return err;
+  }
+  return snd_pcm_start(d->handle);
+}
+
+// Appends frames to the ring. Drops the oldest frames if it is full.
+static void ring_write(mix_device *d, const int16_t *src, int frames) {
+  int overflow;
+  int first;
+
+  pthread_mutex_lock(&d->mutex);
+  overflow = d->buffered_frames + frames - d->ring_frames;
+  if (overflow > 0) {
+    d->read_pos = (d->read_pos + overflow) % d->ring_frames;
+    d->buffered_frames -= overflow;
+    d->overflow_frames += overflow;
+  }
+  first = d->ring_frames - d->write_pos;
+  if (first > frames) {
+    first = frames;
+  }
+  memcpy(d->ring + d->write_pos * channels, src, first * channels * sizeof(int16_t));
+  if (frames > first) {
+    memcpy(d->ring, src + first * channels, (frames - first) * channels * sizeof(int16_t));
+  }
+  d->write_pos = (d->write_pos + frames) % d->ring_frames;
+  d->buffered_frames += frames;
+  pthread_mutex_unlock(&d->mutex);
+}
+
+// Takes frames from the ring. Caller must hold the mutex.
+static void ring_read(mix_device *d, int16_t *dst, int frames) {
+  int first = d->ring_frames - d->read_pos;
+
+  if (first > frames) {
+    first = frames;
+  }
+  memcpy(dst, d->ring + d->read_pos * channels, first * channels * sizeof(int16_t));
+  if (frames > first) {
+    memcpy(dst + first * channels, d->ring, (frames - first) * channels * sizeof(int16_t));
+  }
+  d->read_pos = (d->read_pos + frames) % d->ring_frames;
+  d->buffered_frames -= frames;
+}
+
+static void *capture_loop(void *arg) {
+  mix_device *d = (mix_device *)arg;
+  const snd_pcm_channel_area_t *areas;
+  snd_pcm_uframes_t offset, frames;
+  snd_pcm_sframes_t avail, commitres;
+  int size;
+  int err;
+
+  err = snd_pcm_start(d->handle);
+  if (err < 0) {
+    fprintf(stderr, "error: cannot start %s: %s\n", d->name, snd_strerror(err));
+    pthread_exit(0);
+  }
+
+  while (is_running) {
+    avail = snd_pcm_avail_update(d->handle);
+    if (avail < 0) {
+      if ((err = recover_device(d, avail)) < 0) {
+        fprintf(stderr, "error: %s cannot be recovered: %s\n", d->name, snd_strerror(err));
+        break;
+      }
+      continue;
+    }
+    if (avail < period_size) {
+      // poll until one period is ready
+      err = snd_pcm_wait(d->handle, 1000);
+      if (err < 0 && (err = recover_device(d, err)) < 0) {
+        fprintf(stderr, "error: %s cannot be recovered: %s\n", d->name, snd_strerror(err));
+        break;
+      }
+      continue;
+    }
+
+    size = period_size;
+    while (size > 0) {
+      frames = size;
+      err = snd_pcm_mmap_begin(d->handle, &areas, &offset, &frames);
+      if (err < 0) {
+        err = recover_device(d, err);
+        break;
+      }
+      ring_write(d, (int16_t *)areas[0].addr + offset * channels, frames);
+      commitres = snd_pcm_mmap_commit(d->handle, offset, frames);
+      if (commitres < 0 || (snd_pcm_uframes_t)commitres != frames) {
+        err = recover_device(d, commitres >= 0 ? -EPIPE : commitres);
+        break;
+      }
+      size -= frames;
+    }
+    if (err < 0) {
+      fprintf(stderr, "error: %s cannot be recovered: %s\n", d->name, snd_strerror(err));
+      break;
+    }
+  }
+
+  pthread_exit(0);
+}
+
+int audiomix_start(int sample_rate, int num_channels, int num_frames) {
+  int i;
+
+  channels = num_channels;
+  period_size = num_frames;
+  is_running = 1;
+
+  for (i = 0; i < device_count; i++) {
+    mix_device *d = &devices[i];
+
+    if (open_device(d, sample_rate) != 0) {
+      return -1;
+    }
+    d->gain_q = (int32_t)(d->gain * (1 << GAIN_FRACTION_BITS));
+    d->ring_frames = period_size * RING_PERIODS;
+    d->ring = malloc(d->ring_frames * channels * sizeof(int16_t));
+    d->period_buf = malloc((period_size + 1) * channels * sizeof(int16_t));
+    if (d->ring == NULL || d->period_buf == NULL) {
+      perror("malloc for audiomix buffer");
+      return -1;
+    }
+    pthread_mutex_init(&d->mutex, NULL);
+    pthread_create(&d->thread, NULL, capture_loop, d);
+    d->is_thread_started = 1;
+  }
+
+  return 0;
+}
+
+// Decides whether a frame should be dropped or inserted so that the
+// buffered amount stays around the target. This compensates for the
+// drift between the clocks of the main device and this device.
+static void update_drift_correction(mix_device *d) {
+  float target = TARGET_PERIODS * period_size;
+  float deviation;
+
+  d->average_fill = d->average_fill * 0.99f + d->buffered_frames * 0.01f;
+  deviation = d->average_fill - target;
+
+  // Hysteresis: start correcting at half a period and stop
+  // when the deviation becomes small enough
+  if (d->correction == 0) {
+    if (deviation > period_size / 2) {
+      d->correction = 1;
+    } else if (deviation < -period_size / 2) {
+      d->correction = -1;
+    }
+  } else if (deviation < period_size / 8 && deviation > -period_size / 8) {
+    d->correction = 0;
+  }
+}
+
+// Saturating mix with gain. Written as a plain loop so that
+// gcc can vectorize it with NEON (-ftree-vectorize).
+static void mix_samples(int16_t *restrict dst, const int16_t *restrict src,
+    int32_t gain_q, int total_samples) {
+  int i;
+
+  for (i = 0; i < total_samples; i++) {
+    int32_t value = dst[i] + ((src[i] * gain_q) >> GAIN_FRACTION_BITS);
+    if (value > 32767) {
+      value = 32767;
+    } else if (value < -32768) {
+      value = -32768;
+    }
+    dst[i] = (int16_t)value;
+  }
+}
+
+void audiomix_mix(int16_t *samples) {
+  int i;
+  int frame_bytes = channels * sizeof(int16_t);
+
+  for (i = 0; i < device_count; i++) {
+    mix_device *d = &devices[i];
+    int frames;
+    int middle = period_size / 2;
+
+    pthread_mutex_lock(&d->mutex);
+    if (!d->is_primed) {
+      if (d->buffered_frames < TARGET_PERIODS * period_size) {
+        pthread_mutex_unlock(&d->mutex);
+        continue;
+      }
+      // Align both devices: discard older frames so that
+      // this device lags the main device by TARGET_PERIODS
+      int excess = d->buffered_frames - TARGET_PERIODS * period_size;
+      d->read_pos = (d->read_pos + excess) % d->ring_frames;
+      d->buffered_frames -= excess;
+      d->average_fill = d->buffered_frames;
+      d->correction = 0;
+      d->is_primed = 1;
+    }
+
+    update_drift_correction(d);
+    frames = period_size + d->correction;
+    if (d->buffered_frames < frames) { // underrun
+      d->underrun_frames += frames - d->buffered_frames;
+      memset(d->period_buf, 0, (period_size + 1) * frame_bytes);
+      ring_read(d, d->period_buf, d->buffered_frames);
+      d->is_primed = 0;
+      frames = period_size;
+    } else {
+      ring_read(d, d->period_buf, frames);
+    }
+    pthread_mutex_unlock(&d->mutex);
+
+    if (frames == period_size + 1) { // drop the middle frame
+      memmove(d->period_buf + middle * channels, d->period_buf + (middle + 1) * channels,
+          (period_size - middle) * frame_bytes);
+      d->corrected_frames++;
+    } else if (frames == period_size - 1) { // repeat the middle frame
+      memmove(d->period_buf + (middle + 1) * channels, d->period_buf + middle * channels,
+          (period_size - 1 - middle) * frame_bytes);
+      d->corrected_frames++;
+    }
+
+    mix_samples(samples, d->period_buf, d->gain_q, period_size * channels);
+  }
+}
+
+void audiomix_stop() {
+  int i;
+
+  is_running = 0;
+  for (i = 0; i < device_count; i++) {
+    mix_device *d = &devices[i];
+
+    if (d->handle == NULL) {
+      continue;
+    }
+    if (d->is_thread_started) {
+      pthread_join(d->thread, NULL);
+      pthread_mutex_destroy(&d->mutex);
+      d->is_thread_started = 0;
+    }
+    snd_pcm_close(d->handle);
+    d->handle = NULL;
+    fprintf(stderr, "%s: overflow=%ld underrun=%ld corrected=%ld frames\n",
+        d->name, d->overflow_frames, d->underrun_frames, d->corrected_frames);
+    free(d->ring);
+    d->ring = NULL;
+    free(d->period_buf);
+    d->period_buf = NULL;
+  }
+}
@@ -0,0 +1,51 @@
+#ifndef PICAM_AUDIOMIX_H
+#define PICAM_AUDIOMIX_H
+
+#include <stdint.h>
+
+// Maximum number of additional capture devices
+#define AUDIOMIX_MAX_DEVICES 4
+
+// Maximum gain of a device. Samples are scaled in 32-bit fixed point,
+// which overflows with larger gains.
+#define AUDIOMIX_MAX_GAIN 8.0f
+
+/**
+ * Registers an additional ALSA capture device which will be mixed
+ * into the main audio track. gain is a linear volume multiplier.
+ * Returns 0 on success, -1 if too many devices are registered.
+ */
+int audiomix_add_device(const char *dev, float gain);
+
+/**
+ * Sets the gain of the most recently added device.
+ * gain must be between 0.0 and AUDIOMIX_MAX_GAIN.
+ * Returns 0 on success, -1 if no device has been added.
+ */
+int audiomix_set_last_gain(float gain);
+
+/**
+ * Returns the number of registered additional devices.
+ */
+int audiomix_get_device_count();
+
+/**
+ * Opens all registered devices and starts a capture thread for each.
+ * period_size is in frames and must match the main capture device.
+ * Returns 0 on success.
+ */
+int audiomix_start(int sample_rate, int channels, int period_size);
+
+/**
+ * Mixes one period from each additional device into samples
+ * (interleaved S16, period_size frames). Call this from the main
+ * capture thread each time a period has been read.
+ */
+void audiomix_mix(int16_t *samples);
+
+/**
+ * Stops the capture threads and closes the devices.
+ */
+void audiomix_stop();
+
+#endif // PICAM_AUDIOMIX_H
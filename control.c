@@ -0,0 +1,838 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "control.h"
+
+// Maximum number of simultaneously connected clients
+#define CONTROL_MAX_CLIENTS 8
+
+// Maximum length of a request line including the newline
+#define CONTROL_LINE_BUF_SIZE 16384
+
+// Maximum number of requests in a batch
+#define CONTROL_MAX_BATCH 32
+
+// Size of the buffer for the result of a command
+#define CONTROL_RESULT_BUF_SIZE 4096
+
+// Maximum length of the id and cmd fields
+#define CONTROL_TOKEN_LEN 64
+
+typedef struct control_client {
+  int fd;
+  size_t len;
+  char buf[CONTROL_LINE_BUF_SIZE];
+} control_client;
+
+typedef struct control_request {
+  char id[CONTROL_TOKEN_LEN]; // raw JSON token of "id", empty if not given
+  char cmd[CONTROL_TOKEN_LEN];
+  char *content;
+} control_request;
+
+typedef struct control_response {
+  char *buf;
+  size_t len;
+  size_t size;
+} control_response;
+
+static control_handler command_handler = NULL;
+static char socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static int listen_fd = -1;
+static int wake_pipe[2] = { -1, -1 };
+static pthread_t control_thread;
+static int is_control_running = 0;
+static control_client clients[CONTROL_MAX_CLIENTS];
+
+static void skip_whitespace(const char **p) {
+  while (**p == ' ' || **p == '\t' || **p == '\r' || **p == '\n') {
+    (*p)++;
+  }
+}
+
+static int parse_hex4(const char *p, unsigned int *value) {
+  int i;
+  *value = 0;
+  for (i = 0; i < 4; i++) {
+    char c = p[i];
+    *value <<= 4;
+    if (c >= '0' && c <= '9') {
+      *value |= c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      *value |= c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+      *value |= c - 'A' + 10;
+    } else {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Parses a JSON string at *p and writes the decoded UTF-8 string to out.
+ * The decoded string is never longer than its JSON representation.
+ * Returns 0 on success, -1 on error.
+ */
+static int parse_string(const char **p, char *out, size_t out_size) {
+  const char *s = *p;
+  size_t len = 0;
+
+  if (*s != '"') {
+    return -1;
+  }
+  s++;
+  while (*s != '"') {
+    unsigned int codepoint;
+    char utf8[4];
+    int utf8_len;
+
+    if (*s == '\0' || (unsigned char)*s < 0x20) {
+      return -1;
+    }
+    if (*s != '\\') {
+      if (len + 1 >= out_size) {
+        return -1;
+      }
+      out[len++] = *s++;
+      continue;
+    }
+    s++;
+    switch (*s) {
+      case '"': codepoint = '"'; break;
+      case '\\': codepoint = '\\'; break;
+      case '/': codepoint = '/'; break;
+      case 'b': codepoint = '\b'; break;
+      case 'f': codepoint = '\f'; break;
+      case 'n': codepoint = '\n'; break;
+      case 'r': codepoint = '\r'; break;
+      case 't': codepoint = '\t'; break;
+      case 'u':
+        if (parse_hex4(s + 1, &codepoint) != 0) {
+          return -1;
+        }
+        s += 4;
+        if (codepoint >= 0xd800 && codepoint <= 0xdbff) { // surrogate pair
+          unsigned int low;
+          if (s[1] != '\\' || s[2] != 'u' || parse_hex4(s + 3, &low) != 0 ||
+              low < 0xdc00 || low > 0xdfff) {
+            return -1;
+          }
+          codepoint = 0x10000 + ((codepoint - 0xd800) << 10) + (low - 0xdc00);
+          s += 6;
+        } else if (codepoint >= 0xdc00 && codepoint <= 0xdfff) {
+          return -1;
+        }
+        break;
+      default:
+        return -1;
+    }
+    s++;
+
+    if (codepoint == 0) { // would terminate the string
+      return -1;
+    } else if (codepoint < 0x80) {
+      utf8[0] = codepoint;
+      utf8_len = 1;
+    } else if (codepoint < 0x800) {
+      utf8[0] = 0xc0 | (codepoint >> 6);
+      utf8[1] = 0x80 | (codepoint & 0x3f);
+      utf8_len = 2;
+    } else if (codepoint < 0x10000) {
+      utf8[0] = 0xe0 | (codepoint >> 12);
+      utf8[1] = 0x80 | ((codepoint >> 6) & 0x3f);
+      utf8[2] = 0x80 | (codepoint & 0x3f);
+      utf8_len = 3;
+    } else {
+      utf8[0] = 0xf0 | (codepoint >> 18);
+      utf8[1] = 0x80 | ((codepoint >> 12) & 0x3f);
+      utf8[2] = 0x80 | ((codepoint >> 6) & 0x3f);
+      utf8[3] = 0x80 | (codepoint & 0x3f);
+      utf8_len = 4;
+    }
+    if (len + utf8_len >= out_size) {
+      return -1;
+    }
+    memcpy(out + len, utf8, utf8_len);
+    len += utf8_len;
+  }
+  out[len] = '\0';
+  *p = s + 1;
+  return 0;
+}
+
+/**
+ * Skips a number, true, false, or null at *p.
+ */
+static int skip_literal(const char **p) {
+  const char *s = *p;
+  if (strncmp(s, "true", 4) == 0) {
+    s += 4;
+  } else if (strncmp(s, "false", 5) == 0) {
+    s += 5;
+  } else if (strncmp(s, "null", 4) == 0) {
+    s += 4;
+  } else {
+    if (*s == '-') {
+      s++;
+    }
+    if (*s < '0' || *s > '9') {
+      return -1;
+    }
+    while ((*s >= '0' && *s <= '9') || *s == '.' || *s == 'e' || *s == 'E' ||
+        *s == '+' || *s == '-') {
+      s++;
+    }
+  }
+  *p = s;
+  return 0;
+}
+
+/**
+ * Skips any JSON value at *p.
+ */
+static int skip_value(const char **p, int depth) {
+  if (depth > 16) {
+    return -1;
+  }
+  skip_whitespace(p);
+  if (**p == '"') {
+    // strings are validated by decoding them into a scratch buffer
+    char *scratch = malloc(strlen(*p) + 1);
+    int ret;
+    if (scratch == NULL) {
+      return -1;
+    }
+    ret = parse_string(p, scratch, strlen(*p) + 1);
+    free(scratch);
+    return ret;
+  }
+  if (**p == '{' || **p == '[') {
+    char close = (**p == '{') ? '}' : ']';
+    int is_object = (**p == '{');
+    (*p)++;
+    skip_whitespace(p);
+    if (**p == close) {
+      (*p)++;
+      return 0;
+    }
+    while (1) {
+      if (is_object) {
+        skip_whitespace(p);
+        if (skip_value(p, depth + 1) != 0) { // key
+          return -1;
+        }
+        skip_whitespace(p);
+        if (**p != ':') {
+          return -1;
+        }
+        (*p)++;
+      }
+      if (skip_value(p, depth + 1) != 0) {
+        return -1;
+      }
+      skip_whitespace(p);
+      if (**p == ',') {
+        (*p)++;
+      } else if (**p == close) {
+        (*p)++;
+        return 0;
+      } else {
+        return -1;
+      }
+    }
+  }
+  return skip_literal(p);
+}
+
+/**
+ * Parses a string, number, or boolean at *p and appends it to out
+ * as plain text. Numbers and booleans are copied as they are.
+ */
+static int parse_scalar(const char **p, char *out, size_t out_size) {
+  const char *start = *p;
+  size_t len;
+
+  if (**p == '"') {
+    return parse_string(p, out, out_size);
+  }
+  if (skip_literal(p) != 0 || strncmp(start, "null", 4) == 0) {
+    return -1;
+  }
+  len = *p - start;
+  if (len + 1 > out_size) {
+    return -1;
+  }
+  memcpy(out, start, len);
+  out[len] = '\0';
+  return 0;
+}
+
+/**
+ * Converts "args" object to key=value lines in the hook file format.
+ */
+static int parse_args(const char **p, char *out, size_t out_size) {
+  size_t len = 0;
+
+  if (**p != '{') {
+    return -1;
+  }
+  (*p)++;
+  skip_whitespace(p);
+  if (**p == '}') {
+    (*p)++;
+    out[0] = '\0';
+    return 0;
+  }
+  while (1) {
+    skip_whitespace(p);
+    if (parse_string(p, out + len, out_size - len) != 0) {
+      return -1;
+    }
+    len += strlen(out + len);
+    skip_whitespace(p);
+    if (**p != ':' || len + 1 >= out_size) {
+      return -1;
+    }
+    (*p)++;
+    out[len++] = '=';
+    skip_whitespace(p);
+    if (parse_scalar(p, out + len, out_size - len) != 0) {
+      return -1;
+    }
+    len += strlen(out + len);
+    if (len + 1 >= out_size) {
+      return -1;
+    }
+    out[len++] = '\n';
+    out[len] = '\0';
+    skip_whitespace(p);
+    if (**p == ',') {
+      (*p)++;
+    } else if (**p == '}') {
+      (*p)++;
+      return 0;
+    } else {
+      return -1;
+    }
+  }
+}
+
+/**
+ * Parses a request object at *p.
+ * Returns 0 on success, -1 on error.
+ */
+static int parse_request(const char **p, control_request *req) {
+  // decoded content is never longer than the rest of the line
+  size_t content_size = strlen(*p) + 1;
+  char key[CONTROL_TOKEN_LEN];
+
+  req->id[0] = '\0';
+  req->cmd[0] = '\0';
+  req->content = NULL;
+
+  skip_whitespace(p);
+  if (**p != '{') {
+    return -1;
+  }
+  (*p)++;
+  skip_whitespace(p);
+  if (**p == '}') {
+    (*p)++;
+    return 0;
+  }
+  while (1) {
+    skip_whitespace(p);
+    if (parse_string(p, key, sizeof(key)) != 0) {
+      return -1;
+    }
+    skip_whitespace(p);
+    if (**p != ':') {
+      return -1;
+    }
+    (*p)++;
+    skip_whitespace(p);
+
+    if (strcmp(key, "id") == 0) {
+      const char *start = *p;
+      if (**p == '{' || **p == '[' || skip_value(p, 0) != 0) {
+        return -1;
+      }
+      if (*p - start >= sizeof(req->id)) {
+        return -1;
+      }
+      memcpy(req->id, start, *p - start);
+      req->id[*p - start] = '\0';
+    } else if (strcmp(key, "cmd") == 0) {
+      if (parse_string(p, req->cmd, sizeof(req->cmd)) != 0) {
+        return -1;
+      }
+    } else if (strcmp(key, "content") == 0 || strcmp(key, "args") == 0) {
+      int ret;
+      if (req->content != NULL) { // content and args are exclusive
+        return -1;
+      }
+      req->content = malloc(content_size);
+      if (req->content == NULL) {
+        return -1;
+      }
+      if (strcmp(key, "content") == 0) {
+        ret = parse_string(p, req->content, content_size);
+      } else {
+        ret = parse_args(p, req->content, content_size);
+      }
+      if (ret != 0) {
+        return -1;
+      }
+    } else if (skip_value(p, 0) != 0) { // ignore unknown keys
+      return -1;
+    }
+
+    skip_whitespace(p);
+    if (**p == ',') {
+      (*p)++;
+    } else if (**p == '}') {
+      (*p)++;
+      return 0;
+    } else {
+      return -1;
+    }
+  }
+}
+
+int control_json_string(const char *src, char *dst, size_t dst_size) {
+  size_t len = 0;
+  const unsigned char *s = (const unsigned char *)src;
+
+  if (dst_size < 3) {
+    return -1;
+  }
+  dst[len++] = '"';
+  for (; *s != '\0'; s++) {
+    char escaped[7];
+    int escaped_len;
+    switch (*s) {
+      case '"': strcpy(escaped, "\\\""); break;
+      case '\\': strcpy(escaped, "\\\\"); break;
+      case '\n': strcpy(escaped, "\\n"); break;
+      case '\r': strcpy(escaped, "\\r"); break;
+      case '\t': strcpy(escaped, "\\t"); break;
+      default:
+        if (*s < 0x20) {
+          snprintf(escaped, sizeof(escaped), "\\u%04x", *s);
+        } else {
+          escaped[0] = *s;
+          escaped[1] = '\0';
+        }
+    }
+    escaped_len = strlen(escaped);
+    if (len + escaped_len + 2 > dst_size) {
+      return -1;
+    }
+    memcpy(dst + len, escaped, escaped_len);
+    len += escaped_len;
+  }
+  dst[len++] = '"';
+  dst[len] = '\0';
+  return len;
+}
+
+static int response_append(control_response *res, const char *str) {
+  size_t str_len = strlen(str);
+  if (res->len + str_len + 1 > res->size) {
+    size_t new_size = res->size * 2;
+    char *new_buf;
+    while (new_size < res->len + str_len + 1) {
+      new_size *= 2;
+    }
+    new_buf = realloc(res->buf, new_size);
+    if (new_buf == NULL) {
+      return -1;
+    }
+    res->buf = new_buf;
+    res->size = new_size;
+  }
+  memcpy(res->buf + res->len, str, str_len + 1);
+  res->len += str_len;
+  return 0;
+}
+
+static void response_append_error(control_response *res, const char *id, const char *error) {
+  response_append(res, "{");
+  if (id != NULL && id[0] != '\0') {
+    response_append(res, "\"id\":");
+    response_append(res, id);
+    response_append(res, ",");
+  }
+  response_append(res, "\"ok\":false,\"error\":\"");
+  response_append(res, error);
+  response_append(res, "\"}");
+}
+
+/**
+ * Runs a request and appends its response to res.
+ */
+static void run_request(control_request *req, control_response *res) {
+  char result[CONTROL_RESULT_BUF_SIZE];
+
+  if (req->cmd[0] == '\0') {
+    response_append_error(res, req->id, "missing cmd");
+    return;
+  }
+  result[0] = '\0';
+  if (command_handler(req->cmd, req->content != NULL ? req->content : "",
+        result, sizeof(result)) != 0) {
+    response_append_error(res, req->id, "command failed");
+    return;
+  }
+  response_append(res, "{");
+  if (req->id[0] != '\0') {
+    response_append(res, "\"id\":");
+    response_append(res, req->id);
+    response_append(res, ",");
+  }
+  response_append(res, "\"ok\":true");
+  if (result[0] != '\0') {
+    response_append(res, ",\"result\":");
+    response_append(res, result);
+  }
+  response_append(res, "}");
+}
+
+/**
+ * Handles a request line. A line is either a request object or an
+ * array of request objects (batch). A batch is parsed as a whole
+ * before any of its commands is run, and its responses are returned
+ * in one array in the same order.
+ */
+static void process_line(const char *line, control_response *res) {
+  control_request reqs[CONTROL_MAX_BATCH];
+  int num_reqs = 0;
+  int is_batch = 0;
+  int is_valid = 0;
+  const char *p = line;
+  int i;
+
+  skip_whitespace(&p);
+  if (*p == '\0') { // ignore empty line
+    return;
+  }
+  if (*p == '[') {
+    is_batch = 1;
+    p++;
+    skip_whitespace(&p);
+    if (*p == ']') {
+      p++;
+      is_valid = 1;
+    }
+    while (!is_valid && num_reqs < CONTROL_MAX_BATCH) {
+      if (parse_request(&p, &reqs[num_reqs++]) != 0) {
+        break;
+      }
+      skip_whitespace(&p);
+      if (*p == ',') {
+        p++;
+      } else if (*p == ']') {
+        p++;
+        is_valid = 1;
+      } else {
+        break;
+      }
+    }
+  } else if (parse_request(&p, &reqs[num_reqs++]) == 0) {
+    is_valid = 1;
+  }
+  if (is_valid) {
+    skip_whitespace(&p);
+    if (*p != '\0') { // trailing garbage
+      is_valid = 0;
+    }
+  }
+
+  if (!is_valid) {
+    response_append_error(res, NULL, "invalid request");
+  } else {
+    if (is_batch) {
+      response_append(res, "[");
+    }
+    for (i = 0; i < num_reqs; i++) {
+      if (i > 0) {
+        response_append(res, ",");
+      }
+      run_request(&reqs[i], res);
+    }
+    if (is_batch) {
+      response_append(res, "]");
+    }
+  }
+  response_append(res, "\n");
+
+  for (i = 0; i < num_reqs; i++) {
+    free(reqs[i].content);
+  }
+}
+
+static void close_client(control_client *client) {
+  close(client->fd);
+  client->fd = -1;
+  client->len = 0;
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+    if (sent == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    buf += sent;
+    len -= sent;
+  }
+  return 0;
+}
+
+/**
+ * Reads available data from the client and handles complete lines.
+ */
+static void read_client(control_client *client, control_response *res) {
+  ssize_t received;
+  char *line;
+  char *newline;
+
+  received = recv(client->fd, client->buf + client->len,
+      sizeof(client->buf) - 1 - client->len, 0);
+  if (received <= 0) {
+    if (received == -1 && errno == EINTR) {
+      return;
+    }
+    close_client(client);
+    return;
+  }
+  client->len += received;
+  client->buf[client->len] = '\0';
+
+  res->len = 0;
+  res->buf[0] = '\0';
+  line = client->buf;
+  while ((newline = strchr(line, '\n')) != NULL) {
+    *newline = '\0';
+    process_line(line, res);
+    line = newline + 1;
+  }
+  client->len -= line - client->buf;
+  memmove(client->buf, line, client->len);
+  client->buf[client->len] = '\0';
+
+  if (client->len == sizeof(client->buf) - 1) { // line does not fit
+    fprintf(stderr, "control: request line is too long\n");
+    response_append_error(res, NULL, "request too long");
+    response_append(res, "\n");
+    send_all(client->fd, res->buf, res->len);
+    close_client(client);
+    return;
+  }
+  if (res->len > 0 && send_all(client->fd, res->buf, res->len) != 0) {
+    close_client(client);
+  }
+}
+
+static void accept_client() {
+  struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+  int fd;
+  int i;
+
+  fd = accept(listen_fd, NULL, NULL);
+  if (fd == -1) {
+    if (errno != EINTR && errno != EAGAIN) {
+      perror("control: accept");
+    }
+    return;
+  }
+  for (i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+    if (clients[i].fd == -1) {
+      break;
+    }
+  }
+  if (i == CONTROL_MAX_CLIENTS) {
+    fprintf(stderr, "control: too many clients\n");
+    close(fd);
+    return;
+  }
+  // Prevent a stalled client from blocking the control thread
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  clients[i].fd = fd;
+  clients[i].len = 0;
+}
+
+static void *control_loop(void *arg) {
+  struct pollfd fds[CONTROL_MAX_CLIENTS + 2];
+  int client_index[CONTROL_MAX_CLIENTS + 2];
+  control_response res;
+  int i;
+
+  res.size = CONTROL_RESULT_BUF_SIZE;
+  res.len = 0;
+  res.buf = malloc(res.size);
+  if (res.buf == NULL) {
+    perror("control: malloc response buffer");
+    return NULL;
+  }
+
+  while (1) {
+    int nfds = 0;
+
+    fds[nfds].fd = wake_pipe[0];
+    fds[nfds].events = POLLIN;
+    nfds++;
+    fds[nfds].fd = listen_fd;
+    fds[nfds].events = POLLIN;
+    nfds++;
+    for (i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+      if (clients[i].fd != -1) {
+        fds[nfds].fd = clients[i].fd;
+        fds[nfds].events = POLLIN;
+        client_index[nfds] = i;
+        nfds++;
+      }
+    }
+
+    if (poll(fds, nfds, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("control: poll");
+      break;
+    }
+    if (fds[0].revents) { // control_stop() was called
+      break;
+    }
+    for (i = 2; i < nfds; i++) {
+      if (fds[i].revents) {
+        read_client(&clients[client_index[i]], &res);
+      }
+    }
+    if (fds[1].revents & POLLIN) {
+      accept_client();
+    }
+  }
+
+  free(res.buf);
+  return NULL;
+}
+
+int control_start(const char *path, control_handler handler) {
+  struct sockaddr_un addr;
+  struct stat st;
+  mode_t old_umask;
+  int err;
+  int i;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "control socket path is too long: %s\n", path);
+    return -1;
+  }
+  strncpy(socket_path, path, sizeof(socket_path) - 1);
+  socket_path[sizeof(socket_path) - 1] = '\0';
+  command_handler = handler;
+
+  // Remove stale socket left by the previous run
+  if (stat(socket_path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "control socket path exists and is not a socket: %s\n", socket_path);
+      return -1;
+    }
+    unlink(socket_path);
+  }
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd == -1) {
+    perror("control: socket");
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+  // Only the owner may send commands. The socket is created by bind()
+  // with the umask applied, so it is never accessible to other users.
+  // The umask is process-wide; this runs at startup before any other
+  // thread creates files.
+  old_umask = umask(0077);
+  err = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(old_umask);
+  if (err == -1) {
+    fprintf(stderr, "control: cannot bind %s: %s\n", socket_path, strerror(errno));
+    close(listen_fd);
+    listen_fd = -1;
+    return -1;
+  }
+  if (listen(listen_fd, CONTROL_MAX_CLIENTS) == -1) {
+    perror("control: listen");
+    close(listen_fd);
+    listen_fd = -1;
+    unlink(socket_path);
+    return -1;
+  }
+  if (pipe(wake_pipe) != 0) {
+    perror("control: pipe");
+    close(listen_fd);
+    listen_fd = -1;
+    unlink(socket_path);
+    return -1;
+  }
+
+  for (i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+    clients[i].fd = -1;
+    clients[i].len = 0;
+  }
+
+  if (pthread_create(&control_thread, NULL, control_loop, NULL) != 0) {
+    perror("control: pthread_create");
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    close(listen_fd);
+    listen_fd = -1;
+    unlink(socket_path);
+    return -1;
+  }
+  is_control_running = 1;
+  return 0;
+}
+
+void control_stop() {
+  int i;
+
+  if (!is_control_running) {
+    return;
+  }
+  if (write(wake_pipe[1], "", 1) != 1) {
+    perror("control: write wake pipe");
+  }
+  pthread_join(control_thread, NULL);
+  is_control_running = 0;
+
+  for (i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+    if (clients[i].fd != -1) {
+      close_client(&clients[i]);
+    }
+  }
+  close(wake_pipe[0]);
+  close(wake_pipe[1]);
+  wake_pipe[0] = wake_pipe[1] = -1;
+  close(listen_fd);
+  listen_fd = -1;
+  unlink(socket_path);
+}
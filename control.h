@@ -0,0 +1,32 @@
+#ifndef PICAM_CONTROL_H
+#define PICAM_CONTROL_H
+
+#include <stddef.h>
+
+/**
+ * Runs a control command. name is the command name (same as the hook
+ * file name) and content holds its parameters in the same format as
+ * the hook file. The handler may write a JSON value to result which
+ * is returned to the client. Returns 0 on success, -1 on error.
+ */
+typedef int (*control_handler)(const char *name, const char *content,
+    char *result, size_t result_size);
+
+/**
+ * Starts the control server listening on a UNIX domain socket at
+ * socket_path. Returns 0 on success, -1 on error.
+ */
+int control_start(const char *socket_path, control_handler handler);
+
+/**
+ * Stops the control server and removes the socket.
+ */
+void control_stop();
+
+/**
+ * Writes src to dst as a JSON string literal including the quotes.
+ * Returns the number of bytes written, or -1 if dst is too small.
+ */
+int control_json_string(const char *src, char *dst, size_t dst_size);
+
+#endif // PICAM_CONTROL_H
@@ -4,6 +4,7 @@
 
 #include <stdint.h>
 #include <assert.h>
+#include <time.h>
 
 #include <bcm_host.h>
 
@@ -31,6 +32,12 @@ static uint32_t g_video_height;
 
 #define DISP_CANVAS_BYTES_PER_PIXEL 4
 
+// areas drawn in the previous update, which only the front resource has
+static text_rect g_prev_dirty_rects[DISP_MAX_DIRTY_RECTS];
+static int g_num_prev_dirty_rects = 0;
+
+static dispmanx_overlay_stats g_overlay_stats;
+
 #ifdef DEBUG_FILL_TEXT_OVERLAY
 // just for testing: works only with ARGB images
 static void fill_rect(VC_IMAGE_TYPE_T type, void *canvas, int width, int height, int x, int y, int w, int h, int val)
@@ -124,11 +131,17 @@ static void dispmanx_create_text_overlay(void)
   fill_rect(VC_IMAGE_ARGB8888, g_canvas, g_canvas_width, g_canvas_height,  1100, 600, 500, 200,     0xFF0000FF);
   fill_rect(VC_IMAGE_ARGB8888, g_canvas, g_canvas_width, g_canvas_height,  150, 150, 200, 200,     0xFF00FF00);
   fill_rect(VC_IMAGE_ARGB8888, g_canvas, g_canvas_width, g_canvas_height,  500, 500, 200, 200,     0x8800FF00);
+#endif
 
+  // Only the changed areas are written on update, so both resources
+  // have to start with the same content as the canvas
   vc_dispmanx_rect_set(&dst_rect, 0, 0, width, height);
   ret = vc_dispmanx_resource_write_data(g_frontResource, VC_IMAGE_ARGB8888, pitch, g_canvas, &dst_rect);
   assert(ret == 0);
-#endif
+  ret = vc_dispmanx_resource_write_data(g_backResource, VC_IMAGE_ARGB8888, pitch, g_canvas, &dst_rect);
+  assert(ret == 0);
+  g_num_prev_dirty_rects = 0;
+  memset(&g_overlay_stats, 0, sizeof(g_overlay_stats));
 
   vc_dispmanx_rect_set(&src_rect, 0, 0, width << 16, height << 16);
   vc_dispmanx_rect_set(&dst_rect, x, y, width, height);
@@ -191,28 +204,71 @@ void dispmanx_destroy(void)
   assert(ret == 0);
 }
 
-void dispmanx_update_text_overlay(void)
+static float timespec_diff_ms(const struct timespec *start, const struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) * 1000.0f +
+    (end->tv_nsec - start->tv_nsec) / 1000000.0f;
+}
+
+// write an area of the canvas to the back resource and return the number of bytes sent
+static uint32_t dispmanx_upload_rect(const text_rect *rect)
 {
   VC_RECT_T dst_rect;
   int ret;
-  //clock_t start_time = clock();
-  
+  int pitch = g_canvas_width * DISP_CANVAS_BYTES_PER_PIXEL;
 
-  // reset overlay to fully-transparent
-  memset(g_canvas, 0, g_canvas_size);
+  // vc_dispmanx_resource_write_data() takes the top of the image and
+  // transfers whole lines starting at dst_rect.y
+  vc_dispmanx_rect_set(&dst_rect, rect->x, rect->y, rect->width, rect->height);
+  ret = vc_dispmanx_resource_write_data(g_backResource, VC_IMAGE_ARGB8888, pitch, g_canvas, &dst_rect);
+  assert(ret == 0);
+  return pitch * rect->height;
+}
+
+void dispmanx_update_text_overlay(void)
+{
+  text_rect dirty_rects[DISP_MAX_DIRTY_RECTS];
+  struct timespec cpu_start, cpu_end, upload_start, upload_end;
+  int num_dirty_rects;
+  int i, row;
+  int ret;
+  int pitch = g_canvas_width * DISP_CANVAS_BYTES_PER_PIXEL;
+  uint32_t upload_bytes = 0;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+  num_dirty_rects = text_get_preview_dirty_rects(g_canvas_width, g_canvas_height,
+      dirty_rects, DISP_MAX_DIRTY_RECTS);
+  if (num_dirty_rects == 0) {
+    return; // nothing has changed on the preview
+  }
+
+  for (i = 0; i < num_dirty_rects; i++) {
+    text_rect *rect = &dirty_rects[i];
+
+    // reset the area to fully-transparent
+    for (row = 0; row < rect->height; row++) {
+      memset(g_canvas + (rect->y + row) * pitch + rect->x * DISP_CANVAS_BYTES_PER_PIXEL,
+          0, rect->width * DISP_CANVAS_BYTES_PER_PIXEL);
+    }
 #ifdef DEBUG_FILL_TEXT_OVERLAY // really nice: see refresehed areas (layout boxes)
-  fill_rect(VC_IMAGE_ARGB8888, g_canvas, g_canvas_width, g_canvas_height,  0, 0, g_canvas_width, g_canvas_height,     0x33ff0000);
+    fill_rect(VC_IMAGE_ARGB8888, g_canvas, g_canvas_width, g_canvas_height,  rect->x, rect->y, rect->width, rect->height,     0x33ff0000);
 #endif
 
+    // render texts
+    text_draw_preview_rect(g_canvas, g_canvas_width, g_canvas_height, rect);
+  }
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
 
-  // render texts
-  text_draw_all(g_canvas, g_canvas_width, g_canvas_height, 0); // is_video = 0
-
-  // write data to back resource
-  vc_dispmanx_rect_set(&dst_rect, 0, 0, g_canvas_width, g_canvas_height);
-  int pitch = g_canvas_width * DISP_CANVAS_BYTES_PER_PIXEL;
-  ret = vc_dispmanx_resource_write_data(g_backResource, VC_IMAGE_ARGB8888, pitch, g_canvas, &dst_rect);
-  assert(ret == 0);
+  // write data to back resource: the areas changed in the previous update
+  // went only to the current front resource, so they are written too
+  clock_gettime(CLOCK_MONOTONIC, &upload_start);
+  for (i = 0; i < g_num_prev_dirty_rects; i++) {
+    upload_bytes += dispmanx_upload_rect(&g_prev_dirty_rects[i]);
+  }
+  for (i = 0; i < num_dirty_rects; i++) {
+    upload_bytes += dispmanx_upload_rect(&dirty_rects[i]);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &upload_end);
 
   // change the source of text overlay
   DISPMANX_UPDATE_HANDLE_T update = vc_dispmanx_update_start(0);
@@ -228,5 +284,18 @@ void dispmanx_update_text_overlay(void)
   DISPMANX_RESOURCE_HANDLE_T tmpResource = g_frontResource;
   g_frontResource = g_backResource;
   g_backResource = tmpResource;
-  //log_debug("dispmanx: update took %d ms\n", (clock() - start_time) * 1000 / CLOCKS_PER_SEC);
+
+  memcpy(g_prev_dirty_rects, dirty_rects, sizeof(text_rect) * num_dirty_rects);
+  g_num_prev_dirty_rects = num_dirty_rects;
+
+  g_overlay_stats.updates++;
+  g_overlay_stats.rects = num_dirty_rects;
+  g_overlay_stats.upload_bytes = upload_bytes;
+  g_overlay_stats.draw_cpu_ms = timespec_diff_ms(&cpu_start, &cpu_end);
+  g_overlay_stats.upload_ms = timespec_diff_ms(&upload_start, &upload_end);
+}
+
+void dispmanx_get_overlay_stats(dispmanx_overlay_stats *stats)
+{
+  *stats = g_overlay_stats;
 }
@@ -14,8 +14,21 @@
 // display to which we will output the preview overlays
 #define DISP_DISPLAY_DEFAULT     0
 
+// maximum number of separately updated areas of the text overlay
+#define DISP_MAX_DIRTY_RECTS 8
+
+// statistics of the last update of the text overlay
+typedef struct dispmanx_overlay_stats {
+  uint32_t updates;      // number of updates so far
+  int rects;             // number of updated areas
+  uint32_t upload_bytes; // bytes written to the back resource
+  float draw_cpu_ms;     // CPU time for clearing and drawing the areas
+  float upload_ms;       // time spent in vc_dispmanx_resource_write_data()
+} dispmanx_overlay_stats;
+
 void dispmanx_init(uint32_t bg_color, uint32_t video_width, uint32_t video_height);
 void dispmanx_destroy(void);
 void dispmanx_update_text_overlay(void);
+void dispmanx_get_overlay_stats(dispmanx_overlay_stats *stats);
 
 #endif
@@ -1,11 +1,47 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 #include "log.h"
 
+// Number of messages in the ring (must be a power of 2)
+#define LOG_RING_SIZE 512
+
+// Maximum length of a message. Longer messages are truncated.
+#define LOG_MESSAGE_SIZE 512
+
+// Identical lines within this interval are counted instead of printed
+#define LOG_REPEAT_INTERVAL_NSEC INT64_C(1000000000)
+
+typedef struct log_slot {
+  uint32_t sequence;
+  char text[LOG_MESSAGE_SIZE];
+} log_slot;
+
 static int log_level = LOG_LEVEL_DEBUG;
 static FILE *out_stream = NULL;
 
+// Lock-free ring which is written by any thread and read by log_thread
+static log_slot *ring = NULL;
+static uint32_t enqueue_pos = 0;
+static uint32_t dequeue_pos = 0;
+static unsigned long dropped_count = 0;
+static sem_t ring_sem;
+static pthread_t log_thread;
+static int is_async = 0;
+static int is_stopping = 0;
+
+// State of the repeated line suppression (used only by log_thread)
+static char last_line[LOG_MESSAGE_SIZE];
+static int last_line_repeat_count = 0;
+static int64_t last_line_time = 0;
+static unsigned long reported_dropped_count = 0;
+
 void log_set_level(int level) {
   log_level = level;
 }
@@ -18,6 +54,203 @@ void log_set_stream(FILE *stream) {
   out_stream = stream;
 }
 
+unsigned long log_get_dropped_count() {
+  return __atomic_load_n(&dropped_count, __ATOMIC_RELAXED);
+}
+
+static int64_t get_monotonic_nsec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+static void flush_repeat_count() {
+  if (last_line_repeat_count > 0) {
+    fprintf(out_stream, "(last message repeated %d times)\n", last_line_repeat_count);
+    last_line_repeat_count = 0;
+  }
+}
+
+/**
+ * Writes a message from the ring. Identical lines in a row are
+ * collapsed into a count so that a repeating warning does not flood
+ * a slow console.
+ */
+static void write_message(const char *text) {
+  size_t len = strlen(text);
+  int64_t now;
+
+  if (len < 2 || text[len - 1] != '\n') { // not a line (e.g. progress dots)
+    fwrite(text, 1, len, out_stream);
+    return;
+  }
+
+  now = get_monotonic_nsec();
+  if (strcmp(text, last_line) == 0 &&
+      now - last_line_time < LOG_REPEAT_INTERVAL_NSEC) {
+    last_line_repeat_count++;
+    return;
+  }
+  flush_repeat_count();
+  fwrite(text, 1, len, out_stream);
+  memcpy(last_line, text, len + 1);
+  last_line_time = now;
+}
+
+/**
+ * Reads all messages in the ring. Returns the number of messages read.
+ */
+static int drain_ring() {
+  int count = 0;
+  unsigned long dropped;
+
+  while (1) {
+    log_slot *slot = &ring[dequeue_pos & (LOG_RING_SIZE - 1)];
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != dequeue_pos + 1) {
+      break; // empty
+    }
+    write_message(slot->text);
+    __atomic_store_n(&slot->sequence, dequeue_pos + LOG_RING_SIZE, __ATOMIC_RELEASE);
+    __atomic_store_n(&dequeue_pos, dequeue_pos + 1, __ATOMIC_RELEASE);
+    count++;
+  }
+
+  dropped = log_get_dropped_count();
+  if (dropped != reported_dropped_count) {
+    flush_repeat_count();
+    fprintf(out_stream, "\nlog: %lu messages dropped\n", dropped - reported_dropped_count);
+    reported_dropped_count = dropped;
+  }
+  if (count > 0) {
+    fflush(out_stream);
+  }
+  return count;
+}
+
+static void *log_thread_loop(void *arg) {
+  struct timespec timeout;
+
+  while (1) {
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_sec += 1;
+    if (sem_timedwait(&ring_sem, &timeout) != 0 && errno == ETIMEDOUT) {
+      // print the count of repeated lines after a quiet period
+      if (last_line_repeat_count > 0) {
+        flush_repeat_count();
+        fflush(out_stream);
+      }
+      last_line[0] = '\0';
+    }
+    drain_ring();
+    if (__atomic_load_n(&is_stopping, __ATOMIC_ACQUIRE)) {
+      drain_ring();
+      flush_repeat_count();
+      fflush(out_stream);
+      break;
+    }
+  }
+  return NULL;
+}
+
+int log_start_thread() {
+  uint32_t i;
+
+  if (out_stream == NULL) {
+    out_stream = stdout;
+  }
+  ring = malloc(sizeof(log_slot) * LOG_RING_SIZE);
+  if (ring == NULL) {
+    perror("malloc log ring");
+    return -1;
+  }
+  for (i = 0; i < LOG_RING_SIZE; i++) {
+    ring[i].sequence = i;
+  }
+  enqueue_pos = dequeue_pos = 0;
+  if (sem_init(&ring_sem, 0, 0) != 0) {
+    perror("sem_init log");
+    free(ring);
+    ring = NULL;
+    return -1;
+  }
+  is_stopping = 0;
+  if (pthread_create(&log_thread, NULL, log_thread_loop, NULL) != 0) {
+    perror("pthread_create log");
+    sem_destroy(&ring_sem);
+    free(ring);
+    ring = NULL;
+    return -1;
+  }
+  __atomic_store_n(&is_async, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void log_stop_thread() {
+  if (!__atomic_load_n(&is_async, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  // Messages are written synchronously from now on. The ring and
+  // the semaphore are kept for the messages which are still in flight.
+  __atomic_store_n(&is_async, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&is_stopping, 1, __ATOMIC_RELEASE);
+  sem_post(&ring_sem);
+  pthread_join(log_thread, NULL);
+}
+
+void log_flush() {
+  int i;
+
+  if (!__atomic_load_n(&is_async, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  sem_post(&ring_sem);
+  // Wait up to 1 second for log_thread to write all messages
+  for (i = 0; i < 1000; i++) {
+    if (__atomic_load_n(&dequeue_pos, __ATOMIC_ACQUIRE) ==
+        __atomic_load_n(&enqueue_pos, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000000 };
+    nanosleep(&ts, NULL);
+  }
+}
+
+/**
+ * Formats a message into the ring. The message is dropped if the
+ * ring is full, since the caller may be a camera or audio callback
+ * which must not wait for the console.
+ */
+static void enqueue_message(const char *format, const va_list args) {
+  uint32_t pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+  log_slot *slot;
+  int len;
+
+  while (1) {
+    slot = &ring[pos & (LOG_RING_SIZE - 1)];
+    int32_t diff = (int32_t)__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (int32_t)pos;
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) { // full
+      __atomic_fetch_add(&dropped_count, 1, __ATOMIC_RELAXED);
+      return;
+    } else {
+      pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  len = vsnprintf(slot->text, LOG_MESSAGE_SIZE, format, args);
+  if (len >= LOG_MESSAGE_SIZE) { // truncated
+    strcpy(slot->text + LOG_MESSAGE_SIZE - 5, "...\n");
+  } else if (len < 0) {
+    slot->text[0] = '\0';
+  }
+  __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+  sem_post(&ring_sem);
+}
+
 void log_hex(int msg_log_level, uint8_t *data, int len) {
   int i;
 
@@ -31,17 +264,30 @@ void log_hex(int msg_log_level, uint8_t *data, int len) {
 }
 
 void log_msg(int msg_log_level, const char *format, const va_list args) {
+  if (msg_log_level < log_level) {
+    return;
+  }
+
   if (out_stream == NULL) {
     out_stream = stdout;
   }
 
-  if (msg_log_level >= log_level) {
+  if (__atomic_load_n(&is_async, __ATOMIC_ACQUIRE)) {
+    enqueue_message(format, args);
+    if (msg_log_level >= LOG_LEVEL_FATAL) {
+      // The process is going to exit
+      log_flush();
+    }
+  } else {
     vfprintf(out_stream, format, args);
   }
 }
 
 void log_msg_level(int msg_log_level, const char *format, ...) {
   va_list args;
+  if (msg_log_level < log_level) {
+    return;
+  }
   va_start(args, format);
   log_msg(msg_log_level, format, args);
   va_end(args);
@@ -49,6 +295,9 @@ void log_msg_level(int msg_log_level, const char *format, ...) {
 
 void log_debug(const char *format, ...) {
   va_list args;
+  if (LOG_LEVEL_DEBUG < log_level) {
+    return;
+  }
   va_start(args, format);
   log_msg(LOG_LEVEL_DEBUG, format, args);
   va_end(args);
@@ -56,6 +305,9 @@ void log_debug(const char *format, ...) {
 
 void log_info(const char *format, ...) {
   va_list args;
+  if (LOG_LEVEL_INFO < log_level) {
+    return;
+  }
   va_start(args, format);
   log_msg(LOG_LEVEL_INFO, format, args);
   va_end(args);
@@ -63,6 +315,9 @@ void log_info(const char *format, ...) {
 
 void log_warn(const char *format, ...) {
   va_list args;
+  if (LOG_LEVEL_WARN < log_level) {
+    return;
+  }
   va_start(args, format);
   log_msg(LOG_LEVEL_WARN, format, args);
   va_end(args);
@@ -70,6 +325,9 @@ void log_warn(const char *format, ...) {
 
 void log_error(const char *format, ...) {
   va_list args;
+  if (LOG_LEVEL_ERROR < log_level) {
+    return;
+  }
   va_start(args, format);
   log_msg(LOG_LEVEL_ERROR, format, args);
   va_end(args);
@@ -77,6 +335,9 @@ void log_error(const char *format, ...) {
 
 void log_fatal(const char *format, ...) {
   va_list args;
+  if (LOG_LEVEL_FATAL < log_level) {
+    return;
+  }
   va_start(args, format);
   log_msg(LOG_LEVEL_FATAL, format, args);
   va_end(args);
@@ -16,6 +16,14 @@ enum {
 void log_set_level(int level);
 int  log_get_level();
 void log_set_stream(FILE *stream);
+// Start writing log messages from a background thread
+int  log_start_thread();
+// Write the remaining messages and return to synchronous logging
+void log_stop_thread();
+// Wait until the background thread has written the queued messages
+void log_flush();
+// Number of messages dropped because the queue was full
+unsigned long log_get_dropped_count();
 void log_hex(int msg_log_level, uint8_t *data, int len);
 void log_msg(int level, const char *format, const va_list args);
 void log_msg_level(int msg_log_level, const char *format, ...);
@@ -0,0 +1,371 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "metrics.h"
+
+// Threads beyond this number share the last slot
+#define METRICS_MAX_THREADS 16
+
+// Upper bounds of histogram buckets in nanoseconds. The last bucket is +Inf.
+static const int64_t bucket_bounds[] = {
+  100000, 250000, 500000,
+  1000000, 2500000, 5000000,
+  10000000, 25000000, 50000000,
+  100000000, 250000000, 500000000,
+  1000000000,
+};
+#define METRICS_BUCKET_COUNT (sizeof(bucket_bounds) / sizeof(bucket_bounds[0]) + 1)
+
+typedef struct metrics_slot {
+  uint64_t counters[METRICS_COUNTER_COUNT];
+  uint64_t buckets[METRICS_HISTOGRAM_COUNT][METRICS_BUCKET_COUNT];
+  uint64_t sum_nsec[METRICS_HISTOGRAM_COUNT];
+} metrics_slot;
+
+typedef struct metrics_info {
+  const char *name;
+  const char *labels; // NULL if none
+  const char *help;
+} metrics_info;
+
+static const metrics_info counter_info[METRICS_COUNTER_COUNT] = {
+  { "picam_video_frames_captured_total", NULL, "Video frames received from the camera" },
+  { "picam_video_frames_encoded_total", NULL, "Video frames received from the encoder" },
+  { "picam_audio_frames_encoded_total", NULL, "Audio frames encoded" },
+  { "picam_output_bytes_total", "output=\"record\"", "Bytes written to each output" },
+  { "picam_output_bytes_total", "output=\"hls\"", NULL },
+  { "picam_output_bytes_total", "output=\"tcp\"", NULL },
+  { "picam_output_bytes_total", "output=\"rtsp\"", NULL },
+  { "picam_record_buffer_overruns_total", NULL, "Times a new packet overwrote the oldest keyframe in the record buffer" },
+  { "picam_audio_xruns_total", NULL, "Microphone buffer overruns" },
+  { "picam_abr_decisions_total", "decision=\"decrease\"", "Video bitrate changes made by the adaptive bitrate controller" },
+  { "picam_abr_decisions_total", "decision=\"increase\"", NULL },
+  { "picam_keyframe_requests_total", NULL, "IDR frames requested from the encoder" },
+  { "picam_preview_overlay_updates_total", NULL, "Updates of the text overlay on the preview" },
+  { "picam_preview_overlay_upload_bytes_total", NULL, "Bytes uploaded to the preview text overlay" },
+};
+
+static const metrics_info histogram_info[METRICS_HISTOGRAM_COUNT] = {
+  { "picam_hls_segment_write_seconds", NULL, "Time to finish an HLS segment and start the next one" },
+  { "picam_record_write_seconds", NULL, "Time to write buffered packets to the recording" },
+  { "picam_audio_encode_seconds", NULL, "Time to encode an audio frame" },
+  { "picam_overlay_composite_seconds", NULL, "Time to draw texts and images onto a video frame" },
+  { "picam_frame_latency_seconds", NULL, "Time from camera capture to encoded video frame" },
+};
+
+typedef struct metrics_gauge_info {
+  const char *name;
+  const char *help;
+  double scale; // gauges are exported as value * scale
+} metrics_gauge_info;
+
+static const metrics_gauge_info gauge_info[METRICS_GAUGE_COUNT] = {
+  { "picam_video_target_bitrate", "Target bitrate of the video encoder in bits per second", 1.0 },
+  { "picam_abr_write_seconds", "Average time to write a video frame to the network outputs", 1e-9 },
+  { "picam_preview_overlay_rects", "Areas redrawn by the last preview text overlay update", 1.0 },
+  { "picam_preview_overlay_draw_seconds", "CPU time to draw the last preview text overlay update", 1e-9 },
+  { "picam_preview_overlay_upload_seconds", "Time to upload the last preview text overlay update", 1e-9 },
+};
+
+static metrics_slot slots[METRICS_MAX_THREADS];
+static int64_t gauges[METRICS_GAUGE_COUNT];
+static int num_slots = 0;
+static __thread metrics_slot *thread_slot = NULL;
+
+static int is_metrics_enabled = 0;
+static int listen_fd = -1;
+static int wake_pipe[2] = { -1, -1 };
+static pthread_t metrics_thread;
+
+/**
+ * Returns the slot of the calling thread. Each thread writes only to
+ * its own slot, so the counters are not contended.
+ */
+static metrics_slot *get_thread_slot() {
+  if (thread_slot == NULL) {
+    int index = __atomic_fetch_add(&num_slots, 1, __ATOMIC_RELAXED);
+    if (index >= METRICS_MAX_THREADS) {
+      index = METRICS_MAX_THREADS - 1;
+    }
+    thread_slot = &slots[index];
+  }
+  return thread_slot;
+}
+
+int64_t metrics_now() {
+  struct timespec ts;
+  if (!is_metrics_enabled) {
+    return 0;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+void metrics_add(metrics_counter counter, uint64_t value) {
+  if (!is_metrics_enabled) {
+    return;
+  }
+  __atomic_fetch_add(&get_thread_slot()->counters[counter], value, __ATOMIC_RELAXED);
+}
+
+void metrics_set(metrics_gauge gauge, int64_t value) {
+  if (!is_metrics_enabled) {
+    return;
+  }
+  __atomic_store_n(&gauges[gauge], value, __ATOMIC_RELAXED);
+}
+
+void metrics_observe_since(metrics_histogram histogram, int64_t start_time) {
+  metrics_slot *slot;
+  int64_t elapsed;
+  int i;
+
+  if (!is_metrics_enabled || start_time == 0) {
+    return;
+  }
+  elapsed = metrics_now() - start_time;
+  if (elapsed < 0) {
+    elapsed = 0;
+  }
+  for (i = 0; i < METRICS_BUCKET_COUNT - 1; i++) {
+    if (elapsed <= bucket_bounds[i]) {
+      break;
+    }
+  }
+  slot = get_thread_slot();
+  __atomic_fetch_add(&slot->buckets[histogram][i], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&slot->sum_nsec[histogram], elapsed, __ATOMIC_RELAXED);
+}
+
+static uint64_t sum_counter(metrics_counter counter) {
+  uint64_t total = 0;
+  int i;
+  for (i = 0; i < METRICS_MAX_THREADS; i++) {
+    total += __atomic_load_n(&slots[i].counters[counter], __ATOMIC_RELAXED);
+  }
+  return total;
+}
+
+/**
+ * Formats all metrics in Prometheus text exposition format.
+ * The caller has to free the returned buffer.
+ */
+static char *format_metrics(size_t *len) {
+  size_t size = 8192;
+  char *buf = malloc(size);
+  int i, j, k;
+
+  if (buf == NULL) {
+    return NULL;
+  }
+  *len = 0;
+
+#define APPEND(...) do { \
+    int n = snprintf(buf + *len, size - *len, __VA_ARGS__); \
+    if (n >= size - *len) { \
+      char *new_buf = realloc(buf, size * 2 + n); \
+      if (new_buf == NULL) { free(buf); return NULL; } \
+      buf = new_buf; \
+      size = size * 2 + n; \
+      n = snprintf(buf + *len, size - *len, __VA_ARGS__); \
+    } \
+    *len += n; \
+  } while (0)
+
+  for (i = 0; i < METRICS_COUNTER_COUNT; i++) {
+    const metrics_info *info = &counter_info[i];
+    if (info->help != NULL) {
+      APPEND("# HELP %s %s\n# TYPE %s counter\n", info->name, info->help, info->name);
+    }
+    if (info->labels != NULL) {
+      APPEND("%s{%s} %llu\n", info->name, info->labels,
+          (unsigned long long)sum_counter(i));
+    } else {
+      APPEND("%s %llu\n", info->name, (unsigned long long)sum_counter(i));
+    }
+  }
+
+  for (i = 0; i < METRICS_GAUGE_COUNT; i++) {
+    APPEND("# HELP %s %s\n# TYPE %s gauge\n%s %.9g\n", gauge_info[i].name,
+        gauge_info[i].help, gauge_info[i].name, gauge_info[i].name,
+        __atomic_load_n(&gauges[i], __ATOMIC_RELAXED) * gauge_info[i].scale);
+  }
+
+  for (i = 0; i < METRICS_HISTOGRAM_COUNT; i++) {
+    const metrics_info *info = &histogram_info[i];
+    uint64_t buckets[METRICS_BUCKET_COUNT];
+    uint64_t sum_nsec = 0;
+    uint64_t cumulative = 0;
+
+    memset(buckets, 0, sizeof(buckets));
+    for (j = 0; j < METRICS_MAX_THREADS; j++) {
+      for (k = 0; k < METRICS_BUCKET_COUNT; k++) {
+        buckets[k] += __atomic_load_n(&slots[j].buckets[i][k], __ATOMIC_RELAXED);
+      }
+      sum_nsec += __atomic_load_n(&slots[j].sum_nsec[i], __ATOMIC_RELAXED);
+    }
+
+    APPEND("# HELP %s %s\n# TYPE %s histogram\n", info->name, info->help, info->name);
+    for (k = 0; k < METRICS_BUCKET_COUNT; k++) {
+      cumulative += buckets[k];
+      if (k < METRICS_BUCKET_COUNT - 1) {
+        APPEND("%s_bucket{le=\"%g\"} %llu\n", info->name,
+            bucket_bounds[k] / 1000000000.0, (unsigned long long)cumulative);
+      } else {
+        APPEND("%s_bucket{le=\"+Inf\"} %llu\n", info->name, (unsigned long long)cumulative);
+      }
+    }
+    APPEND("%s_sum %.9f\n", info->name, sum_nsec / 1000000000.0);
+    APPEND("%s_count %llu\n", info->name, (unsigned long long)cumulative);
+  }
+#undef APPEND
+
+  return buf;
+}
+
+static void send_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+    if (sent == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    buf += sent;
+    len -= sent;
+  }
+}
+
+/**
+ * Answers any request on the connection with the metrics.
+ */
+static void serve_client(int fd) {
+  struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+  char request[1024];
+  char header[256];
+  char *body;
+  size_t body_len;
+
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  // The request itself is not inspected
+  if (recv(fd, request, sizeof(request), 0) <= 0) {
+    return;
+  }
+
+  body = format_metrics(&body_len);
+  if (body == NULL) {
+    const char *error = "HTTP/1.0 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n";
+    send_all(fd, error, strlen(error));
+    return;
+  }
+  snprintf(header, sizeof(header),
+      "HTTP/1.0 200 OK\r\n"
+      "Content-Type: text/plain; version=0.0.4\r\n"
+      "Content-Length: %zu\r\n"
+      "Connection: close\r\n"
+      "\r\n", body_len);
+  send_all(fd, header, strlen(header));
+  send_all(fd, body, body_len);
+  free(body);
+}
+
+static void *metrics_loop(void *arg) {
+  struct pollfd fds[2];
+
+  fds[0].fd = wake_pipe[0];
+  fds[0].events = POLLIN;
+  fds[1].fd = listen_fd;
+  fds[1].events = POLLIN;
+
+  while (1) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("metrics: poll");
+      break;
+    }
+    if (fds[0].revents) { // metrics_stop() was called
+      break;
+    }
+    if (fds[1].revents & POLLIN) {
+      int fd = accept(listen_fd, NULL, NULL);
+      if (fd == -1) {
+        if (errno != EINTR && errno != EAGAIN) {
+          perror("metrics: accept");
+        }
+        continue;
+      }
+      serve_client(fd);
+      close(fd);
+    }
+  }
+  return NULL;
+}
+
+int metrics_start(int port) {
+  struct sockaddr_in addr;
+  int optval = 1;
+
+  listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd == -1) {
+    perror("metrics: socket");
+    return -1;
+  }
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    fprintf(stderr, "metrics: cannot bind port %d: %s\n", port, strerror(errno));
+    close(listen_fd);
+    listen_fd = -1;
+    return -1;
+  }
+  if (listen(listen_fd, 4) == -1 || pipe(wake_pipe) != 0) {
+    perror("metrics: listen");
+    close(listen_fd);
+    listen_fd = -1;
+    return -1;
+  }
+  is_metrics_enabled = 1;
+  if (pthread_create(&metrics_thread, NULL, metrics_loop, NULL) != 0) {
+    perror("metrics: pthread_create");
+    is_metrics_enabled = 0;
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    close(listen_fd);
+    listen_fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+void metrics_stop() {
+  if (listen_fd == -1) {
+    return;
+  }
+  if (write(wake_pipe[1], "", 1) != 1) {
+    perror("metrics: write wake pipe");
+  }
+  pthread_join(metrics_thread, NULL);
+  is_metrics_enabled = 0;
+  close(wake_pipe[0]);
+  close(wake_pipe[1]);
+  wake_pipe[0] = wake_pipe[1] = -1;
+  close(listen_fd);
+  listen_fd = -1;
+}
@@ -0,0 +1,83 @@
+#ifndef PICAM_METRICS_H
+#define PICAM_METRICS_H
+
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+typedef enum metrics_counter {
+  METRICS_VIDEO_FRAMES_CAPTURED,
+  METRICS_VIDEO_FRAMES_ENCODED,
+  METRICS_AUDIO_FRAMES_ENCODED,
+  METRICS_RECORD_BYTES,
+  METRICS_HLS_BYTES,
+  METRICS_TCP_BYTES,
+  METRICS_RTSP_BYTES,
+  METRICS_RECORD_BUFFER_OVERRUNS,
+  METRICS_AUDIO_XRUNS,
+  METRICS_ABR_DECREASES,
+  METRICS_ABR_INCREASES,
+  METRICS_KEYFRAME_REQUESTS,
+  METRICS_PREVIEW_OVERLAY_UPDATES,
+  METRICS_PREVIEW_OVERLAY_UPLOAD_BYTES,
+  METRICS_COUNTER_COUNT
+} metrics_counter;
+
+typedef enum metrics_histogram {
+  METRICS_HLS_SEGMENT_WRITE_TIME,
+  METRICS_RECORD_WRITE_TIME,
+  METRICS_AUDIO_ENCODE_TIME,
+  METRICS_OVERLAY_COMPOSITE_TIME,
+  METRICS_FRAME_LATENCY,
+  METRICS_HISTOGRAM_COUNT
+} metrics_histogram;
+
+typedef enum metrics_gauge {
+  METRICS_VIDEO_TARGET_BITRATE,
+  METRICS_ABR_WRITE_TIME, // in nanoseconds
+  METRICS_PREVIEW_OVERLAY_RECTS,
+  METRICS_PREVIEW_OVERLAY_DRAW_TIME, // in nanoseconds
+  METRICS_PREVIEW_OVERLAY_UPLOAD_TIME, // in nanoseconds
+  METRICS_GAUGE_COUNT
+} metrics_gauge;
+
+/**
+ * Starts the HTTP server which exports the metrics in Prometheus
+ * text format on the given TCP port. Returns 0 on success, -1 on error.
+ */
+int metrics_start(int port);
+
+/**
+ * Stops the HTTP server.
+ */
+void metrics_stop();
+
+/**
+ * Returns the current time in nanoseconds for measuring durations,
+ * or 0 if the metrics are disabled.
+ */
+int64_t metrics_now();
+
+/**
+ * Adds value to the counter. This does not take any lock.
+ */
+void metrics_add(metrics_counter counter, uint64_t value);
+
+/**
+ * Sets the gauge to value. This does not take any lock.
+ */
+void metrics_set(metrics_gauge gauge, int64_t value);
+
+/**
+ * Records the time elapsed since start_time (returned by metrics_now())
+ * to the histogram. This does not take any lock.
+ */
+void metrics_observe_since(metrics_histogram histogram, int64_t start_time);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // PICAM_METRICS_H
@@ -59,19 +59,62 @@ static int is_sample_fmt_supported(AVCodec *codec, enum AVSampleFormat sample_fm
   return 0;
 }
 
+static int is_sample_rate_supported(AVCodec *codec, int sample_rate) {
+  const int *p = codec->supported_samplerates;
+
+  if (p == NULL) { // any sample rate is accepted
+    return 1;
+  }
+  while (*p != 0) {
+    if (*p == sample_rate) {
+      return 1;
+    }
+    p++;
+  }
+
+  return 0;
+}
+
+/**
+ * Finds an audio encoder by picam's codec name.
+ * "aac" prefers libfdk_aac and falls back to FFmpeg's native AAC encoder.
+ * Returns NULL if no suitable encoder is available.
+ */
+AVCodec *mpegts_find_audio_encoder(const char *audio_codec) {
+  AVCodec *codec;
+
+  av_register_all();
+
+  if (audio_codec == NULL || strcmp(audio_codec, "aac") == 0) {
+    codec = avcodec_find_encoder_by_name("libfdk_aac");
+    if (!codec) {
+      codec = avcodec_find_encoder_by_name("aac");
+    }
+    return codec;
+  } else if (strcmp(audio_codec, "fdkaac") == 0) {
+    return avcodec_find_encoder_by_name("libfdk_aac");
+  } else if (strcmp(audio_codec, "opus") == 0) {
+    return avcodec_find_encoder_by_name("libopus");
+  }
+
+  return NULL;
+}
+
 void setup_audio_stream(AVFormatContext *format_ctx, MpegTSCodecSettings *settings) {
-  AVCodec *aac_codec;
+  AVCodec *audio_codec;
   AVCodecContext *audio_codec_ctx = NULL;
   AVStream *audio_stream;
+  AVDictionary *opts = NULL;
   int ret;
 
-  aac_codec = avcodec_find_encoder_by_name("libfdk_aac");
-  if (!aac_codec) {
-    fprintf(stderr, "codec not found\n");
+  audio_codec = mpegts_find_audio_encoder(settings->audio_codec);
+  if (!audio_codec) {
+    fprintf(stderr, "codec not found: %s\n",
+        settings->audio_codec != NULL ? settings->audio_codec : "aac");
     exit(EXIT_FAILURE);
   }
 
-  audio_stream = avformat_new_stream(format_ctx, aac_codec);
+  audio_stream = avformat_new_stream(format_ctx, audio_codec);
   if (!audio_stream) {
     fprintf(stderr, "avformat_new_stream for audio error\n");
     exit(EXIT_FAILURE);
@@ -79,10 +122,21 @@ void setup_audio_stream(AVFormatContext *format_ctx, MpegTSCodecSettings *settin
   audio_stream->id = format_ctx->nb_streams - 1;
   audio_codec_ctx = audio_stream->codec;
 
-  audio_codec_ctx->sample_fmt = AV_SAMPLE_FMT_S16;
-  if ( ! is_sample_fmt_supported(aac_codec, audio_codec_ctx->sample_fmt) ) {
-    fprintf(stderr, "Sample format %s is not supported",
-        av_get_sample_fmt_name(audio_codec_ctx->sample_fmt));
+  // Samples are captured as S16. Encoders that do not accept S16
+  // (e.g. native aac) get planar float, converted by the caller.
+  if (is_sample_fmt_supported(audio_codec, AV_SAMPLE_FMT_S16)) {
+    audio_codec_ctx->sample_fmt = AV_SAMPLE_FMT_S16;
+  } else if (is_sample_fmt_supported(audio_codec, AV_SAMPLE_FMT_FLTP)) {
+    audio_codec_ctx->sample_fmt = AV_SAMPLE_FMT_FLTP;
+  } else {
+    fprintf(stderr, "%s supports neither s16 nor fltp sample format\n",
+        audio_codec->name);
+    exit(EXIT_FAILURE);
+  }
+
+  if ( ! is_sample_rate_supported(audio_codec, settings->audio_sample_rate) ) {
+    fprintf(stderr, "Sample rate %d is not supported by %s\n",
+        settings->audio_sample_rate, audio_codec->name);
     exit(EXIT_FAILURE);
   }
 
@@ -93,7 +147,11 @@ void setup_audio_stream(AVFormatContext *format_ctx, MpegTSCodecSettings *settin
   audio_codec_ctx->ticks_per_frame = 1;
   audio_codec_ctx->bit_rate = settings->audio_bit_rate;
   audio_codec_ctx->codec_type = AVMEDIA_TYPE_AUDIO;
-  audio_codec_ctx->profile = settings->audio_profile;
+  if (audio_codec->id == AV_CODEC_ID_AAC) {
+    audio_codec_ctx->profile = settings->audio_profile;
+    // native aac encoder is marked as experimental in older FFmpeg
+    audio_codec_ctx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+  }
   audio_codec_ctx->sample_rate = settings->audio_sample_rate;
   if (settings->audio_channels == 2) {
     audio_codec_ctx->channel_layout = AV_CH_LAYOUT_STEREO;
@@ -102,7 +160,16 @@ void setup_audio_stream(AVFormatContext *format_ctx, MpegTSCodecSettings *settin
   }
   audio_codec_ctx->channels = av_get_channel_layout_nb_channels(audio_codec_ctx->channel_layout);
 
-  ret = avcodec_open2(audio_codec_ctx, aac_codec, NULL);
+  if (audio_codec->id == AV_CODEC_ID_OPUS) {
+    // Favor low algorithmic delay over music quality
+    av_dict_set(&opts, "application", "lowdelay", 0);
+    if (settings->audio_frame_duration > 0) {
+      av_dict_set_int(&opts, "frame_duration", settings->audio_frame_duration, 0);
+    }
+  }
+
+  ret = avcodec_open2(audio_codec_ctx, audio_codec, &opts);
+  av_dict_free(&opts);
   if (ret < 0) {
     av_strerror(ret, errbuf, sizeof(errbuf));
     fprintf(stderr, "avcodec_open2 failed: %s\n", errbuf);
@@ -127,7 +194,7 @@ void mpegts_close_stream_without_trailer(AVFormatContext *format_ctx) {
   avio_close(format_ctx->pb);
 }
 
-void mpegts_open_stream(AVFormatContext *format_ctx, char *outputfilename, int dump_format) {
+int mpegts_try_open_stream(AVFormatContext *format_ctx, char *outputfilename, int dump_format) {
   int ret;
 
   if (dump_format) {
@@ -142,11 +209,19 @@ void mpegts_open_stream(AVFormatContext *format_ctx, char *outputfilename, int d
   if (ret < 0) {
     av_strerror(ret, errbuf, sizeof(errbuf));
     fprintf(stderr, "avio_open for %s failed: %s\n", outputfilename, errbuf);
-    exit(EXIT_FAILURE);
+    return -1;
   }
 
   if (avformat_write_header(format_ctx, NULL)) {
     fprintf(stderr, "avformat_write_header failed\n");
+    avio_closep(&format_ctx->pb);
+    return -1;
+  }
+  return 0;
+}
+
+void mpegts_open_stream(AVFormatContext *format_ctx, char *outputfilename, int dump_format) {
+  if (mpegts_try_open_stream(format_ctx, outputfilename, dump_format) != 0) {
     exit(EXIT_FAILURE);
   }
 }
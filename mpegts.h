@@ -12,13 +12,18 @@ typedef struct MpegTSCodecSettings {
   int audio_bit_rate;    // e.g. 24000
   int audio_channels;    // e.g. 1
   int audio_profile;     // e.g. FF_PROFILE_AAC_LOW
+  char *audio_codec;     // e.g. "aac", "fdkaac" or "opus" (NULL means "aac")
+  int audio_frame_duration; // in milliseconds (0 means encoder default)
 } MpegTSCodecSettings;
 
 AVFormatContext *mpegts_create_context(MpegTSCodecSettings *settings);
 AVFormatContext *mpegts_create_context_video_only(MpegTSCodecSettings *settings);
 AVFormatContext *mpegts_create_context_audio_only(MpegTSCodecSettings *settings);
 void mpegts_set_config(long bitrate, int width, int height);
+AVCodec *mpegts_find_audio_encoder(const char *audio_codec);
 void mpegts_open_stream(AVFormatContext *format_ctx, char *filename, int dump_format);
+// Same as mpegts_open_stream() but returns -1 instead of exiting on error
+int mpegts_try_open_stream(AVFormatContext *format_ctx, char *filename, int dump_format);
 void mpegts_open_stream_without_header(AVFormatContext *format_ctx, char *filename, int dump_format);
 void mpegts_close_stream(AVFormatContext *format_ctx);
 void mpegts_close_stream_without_trailer(AVFormatContext *format_ctx);
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <png.h>
+
+#include "text.h"
+#include "overlay.h"
+
+// text id of the image on screen
+static int text_id = -1;
+// text id of the image loaded by overlay_load() and not shown yet
+static int loaded_text_id = -1;
+
+/**
+ * Reads a PNG file into an ARGB bitmap (0xAARRGGBB, not premultiplied).
+ * Returns NULL on error.
+ */
+static uint32_t *read_png(const char *png_file, int *width, int *height) {
+  png_image image;
+  uint32_t *argb;
+
+  memset(&image, 0, sizeof(image));
+  image.version = PNG_IMAGE_VERSION;
+  if (!png_image_begin_read_from_file(&image, png_file)) {
+    fprintf(stderr, "overlay: cannot read %s: %s\n", png_file, image.message);
+    return NULL;
+  }
+
+  // BGRA in memory is 0xAARRGGBB in a little-endian uint32_t
+  image.format = PNG_FORMAT_BGRA;
+  if (image.width > UINT16_MAX || image.height > UINT16_MAX) {
+    fprintf(stderr, "overlay: image is too large: %ux%u\n", image.width, image.height);
+    png_image_free(&image);
+    return NULL;
+  }
+  argb = malloc(PNG_IMAGE_SIZE(image));
+  if (argb == NULL) {
+    fprintf(stderr, "cannot allocate memory for overlay image: %u bytes\n",
+        PNG_IMAGE_SIZE(image));
+    png_image_free(&image);
+    return NULL;
+  }
+  if (!png_image_finish_read(&image, NULL, argb, 0, NULL)) {
+    fprintf(stderr, "overlay: cannot decode %s: %s\n", png_file, image.message);
+    free(argb);
+    return NULL;
+  }
+  *width = image.width;
+  *height = image.height;
+  return argb;
+}
+
+/**
+ * Loads a PNG image which will be shown by overlay_show().
+ * The image is converted to overlay planes here, so drawing it on
+ * each frame is a single blend pass.
+ */
+int overlay_load(const char *png_file) {
+  int width, height;
+  uint32_t *argb = read_png(png_file, &width, &height);
+  if (argb == NULL) {
+    return -1;
+  }
+  if (loaded_text_id != -1) {
+    text_destroy(loaded_text_id);
+  }
+  loaded_text_id = text_create_image(argb, width, height);
+  return 0;
+}
+
+/**
+ * Sets the absolute position for the loaded image.
+ */
+void overlay_set_position(int x, int y) {
+  text_set_position(loaded_text_id, x, y);
+}
+
+/**
+ * Sets the relative layout for the loaded image in the screen.
+ */
+void overlay_set_layout(LAYOUT_ALIGN layout_align, int horizontal_margin, int vertical_margin) {
+  text_set_layout(loaded_text_id, layout_align, horizontal_margin, vertical_margin);
+}
+
+/**
+ * Sets the visibility of the loaded image.
+ */
+void overlay_set_visibility(int in_preview, int in_video) {
+  text_set_visibility(loaded_text_id, in_preview, in_video);
+}
+
+/**
+ * Shows the loaded image.
+ */
+void overlay_show() {
+  if (loaded_text_id == -1) {
+    return;
+  }
+  if (text_id != -1) {
+    // Queue text_id to be destroyed when loaded_text_id will appear on screen
+    text_destroy_on_appear(text_id, loaded_text_id);
+  }
+  text_show_image(loaded_text_id);
+  text_id = loaded_text_id;
+  loaded_text_id = -1;
+}
+
+/**
+ * Removes the image from the screen.
+ */
+void overlay_clear() {
+  if (text_id != -1) {
+    text_destroy(text_id);
+    text_id = -1;
+  }
+  if (loaded_text_id != -1) {
+    text_destroy(loaded_text_id);
+    loaded_text_id = -1;
+  }
+}
@@ -0,0 +1,38 @@
+#ifndef PICAM_OVERLAY_H
+#define PICAM_OVERLAY_H
+
+#include "text.h"
+
+/**
+ * Loads a PNG image which will be shown by overlay_show().
+ * Returns 0 on success, -1 if the image cannot be loaded.
+ */
+int overlay_load(const char *png_file);
+
+/**
+ * Sets the absolute position for the loaded image.
+ */
+void overlay_set_position(int x, int y);
+
+/**
+ * Sets the relative layout for the loaded image in the screen.
+ */
+void overlay_set_layout(LAYOUT_ALIGN layout_align, int horizontal_margin, int vertical_margin);
+
+/**
+ * Sets the visibility of the loaded image.
+ */
+void overlay_set_visibility(int in_preview, int in_video);
+
+/**
+ * Shows the loaded image. The previous image is removed
+ * when the new one appears on screen.
+ */
+void overlay_show();
+
+/**
+ * Removes the image from the screen.
+ */
+void overlay_clear();
+
+#endif // PICAM_OVERLAY_H
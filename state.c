@@ -7,6 +7,8 @@
 
 #include "state.h"
 
+static int is_state_enabled = 1;
+
 // Create state dir if it does not exist
 int state_create_dir(char *dir) {
   struct stat st;
@@ -44,26 +46,19 @@ int state_create_dir(char *dir) {
   return 0;
 }
 
+// When disabled, state_set() does not write anything
+void state_set_enabled(int enabled) {
+  is_state_enabled = enabled;
+}
+
+// The dir is expected to be created by state_create_dir()
 void state_set(char *dir, char *name, char *value) {
   FILE *fp;
   char *path;
   int path_len;
-  struct stat st;
-  int err;
 
-  err = stat(dir, &st);
-  if (err == -1) {
-    if (errno == ENOENT) {
-      fprintf(stderr, "Error: %s directory does not exist\n", dir);
-    } else {
-      perror("stat error");
-    }
-    exit(EXIT_FAILURE);
-  } else {
-    if (!S_ISDIR(st.st_mode)) {
-      fprintf(stderr, "Error: %s is not a directory\n", dir);
-      exit(EXIT_FAILURE);
-    }
+  if (!is_state_enabled) {
+    return;
   }
 
   path_len = strlen(dir) + strlen(name) + 2;
@@ -76,6 +71,7 @@ void state_set(char *dir, char *name, char *value) {
   fp = fopen(path, "w");
   if (fp == NULL) {
     perror("State file open failed");
+    free(path);
     return;
   }
   fwrite(value, 1, strlen(value), fp);
@@ -114,6 +110,7 @@ void state_get(char *dir, char *name, char **buf) {
   }
   snprintf(path, path_len, "%s/%s", dir, name);
   fp = fopen(path, "r");
+  free(path);
   if (fp == NULL) {
     perror("State file open failed");
     return;
@@ -124,9 +121,9 @@ void state_get(char *dir, char *name, char **buf) {
   *buf = malloc(size);
   if (*buf == NULL) {
     perror("Can't malloc for buffer");
+    fclose(fp);
     return;
   }
   fread(*buf, 1, size, fp);
   fclose(fp);
-  free(path);
 }
@@ -6,6 +6,7 @@ extern "C" {
 #endif
 
 int state_create_dir(char *dir);
+void state_set_enabled(int enabled);
 void state_set(char *dir, char *name, char *value);
 void state_get(char *dir, char *name, char **buf);
 
@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "status.h"
+
+// NULL if the status page is not enabled
+static picam_status *page = NULL;
+static char shm_name[256];
+
+// Serializes the writers of the fields guarded by page->sequence.
+// They are not called from the camera and audio threads.
+static pthread_mutex_t write_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Marks the start of an update of the fields guarded by *sequence.
+ * Each sequence has only one writer at a time.
+ */
+static void write_begin(uint32_t *sequence) {
+  __atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELAXED);
+  // make the odd sequence visible before the fields are changed
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(uint32_t *sequence) {
+  __atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELEASE);
+}
+
+int status_open(const char *name) {
+  int fd;
+
+  if (name[0] == '/') {
+    snprintf(shm_name, sizeof(shm_name), "%s", name);
+  } else {
+    snprintf(shm_name, sizeof(shm_name), "/%s", name);
+  }
+  fd = shm_open(shm_name, O_CREAT | O_RDWR, 0644);
+  if (fd == -1) {
+    fprintf(stderr, "error: cannot open status page %s: %s\n", shm_name, strerror(errno));
+    return -1;
+  }
+  if (ftruncate(fd, sizeof(picam_status)) != 0) {
+    fprintf(stderr, "error: cannot resize status page %s: %s\n", shm_name, strerror(errno));
+    close(fd);
+    shm_unlink(shm_name);
+    return -1;
+  }
+  page = mmap(NULL, sizeof(picam_status), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (page == MAP_FAILED) {
+    fprintf(stderr, "error: cannot map status page %s: %s\n", shm_name, strerror(errno));
+    page = NULL;
+    shm_unlink(shm_name);
+    return -1;
+  }
+
+  // Keep readers away while the page is initialized
+  __atomic_store_n(&page->sequence, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  page->magic = STATUS_MAGIC;
+  page->version = STATUS_VERSION;
+  page->size = sizeof(picam_status);
+  memset(&page->update_time_ms, 0,
+      sizeof(picam_status) - offsetof(picam_status, update_time_ms));
+  page->pid = getpid();
+  write_end(&page->sequence);
+  return 0;
+}
+
+void status_close() {
+  if (page == NULL) {
+    return;
+  }
+  munmap(page, sizeof(picam_status));
+  page = NULL;
+  shm_unlink(shm_name);
+}
+
+void status_set_recording(int is_recording, const char *filepath) {
+  if (page == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&write_mutex);
+  write_begin(&page->sequence);
+  page->is_recording = is_recording;
+  if (is_recording && filepath != NULL) {
+    strncpy(page->recording_filepath, filepath, sizeof(page->recording_filepath) - 1);
+    page->recording_filepath[sizeof(page->recording_filepath) - 1] = '\0';
+  } else {
+    page->recording_filepath[0] = '\0';
+  }
+  write_end(&page->sequence);
+  pthread_mutex_unlock(&write_mutex);
+}
+
+void status_set_audio_muted(int is_audio_muted) {
+  if (page == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&write_mutex);
+  write_begin(&page->sequence);
+  page->is_audio_muted = is_audio_muted;
+  write_end(&page->sequence);
+  pthread_mutex_unlock(&write_mutex);
+}
+
+void status_set_video_stats(float fps, int video_bitrate, int64_t av_drift_us) {
+  if (page == NULL) {
+    return;
+  }
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  write_begin(&page->stats_sequence);
+  page->fps = fps;
+  page->video_bitrate = video_bitrate;
+  page->av_drift_us = av_drift_us;
+  page->update_time_ms = ts.tv_sec * INT64_C(1000) + ts.tv_nsec / 1000000;
+  write_end(&page->stats_sequence);
+}
+
+void status_set_queue_depths(int record_buffer_packets, int record_write_backlog,
+    int audio_capture_frames) {
+  if (page == NULL) {
+    return;
+  }
+  write_begin(&page->stats_sequence);
+  page->record_buffer_packets = record_buffer_packets;
+  page->record_write_backlog = record_write_backlog;
+  page->audio_capture_frames = audio_capture_frames;
+  write_end(&page->stats_sequence);
+}
+
+void status_add_audio_xrun() {
+  if (page == NULL) {
+    return;
+  }
+  __atomic_fetch_add(&page->audio_xruns, 1, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,115 @@
+#ifndef PICAM_STATUS_H
+#define PICAM_STATUS_H
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// "PCAM" in little endian
+#define STATUS_MAGIC 0x4d414350
+
+// Incremented when the layout of picam_status changes
+#define STATUS_VERSION 2
+
+/**
+ * Status page shared via /dev/shm. Readers open it with shm_open()
+ * and mmap() and take a snapshot with status_read_snapshot().
+ *
+ * The fields are grouped by the thread which writes them, and each
+ * group has its own sequence number, so writers never wait for each
+ * other. audio_xruns is a plain atomic counter.
+ */
+typedef struct picam_status {
+  uint32_t magic; // STATUS_MAGIC
+  uint32_t version; // STATUS_VERSION
+  uint32_t size; // sizeof(picam_status)
+  uint32_t sequence; // odd while is_recording, is_audio_muted or recording_filepath is updated
+  int64_t update_time_ms; // wall clock time of the last stats update
+  int32_t pid;
+  int32_t is_recording;
+  int32_t is_audio_muted;
+  uint32_t audio_xruns; // number of microphone buffer overruns
+  uint32_t stats_sequence; // odd while the fields from update_time_ms to audio_capture_frames (except the above) are updated
+  float fps; // measured over the last GOP
+  int32_t video_bitrate; // measured over the last GOP, in bits per second
+  int64_t av_drift_us; // audio PTS minus video PTS
+  int32_t record_buffer_packets; // packets held in the record buffer
+  int32_t record_write_backlog; // packets waiting to be written to the recording
+  int32_t audio_capture_frames; // frames waiting in the microphone buffer
+  char recording_filepath[256]; // empty if not recording
+} picam_status;
+
+/**
+ * Copies a consistent snapshot of page to snapshot without a system call.
+ * Returns 0 on success, -1 if the page is invalid or is being updated
+ * too frequently.
+ */
+static inline int status_read_snapshot(const picam_status *page, picam_status *snapshot) {
+  int tries;
+  for (tries = 0; tries < 1000; tries++) {
+    uint32_t seq = __atomic_load_n(&page->sequence, __ATOMIC_ACQUIRE);
+    uint32_t stats_seq = __atomic_load_n(&page->stats_sequence, __ATOMIC_ACQUIRE);
+    if ((seq & 1) || (stats_seq & 1)) { // writer is active
+      continue;
+    }
+    memcpy(snapshot, (const void *)page, sizeof(picam_status));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&page->sequence, __ATOMIC_RELAXED) == seq &&
+        __atomic_load_n(&page->stats_sequence, __ATOMIC_RELAXED) == stats_seq) {
+      if (snapshot->magic != STATUS_MAGIC || snapshot->version != STATUS_VERSION) {
+        return -1;
+      }
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Creates the status page /dev/shm/<name>.
+ * Returns 0 on success, -1 on error.
+ */
+int status_open(const char *name);
+
+/**
+ * Removes the status page.
+ */
+void status_close();
+
+/**
+ * Sets the recording state. filepath may be NULL when not recording.
+ * This and status_set_audio_muted() may be called from any thread
+ * except the camera and audio threads.
+ */
+void status_set_recording(int is_recording, const char *filepath);
+
+/**
+ * Sets whether audio is muted.
+ */
+void status_set_audio_muted(int is_audio_muted);
+
+/**
+ * Sets the statistics measured over the last GOP. This and
+ * status_set_queue_depths() must be called from a single thread.
+ */
+void status_set_video_stats(float fps, int video_bitrate, int64_t av_drift_us);
+
+/**
+ * Sets the depths of the queues.
+ */
+void status_set_queue_depths(int record_buffer_packets, int record_write_backlog,
+    int audio_capture_frames);
+
+/**
+ * Counts a microphone buffer overrun. This does not wait for any writer.
+ */
+void status_add_audio_xrun();
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // PICAM_STATUS_H
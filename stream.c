@@ -3,7 +3,7 @@
  *  encode them to H.264/AAC, and mux them to MPEG-TS.
  *
  *  H.264 encoder: Raspberry Pi H.264 hardware encoder (via OpenMAX IL)
- *  AAC encoder  : fdk-aac (via libavcodec)
+ *  Audio encoder: fdk-aac, FFmpeg native AAC or Opus (via libavcodec)
  *  MPEG-TS muxer: libavformat
  */
 
@@ -28,6 +28,8 @@ extern "C" {
 #include <sys/statvfs.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/wait.h>
+#include <spawn.h>
 #include <alsa/asoundlib.h>
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
@@ -38,6 +40,11 @@ extern "C" {
 #include "ilclient.h"
 
 #include "hooks.h"
+#include "control.h"
+#include "status.h"
+#include "metrics.h"
+#include "trace.h"
+#include "abr.h"
 #include "mpegts.h"
 #include "httplivestreaming.h"
 #include "state.h"
@@ -46,6 +53,9 @@ extern "C" {
 #include "dispmanx.h"
 #include "timestamp.h"
 #include "subtitle.h"
+#include "overlay.h"
+#include "audiolevel.h"
+#include "audiomix.h"
 
 #define PROGRAM_NAME     "picam"
 #define PROGRAM_VERSION  "1.4.11"
@@ -59,6 +69,25 @@ extern "C" {
 // ALSA buffer size for playback will be multiplied by this number (max: 16)
 #define ALSA_PLAYBACK_BUFFER_MULTIPLY 10
 
+// Number of periods held in the jitter buffer for audio preview
+#define AUDIO_PREVIEW_BUFFER_PERIODS 8
+
+// Audio preview starts (or restarts after running dry) once
+// this many periods are buffered
+#define AUDIO_PREVIEW_PREFILL_PERIODS 2
+
+// Buffered periods above this are dropped to keep preview latency low
+#define AUDIO_PREVIEW_MAX_BUFFERED_PERIODS 4
+
+// Max consecutive periods repeated while capture is behind playback
+#define AUDIO_PREVIEW_MAX_REPEATS 4
+
+// Max number of --silencecmd processes running at the same time
+#define SILENCE_COMMAND_MAX_PROCESSES 4
+
+// Audio levels are written to the state dir at this interval
+#define AUDIO_LEVEL_STATE_INTERVAL_SEC 1
+
 // If this is 1, PTS will be reset to zero when it exceeds PTS_MODULO
 #define ENABLE_PTS_WRAP_AROUND 0
 
@@ -163,6 +192,12 @@ static int video_vflip;
 static const int video_vflip_default = 0;
 static long video_bitrate;
 static const long video_bitrate_default = 2000 * 1000; // 2 Mbps
+static int is_abr_enabled;
+static const int is_abr_enabled_default = 0;
+static long abr_min_bitrate;
+static const long abr_min_bitrate_default = 0; // 0 means video_bitrate / 4
+static long abr_max_bitrate;
+static const long abr_max_bitrate_default = 0; // 0 means video_bitrate
 
 static char video_avc_profile[21];
 static const char *video_avc_profile_default = "constrained_baseline";
@@ -222,6 +257,20 @@ static int audio_preview_channels;
 static const int audio_channels_default = 1; // mono
 static int audio_sample_rate;
 static const int audio_sample_rate_default = 48000;
+static int is_audio_level_enabled;
+static const int is_audio_level_enabled_default = 0;
+static float silence_threshold;
+static const float silence_threshold_default = -60.0f; // dBFS
+static float silence_duration;
+static const float silence_duration_default = 0.0f; // disabled
+static char silence_command[256];
+static const char *silence_command_default = "";
+// pids of running --silencecmd processes, or 0
+static pid_t silence_command_pids[SILENCE_COMMAND_MAX_PROCESSES];
+static char audio_codec[16];
+static const char *audio_codec_default = "aac";
+static int audio_frame_duration;
+static const int audio_frame_duration_default = 0; // use encoder default
 static int is_hlsout_enabled;
 static const int is_hlsout_enabled_default = 0;
 static char hls_output_dir[256];
@@ -336,6 +385,24 @@ static char state_dir[256];
 static const char *state_dir_default = "state";
 static char hooks_dir[256];
 static const char *hooks_dir_default = "hooks";
+static char control_socket_path[256];
+static const char *control_socket_path_default = ""; // disabled
+static char status_shm_name[256];
+static const char *status_shm_name_default = ""; // disabled
+static int is_state_file_disabled;
+static const int is_state_file_disabled_default = 0;
+static int metrics_port;
+static const int metrics_port_default = 0; // disabled
+static int is_trace_requested;
+static const int is_trace_requested_default = 0;
+static float keyframe_request_interval;
+static const float keyframe_request_interval_default = 2.0f; // in seconds
+static int is_auto_keyframe_enabled;
+static const int is_auto_keyframe_enabled_default = 0;
+static long gop_cache_size;
+static const long gop_cache_size_default = 0; // disabled
+static int is_intra_refresh_enabled;
+static const int is_intra_refresh_enabled_default = 0;
 static float audio_volume_multiply;
 static const float audio_volume_multiply_default = 1.0f;
 static int audio_min_value;
@@ -443,15 +510,36 @@ static void encode_and_send_image();
 static void encode_and_send_audio();
 void start_record();
 void stop_record();
-#if ENABLE_AUTO_GOP_SIZE_CONTROL_FOR_VFR
-static void set_gop_size(int gop_size);
-#endif
+static int set_gop_size(int gop_size);
+static int set_video_bitrate(long bitrate);
+static void control_bitrate();
+static void schedule_keyframe();
+static void process_keyframe_request();
+static void process_gop_size_request();
+static int setup_tcp_output();
+static void teardown_tcp_output();
+static int ensure_hls_dir_exists();
+static int configure_hls_output();
+static int open_rtsp_sockets();
+static void close_rtsp_sockets();
 
 static int video_send_keyframe_count = 0;
+
+// Keyframes requested by schedule_keyframe()
+static int is_keyframe_requested = 0; // set by any thread
+static int64_t last_keyframe_request_time = 0;
+static int keyframe_request_age = -1; // frames since the request was sent to the encoder, or -1
+// GOP size set by the gopsize command, or 0. video_gop_size itself is
+// only changed on the camera thread.
+static int pending_video_gop_size = 0; // set by any thread
+static int video_frames_since_keyframe = 0;
 static long long video_frame_count = 0;
 static long long audio_frame_count = 0;
 static int64_t video_start_time;
 static int64_t audio_start_time;
+// CLOCK_MONOTONIC time at which main() was entered
+static int64_t launch_time;
+static int is_first_frame_encoded = 0;
 static int is_video_recording_started = 0;
 static int is_audio_recording_started = 0;
 static uint8_t *last_video_buffer = NULL;
@@ -477,10 +565,37 @@ static int n_tunnel = 0;
 static AVFormatContext *tcp_ctx;
 static pthread_mutex_t tcp_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// When tcpout starts from the GOP cache, tcpout_replay_thread sends the
+// cached packets followed by the packets encoded in the meantime.
+// These are guarded by tcp_mutex.
+static EncodedPacket *tcpout_replay_packets = NULL;
+static int tcpout_replay_capacity = 0;
+static int tcpout_replay_head = 0; // index of the next packet to send
+static int tcpout_replay_count = 0;
+static int is_tcpout_replaying = 0; // new packets are queued while this is set
+static int tcpout_replay_thread_needs_exit = 0;
+static pthread_cond_t tcpout_replay_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t tcpout_replay_thread;
+static int is_tcpout_replay_thread_started = 0;
+// Held by tcpout_replay_thread while it writes to tcp_ctx without tcp_mutex
+static pthread_mutex_t tcpout_replay_write_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 static int current_exposure_mode = EXPOSURE_AUTO;
 
 static int keepRunning = 1;
 static int frame_count = 0;
+static int64_t video_bytes_since_stats = 0; // encoded video bytes since the last FPS calculation
+static int audio_capture_frames = 0; // frames available in the microphone buffer at the last read
+// Capture times and numbers of the frames being encoded, for measuring
+// frame latency. The encoder outputs the frames in the same order as
+// they are fed.
+#define CAPTURE_TIMES_SIZE 8
+static int64_t capture_times[CAPTURE_TIMES_SIZE];
+static int64_t capture_frames[CAPTURE_TIMES_SIZE];
+static int capture_times_head = 0; // index of the oldest item
+static int capture_times_count = 0;
+static int64_t video_capture_frame = -1; // number of the last frame from the camera
+static int64_t video_encoded_frame = -1; // number of the last frame from the encoder
 static int current_audio_frames = 0;
 static uint8_t *codec_configs[2];
 static int codec_config_sizes[2];
@@ -498,6 +613,10 @@ static HTTPLiveStreaming *hls;
 static uint8_t access_unit_delimiter[] = {
   0x00, 0x00, 0x00, 0x01, 0x09, 0xf0,
 };
+
+// Recovery point SEI (NAL unit type 6) inserted in intra refresh mode
+static uint8_t recovery_point_sei[32];
+static int recovery_point_sei_length = 0;
 static int access_unit_delimiter_length = 6;
 
 // sound
@@ -505,6 +624,9 @@ static snd_pcm_t *capture_handle;
 static snd_pcm_t *audio_preview_handle;
 static snd_pcm_hw_params_t *alsa_hw_params;
 static uint16_t *samples;
+// Buffer passed to the encoder when it does not accept S16 samples.
+// NULL if samples can be encoded as is.
+static uint8_t *encoder_samples;
 static AVFrame *av_frame;
 static int audio_fd_count;
 static struct pollfd *poll_fds; // file descriptors for polling audio
@@ -514,15 +636,42 @@ static int audio_buffer_size;
 static int is_audio_preview_enabled;
 static const int is_audio_preview_enabled_default = 0;
 static int is_audio_preview_device_opened = 0;
+static snd_pcm_uframes_t audio_preview_device_buffer_frames = 0;
+
+// audio preview jitter buffer (capture thread -> audio preview thread)
+static pthread_t audio_preview_thread;
+static pthread_mutex_t audio_preview_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t audio_preview_cond = PTHREAD_COND_INITIALIZER;
+static uint16_t *audio_preview_buffer;
+static int audio_preview_read_index = 0;
+static int audio_preview_write_index = 0;
+static int audio_preview_buffered_periods = 0;
+static int is_audio_preview_thread_started = 0;
+static long audio_preview_dropped_periods = 0;
+static long audio_preview_repeated_periods = 0;
+
+// audio level metering
+static int audio_level_periods_since_publish = 0;
 
 // threads
 static pthread_mutex_t mutex_writing = PTHREAD_MUTEX_INITIALIZER;
 
 // UNIX domain sockets
-static int sockfd_video;
-static int sockfd_video_control;
-static int sockfd_audio;
-static int sockfd_audio_control;
+static int sockfd_video = -1;
+static int sockfd_video_control = -1;
+static int sockfd_audio = -1;
+static int sockfd_audio_control = -1;
+// Guards the sockets when rtspout is enabled or disabled at runtime
+static pthread_mutex_t rtsp_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Outputs enabled by the output command start at the next keyframe
+static int is_hlsout_pending = 0;
+static int is_tcpout_pending = 0;
+static int is_rtspout_pending = 0;
+// HLS has been disabled and enabled again by the output command
+static int is_hlsout_resuming = 0;
+// HLS output directory and encryption have been set up
+static int is_hls_configured = 0;
 
 static uint8_t *encbuf = NULL;
 static int encbuf_size = -1;
@@ -549,9 +698,14 @@ static int current_encoded_packet = -1; // write pointer of encoded_packets arra
 static int *keyframe_pointers; // circular buffer that stores where keyframe occurs within encoded_packets
 static int current_keyframe_pointer = -1; // write pointer of keyframe_pointers array
 static int is_keyframe_pointers_filled = 0; // will be changed to 1 once encoded_packets is fully filled
+static int last_idr_packet = -1; // index of the latest IDR frame (or recovery point) in encoded_packets, including requested ones
+static int64_t gop_cache_bytes = 0; // bytes stored in encoded_packets since last_idr_packet
+static int gop_cache_packets = 0; // the number of packets stored in encoded_packets since last_idr_packet
 
 // hooks
 static pthread_t hooks_thread;
+// serializes the commands from hooks and the control socket
+static pthread_mutex_t command_mutex = PTHREAD_MUTEX_INITIALIZER;
 char recording_filepath[256];
 char recording_tmp_filepath[256];
 char recording_archive_filepath[1024];
@@ -585,11 +739,13 @@ static char errbuf[1024];
 static void unmute_audio() {
   log_info("unmute");
   is_audio_muted = 0;
+  status_set_audio_muted(0);
 }
 
 static void mute_audio() {
   log_info("mute");
   is_audio_muted = 1;
+  status_set_audio_muted(1);
 }
 
 // Check if disk usage is >= 95%
@@ -640,7 +796,10 @@ static int write_encoded_packets(int max_packets, int origin_pts) {
 
   av_init_packet(&avpkt);
   int wrote_packets = 0;
+  int64_t wrote_bytes = 0;
+  int64_t write_start_time = metrics_now();
 
+  trace_begin(TRACE_RECORD_WRITE, -1);
   pthread_mutex_lock(&rec_write_mutex);
   while (1) {
     wrote_packets++;
@@ -654,6 +813,8 @@ static int write_encoded_packets(int max_packets, int origin_pts) {
     if (ret < 0) {
       av_strerror(ret, errbuf, sizeof(errbuf));
       log_error("error: write_encoded_packets: av_write_frame: %s\n", errbuf);
+    } else {
+      wrote_bytes += enc_pkt->size;
     }
     if (++rec_thread_frame == encoded_packets_size) {
       rec_thread_frame = 0;
@@ -666,7 +827,10 @@ static int write_encoded_packets(int max_packets, int origin_pts) {
     }
   }
   pthread_mutex_unlock(&rec_write_mutex);
+  trace_end(TRACE_RECORD_WRITE, -1);
   av_free_packet(&avpkt);
+  metrics_add(METRICS_RECORD_BYTES, wrote_bytes);
+  metrics_observe_since(METRICS_RECORD_WRITE_TIME, write_start_time);
 
   return wrote_packets;
 }
@@ -685,6 +849,7 @@ static void add_encoded_packet(int64_t pts, uint8_t *data, int size, int stream_
     }
     if (current_encoded_packet == keyframe_pointers[next_keyframe_pointer]) {
       log_warn("warning: Record buffer is starving. Recorded file may not start from keyframe. Try reducing the value of --gopsize.\n");
+      metrics_add(METRICS_RECORD_BUFFER_OVERRUNS, 1);
     }
 
     av_freep(&packet->data);
@@ -701,6 +866,25 @@ static void add_encoded_packet(int64_t pts, uint8_t *data, int size, int stream_
   packet->size = size;
   packet->stream_index = stream_index;
   packet->flags = flags;
+
+  if (last_idr_packet != -1) {
+    if (++gop_cache_packets >= encoded_packets_size) {
+      // The IDR frame has been overwritten
+      last_idr_packet = -1;
+    } else {
+      gop_cache_bytes += size;
+    }
+  }
+}
+
+/**
+ * Marks the last packet added by add_encoded_packet() as the start of
+ * the GOP cache. rec_write_mutex must be locked by the caller.
+ */
+static void mark_idr_packet() {
+  last_idr_packet = current_encoded_packet;
+  gop_cache_bytes = encoded_packets[current_encoded_packet]->size;
+  gop_cache_packets = 0;
 }
 
 static void free_encoded_packets() {
@@ -746,8 +930,9 @@ void setup_av_frame(AVFormatContext *format_ctx) {
   log_debug("audio_codec_ctx->channels: %d\n", audio_codec_ctx->channels);
   log_debug("av_frame->channels: %d\n", av_frame->channels);
 
+  // Samples are always captured as interleaved S16
   buffer_size = av_samples_get_buffer_size(NULL, audio_codec_ctx->channels,
-      audio_codec_ctx->frame_size, audio_codec_ctx->sample_fmt, 0);
+      audio_codec_ctx->frame_size, AV_SAMPLE_FMT_S16, 0);
   samples = av_malloc(buffer_size);
   if (!samples) {
     log_error("error: av_malloc for samples failed\n");
@@ -765,12 +950,26 @@ void setup_av_frame(AVFormatContext *format_ctx) {
   }
 #endif
 
-  period_size = buffer_size / audio_channels / sizeof(short);
+  // One ALSA period holds exactly one encoder frame
+  period_size = audio_codec_ctx->frame_size;
   audio_pts_step_base = 90000.0f * period_size / audio_sample_rate;
   log_debug("audio_pts_step_base: %d\n", audio_pts_step_base);
 
-  ret = avcodec_fill_audio_frame(av_frame, audio_codec_ctx->channels, audio_codec_ctx->sample_fmt,
-      (const uint8_t*)samples, buffer_size, 0);
+  if (audio_codec_ctx->sample_fmt == AV_SAMPLE_FMT_S16) {
+    ret = avcodec_fill_audio_frame(av_frame, audio_codec_ctx->channels, audio_codec_ctx->sample_fmt,
+        (const uint8_t*)samples, buffer_size, 0);
+  } else {
+    int encoder_buffer_size = av_samples_get_buffer_size(NULL, audio_codec_ctx->channels,
+        audio_codec_ctx->frame_size, audio_codec_ctx->sample_fmt, 0);
+    encoder_samples = av_malloc(encoder_buffer_size);
+    if (!encoder_samples) {
+      log_error("error: av_malloc for encoder_samples failed\n");
+      exit(EXIT_FAILURE);
+    }
+    log_debug("allocated %d bytes for converted audio samples\n", encoder_buffer_size);
+    ret = avcodec_fill_audio_frame(av_frame, audio_codec_ctx->channels, audio_codec_ctx->sample_fmt,
+        encoder_samples, encoder_buffer_size, 0);
+  }
   if (ret < 0) {
     av_strerror(ret, errbuf, sizeof(errbuf));
     log_error("error: avcodec_fill_audio_frame failed: %s\n", errbuf);
@@ -907,6 +1106,7 @@ void *rec_thread_stop(int skip_cleanup) {
 
   is_recording = 0;
   state_set(state_dir, "record", "false");
+  status_set_recording(0, NULL);
 
   pthread_exit(0);
 }
@@ -1012,6 +1212,7 @@ void *rec_thread_start() {
   is_recording = 1;
   log_info("start rec to %s\n", recording_archive_filepath);
   state_set(state_dir, "record", "true");
+  status_set_recording(1, recording_filepath);
   pthread_mutex_unlock(&rec_write_mutex);
 
   int look_back_keyframes;
@@ -1203,21 +1404,46 @@ static int set_record_buffer_keyframes(int newsize) {
   current_encoded_packet = -1;
   current_keyframe_pointer = -1;
   is_keyframe_pointers_filled = 0;
+  last_idr_packet = -1;
 
   return 0;
 }
 
-// parse the contents of hooks/start_record
-static void parse_start_record_file(char *full_filename) {
+/**
+ * Copies the next line of *cursor (including the newline) to buf
+ * in the same way as fgets(), and advances *cursor.
+ * Returns NULL when there are no more lines.
+ */
+static char *read_line(const char **cursor, char *buf, size_t buf_size) {
+  const char *p = *cursor;
+  size_t len = 0;
+
+  if (p == NULL || *p == '\0') {
+    return NULL;
+  }
+  while (p[len] != '\0' && len < buf_size - 1) {
+    if (p[len++] == '\n') {
+      break;
+    }
+  }
+  memcpy(buf, p, len);
+  buf[len] = '\0';
+  *cursor = p + len;
+  return buf;
+}
+
+// parse the parameters of start_record command
+static void parse_start_record_params(const char *content) {
   char buf[1024];
+  const char *cursor = content;
+  const char *full_filename = "start_record";
 
   recording_basename[0] = 0; // empties the basename used for this recording
   recording_dest_dir[0] = 0; // empties the directory the result file will be put in
   recording_look_back_keyframes = -1;
 
-  FILE *fp = fopen(full_filename, "r");
-  if (fp != NULL) {
-    while (fgets(buf, sizeof(buf), fp)) {
+  if (content != NULL) {
+    while (read_line(&cursor, buf, sizeof(buf))) {
       char *sep_p = strchr(buf, '='); // separator (name=value)
       if (sep_p == NULL) { // we couldn't find '='
         log_error("error parsing line in %s: %s\n",
@@ -1265,7 +1491,6 @@ static void parse_start_record_file(char *full_filename) {
             full_filename, buf);
       }
     }
-    fclose(fp);
   }
 }
 
@@ -1314,14 +1539,537 @@ static int read_file(const char *filepath, char **file_contents, size_t *file_co
   return 0;
 }
 
-void on_file_create(char *filename, char *content) {
-  if (strcmp(filename, "start_record") == 0) {
-    char buf[256];
+/**
+ * Parses comma-separated layout_align value like "top,right".
+ * Returns 0 on success, -1 if an unknown word is found.
+ */
+static int parse_layout_align(const char *value, LAYOUT_ALIGN *layout_align) {
+  const char *search_p = value;
+  const char *end_p = value + strlen(value);
+  const char *comma_p;
+  int param_len;
+
+  *layout_align = 0;
+  while (1) {
+    comma_p = strchr(search_p, ',');
+    if (comma_p == NULL) {
+      param_len = end_p - search_p;
+    } else {
+      param_len = comma_p - search_p;
+    }
+    if (strncmp(search_p, "top", param_len) == 0) {
+      *layout_align |= LAYOUT_ALIGN_TOP;
+    } else if (strncmp(search_p, "middle", param_len) == 0) {
+      *layout_align |= LAYOUT_ALIGN_MIDDLE;
+    } else if (strncmp(search_p, "bottom", param_len) == 0) {
+      *layout_align |= LAYOUT_ALIGN_BOTTOM;
+    } else if (strncmp(search_p, "left", param_len) == 0) {
+      *layout_align |= LAYOUT_ALIGN_LEFT;
+    } else if (strncmp(search_p, "center", param_len) == 0) {
+      *layout_align |= LAYOUT_ALIGN_CENTER;
+    } else if (strncmp(search_p, "right", param_len) == 0) {
+      *layout_align |= LAYOUT_ALIGN_RIGHT;
+    } else {
+      return -1;
+    }
+    if (comma_p == NULL || end_p - 1 - comma_p <= 0) { // no remaining chars
+      break;
+    }
+    search_p = comma_p + 1;
+  }
+  return 0;
+}
+
+/**
+ * Shows the PNG image specified by file= in the overlay command.
+ * The image is removed if file= is not given.
+ */
+static int on_overlay_hook(const char *content) {
+  char line[1024];
+  char png_file[256] = { 0x00 };
+  LAYOUT_ALIGN layout_align = LAYOUT_ALIGN_TOP | LAYOUT_ALIGN_RIGHT;
+  int horizontal_margin = 20;
+  int vertical_margin = 20;
+  int abspos_x = 0;
+  int abspos_y = 0;
+  int is_abspos_specified = 0;
+  int in_preview = 1;
+  int in_video = 1;
+
+  const char *cursor = content;
+
+  // read key=value lines
+  while (read_line(&cursor, line, sizeof(line))) {
+    // remove newline at the end of the line
+    size_t line_len = strlen(line);
+    if (line[line_len-1] == '\n') {
+      line[line_len-1] = '\0';
+      line_len--;
+    }
+    if (line_len == 0 || line[0] == '#') { // blank or comment line
+      continue;
+    }
+
+    char *delimiter_p = strchr(line, '=');
+    if (delimiter_p == NULL) {
+      log_error("overlay error: cannot find delimiter: %s\n", line);
+      continue;
+    }
+    int key_len = delimiter_p - line;
+    char *end;
+    long value;
+    errno = 0;
+    if (strncmp(line, "file=", key_len+1) == 0) {
+      strncpy(png_file, delimiter_p + 1, sizeof(png_file) - 1);
+      png_file[sizeof(png_file) - 1] = '\0';
+    } else if (strncmp(line, "layout_align=", key_len+1) == 0) {
+      if (parse_layout_align(delimiter_p + 1, &layout_align) != 0) {
+        log_error("overlay error: invalid layout_align: %s\n", delimiter_p + 1);
+        return -1;
+      }
+    } else if (strncmp(line, "horizontal_margin=", key_len+1) == 0) {
+      value = strtol(delimiter_p+1, &end, 10);
+      if (end == delimiter_p+1 || *end != '\0' || errno == ERANGE) { // parse error
+        log_error("overlay error: invalid horizontal_margin: %s\n", delimiter_p+1);
+        return -1;
+      }
+      horizontal_margin = value;
+    } else if (strncmp(line, "vertical_margin=", key_len+1) == 0) {
+      value = strtol(delimiter_p+1, &end, 10);
+      if (end == delimiter_p+1 || *end != '\0' || errno == ERANGE) { // parse error
+        log_error("overlay error: invalid vertical_margin: %s\n", delimiter_p+1);
+        return -1;
+      }
+      vertical_margin = value;
+    } else if (strncmp(line, "pos=", key_len+1) == 0) { // absolute position
+      if (sscanf(delimiter_p+1, "%d,%d", &abspos_x, &abspos_y) != 2) {
+        log_error("overlay error: invalid pos format: %s (should be <x>,<y>)\n", delimiter_p+1);
+        return -1;
+      }
+      is_abspos_specified = 1;
+    } else if (strncmp(line, "in_preview=", key_len+1) == 0) {
+      in_preview = (atoi(delimiter_p+1) != 0);
+    } else if (strncmp(line, "in_video=", key_len+1) == 0) {
+      in_video = (atoi(delimiter_p+1) != 0);
+    } else {
+      log_error("overlay error: cannot parse line: %s\n", line);
+    }
+  }
+
+  if (png_file[0] == '\0') {
+    overlay_clear();
+    return 0;
+  }
+  if (overlay_load(png_file) != 0) {
+    log_error("overlay error: cannot load image: %s\n", png_file);
+    return -1;
+  }
+  if (is_abspos_specified) {
+    overlay_set_position(abspos_x, abspos_y);
+  } else {
+    overlay_set_layout(layout_align, horizontal_margin, vertical_margin);
+  }
+  overlay_set_visibility(in_preview, in_video);
+  overlay_show();
+}
+
+/**
+ * Starts the subtitle schedule. The content is SRT or WebVTT cues,
+ * or a file=<path> line pointing to them. An empty content stops
+ * the schedule.
+ */
+static int on_subtitle_schedule_hook(const char *content) {
+  char *file_buf = NULL;
+  size_t file_buf_len;
+  const char *data = content;
+
+  if (content == NULL) {
+    log_error("subtitle_schedule error: cannot read hook\n");
+    return -1;
+  }
+  if (strncmp(content, "file=", 5) == 0) {
+    char filepath[256];
+    size_t path_len = strcspn(content + 5, "\r\n");
+    if (path_len >= sizeof(filepath)) {
+      path_len = sizeof(filepath) - 1;
+    }
+    memcpy(filepath, content + 5, path_len);
+    filepath[path_len] = '\0';
+    if (read_file(filepath, &file_buf, &file_buf_len) != 0) {
+      log_error("subtitle_schedule error: cannot read file: %s\n", filepath);
+      return -1;
+    }
+    data = file_buf;
+  }
+
+  int ret = 0;
+  if (strspn(data, " \t\r\n") == strlen(data)) { // empty
+    subtitle_schedule_stop();
+  } else if (subtitle_schedule_start(data, strlen(data)) != 0) {
+    log_error("subtitle_schedule error: cannot start the schedule\n");
+    ret = -1;
+  }
+  free(file_buf);
+  return ret;
+}
+
+/**
+ * Writes the trace of the last seconds= (default 10) seconds to
+ * file= (default: state/trace.json).
+ */
+static int on_trace_hook(const char *content) {
+  char line[1024];
+  char trace_file[256];
+  int seconds = 10;
+  const char *cursor = content;
+
+  snprintf(trace_file, sizeof(trace_file), "%s/trace.json", state_dir);
+  while (read_line(&cursor, line, sizeof(line))) {
+    // remove newline at the end of the line
+    size_t line_len = strlen(line);
+    if (line_len > 0 && line[line_len-1] == '\n') {
+      line[line_len-1] = '\0';
+    }
+    if (strncmp(line, "seconds=", 8) == 0) {
+      char *end;
+      long value = strtol(line + 8, &end, 10);
+      if (end == line + 8 || *end != '\0' || value <= 0) {
+        log_error("trace error: invalid seconds: %s\n", line + 8);
+        return -1;
+      }
+      seconds = value;
+    } else if (strncmp(line, "file=", 5) == 0) {
+      strncpy(trace_file, line + 5, sizeof(trace_file) - 1);
+      trace_file[sizeof(trace_file) - 1] = '\0';
+    } else if (line[0] != '\0') {
+      log_error("trace error: cannot parse line: %s\n", line);
+    }
+  }
+  if (!is_trace_enabled) {
+    log_error("trace error: start picam with --trace\n");
+    return -1;
+  }
+  return trace_dump(trace_file, seconds);
+}
+
+/**
+ * Appends a copy of the packet to the packets sent by tcpout_replay_thread.
+ * tcp_mutex must be locked by the caller.
+ * Returns 0 on success, -1 on error.
+ */
+static int queue_tcpout_replay_packet(int64_t pts, uint8_t *data, int size,
+    int stream_index, int flags) {
+  EncodedPacket *packet;
+
+  if (tcpout_replay_count == tcpout_replay_capacity) {
+    int capacity = (tcpout_replay_capacity > 0) ? tcpout_replay_capacity * 2 : 64;
+    EncodedPacket *packets = realloc(tcpout_replay_packets, capacity * sizeof(EncodedPacket));
+    if (packets == NULL) {
+      log_error("error: cannot allocate memory for tcpout replay\n");
+      return -1;
+    }
+    tcpout_replay_packets = packets;
+    tcpout_replay_capacity = capacity;
+  }
+  packet = &tcpout_replay_packets[tcpout_replay_count];
+  packet->data = av_malloc(size);
+  if (packet->data == NULL) {
+    log_error("error: cannot allocate memory for tcpout replay (%d bytes)\n", size);
+    return -1;
+  }
+  memcpy(packet->data, data, size);
+  packet->pts = pts;
+  packet->size = size;
+  packet->stream_index = stream_index;
+  packet->flags = flags;
+  tcpout_replay_count++;
+  return 0;
+}
+
+/**
+ * Discards the packets which have not been sent by tcpout_replay_thread,
+ * and lets the packets from now on be written directly.
+ * tcp_mutex must be locked by the caller.
+ */
+static void clear_tcpout_replay_packets() {
+  int i;
+
+  for (i = tcpout_replay_head; i < tcpout_replay_count; i++) {
+    av_freep(&tcpout_replay_packets[i].data);
+  }
+  tcpout_replay_head = 0;
+  tcpout_replay_count = 0;
+  is_tcpout_replaying = 0;
+}
+
+/**
+ * Writes the packet to tcpout, or queues it after the GOP cache while
+ * tcpout_replay_thread is sending it. tcp_mutex must be locked by the caller.
+ */
+static void write_tcpout_packet(AVPacket *pkt) {
+  if (is_tcpout_replaying) {
+    queue_tcpout_replay_packet(pkt->pts, pkt->data, pkt->size,
+        pkt->stream_index, pkt->flags);
+  } else {
+    av_write_frame(tcp_ctx, pkt);
+  }
+}
+
+/**
+ * Sends the packets queued by start_tcpout_from_gop_cache() and
+ * write_tcpout_packet(). Each packet is written without tcp_mutex,
+ * so a slow receiver does not hold back the camera and audio threads.
+ */
+static void *tcpout_replay_thread_start(void *arg) {
+  EncodedPacket packet;
+  AVPacket avpkt;
+  int needs_exit;
 
-    // parse the contents of hooks/start_record
-    snprintf(buf, sizeof(buf), "%s/%s", hooks_dir, filename);
-    parse_start_record_file(buf);
+  av_init_packet(&avpkt);
+  while (1) {
+    pthread_mutex_lock(&tcp_mutex);
+    while (!tcpout_replay_thread_needs_exit && !is_tcpout_replaying) {
+      pthread_cond_wait(&tcpout_replay_cond, &tcp_mutex);
+    }
+    needs_exit = tcpout_replay_thread_needs_exit;
+    pthread_mutex_unlock(&tcp_mutex);
+    if (needs_exit) {
+      break;
+    }
+
+    // Lock order is tcpout_replay_write_mutex -> tcp_mutex
+    pthread_mutex_lock(&tcpout_replay_write_mutex);
+    pthread_mutex_lock(&tcp_mutex);
+    if (!is_tcpout_replaying) { // stopped by the output command
+      pthread_mutex_unlock(&tcp_mutex);
+      pthread_mutex_unlock(&tcpout_replay_write_mutex);
+      continue;
+    }
+    if (tcpout_replay_head == tcpout_replay_count) {
+      // Caught up; packets from now on are sent as they are encoded
+      clear_tcpout_replay_packets();
+      pthread_mutex_unlock(&tcp_mutex);
+      pthread_mutex_unlock(&tcpout_replay_write_mutex);
+      log_debug("tcpout caught up with the live stream\n");
+      continue;
+    }
+    packet = tcpout_replay_packets[tcpout_replay_head++];
+    pthread_mutex_unlock(&tcp_mutex);
+
+    avpkt.pts = avpkt.dts = packet.pts;
+    avpkt.data = packet.data;
+    avpkt.size = packet.size;
+    avpkt.stream_index = packet.stream_index;
+    avpkt.flags = packet.flags;
+    trace_begin(TRACE_TCP_WRITE, -1);
+    av_write_frame(tcp_ctx, &avpkt);
+    trace_end(TRACE_TCP_WRITE, -1);
+    av_freep(&packet.data);
+    pthread_mutex_unlock(&tcpout_replay_write_mutex);
+  }
+  av_free_packet(&avpkt);
+  pthread_exit(0);
+}
+
+static void start_tcpout_replay_thread() {
+  tcpout_replay_thread_needs_exit = 0;
+  pthread_create(&tcpout_replay_thread, NULL, tcpout_replay_thread_start, NULL);
+  is_tcpout_replay_thread_started = 1;
+}
+
+static void stop_tcpout_replay_thread() {
+  pthread_mutex_lock(&tcp_mutex);
+  tcpout_replay_thread_needs_exit = 1;
+  clear_tcpout_replay_packets();
+  pthread_cond_signal(&tcpout_replay_cond);
+  pthread_mutex_unlock(&tcp_mutex);
+  pthread_join(tcpout_replay_thread, NULL);
+  is_tcpout_replay_thread_started = 0;
+  free(tcpout_replay_packets);
+  tcpout_replay_packets = NULL;
+  tcpout_replay_capacity = 0;
+}
+
+/**
+ * Enables or disables tcpout. An enabled output starts at the next keyframe,
+ * or at the next frame from the GOP cache if --gopcache is set.
+ * Returns 0 on success, -1 on error.
+ */
+static int set_tcpout_enabled(int enable) {
+  int was_enabled;
+
+  if (enable) {
+    if (is_tcpout_enabled || is_tcpout_pending) {
+      return 0;
+    }
+    if (tcp_output_dest[0] == '\0') {
+      log_error("output error: tcp_dest is not set\n");
+      return -1;
+    }
+    if (setup_tcp_output() != 0) {
+      return -1;
+    }
+    pthread_mutex_lock(&tcp_mutex);
+    is_tcpout_pending = 1;
+    pthread_mutex_unlock(&tcp_mutex);
+    if (gop_cache_size > 0) {
+      log_info("tcpout (%s) will start at the next frame\n", tcp_output_dest);
+    } else {
+      log_info("tcpout (%s) will start at the next keyframe\n", tcp_output_dest);
+    }
+  } else {
+    pthread_mutex_lock(&tcp_mutex);
+    was_enabled = is_tcpout_enabled || is_tcpout_pending;
+    is_tcpout_enabled = 0;
+    is_tcpout_pending = 0;
+    clear_tcpout_replay_packets();
+    pthread_mutex_unlock(&tcp_mutex);
+    // Wait for the packet which tcpout_replay_thread may be writing
+    pthread_mutex_lock(&tcpout_replay_write_mutex);
+    pthread_mutex_unlock(&tcpout_replay_write_mutex);
+    if (tcp_ctx != NULL) {
+      teardown_tcp_output();
+    }
+    if (was_enabled) {
+      log_info("tcpout stopped\n");
+    }
+  }
+  return 0;
+}
+
+/**
+ * Enables or disables rtspout. An enabled output starts at the next keyframe.
+ * Returns 0 on success, -1 on error.
+ */
+static int set_rtspout_enabled(int enable) {
+  int was_enabled;
+
+  if (enable) {
+    if (is_rtspout_enabled || is_rtspout_pending) {
+      return 0;
+    }
+    if (strcmp(audio_codec, "opus") == 0) {
+      log_error("output error: rtspout supports only AAC audio\n");
+      return -1;
+    }
+    if (open_rtsp_sockets() != 0) {
+      return -1;
+    }
+    pthread_mutex_lock(&rtsp_mutex);
+    is_rtspout_pending = 1;
+    pthread_mutex_unlock(&rtsp_mutex);
+    log_info("rtspout will start at the next keyframe\n");
+  } else {
+    pthread_mutex_lock(&rtsp_mutex);
+    was_enabled = is_rtspout_enabled || is_rtspout_pending;
+    is_rtspout_enabled = 0;
+    is_rtspout_pending = 0;
+    close_rtsp_sockets();
+    pthread_mutex_unlock(&rtsp_mutex);
+    if (was_enabled) {
+      log_info("rtspout stopped\n");
+    }
+  }
+  return 0;
+}
+
+/**
+ * Enables or disables hlsout. An enabled output starts a new segment
+ * at the next keyframe. Returns 0 on success, -1 on error.
+ */
+static int set_hlsout_enabled(int enable) {
+  int was_enabled;
 
+  if (enable) {
+    if (is_hlsout_enabled || is_hlsout_pending) {
+      return 0;
+    }
+    if (ensure_hls_dir_exists() != 0 || configure_hls_output() != 0) {
+      return -1;
+    }
+    pthread_mutex_lock(&mutex_writing);
+    is_hlsout_pending = 1;
+    pthread_mutex_unlock(&mutex_writing);
+    log_info("hlsout (%s) will start at the next keyframe\n", hls_output_dir);
+  } else {
+    pthread_mutex_lock(&mutex_writing);
+    was_enabled = is_hlsout_enabled || is_hlsout_pending;
+    is_hlsout_enabled = 0;
+    is_hlsout_pending = 0;
+    pthread_mutex_unlock(&mutex_writing);
+    if (was_enabled) {
+      log_info("hlsout stopped\n");
+    }
+  }
+  return 0;
+}
+
+/**
+ * Enables or disables the outputs with hls=, tcp= and rtsp= (1 or 0).
+ * tcp_dest= changes the destination of tcpout, which restarts
+ * tcpout if it is running.
+ */
+static int on_output_hook(const char *content) {
+  char line[1024];
+  char tcp_dest[sizeof(tcp_output_dest)] = { 0x00 };
+  int hls_enable = -1;
+  int tcp_enable = -1;
+  int rtsp_enable = -1;
+  const char *cursor = content;
+  int ret = 0;
+
+  if (hls == NULL) {
+    log_error("output error: outputs are not ready yet\n");
+    return -1;
+  }
+  while (read_line(&cursor, line, sizeof(line))) {
+    // remove newline at the end of the line
+    size_t line_len = strlen(line);
+    if (line_len > 0 && line[line_len-1] == '\n') {
+      line[line_len-1] = '\0';
+    }
+    if (strcmp(line, "hls=0") == 0 || strcmp(line, "hls=1") == 0) {
+      hls_enable = line[4] - '0';
+    } else if (strcmp(line, "tcp=0") == 0 || strcmp(line, "tcp=1") == 0) {
+      tcp_enable = line[4] - '0';
+    } else if (strcmp(line, "rtsp=0") == 0 || strcmp(line, "rtsp=1") == 0) {
+      rtsp_enable = line[5] - '0';
+    } else if (strncmp(line, "tcp_dest=", 9) == 0) {
+      strncpy(tcp_dest, line + 9, sizeof(tcp_dest) - 1);
+      tcp_dest[sizeof(tcp_dest) - 1] = '\0';
+    } else if (line[0] != '\0') {
+      log_error("output error: cannot parse line: %s\n", line);
+      return -1;
+    }
+  }
+
+  if (tcp_dest[0] != '\0') {
+    if (tcp_enable == -1 && (is_tcpout_enabled || is_tcpout_pending)) {
+      tcp_enable = 1;
+    }
+    set_tcpout_enabled(0);
+    memcpy(tcp_output_dest, tcp_dest, sizeof(tcp_output_dest));
+  }
+  if (tcp_enable != -1 && set_tcpout_enabled(tcp_enable) != 0) {
+    ret = -1;
+  }
+  if (hls_enable != -1 && set_hlsout_enabled(hls_enable) != 0) {
+    ret = -1;
+  }
+  if (rtsp_enable != -1 && set_rtspout_enabled(rtsp_enable) != 0) {
+    ret = -1;
+  }
+  if (is_auto_keyframe_enabled &&
+      (is_hlsout_pending || is_tcpout_pending || is_rtspout_pending)) {
+    // Start the outputs now rather than at the end of the GOP
+    schedule_keyframe();
+  }
+  return ret;
+}
+
+static int run_command_locked(const char *filename, const char *content) {
+  if (strcmp(filename, "start_record") == 0) {
+    parse_start_record_params(content);
     start_record();
   } else if (strcmp(filename, "stop_record") == 0) {
     stop_record();
@@ -1330,53 +2078,37 @@ void on_file_create(char *filename, char *content) {
   } else if (strcmp(filename, "unmute") == 0) {
     unmute_audio();
   } else if (strcmp(filename, "wbred") == 0) {
-    char buf[256];
-    snprintf(buf, sizeof(buf), "%s/%s", hooks_dir, filename);
-    char *file_buf;
-    size_t file_buf_len;
-    if (read_file(buf, &file_buf, &file_buf_len) == 0) {
-      if (file_buf != NULL) {
-        // read a number
-        char *end;
-        double value = strtod(file_buf, &end);
-        if (end == file_buf || errno == ERANGE) { // parse error
-          log_error("error parsing file %s\n", buf);
-        } else { // parse ok
-          awb_red_gain = value;
-          if (camera_set_custom_awb_gains() == 0) {
-            log_info("changed red gain to %.2f\n", awb_red_gain);
-          } else {
-            log_error("error: failed to set wbred\n");
-          }
-        }
-        free(file_buf);
-      }
+    // read a number
+    char *end;
+    double value = content != NULL ? strtod(content, &end) : 0.0;
+    if (content == NULL || end == content || errno == ERANGE) { // parse error
+      log_error("error parsing wbred: %s\n", content != NULL ? content : "");
+      return -1;
+    }
+    awb_red_gain = value;
+    if (camera_set_custom_awb_gains() == 0) {
+      log_info("changed red gain to %.2f\n", awb_red_gain);
+    } else {
+      log_error("error: failed to set wbred\n");
+      return -1;
     }
   } else if (strcmp(filename, "wbblue") == 0) {
-    char buf[256];
-    snprintf(buf, sizeof(buf), "%s/%s", hooks_dir, filename);
-    char *file_buf;
-    size_t file_buf_len;
-    if (read_file(buf, &file_buf, &file_buf_len) == 0) {
-      if (file_buf != NULL) {
-        // read a number
-        char *end;
-        double value = strtod(file_buf, &end);
-        if (end == file_buf || errno == ERANGE) { // parse error
-          log_error("error parsing file %s\n", buf);
-        } else { // parse ok
-          awb_blue_gain = value;
-          if (camera_set_custom_awb_gains() == 0) {
-            log_info("changed blue gain to %.2f\n", awb_blue_gain);
-          } else {
-            log_error("error: failed to set wbblue\n");
-          }
-        }
-        free(file_buf);
-      }
+    // read a number
+    char *end;
+    double value = content != NULL ? strtod(content, &end) : 0.0;
+    if (content == NULL || end == content || errno == ERANGE) { // parse error
+      log_error("error parsing wbblue: %s\n", content != NULL ? content : "");
+      return -1;
+    }
+    awb_blue_gain = value;
+    if (camera_set_custom_awb_gains() == 0) {
+      log_info("changed blue gain to %.2f\n", awb_blue_gain);
+    } else {
+      log_error("error: failed to set wbblue\n");
+      return -1;
     }
   } else if (strncmp(filename, "wb_", 3) == 0) { // e.g. wb_sun
-    char *wb_mode = filename + 3;
+    const char *wb_mode = filename + 3;
     int matched = 0;
     int i;
     for (i = 0; i < sizeof(white_balance_options) / sizeof(white_balance_option); i++) {
@@ -1392,6 +2124,7 @@ void on_file_create(char *filename, char *content) {
         log_info("changed the white balance to %s\n", white_balance);
       } else {
         log_error("error: failed to set the white balance to %s\n", white_balance);
+        return -1;
       }
     } else {
       log_error("hook error: invalid white balance: %s\n", wb_mode);
@@ -1405,9 +2138,10 @@ void on_file_create(char *filename, char *content) {
           log_error("/");
         }
       }
+      return -1;
     }
   } else if (strncmp(filename, "ex_", 3) == 0) { // e.g. ex_night
-    char *ex_mode = filename + 3;
+    const char *ex_mode = filename + 3;
     int matched = 0;
     int i;
 
@@ -1428,6 +2162,7 @@ void on_file_create(char *filename, char *content) {
         log_info("changed the exposure control to %s\n", exposure_control);
       } else {
         log_error("error: failed to set the exposure control to %s\n", exposure_control);
+        return -1;
       }
     } else {
       log_error("hook error: invalid exposure control: %s\n", ex_mode);
@@ -1441,27 +2176,63 @@ void on_file_create(char *filename, char *content) {
           log_error("/");
         }
       }
+      return -1;
     }
-  } else if (strcmp(filename, "set_recordbuf") == 0) { // set global recordbuf
-    char buf[256];
-    snprintf(buf, sizeof(buf), "%s/%s", hooks_dir, filename);
-    char *file_buf;
-    size_t file_buf_len;
-    if (read_file(buf, &file_buf, &file_buf_len) == 0) {
-      if (file_buf != NULL) {
-        // read a number
-        char *end;
-        int value = strtol(file_buf, &end, 10);
-        if (end == file_buf || errno == ERANGE) { // parse error
-          log_error("error parsing file %s\n", buf);
-        } else { // parse ok
-          if (set_record_buffer_keyframes(value) == 0) {
-            log_info("recordbuf set to %d; existing record buffer cleared\n", value);
-          }
-        }
-        free(file_buf);
-      }
+  } else if (strcmp(filename, "bitrate") == 0) {
+    // read a number
+    char *end;
+    long value = content != NULL ? strtol(content, &end, 10) : 0;
+    if (content == NULL || end == content || errno == ERANGE || value <= 0) { // parse error
+      log_error("error parsing bitrate: %s\n", content != NULL ? content : "");
+      return -1;
+    }
+    if (video_encode == NULL) {
+      log_error("error: video encoder is not ready yet\n");
+      return -1;
+    }
+    if (video_bitrate == 0) {
+      log_error("error: bitrate cannot be changed when rate control is disabled\n");
+      return -1;
     }
+    if (set_video_bitrate(value) != 0) {
+      return -1;
+    }
+    log_info("changed video bitrate to %ld\n", video_bitrate);
+  } else if (strcmp(filename, "gopsize") == 0) {
+    // read a number
+    char *end;
+    long value = content != NULL ? strtol(content, &end, 10) : 0;
+    if (content == NULL || end == content || errno == ERANGE || value <= 0) { // parse error
+      log_error("error parsing gopsize: %s\n", content != NULL ? content : "");
+      return -1;
+    }
+    if (video_encode == NULL) {
+      log_error("error: video encoder is not ready yet\n");
+      return -1;
+    }
+    if (is_intra_refresh_enabled) {
+      // The refresh cycle of the encoder cannot be changed while running
+      log_error("error: gopsize cannot be changed with --intrarefresh\n");
+      return -1;
+    }
+    if (set_gop_size(value) != 0) {
+      return -1;
+    }
+    // Taken over by the camera thread at the next frame
+    __atomic_store_n(&pending_video_gop_size, (int) value, __ATOMIC_RELEASE);
+    log_info("changed gop size to %ld\n", value);
+  } else if (strcmp(filename, "set_recordbuf") == 0) { // set global recordbuf
+    // read a number
+    char *end;
+    int value = content != NULL ? strtol(content, &end, 10) : 0;
+    if (content == NULL || end == content || errno == ERANGE) { // parse error
+      log_error("error parsing set_recordbuf: %s\n", content != NULL ? content : "");
+      return -1;
+    }
+    if (set_record_buffer_keyframes(value) != 0) {
+      return -1;
+    }
+    log_info("recordbuf set to %d; existing record buffer cleared\n", value);
   } else if (strcmp(filename, "subtitle") == 0) {
     // The followings are default values for the subtitle
     char line[1024];
@@ -1489,15 +2260,13 @@ void on_file_create(char *filename, char *content) {
     int in_preview = 1;
     int in_video = 1;
 
-    char filepath[256];
-    snprintf(filepath, sizeof(filepath), "%s/%s", hooks_dir, filename);
-    FILE *fp;
-    fp = fopen(filepath, "r");
-    if (fp == NULL) {
-      log_error("subtitle error: cannot open file: %s\n", filepath);
+    const char *cursor = content;
+    if (content == NULL) {
+      log_error("subtitle error: no parameters\n");
+      return -1;
     } else {
       // read key=value lines
-      while (fgets(line, sizeof(line), fp)) {
+      while (read_line(&cursor, line, sizeof(line))) {
         // remove newline at the end of the line
         size_t line_len = strlen(line);
         if (line[line_len-1] == '\n') {
@@ -1532,7 +2301,7 @@ void on_file_create(char *filename, char *content) {
             long value = strtol(delimiter_p+1, &end, 10);
             if (end == delimiter_p+1 || *end != '\0' || errno == ERANGE) { // parse error
               log_error("subtitle error: invalid face_index: %s\n", delimiter_p+1);
-              return;
+              return -1;
             }
             face_index = value;
           } else if (strncmp(line, "pt=", key_len+1) == 0) {
@@ -1540,7 +2309,7 @@ void on_file_create(char *filename, char *content) {
             double value = strtod(delimiter_p+1, &end);
             if (end == delimiter_p+1 || *end != '\0' || errno == ERANGE) { // parse error
               log_error("subtitle error: invalid pt: %s\n", delimiter_p+1);
-              return;
+              return -1;
             }
             font_points = value;
           } else if (strncmp(line, "dpi=", key_len+1) == 0) {
@@ -1548,7 +2317,7 @@ void on_file_create(char *filename, char *content) {
             long value = strtol(delimiter_p+1, &end, 10);
             if (end == delimiter_p+1 || *end != '\0' || errno == ERANGE) { // parse error
               log_error("subtitle error: invalid dpi: %s\n", delimiter_p+1);
-              return;
+              return -1;
             }
             font_dpi = value;
           } else if (strncmp(line, "horizontal_margin=", key_len+1) == 0) {
@@ -1556,7 +2325,7 @@ void on_file_create(char *filename, char *content) {
             long value = strtol(delimiter_p+1, &end, 10);
             if (end == delimiter_p+1 || *end != '\0' || errno == ERANGE) { // parse error
               log_error("subtitle error: invalid horizontal_margin: %s\n", delimiter_p+1);
-              return;
+              return -1;
             }
             horizontal_margin = value;
           } else if (strncmp(line, "vertical_margin=", key_len+1) == 0) {
@@ -1564,7 +2333,7 @@ void on_file_create(char *filename, char *content) {
             long value = strtol(delimiter_p+1, &end, 10);
             if (end == delimiter_p+1 || *end != '\0' || errno == ERANGE) { // parse error
               log_error("subtitle error: invalid vertical_margin: %s\n", delimiter_p+1);
-              return;
+              return -1;
             }
             vertical_margin = value;
           } else if (strncmp(line, "duration=", key_len+1) == 0) {
@@ -1572,7 +2341,7 @@ void on_file_create(char *filename, char *content) {
             double value = strtod(delimiter_p+1, &end);
             if (end == delimiter_p+1 || *end != '\0' || errno == ERANGE) { // parse error
               log_error("subtitle error: invalid duration: %s\n", delimiter_p+1);
-              return;
+              return -1;
             }
             duration = value;
           } else if (strncmp(line, "color=", key_len+1) == 0) {
@@ -1580,11 +2349,11 @@ void on_file_create(char *filename, char *content) {
             long value = strtol(delimiter_p+1, &end, 16);
             if (end == delimiter_p+1 || *end != '\0' || errno == ERANGE) { // parse error
               log_error("subtitle error: invalid color: %s\n", delimiter_p+1);
-              return;
+              return -1;
             }
             if (value < 0) {
               log_error("subtitle error: invalid color: %d (must be >= 0)\n", value);
-              return;
+              return -1;
             }
             color = value;
           } else if (strncmp(line, "stroke_color=", key_len+1) == 0) {
@@ -1592,11 +2361,11 @@ void on_file_create(char *filename, char *content) {
             long value = strtol(delimiter_p+1, &end, 16);
             if (end == delimiter_p+1 || *end != '\0' || errno == ERANGE) { // parse error
               log_error("subtitle error: invalid stroke_color: %s\n", delimiter_p+1);
-              return;
+              return -1;
             }
             if (value < 0) {
               log_error("subtitle error: invalid stroke_color: %d (must be >= 0)\n", value);
-              return;
+              return -1;
             }
             stroke_color = value;
           } else if (strncmp(line, "stroke_width=", key_len+1) == 0) {
@@ -1604,7 +2373,7 @@ void on_file_create(char *filename, char *content) {
             double value = strtod(delimiter_p+1, &end);
             if (end == delimiter_p+1 || *end != '\0' || errno == ERANGE) { // parse error
               log_error("subtitle error: invalid stroke_width: %s\n", delimiter_p+1);
-              return;
+              return -1;
             }
             stroke_width = value;
           } else if (strncmp(line, "letter_spacing=", key_len+1) == 0) {
@@ -1612,7 +2381,7 @@ void on_file_create(char *filename, char *content) {
             long value = strtol(delimiter_p+1, &end, 10);
             if (end == delimiter_p+1 || *end != '\0' || errno == ERANGE) { // parse error
               log_error("subtitle error: invalid letter_spacing: %s\n", delimiter_p+1);
-              return;
+              return -1;
             }
             letter_spacing = value;
           } else if (strncmp(line, "line_height=", key_len+1) == 0) {
@@ -1620,7 +2389,7 @@ void on_file_create(char *filename, char *content) {
             double value = strtod(delimiter_p+1, &end);
             if (end == delimiter_p+1 || *end != '\0' || errno == ERANGE) { // parse error
               log_error("subtitle error: invalid line_height: %s\n", delimiter_p+1);
-              return;
+              return -1;
             }
             line_height_multiply = value;
           } else if (strncmp(line, "tab_scale=", key_len+1) == 0) {
@@ -1628,64 +2397,36 @@ void on_file_create(char *filename, char *content) {
             double value = strtod(delimiter_p+1, &end);
             if (end == delimiter_p+1 || *end != '\0' || errno == ERANGE) { // parse error
               log_error("subtitle error: invalid tab_scale: %s\n", delimiter_p+1);
-              return;
+              return -1;
             }
             tab_scale = value;
           } else if (strncmp(line, "pos=", key_len+1) == 0) { // absolute position
             char *comma_p = strchr(delimiter_p+1, ',');
             if (comma_p == NULL) {
               log_error("subtitle error: invalid pos format: %s (should be <x>,<y>)\n", delimiter_p+1);
-              return;
+              return -1;
             }
 
             char *end;
             long value = strtol(delimiter_p+1, &end, 10);
             if (end == delimiter_p+1 || end != comma_p || errno == ERANGE) { // parse error
               log_error("subtitle error: invalid pos x: %s\n", delimiter_p+1);
-              return;
+              return -1;
             }
             abspos_x = value;
 
             value = strtol(comma_p+1, &end, 10);
             if (end == comma_p+1 || *end != '\0' || errno == ERANGE) { // parse error
               log_error("subtitle error: invalid pos y: %s\n", comma_p+1);
-              return;
+              return -1;
             }
             abspos_y = value;
 
             is_abspos_specified = 1;
           } else if (strncmp(line, "layout_align=", key_len+1) == 0) { // layout align
-            char *comma_p;
-            char *search_p = delimiter_p + 1;
-            int param_len;
-            layout_align = 0;
-            while (1) {
-              comma_p = strchr(search_p, ',');
-              if (comma_p == NULL) {
-                param_len = line + line_len - search_p;
-              } else {
-                param_len = comma_p - search_p;
-              }
-              if (strncmp(search_p, "top", param_len) == 0) {
-                layout_align |= LAYOUT_ALIGN_TOP;
-              } else if (strncmp(search_p, "middle", param_len) == 0) {
-                layout_align |= LAYOUT_ALIGN_MIDDLE;
-              } else if (strncmp(search_p, "bottom", param_len) == 0) {
-                layout_align |= LAYOUT_ALIGN_BOTTOM;
-              } else if (strncmp(search_p, "left", param_len) == 0) {
-                layout_align |= LAYOUT_ALIGN_LEFT;
-              } else if (strncmp(search_p, "center", param_len) == 0) {
-                layout_align |= LAYOUT_ALIGN_CENTER;
-              } else if (strncmp(search_p, "right", param_len) == 0) {
-                layout_align |= LAYOUT_ALIGN_RIGHT;
-              } else {
-                log_error("subtitle error: invalid layout_align found at: %s\n", search_p);
-                return;
-              }
-              if (comma_p == NULL || line + line_len - 1 - comma_p <= 0) { // no remaining chars
-                break;
-              }
-              search_p = comma_p + 1;
+            if (parse_layout_align(delimiter_p + 1, &layout_align) != 0) {
+              log_error("subtitle error: invalid layout_align: %s\n", delimiter_p + 1);
+              return -1;
             }
           } else if (strncmp(line, "text_align=", key_len+1) == 0) { // text align
             char *comma_p;
@@ -1707,7 +2448,7 @@ void on_file_create(char *filename, char *content) {
                 text_align |= TEXT_ALIGN_RIGHT;
               } else {
                 log_error("subtitle error: invalid text_align found at: %s\n", search_p);
-                return;
+                return -1;
               }
               if (comma_p == NULL || line + line_len - 1 - comma_p <= 0) { // no remaining chars
                 break;
@@ -1719,7 +2460,7 @@ void on_file_create(char *filename, char *content) {
             double value = strtod(delimiter_p+1, &end);
             if (end == delimiter_p+1 || *end != '\0' || errno == ERANGE) { // parse error
               log_error("subtitle error: invalid in_preview: %s\n", delimiter_p+1);
-              return;
+              return -1;
             }
             in_preview = (value != 0);
           } else if (strncmp(line, "in_video=", key_len+1) == 0) {
@@ -1727,7 +2468,7 @@ void on_file_create(char *filename, char *content) {
             double value = strtod(delimiter_p+1, &end);
             if (end == delimiter_p+1 || *end != '\0' || errno == ERANGE) { // parse error
               log_error("subtitle error: invalid in_video: %s\n", delimiter_p+1);
-              return;
+              return -1;
             }
             in_video = (value != 0);
           } else {
@@ -1803,11 +2544,64 @@ void on_file_create(char *filename, char *content) {
       } else {
         subtitle_clear();
       }
-      fclose(fp);
     }
+  } else if (strcmp(filename, "overlay") == 0) {
+    return on_overlay_hook(content);
+  } else if (strcmp(filename, "subtitle_schedule") == 0) {
+    return on_subtitle_schedule_hook(content);
+  } else if (strcmp(filename, "trace") == 0) {
+    return on_trace_hook(content);
+  } else if (strcmp(filename, "output") == 0) {
+    return on_output_hook(content);
+  } else if (strcmp(filename, "keyframe") == 0) {
+    schedule_keyframe();
   } else {
     log_error("error: invalid hook: %s\n", filename);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Runs a control command. name is the hook file name or the command
+ * name given to the control socket, and content holds its parameters.
+ * Commands arrive from the hooks thread and the control thread, so
+ * they are serialized by command_mutex.
+ * Returns 0 on success, -1 on error.
+ */
+static int run_command(const char *name, const char *content) {
+  int ret;
+  pthread_mutex_lock(&command_mutex);
+  ret = run_command_locked(name, content);
+  pthread_mutex_unlock(&command_mutex);
+  return ret;
+}
+
+void on_file_create(char *filename, char *content) {
+  run_command(filename, content);
+}
+
+/**
+ * Handles a command from the control socket. In addition to the hook
+ * commands, "status" returns the current state.
+ */
+static int on_control_command(const char *name, const char *content,
+    char *result, size_t result_size) {
+  if (strcmp(name, "status") == 0) {
+    char filepath_json[512];
+    pthread_mutex_lock(&command_mutex);
+    if (control_json_string(recording_filepath, filepath_json, sizeof(filepath_json)) == -1) {
+      strcpy(filepath_json, "null");
+    }
+    snprintf(result, result_size,
+        "{\"recording\":%s,\"filepath\":%s,\"muted\":%s}",
+        is_recording ? "true" : "false",
+        is_recording ? filepath_json : "null",
+        is_audio_muted ? "true" : "false");
+    pthread_mutex_unlock(&command_mutex);
+    return 0;
   }
+  return run_command(name, content);
 }
 
 // Send audio packet to node-rtsp-rtmp-server
@@ -1832,10 +2626,12 @@ static void send_audio_start_time() {
       (logical_start_time >> 8) & 0xff,
       logical_start_time & 0xff,
     };
-    if (send(sockfd_audio_control, sendbuf, 12, 0) == -1) {
+    pthread_mutex_lock(&rtsp_mutex);
+    if (is_rtspout_enabled && send(sockfd_audio_control, sendbuf, 12, 0) == -1) {
       perror("send audio start time");
       exit(EXIT_FAILURE);
     }
+    pthread_mutex_unlock(&rtsp_mutex);
   } // if (is_rtspout_enabled)
 }
 
@@ -1855,93 +2651,79 @@ static void send_video_start_time() {
       // stream name
       'l', 'i', 'v', 'e', '/', 'p', 'i', 'c', 'a', 'm',
     };
-    if (send(sockfd_video_control, sendbuf, sizeof(sendbuf), 0) == -1) {
+    pthread_mutex_lock(&rtsp_mutex);
+    if (is_rtspout_enabled && send(sockfd_video_control, sendbuf, sizeof(sendbuf), 0) == -1) {
       perror("send video start time");
       exit(EXIT_FAILURE);
     }
+    pthread_mutex_unlock(&rtsp_mutex);
   } // if (is_rtspout_enabled)
 }
 
-static void setup_socks() {
-  if (is_rtspout_enabled) {
-    struct sockaddr_un remote_video;
-    struct sockaddr_un remote_audio;
-
-    int len;
-    struct sockaddr_un remote_video_control;
-    struct sockaddr_un remote_audio_control;
-
-    log_debug("connecting to UNIX domain sockets\n");
+/**
+ * Connects sockfd to the UNIX domain socket at path.
+ * Returns 0 on success, -1 on error.
+ */
+static int connect_rtsp_socket(int *sockfd, const char *path, const char *name) {
+  struct sockaddr_un remote;
+  int len;
 
-    // Setup sockfd_video
-    if ((sockfd_video = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-      perror("socket video");
-      exit(EXIT_FAILURE);
-    }
-    remote_video.sun_family = AF_UNIX;
-    strcpy(remote_video.sun_path, rtsp_video_data_path);
-    len = strlen(remote_video.sun_path) + sizeof(remote_video.sun_family);
-    if (connect(sockfd_video, (struct sockaddr *)&remote_video, len) == -1) {
-      log_error("error: failed to connect to video data socket (%s): %s\n"
-          "perhaps RTSP server (https://github.com/iizukanao/node-rtsp-rtmp-server) is not running?\n",
-          rtsp_video_data_path, strerror(errno));
-      exit(EXIT_FAILURE);
-    }
+  if ((*sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+    log_error("error: socket %s: %s\n", name, strerror(errno));
+    return -1;
+  }
+  remote.sun_family = AF_UNIX;
+  strncpy(remote.sun_path, path, sizeof(remote.sun_path) - 1);
+  remote.sun_path[sizeof(remote.sun_path) - 1] = '\0';
+  len = strlen(remote.sun_path) + sizeof(remote.sun_family);
+  if (connect(*sockfd, (struct sockaddr *)&remote, len) == -1) {
+    log_error("error: failed to connect to %s socket (%s): %s\n"
+        "perhaps RTSP server (https://github.com/iizukanao/node-rtsp-rtmp-server) is not running?\n",
+        name, path, strerror(errno));
+    close(*sockfd);
+    *sockfd = -1;
+    return -1;
+  }
+  return 0;
+}
 
-    // Setup sockfd_video_control
-    if ((sockfd_video_control = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-      perror("socket video_control");
-      exit(EXIT_FAILURE);
-    }
-    remote_video_control.sun_family = AF_UNIX;
-    strcpy(remote_video_control.sun_path, rtsp_video_control_path);
-    len = strlen(remote_video_control.sun_path) + sizeof(remote_video_control.sun_family);
-    if (connect(sockfd_video_control, (struct sockaddr *)&remote_video_control, len) == -1) {
-      log_error("error: failed to connect to video control socket (%s): %s\n"
-          "perhaps RTSP server (https://github.com/iizukanao/node-rtsp-rtmp-server) is not running?\n",
-          rtsp_video_control_path, strerror(errno));
-      exit(EXIT_FAILURE);
+static void close_rtsp_sockets() {
+  int *fds[] = { &sockfd_video, &sockfd_video_control, &sockfd_audio, &sockfd_audio_control };
+  int i;
+  for (i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+    if (*fds[i] != -1) {
+      close(*fds[i]);
+      *fds[i] = -1;
     }
+  }
+}
 
-    // Setup sockfd_audio
-    if ((sockfd_audio = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-      perror("socket audio");
-      exit(EXIT_FAILURE);
-    }
-    remote_audio.sun_family = AF_UNIX;
-    strcpy(remote_audio.sun_path, rtsp_audio_data_path);
-    len = strlen(remote_audio.sun_path) + sizeof(remote_audio.sun_family);
-    if (connect(sockfd_audio, (struct sockaddr *)&remote_audio, len) == -1) {
-      log_error("error: failed to connect to audio data socket (%s): %s\n"
-          "perhaps RTSP server (https://github.com/iizukanao/node-rtsp-rtmp-server) is not running?\n",
-          rtsp_audio_data_path, strerror(errno));
-      exit(EXIT_FAILURE);
-    }
+/**
+ * Connects to the UNIX domain sockets of node-rtsp-rtmp-server.
+ * Returns 0 on success, -1 on error.
+ */
+static int open_rtsp_sockets() {
+  log_debug("connecting to UNIX domain sockets\n");
+  if (connect_rtsp_socket(&sockfd_video, rtsp_video_data_path, "video data") != 0 ||
+      connect_rtsp_socket(&sockfd_video_control, rtsp_video_control_path, "video control") != 0 ||
+      connect_rtsp_socket(&sockfd_audio, rtsp_audio_data_path, "audio data") != 0 ||
+      connect_rtsp_socket(&sockfd_audio_control, rtsp_audio_control_path, "audio control") != 0) {
+    close_rtsp_sockets();
+    return -1;
+  }
+  return 0;
+}
 
-    // Setup sockfd_audio_control
-    if ((sockfd_audio_control = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-      perror("socket audio_control");
-      exit(EXIT_FAILURE);
-    }
-    remote_audio_control.sun_family = AF_UNIX;
-    strcpy(remote_audio_control.sun_path, rtsp_audio_control_path);
-    len = strlen(remote_audio_control.sun_path) + sizeof(remote_audio_control.sun_family);
-    if (connect(sockfd_audio_control, (struct sockaddr *)&remote_audio_control, len) == -1) {
-      log_error("error: failed to connect to audio control socket (%s): %s\n"
-          "perhaps RTSP server (https://github.com/iizukanao/node-rtsp-rtmp-server) is not running?\n",
-          rtsp_audio_control_path, strerror(errno));
+static void setup_socks() {
+  if (is_rtspout_enabled) {
+    if (open_rtsp_sockets() != 0) {
       exit(EXIT_FAILURE);
     }
-  } // if (is_rtspout_enabled)
+  }
 }
 
 static void teardown_socks() {
-  if (is_rtspout_enabled) {
-    close(sockfd_video);
-    close(sockfd_video_control);
-    close(sockfd_audio);
-    close(sockfd_audio_control);
-  }
+  close_rtsp_sockets();
 }
 
 static int64_t get_next_audio_pts() {
@@ -2056,8 +2838,37 @@ static void print_audio_timing() {
       avdiff, clock_pts - audio_pts, speed_up_count, speed_down_count, last_pts);
 }
 
+// Write the statistics of the last GOP to the status page
+static void publish_status_stats(float fps, int64_t elapsed_nsec) {
+  int record_buffer_packets = 0;
+  int record_write_backlog = 0;
+  int video_bitrate = 0;
+
+  if (current_encoded_packet != -1) {
+    if (encoded_packets[encoded_packets_size - 1] != NULL) { // buffer is filled
+      record_buffer_packets = encoded_packets_size;
+    } else {
+      record_buffer_packets = current_encoded_packet + 1;
+    }
+    if (is_recording) {
+      record_write_backlog = (current_encoded_packet - rec_thread_frame +
+          encoded_packets_size) % encoded_packets_size;
+    }
+  }
+  if (elapsed_nsec > 0) {
+    video_bitrate = video_bytes_since_stats * 8 * INT64_C(1000000000) / elapsed_nsec;
+  }
+
+  // PTS is in 90 kHz
+  status_set_video_stats(fps, video_bitrate,
+      (audio_current_pts - video_current_pts) * 100 / 9);
+  status_set_queue_depths(record_buffer_packets, record_write_backlog,
+      audio_capture_frames);
+}
+
 static void send_audio_frame(uint8_t *databuf, int databuflen, int64_t pts) {
   if (is_rtspout_enabled) {
+    ssize_t ret;
     int payload_size = databuflen + 7;  // +1(packet type) +6(pts)
     int total_size = payload_size + 3;  // more 3 bytes for payload length
     uint8_t *sendbuf = malloc(total_size);
@@ -2078,8 +2889,16 @@ static void send_audio_frame(uint8_t *databuf, int databuflen, int64_t pts) {
     sendbuf[8] = (pts >> 8) & 0xff;
     sendbuf[9] = pts & 0xff;
     memcpy(sendbuf + 10, databuf, databuflen);
-    if (send(sockfd_audio, sendbuf, total_size, 0) == -1) {
+    trace_begin(TRACE_RTSP_WRITE, -1);
+    pthread_mutex_lock(&rtsp_mutex);
+    // rtspout may have been disabled by the output command meanwhile
+    ret = is_rtspout_enabled ? send(sockfd_audio, sendbuf, total_size, 0) : 0;
+    pthread_mutex_unlock(&rtsp_mutex);
+    trace_end(TRACE_RTSP_WRITE, -1);
+    if (ret == -1) {
       perror("send audio data");
+    } else {
+      metrics_add(METRICS_RTSP_BYTES, ret);
     }
     free(sendbuf);
   } // if (is_rtspout_enabled)
@@ -2087,6 +2906,7 @@ static void send_audio_frame(uint8_t *databuf, int databuflen, int64_t pts) {
 
 static void send_video_frame(uint8_t *databuf, int databuflen, int64_t pts) {
   if (is_rtspout_enabled) {
+    ssize_t ret;
     int payload_size = databuflen + 7;  // +1(packet type) +6(pts)
     int total_size = payload_size + 3;  // more 3 bytes for payload length
     uint8_t *sendbuf = malloc(total_size);
@@ -2107,21 +2927,238 @@ static void send_video_frame(uint8_t *databuf, int databuflen, int64_t pts) {
     sendbuf[8] = (pts >> 8) & 0xff;
     sendbuf[9] = pts & 0xff;
     memcpy(sendbuf + 10, databuf, databuflen);
-    if (send(sockfd_video, sendbuf, total_size, 0) == -1) {
+    int64_t write_start_time = abr_now();
+    trace_begin(TRACE_RTSP_WRITE, video_encoded_frame);
+    pthread_mutex_lock(&rtsp_mutex);
+    // rtspout may have been disabled by the output command meanwhile
+    ret = is_rtspout_enabled ? send(sockfd_video, sendbuf, total_size, 0) : 0;
+    pthread_mutex_unlock(&rtsp_mutex);
+    trace_end(TRACE_RTSP_WRITE, video_encoded_frame);
+    abr_add_write_time(write_start_time);
+    if (ret == -1) {
       perror("send video data");
+    } else {
+      metrics_add(METRICS_RTSP_BYTES, ret);
     }
     free(sendbuf);
   } // if (is_rtspout_enabled)
 }
 
-// send keyframe (nal_unit_type 5)
+/**
+ * Starts the outputs which were enabled by the output command.
+ * This is called for a keyframe so that each output begins with
+ * a decodable frame.
+ */
+static void start_pending_outputs() {
+  int is_started;
+
+  pthread_mutex_lock(&tcp_mutex);
+  is_started = is_tcpout_pending;
+  if (is_tcpout_pending) {
+    is_tcpout_enabled = 1;
+    is_tcpout_pending = 0;
+  }
+  pthread_mutex_unlock(&tcp_mutex);
+  if (is_started) {
+    log_info("tcpout started\n");
+  }
+
+  pthread_mutex_lock(&rtsp_mutex);
+  is_started = is_rtspout_pending;
+  if (is_rtspout_pending) {
+    is_rtspout_enabled = 1;
+    is_rtspout_pending = 0;
+  }
+  pthread_mutex_unlock(&rtsp_mutex);
+  if (is_started) {
+    send_video_start_time();
+    send_audio_start_time();
+    log_info("rtspout started\n");
+  }
+
+  pthread_mutex_lock(&mutex_writing);
+  is_started = is_hlsout_pending;
+  if (is_hlsout_pending) {
+    is_hlsout_enabled = 1;
+    is_hlsout_pending = 0;
+    // Start a new segment from this keyframe
+    video_send_keyframe_count = 0;
+    is_hlsout_resuming = hls->is_started;
+  }
+  pthread_mutex_unlock(&mutex_writing);
+  if (is_started) {
+    log_info("hlsout started\n");
+  }
+}
+
+/**
+ * Starts the pending tcpout in the middle of a GOP by sending the
+ * packets from the latest IDR frame in encoded_packets, so that the
+ * receiver can start decoding without waiting for the next keyframe.
+ * If the GOP so far is larger than --gopcache bytes, tcpout starts at
+ * the next keyframe as usual.
+ *
+ * This is called from send_pframe() on the camera thread. The packets
+ * are only copied here while rec_write_mutex is held, and are sent by
+ * tcpout_replay_thread. Packets encoded until it has caught up are
+ * queued after them by write_tcpout_packet().
+ */
+static void start_tcpout_from_gop_cache() {
+  EncodedPacket *enc_pkt;
+  int index;
+  int is_started = 0;
+  int queued_packets = 0;
+  int64_t queued_bytes = 0;
+
+  // Lock order is rec_write_mutex -> tcp_mutex
+  pthread_mutex_lock(&rec_write_mutex);
+  if (last_idr_packet == -1 || gop_cache_bytes > gop_cache_size) {
+    pthread_mutex_unlock(&rec_write_mutex);
+    return;
+  }
+  pthread_mutex_lock(&tcp_mutex);
+  // tcpout may have been disabled by the output command, and the previous
+  // replay may not have been dropped yet
+  if (is_tcpout_pending && !is_tcpout_replaying) {
+    // The packets added so far are queued here. Since is_tcpout_enabled is
+    // set before rec_write_mutex is released, the audio thread writes
+    // only the packets it adds after this (see is_tcpout_enabled_at_add).
+    index = last_idr_packet;
+    while (1) {
+      enc_pkt = encoded_packets[index];
+      if (queue_tcpout_replay_packet(enc_pkt->pts, enc_pkt->data, enc_pkt->size,
+            enc_pkt->stream_index, enc_pkt->flags) != 0) {
+        break;
+      }
+      queued_packets++;
+      queued_bytes += enc_pkt->size;
+      if (index == current_encoded_packet) {
+        is_started = 1;
+        break;
+      }
+      if (++index == encoded_packets_size) {
+        index = 0;
+      }
+    }
+    if (is_started) {
+      // Packets from now on are queued until the replay has caught up
+      is_tcpout_replaying = 1;
+      is_tcpout_enabled = 1;
+      is_tcpout_pending = 0;
+      pthread_cond_signal(&tcpout_replay_cond);
+    } else {
+      // Start at the next keyframe instead
+      clear_tcpout_replay_packets();
+    }
+  }
+  pthread_mutex_unlock(&tcp_mutex);
+  pthread_mutex_unlock(&rec_write_mutex);
+
+  if (is_started) {
+    metrics_add(METRICS_TCP_BYTES, queued_bytes);
+    log_info("tcpout started with %d packets (%lld bytes) from GOP cache\n",
+        queued_packets, (long long)queued_bytes);
+  }
+}
+
+/**
+ * Builds the recovery point SEI message. A decoder which starts
+ * decoding at the frame following this SEI has a complete picture
+ * after recovery_frame_cnt more frames.
+ */
+static void build_recovery_point_sei(int recovery_frame_cnt) {
+  uint8_t rbsp[16];
+  int rbsp_len = 0;
+  uint64_t bits = 0;
+  int n_bits = 0;
+  int code_len = 0;
+  int payload_len, zero_count, i;
+  uint8_t *ptr;
+
+  // recovery_frame_cnt: ue(v)
+  while ((((uint64_t)recovery_frame_cnt + 1) >> code_len) != 0) {
+    code_len++;
+  }
+  n_bits = (code_len - 1) + code_len;
+  bits = recovery_frame_cnt + 1;
+  // exact_match_flag (0), broken_link_flag (0), changing_slice_group_idc (0)
+  bits <<= 4;
+  n_bits += 4;
+  // Align the payload with bit_equal_to_one and bit_equal_to_zero
+  if (n_bits % 8 != 0) {
+    bits = (bits << 1) | 1;
+    n_bits++;
+    bits <<= (8 - n_bits % 8) % 8;
+    n_bits += (8 - n_bits % 8) % 8;
+  }
+  payload_len = n_bits / 8;
+
+  rbsp[rbsp_len++] = 6; // payloadType (recovery point)
+  rbsp[rbsp_len++] = payload_len; // payloadSize
+  for (i = payload_len - 1; i >= 0; i--) {
+    rbsp[rbsp_len++] = (bits >> (i * 8)) & 0xff;
+  }
+  rbsp[rbsp_len++] = 0x80; // rbsp_trailing_bits
+
+  ptr = recovery_point_sei;
+  *ptr++ = 0x00;
+  *ptr++ = 0x00;
+  *ptr++ = 0x00;
+  *ptr++ = 0x01;
+  *ptr++ = 0x06; // nal_unit_type 6
+  zero_count = 0;
+  for (i = 0; i < rbsp_len; i++) {
+    // emulation_prevention_three_byte
+    if (zero_count == 2 && rbsp[i] <= 0x03) {
+      *ptr++ = 0x03;
+      zero_count = 0;
+    }
+    *ptr++ = rbsp[i];
+    zero_count = (rbsp[i] == 0x00) ? zero_count + 1 : 0;
+  }
+  recovery_point_sei_length = ptr - recovery_point_sei;
+}
+
+/**
+ * Returns nonzero if a frame of nal_unit_type should be sent as a
+ * recovery point, i.e. a random access point in intra refresh mode.
+ */
+static int is_recovery_point(int nal_unit_type) {
+  return is_intra_refresh_enabled && nal_unit_type == 1 &&
+    video_frames_since_keyframe + 1 >= video_gop_size;
+}
+
+// send keyframe (nal_unit_type 5), or recovery point (nal_unit_type 1)
+// in intra refresh mode
 static int send_keyframe(uint8_t *data, size_t data_len, int consume_time) {
   uint8_t *buf, *ptr;
   int total_size, ret, i;
   AVPacket pkt;
   int64_t pts;
-
-  total_size = access_unit_delimiter_length + codec_config_total_size + data_len;
+  int is_forced;
+  int sei_length;
+
+  // A non-IDR frame is a recovery point. It is preceded by codec configs
+  // and a recovery point SEI, and is treated as a keyframe from here on.
+  sei_length = (is_intra_refresh_enabled && data_len > 4 && (data[4] & 0x1f) == 1) ?
+    recovery_point_sei_length : 0;
+
+  // A keyframe which arrives before the end of the GOP after a request
+  // is the requested one. It is a normal IDR frame for the outputs,
+  // but it is not counted as a keyframe for the record buffer and HLS
+  // segmentation. The encoder starts a new GOP at the forced keyframe,
+  // so the HLS segment which contains it becomes longer by the frames
+  // between the previous keyframe and the forced one.
+  is_forced = sei_length == 0 && keyframe_request_age >= 0 &&
+    video_frames_since_keyframe + 1 < video_gop_size;
+  // Any keyframe satisfies the request
+  keyframe_request_age = -1;
+  video_frames_since_keyframe = 0;
+
+  // Clients waiting for a keyframe are served by this one
+  __atomic_store_n(&is_keyframe_requested, 0, __ATOMIC_RELEASE);
+
+  total_size = access_unit_delimiter_length + codec_config_total_size + sei_length + data_len;
   ptr = buf = av_malloc(total_size);
   if (buf == NULL) {
     log_error("error: send_keyframe: cannot allocate memory for buf (%d bytes)\n", total_size);
@@ -2146,7 +3183,13 @@ static int send_keyframe(uint8_t *data, size_t data_len, int consume_time) {
     ptr += codec_config_sizes[i];
   }
 
-  // I frame (nal_unit_type 5)
+  // recovery point SEI (nal_unit_type 6)
+  if (sei_length > 0) {
+    memcpy(ptr, recovery_point_sei, sei_length);
+    ptr += sei_length;
+  }
+
+  // I frame (nal_unit_type 5) or P frame (nal_unit_type 1)
   memcpy(ptr, data, data_len);
 
   av_init_packet(&pkt);
@@ -2162,16 +3205,16 @@ static int send_keyframe(uint8_t *data, size_t data_len, int consume_time) {
   }
 
 #if ENABLE_AUTO_GOP_SIZE_CONTROL_FOR_VFR
-  if (is_vfr_enabled) {
+  if (is_vfr_enabled && !is_forced && !is_intra_refresh_enabled) {
     int64_t pts_between_keyframes = pts - last_keyframe_pts;
     if (pts_between_keyframes < 80000) { // < .89 seconds
       // Frame rate is running faster than we thought
       int ideal_video_gop_size = (frames_since_last_keyframe + 1)
         * 90000.0f / pts_between_keyframes;
-      if (ideal_video_gop_size > video_gop_size) {
+      if (ideal_video_gop_size > video_gop_size &&
+          set_gop_size(ideal_video_gop_size) == 0) {
         video_gop_size = ideal_video_gop_size;
         log_debug("increase gop_size to %d ", ideal_video_gop_size);
-        set_gop_size(video_gop_size);
       }
     }
     last_keyframe_pts = pts;
@@ -2179,6 +3222,10 @@ static int send_keyframe(uint8_t *data, size_t data_len, int consume_time) {
   }
 #endif
 
+  if (is_hlsout_pending || is_tcpout_pending || is_rtspout_pending) {
+    start_pending_outputs();
+  }
+
   send_video_frame(data, data_len, pts);
 
 #if ENABLE_PTS_WRAP_AROUND
@@ -2201,7 +3248,10 @@ static int send_keyframe(uint8_t *data, size_t data_len, int consume_time) {
   memcpy(copied_data, buf, total_size);
   pthread_mutex_lock(&rec_write_mutex);
   add_encoded_packet(pts, copied_data, total_size, pkt.stream_index, pkt.flags);
-  mark_keyframe_packet();
+  if (!is_forced) {
+    mark_keyframe_packet();
+  }
+  mark_idr_packet();
   pthread_mutex_unlock(&rec_write_mutex);
 
   if (is_recording) {
@@ -2212,32 +3262,59 @@ static int send_keyframe(uint8_t *data, size_t data_len, int consume_time) {
   }
 
   if (is_tcpout_enabled) {
+    int64_t write_start_time = abr_now();
+    trace_begin(TRACE_TCP_WRITE, video_encoded_frame);
     pthread_mutex_lock(&tcp_mutex);
-    av_write_frame(tcp_ctx, &pkt);
+    if (is_tcpout_enabled) { // may have been disabled by the output command
+      write_tcpout_packet(&pkt);
+    }
     pthread_mutex_unlock(&tcp_mutex);
+    trace_end(TRACE_TCP_WRITE, video_encoded_frame);
+    abr_add_write_time(write_start_time);
+    metrics_add(METRICS_TCP_BYTES, total_size);
   }
 
   if (is_hlsout_enabled) {
     pthread_mutex_lock(&mutex_writing);
     int split;
 
-    if (video_send_keyframe_count % hls_keyframes_per_segment == 0 && video_frame_count != 1) {
+    if (is_forced && !is_hlsout_resuming) {
+      split = 0;
+    } else if (video_send_keyframe_count % hls_keyframes_per_segment == 0 && video_frame_count != 1 &&
+        hls->is_started) {
       split = 1;
     } else {
       split = 0;
     }
 
-    video_send_keyframe_count = video_send_keyframe_count % hls_keyframes_per_segment;    
+    if (is_hlsout_resuming) {
+      // Leave out the time while hlsout was disabled from the last segment
+      hls->segment_start_pts += pkt.pts - hls->last_packet_pts;
+      is_hlsout_resuming = 0;
+    }
+
+    if (!is_forced || split) {
+      video_send_keyframe_count = video_send_keyframe_count % hls_keyframes_per_segment;    
 
-    // Update counter 
-    video_send_keyframe_count++;
+      // Update counter 
+      video_send_keyframe_count++;
+    }
 
+    int64_t write_start_time = metrics_now();
+    trace_begin(TRACE_HLS_WRITE, video_encoded_frame);
     ret = hls_write_packet(hls, &pkt, split);
+    trace_end(TRACE_HLS_WRITE, video_encoded_frame);
     pthread_mutex_unlock(&mutex_writing);
+    if (split) {
+      metrics_observe_since(METRICS_HLS_SEGMENT_WRITE_TIME, write_start_time);
+      trace_instant(TRACE_HLS_SEGMENT_PUBLISH, video_encoded_frame);
+    }
     if (ret < 0) {
       av_strerror(ret, errbuf, sizeof(errbuf));
       log_error("keyframe write error (hls): %s\n", errbuf);
       log_error("please check if the disk is full\n");
+    } else {
+      metrics_add(METRICS_HLS_BYTES, total_size);
     }
   }
 
@@ -2258,6 +3335,12 @@ static int send_pframe(uint8_t *data, size_t data_len, int consume_time) {
     return 0;
   }
 
+  video_frames_since_keyframe++;
+  if (keyframe_request_age >= 0 && ++keyframe_request_age > video_gop_size) {
+    // The encoder did not make the requested keyframe within a GOP
+    keyframe_request_age = -1;
+  }
+
   total_size = access_unit_delimiter_length + data_len;
   buf = av_malloc(total_size);
   if (buf == NULL) {
@@ -2283,17 +3366,17 @@ static int send_pframe(uint8_t *data, size_t data_len, int consume_time) {
   }
 
 #if ENABLE_AUTO_GOP_SIZE_CONTROL_FOR_VFR
-  if (is_vfr_enabled) {
+  if (is_vfr_enabled && !is_intra_refresh_enabled) {
     if (video_current_pts - last_keyframe_pts >= 100000) { // >= 1.11 seconds
       // Frame rate is running slower than we thought
       int ideal_video_gop_size = frames_since_last_keyframe;
       if (ideal_video_gop_size == 0) {
         ideal_video_gop_size = 1;
       }
-      if (ideal_video_gop_size < video_gop_size) {
+      if (ideal_video_gop_size < video_gop_size &&
+          set_gop_size(ideal_video_gop_size) == 0) {
         video_gop_size = ideal_video_gop_size;
         log_debug("decrease gop_size to %d ", video_gop_size);
-        set_gop_size(video_gop_size);
       }
     }
     frames_since_last_keyframe++;
@@ -2315,6 +3398,10 @@ static int send_pframe(uint8_t *data, size_t data_len, int consume_time) {
 
   pkt.pts = pkt.dts = pts;
 
+  if (is_tcpout_pending && gop_cache_size > 0) {
+    start_tcpout_from_gop_cache();
+  }
+
   uint8_t *copied_data = av_malloc(total_size);
   memcpy(copied_data, buf, total_size);
   pthread_mutex_lock(&rec_write_mutex);
@@ -2329,19 +3416,30 @@ static int send_pframe(uint8_t *data, size_t data_len, int consume_time) {
   }
 
   if (is_tcpout_enabled) {
+    int64_t write_start_time = abr_now();
+    trace_begin(TRACE_TCP_WRITE, video_encoded_frame);
     pthread_mutex_lock(&tcp_mutex);
-    av_write_frame(tcp_ctx, &pkt);
+    if (is_tcpout_enabled) { // may have been disabled by the output command
+      write_tcpout_packet(&pkt);
+    }
     pthread_mutex_unlock(&tcp_mutex);
+    trace_end(TRACE_TCP_WRITE, video_encoded_frame);
+    abr_add_write_time(write_start_time);
+    metrics_add(METRICS_TCP_BYTES, total_size);
   }
 
   if (is_hlsout_enabled) {
     pthread_mutex_lock(&mutex_writing);
+    trace_begin(TRACE_HLS_WRITE, video_encoded_frame);
     ret = hls_write_packet(hls, &pkt, 0);
+    trace_end(TRACE_HLS_WRITE, video_encoded_frame);
     pthread_mutex_unlock(&mutex_writing);
     if (ret < 0) {
       av_strerror(ret, errbuf, sizeof(errbuf));
       log_error("P frame write error (hls): %s\n", errbuf);
       log_error("please check if the disk is full\n");
+    } else {
+      metrics_add(METRICS_HLS_BYTES, total_size);
     }
   }
 
@@ -2355,6 +3453,10 @@ static int xrun_recovery(snd_pcm_t *handle, int error) {
   switch(error) {
     case -EPIPE: // Buffer overrun
       log_error("microphone error: buffer overrun\n");
+      if (handle == capture_handle) {
+        status_add_audio_xrun();
+        metrics_add(METRICS_AUDIO_XRUNS, 1);
+      }
       if ((error = snd_pcm_prepare(handle)) < 0) {
         log_error("microphone error: buffer overrrun cannot be recovered, "
             "snd_pcm_prepare failed: %s\n", snd_strerror(error));
@@ -2437,7 +3539,8 @@ static int open_audio_preview_device() {
   snd_pcm_hw_params_t *audio_preview_params;
 
   log_debug("opening ALSA device for playback (preview): %s\n", audio_preview_dev);
-  err = snd_pcm_open(&audio_preview_handle, audio_preview_dev, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK);
+  // Blocking mode is fine because playback runs on its own thread
+  err = snd_pcm_open(&audio_preview_handle, audio_preview_dev, SND_PCM_STREAM_PLAYBACK, 0);
   if (err < 0) {
     log_error("error: cannot open audio playback (preview) device '%s': %s\n",
         audio_preview_dev, snd_strerror(err));
@@ -2513,8 +3616,10 @@ static int open_audio_preview_device() {
 
   int dir;
   // set the period size
+  // (use a copy since period_size is shared with the capture thread)
+  snd_pcm_uframes_t preview_period_size = period_size;
   err = snd_pcm_hw_params_set_period_size_near(audio_preview_handle, audio_preview_params,
-      (snd_pcm_uframes_t *)&period_size, &dir);
+      &preview_period_size, &dir);
   if (err < 0) {
     log_fatal("error: failed to set period size for audio preview: %s\n",
         snd_strerror(err));
@@ -2529,6 +3634,13 @@ static int open_audio_preview_device() {
     exit(EXIT_FAILURE);
   }
 
+  err = snd_pcm_hw_params_get_buffer_size(audio_preview_params, &audio_preview_device_buffer_frames);
+  if (err < 0) {
+    log_fatal("error: cannot get buffer size for audio preview: %s\n",
+        snd_strerror(err));
+    exit(EXIT_FAILURE);
+  }
+
   // end of configuration
   snd_pcm_hw_params_free(audio_preview_params);
 
@@ -2547,6 +3659,158 @@ static int open_audio_preview_device() {
   return 0;
 }
 
+// Called from the capture thread. Never blocks on the preview device.
+// If the jitter buffer is full, the oldest period is dropped.
+static void push_audio_preview_period(uint16_t *period_samples) {
+  int period_len = period_size * audio_channels;
+
+  pthread_mutex_lock(&audio_preview_mutex);
+  if (audio_preview_buffered_periods == AUDIO_PREVIEW_BUFFER_PERIODS) {
+    audio_preview_read_index = (audio_preview_read_index + 1) % AUDIO_PREVIEW_BUFFER_PERIODS;
+    audio_preview_buffered_periods--;
+    audio_preview_dropped_periods++;
+  }
+  memcpy(audio_preview_buffer + audio_preview_write_index * period_len,
+      period_samples, period_len * sizeof(short));
+  audio_preview_write_index = (audio_preview_write_index + 1) % AUDIO_PREVIEW_BUFFER_PERIODS;
+  audio_preview_buffered_periods++;
+  pthread_cond_signal(&audio_preview_cond);
+  pthread_mutex_unlock(&audio_preview_mutex);
+}
+
+// Returns nonzero if the preview device will run out of samples
+// within about one period.
+static int is_audio_preview_device_starving() {
+  snd_pcm_sframes_t avail = snd_pcm_avail(audio_preview_handle);
+  if (avail < 0) { // xrun etc.; snd_pcm_mmap_writei() will recover it
+    return 1;
+  }
+  return audio_preview_device_buffer_frames - avail <= (snd_pcm_uframes_t)period_size;
+}
+
+// Pace audio preview by the playback device clock. The jitter buffer
+// absorbs clock skew between the capture and playback devices: periods
+// are dropped when capture runs ahead, and the last period is repeated
+// when capture falls behind.
+static void *audio_preview_loop() {
+  int period_len = period_size * audio_channels;
+  uint16_t *play_samples;
+  int is_primed = 0;
+  int repeat_count = 0;
+  int err;
+
+  play_samples = calloc(period_len, sizeof(short));
+  if (play_samples == NULL) {
+    log_fatal("error: cannot allocate memory for audio preview\n");
+    exit(EXIT_FAILURE);
+  }
+
+  open_audio_preview_device();
+  is_audio_preview_device_opened = 1;
+
+  while (keepRunning) {
+    // Query the device before locking so that the capture thread
+    // never waits for the preview device
+    int is_device_starving = is_audio_preview_device_starving();
+
+    pthread_mutex_lock(&audio_preview_mutex);
+    if (!is_primed) {
+      while (keepRunning && audio_preview_buffered_periods < AUDIO_PREVIEW_PREFILL_PERIODS) {
+        pthread_cond_wait(&audio_preview_cond, &audio_preview_mutex);
+      }
+      is_primed = 1;
+      repeat_count = 0;
+    }
+    if (!keepRunning) {
+      pthread_mutex_unlock(&audio_preview_mutex);
+      break;
+    }
+
+    // capture is ahead of playback
+    while (audio_preview_buffered_periods > AUDIO_PREVIEW_MAX_BUFFERED_PERIODS) {
+      audio_preview_read_index = (audio_preview_read_index + 1) % AUDIO_PREVIEW_BUFFER_PERIODS;
+      audio_preview_buffered_periods--;
+      audio_preview_dropped_periods++;
+    }
+
+    if (audio_preview_buffered_periods > 0) {
+      memcpy(play_samples, audio_preview_buffer + audio_preview_read_index * period_len,
+          period_len * sizeof(short));
+      audio_preview_read_index = (audio_preview_read_index + 1) % AUDIO_PREVIEW_BUFFER_PERIODS;
+      audio_preview_buffered_periods--;
+      repeat_count = 0;
+    } else if (!is_device_starving) {
+      // The device still has enough samples to play.
+      // Wait up to one period for capture.
+      struct timespec timeout;
+      clock_gettime(CLOCK_REALTIME, &timeout);
+      timeout.tv_nsec += (int64_t)period_size * 1000000000 / audio_sample_rate;
+      if (timeout.tv_nsec >= 1000000000) {
+        timeout.tv_sec += timeout.tv_nsec / 1000000000;
+        timeout.tv_nsec %= 1000000000;
+      }
+      pthread_cond_timedwait(&audio_preview_cond, &audio_preview_mutex, &timeout);
+      pthread_mutex_unlock(&audio_preview_mutex);
+      continue;
+    } else if (repeat_count < AUDIO_PREVIEW_MAX_REPEATS) {
+      // capture is behind playback and the device is about to
+      // underrun; play the last period again
+      repeat_count++;
+      audio_preview_repeated_periods++;
+    } else {
+      // capture has stalled; wait until the buffer is filled again
+      is_primed = 0;
+      pthread_mutex_unlock(&audio_preview_mutex);
+      continue;
+    }
+    pthread_mutex_unlock(&audio_preview_mutex);
+
+    uint16_t *ptr = play_samples;
+    int cptr = period_size;
+    while (cptr > 0 && keepRunning) {
+      err = snd_pcm_mmap_writei(audio_preview_handle, ptr, cptr);
+      if (err == -EAGAIN) {
+        continue;
+      }
+      if (err < 0) {
+        if (xrun_recovery(audio_preview_handle, err) < 0) {
+          log_fatal("audio preview error: %s\n", snd_strerror(err));
+          exit(EXIT_FAILURE);
+        }
+        break; // skip one period
+      }
+      ptr += err * audio_preview_channels;
+      cptr -= err;
+    }
+  }
+
+  log_debug("audio preview: dropped %ld periods, repeated %ld periods\n",
+      audio_preview_dropped_periods, audio_preview_repeated_periods);
+  free(play_samples);
+  pthread_exit(0);
+}
+
+static void start_audio_preview_thread() {
+  audio_preview_buffer = calloc(period_size * audio_channels * AUDIO_PREVIEW_BUFFER_PERIODS,
+      sizeof(short));
+  if (audio_preview_buffer == NULL) {
+    log_fatal("error: cannot allocate memory for audio preview buffer\n");
+    exit(EXIT_FAILURE);
+  }
+  pthread_create(&audio_preview_thread, NULL, audio_preview_loop, NULL);
+  is_audio_preview_thread_started = 1;
+}
+
+static void stop_audio_preview_thread() {
+  pthread_mutex_lock(&audio_preview_mutex);
+  pthread_cond_signal(&audio_preview_cond);
+  pthread_mutex_unlock(&audio_preview_mutex);
+  pthread_join(audio_preview_thread, NULL);
+  is_audio_preview_thread_started = 0;
+  free(audio_preview_buffer);
+  audio_preview_buffer = NULL;
+}
+
 // Configure the microphone before main setup
 static void preconfigure_microphone() {
   int err;
@@ -2611,7 +3875,7 @@ static int configure_audio_capture_device() {
   int dir;
 
   buffer_size = av_samples_get_buffer_size(NULL, ctx->channels,
-      ctx->frame_size, ctx->sample_fmt, 0);
+      ctx->frame_size, AV_SAMPLE_FMT_S16, 0);
 
   // use mmap
   err = snd_pcm_hw_params_set_access(capture_handle, alsa_hw_params,
@@ -2771,6 +4035,7 @@ static void teardown_audio_encode() {
   }
 
   av_freep(&samples);
+  av_freep(&encoder_samples);
 #if AUDIO_BUFFER_CHUNKS > 0
   for (i = 0; i < AUDIO_BUFFER_CHUNKS; i++) {
     av_freep(&audio_buffer[i]);
@@ -2813,6 +4078,7 @@ static void shutdown_video() {
 
   timestamp_shutdown();
   subtitle_shutdown();
+  overlay_clear();
   text_teardown();
 }
 
@@ -2858,7 +4124,11 @@ static void shutdown_openmax() {
   ilclient_destroy(ilclient);
 }
 
-static void set_gop_size(int gop_size) {
+/**
+ * Sets the distance between two IDR frames of the encoder.
+ * Returns 0 on success, -1 on error.
+ */
+static int set_gop_size(int gop_size) {
   OMX_VIDEO_CONFIG_AVCINTRAPERIOD avc_intra_period;
   OMX_ERRORTYPE error;
 
@@ -2867,8 +4137,9 @@ static void set_gop_size(int gop_size) {
   avc_intra_period.nVersion.nVersion = OMX_VERSION;
   avc_intra_period.nPortIndex = VIDEO_ENCODE_OUTPUT_PORT;
 
-  // Distance between two IDR frames
-  avc_intra_period.nIDRPeriod = gop_size;
+  // Distance between two IDR frames. In intra refresh mode, only the
+  // first frame is an IDR frame.
+  avc_intra_period.nIDRPeriod = is_intra_refresh_enabled ? 0 : gop_size;
 
   // It seems this value has no effect for the encoding.
   avc_intra_period.nPFrames = gop_size;
@@ -2876,8 +4147,158 @@ static void set_gop_size(int gop_size) {
   error = OMX_SetParameter(ILC_GET_HANDLE(video_encode),
       OMX_IndexConfigVideoAVCIntraPeriod, &avc_intra_period);
   if (error != OMX_ErrorNone) {
-    log_fatal("error: failed to set video_encode %d AVC intra period: 0x%x\n", VIDEO_ENCODE_OUTPUT_PORT, error);
-    exit(EXIT_FAILURE);
+    log_error("error: failed to set video_encode %d AVC intra period: 0x%x\n", VIDEO_ENCODE_OUTPUT_PORT, error);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Changes the target bitrate of the running encoder.
+ * command_mutex must be held by the caller.
+ * Returns 0 on success, -1 on error.
+ */
+static int set_video_bitrate(long bitrate) {
+  OMX_VIDEO_CONFIG_BITRATETYPE bitrate_config;
+  OMX_ERRORTYPE error;
+
+  memset(&bitrate_config, 0, sizeof(OMX_VIDEO_CONFIG_BITRATETYPE));
+  bitrate_config.nSize = sizeof(OMX_VIDEO_CONFIG_BITRATETYPE);
+  bitrate_config.nVersion.nVersion = OMX_VERSION;
+  bitrate_config.nPortIndex = VIDEO_ENCODE_OUTPUT_PORT;
+  bitrate_config.nEncodeBitrate = bitrate; // in bits per second
+
+  error = OMX_SetConfig(ILC_GET_HANDLE(video_encode),
+      OMX_IndexConfigVideoBitrate, &bitrate_config);
+  if (error != OMX_ErrorNone) {
+    log_error("error: failed to set video_encode %d bitrate: 0x%x\n", VIDEO_ENCODE_OUTPUT_PORT, error);
+    return -1;
+  }
+  video_bitrate = bitrate;
+  metrics_set(METRICS_VIDEO_TARGET_BITRATE, video_bitrate);
+
+  // For the recordings which will be started from now on
+  mpegts_set_config(video_bitrate, video_width, video_height);
+  return 0;
+}
+
+/**
+ * Asks the encoder to make the next frame an IDR frame.
+ * Returns 0 on success, -1 on error.
+ */
+static int request_keyframe() {
+  OMX_CONFIG_PORTBOOLEANTYPE boolean;
+  OMX_ERRORTYPE error;
+
+  memset(&boolean, 0, sizeof(OMX_CONFIG_PORTBOOLEANTYPE));
+  boolean.nSize = sizeof(OMX_CONFIG_PORTBOOLEANTYPE);
+  boolean.nVersion.nVersion = OMX_VERSION;
+  boolean.nPortIndex = VIDEO_ENCODE_OUTPUT_PORT;
+  boolean.bEnabled = OMX_TRUE;
+
+  error = OMX_SetConfig(ILC_GET_HANDLE(video_encode),
+      OMX_IndexConfigBrcmVideoRequestIFrame, &boolean);
+  if (error != OMX_ErrorNone) {
+    log_error("error: failed to request keyframe: 0x%x\n", error);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Asks for an IDR frame, e.g. when a client has joined. This can be
+ * called from any thread. Requests made within --idrlimit seconds of
+ * the previous one are merged and sent when the interval has passed,
+ * so that frequent joins do not flood the stream with IDR frames.
+ */
+static void schedule_keyframe() {
+  __atomic_store_n(&is_keyframe_requested, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Sends the scheduled keyframe request to the encoder.
+ * This is called for each encoded video frame.
+ */
+static void process_keyframe_request() {
+  struct timespec ts;
+  int64_t now;
+
+  if (!__atomic_load_n(&is_keyframe_requested, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  now = ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+  if (last_keyframe_request_time != 0 &&
+      now - last_keyframe_request_time < keyframe_request_interval * 1000000000.0f) {
+    return;
+  }
+  __atomic_store_n(&is_keyframe_requested, 0, __ATOMIC_RELEASE);
+  if (request_keyframe() == 0) {
+    last_keyframe_request_time = now;
+    keyframe_request_age = 0;
+    metrics_add(METRICS_KEYFRAME_REQUESTS, 1);
+    log_debug("requested keyframe\n");
+  }
+}
+
+/**
+ * Takes over the GOP size set by the gopsize command.
+ * This is called for each encoded video frame.
+ */
+static void process_gop_size_request() {
+  int gop_size = __atomic_exchange_n(&pending_video_gop_size, 0, __ATOMIC_ACQUIRE);
+  if (gop_size == 0) {
+    return;
+  }
+#if ENABLE_AUTO_GOP_SIZE_CONTROL_FOR_VFR
+  // The VFR code may have changed the encoder since the command set it
+  if (is_vfr_enabled && set_gop_size(gop_size) != 0) {
+    return;
+  }
+#endif
+  video_gop_size = gop_size;
+}
+
+/**
+ * Lets the adaptive bitrate controller adjust the bitrate after
+ * a video frame has been written to the outputs.
+ */
+static void control_bitrate() {
+  ABR_DECISION decision = abr_end_frame(video_bitrate, abr_now(),
+      abr_take_write_time());
+  long new_bitrate;
+  int ret;
+
+  metrics_set(METRICS_ABR_WRITE_TIME, abr_get_write_time());
+  if (decision == ABR_DECISION_NONE) {
+    return;
+  }
+  // The bitrate command changes the bitrate under command_mutex as well.
+  // Do not make the camera thread wait for a running command; the next
+  // decision is made in a second. The decision is not committed, so the
+  // controller state stays as it was.
+  if (pthread_mutex_trylock(&command_mutex) != 0) {
+    log_debug("abr: skipped the decision since a command is running\n");
+    return;
+  }
+  new_bitrate = abr_get_bitrate();
+  ret = set_video_bitrate(new_bitrate);
+  pthread_mutex_unlock(&command_mutex);
+  if (ret != 0) {
+    return;
+  }
+  abr_commit(new_bitrate);
+  if (decision == ABR_DECISION_DECREASE) {
+    metrics_add(METRICS_ABR_DECREASES, 1);
+    log_info("abr: decreased video bitrate to %ld (write time %.1f ms/frame)\n",
+        new_bitrate, abr_get_write_time() / 1000000.0f);
+  } else {
+    metrics_add(METRICS_ABR_INCREASES, 1);
+    log_debug("abr: increased video bitrate to %ld\n", new_bitrate);
+  }
+  if (abr_needs_keyframe()) {
+    // The rate control of the encoder settles faster from a keyframe
+    schedule_keyframe();
   }
 }
 
@@ -3039,6 +4460,47 @@ static void auto_select_exposure(int width, int height, uint8_t *data, float fps
   }
 }
 
+// Exports the cost of the last preview text overlay update as metrics.
+// This is called on the camera thread, so it must not touch the file system.
+static void publish_preview_overlay_stats() {
+  dispmanx_overlay_stats stats;
+
+  dispmanx_get_overlay_stats(&stats);
+  metrics_add(METRICS_PREVIEW_OVERLAY_UPDATES, 1);
+  metrics_add(METRICS_PREVIEW_OVERLAY_UPLOAD_BYTES, stats.upload_bytes);
+  metrics_set(METRICS_PREVIEW_OVERLAY_RECTS, stats.rects);
+  metrics_set(METRICS_PREVIEW_OVERLAY_DRAW_TIME, stats.draw_cpu_ms * 1000000.0f);
+  metrics_set(METRICS_PREVIEW_OVERLAY_UPLOAD_TIME, stats.upload_ms * 1000000.0f);
+}
+
+// Remember the capture time of the frame which is fed to the encoder
+static void push_capture_time(int64_t capture_time, int64_t frame) {
+  int index;
+  if (capture_times_count == CAPTURE_TIMES_SIZE) { // drop the oldest
+    capture_times_head = (capture_times_head + 1) % CAPTURE_TIMES_SIZE;
+    capture_times_count--;
+  }
+  index = (capture_times_head + capture_times_count) % CAPTURE_TIMES_SIZE;
+  capture_times[index] = capture_time;
+  capture_frames[index] = frame;
+  capture_times_count++;
+}
+
+// Return the capture time of the oldest frame in the encoder, or 0 if unknown.
+// The number of the frame is stored in *frame (-1 if unknown).
+static int64_t pop_capture_time(int64_t *frame) {
+  int64_t capture_time;
+  if (capture_times_count == 0) {
+    *frame = -1;
+    return 0;
+  }
+  capture_time = capture_times[capture_times_head];
+  *frame = capture_frames[capture_times_head];
+  capture_times_head = (capture_times_head + 1) % CAPTURE_TIMES_SIZE;
+  capture_times_count--;
+  return capture_time;
+}
+
 static void cam_fill_buffer_done(void *data, COMPONENT_T *comp) {
   OMX_BUFFERHEADERTYPE *out;
   OMX_ERRORTYPE error;
@@ -3049,6 +4511,10 @@ static void cam_fill_buffer_done(void *data, COMPONENT_T *comp) {
       last_video_buffer = out->pBuffer;
       last_video_buffer_size = out->nFilledLen;
       if (out->nFlags & OMX_BUFFERFLAG_ENDOFFRAME) {
+        int64_t capture_time = metrics_now();
+        metrics_add(METRICS_VIDEO_FRAMES_CAPTURED, 1);
+        video_capture_frame++;
+        trace_instant(TRACE_CAMERA_BUFFER_DONE, video_capture_frame);
         if (is_video_recording_started == 0) {
           is_video_recording_started = 1;
           if (is_audio_recording_started == 1) {
@@ -3067,13 +4533,19 @@ static void cam_fill_buffer_done(void *data, COMPONENT_T *comp) {
             video_pending_drop_frames--;
           } else {
             log_debug(".");
+            int64_t composite_start_time = metrics_now();
+            trace_begin(TRACE_OVERLAY, video_capture_frame);
             timestamp_update();
             subtitle_update();
             int is_text_changed = text_draw_all(last_video_buffer, video_width_32, video_height_16, 1); // is_video = 1
+            trace_end(TRACE_OVERLAY, video_capture_frame);
+            metrics_observe_since(METRICS_OVERLAY_COMPOSITE_TIME, composite_start_time);
             if (is_text_changed && is_preview_enabled) {
               // the text has actually changed, redraw preview subtitle overlay
               dispmanx_update_text_overlay();
+              publish_preview_overlay_stats();
             }
+            push_capture_time(capture_time, video_capture_frame);
             encode_and_send_image();
           }
         }
@@ -3730,9 +5202,24 @@ static int video_encode_fill_buffer_done(OMX_BUFFERHEADERTYPE *out) {
       send_video_frame(buf, buf_len, 0);
     } else { // video frame
       frame_count++; // will be used for printing stats about FPS, etc.
+      video_bytes_since_stats += buf_len;
+      if (out->nFlags & OMX_BUFFERFLAG_ENDOFFRAME) {
+        metrics_add(METRICS_VIDEO_FRAMES_ENCODED, 1);
+        metrics_observe_since(METRICS_FRAME_LATENCY, pop_capture_time(&video_encoded_frame));
+        trace_instant(TRACE_ENCODED_NAL, video_encoded_frame);
+      }
+
+      if (!is_first_frame_encoded) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        log_info("startup: first video frame encoded %.1f ms after launch\n",
+            (ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec - launch_time) / 1000000.0f);
+        is_first_frame_encoded = 1;
+      }
 
-      if (out->nFlags & OMX_BUFFERFLAG_SYNCFRAME) { // keyframe
-        if (nal_unit_type != 5) {
+      if ((out->nFlags & OMX_BUFFERFLAG_SYNCFRAME) || // keyframe
+          is_recovery_point(nal_unit_type)) {
+        if (nal_unit_type != 5 && !is_intra_refresh_enabled) {
           log_debug("SYNCFRAME nal_unit_type=%d len=%d\n", nal_unit_type, buf_len);
         }
         int consume_time = 0;
@@ -3745,6 +5232,11 @@ static int video_encode_fill_buffer_done(OMX_BUFFERHEADERTYPE *out) {
         }
 #if !(AUDIO_ONLY)
         send_keyframe(buf, buf_len, consume_time);
+        if (is_abr_enabled) {
+          control_bitrate();
+        }
+        process_keyframe_request();
+        process_gop_size_request();
 #endif
 
         // calculate FPS and display it
@@ -3764,8 +5256,10 @@ static int video_encode_fill_buffer_done(OMX_BUFFERHEADERTYPE *out) {
           if (log_get_level() <= LOG_LEVEL_DEBUG) {
             print_audio_timing();
           }
+          publish_status_stats(fps, wait_nsec);
           current_audio_frames = 0;
           frame_count = 0;
+          video_bytes_since_stats = 0;
 
           if (is_auto_exposure_enabled) {
             auto_select_exposure(video_width, video_height, last_video_buffer, fps);
@@ -3786,6 +5280,11 @@ static int video_encode_fill_buffer_done(OMX_BUFFERHEADERTYPE *out) {
           }
 #if !(AUDIO_ONLY)
           send_pframe(buf, buf_len, consume_time);
+          if (is_abr_enabled) {
+            control_bitrate();
+          }
+          process_keyframe_request();
+          process_gop_size_request();
 #endif
         }
       }
@@ -3950,7 +5449,42 @@ static int video_encode_startup() {
   }
 
   // Set GOP size
-  set_gop_size(video_gop_size);
+  if (set_gop_size(video_gop_size) != 0) {
+    exit(EXIT_FAILURE);
+  }
+
+  // Intra refresh
+  if (is_intra_refresh_enabled) {
+    OMX_VIDEO_PARAM_INTRAREFRESHTYPE intra_refresh;
+    int mb_count = ((video_width + 15) / 16) * ((video_height + 15) / 16);
+
+    memset(&intra_refresh, 0, sizeof(OMX_VIDEO_PARAM_INTRAREFRESHTYPE));
+    intra_refresh.nSize = sizeof(OMX_VIDEO_PARAM_INTRAREFRESHTYPE);
+    intra_refresh.nVersion.nVersion = OMX_VERSION;
+    intra_refresh.nPortIndex = VIDEO_ENCODE_OUTPUT_PORT;
+
+    error = OMX_GetParameter(ILC_GET_HANDLE(video_encode),
+        OMX_IndexParamVideoIntraRefresh, &intra_refresh);
+    if (error != OMX_ErrorNone) {
+      log_fatal("error: failed to get video_encode %d intra refresh: 0x%x\n", VIDEO_ENCODE_OUTPUT_PORT, error);
+      exit(EXIT_FAILURE);
+    }
+
+    // Refresh all macroblocks once per GOP size frames
+    intra_refresh.eRefreshMode = OMX_VIDEO_IntraRefreshCyclic;
+    intra_refresh.nCirMBs = (mb_count + video_gop_size - 1) / video_gop_size;
+
+    error = OMX_SetParameter(ILC_GET_HANDLE(video_encode),
+        OMX_IndexParamVideoIntraRefresh, &intra_refresh);
+    if (error != OMX_ErrorNone) {
+      log_fatal("error: failed to set video_encode %d intra refresh: 0x%x\n", VIDEO_ENCODE_OUTPUT_PORT, error);
+      exit(EXIT_FAILURE);
+    }
+    log_debug("intra refresh: %d macroblocks per frame\n", intra_refresh.nCirMBs);
+
+    // Every macroblock has been refreshed after a whole cycle
+    build_recovery_point_sei(video_gop_size - 1);
+  }
 
   // Set bitrate
   memset(&bitrate_type, 0, sizeof(OMX_VIDEO_PARAM_BITRATETYPE));
@@ -4114,7 +5648,9 @@ static void encode_and_send_image() {
 
   // Feed the raw camera image into video_encode
   // OMX_EmptyThisBuffer takes 22000-27000 usec at 1920x1080
+  trace_begin(TRACE_ENCODER_INPUT, video_capture_frame);
   error = OMX_EmptyThisBuffer(ILC_GET_HANDLE(video_encode), buf);
+  trace_end(TRACE_ENCODER_INPUT, video_capture_frame);
   if (error != OMX_ErrorNone) {
     log_error("error emptying buffer: 0x%x\n", error);
   }
@@ -4167,6 +5703,20 @@ static void encode_and_send_image() {
   }
 }
 
+// Convert interleaved S16 samples to the planar float format
+// which is required by the native aac encoder
+static void convert_samples_to_fltp() {
+  int ch, i;
+  int16_t *src = (int16_t *)samples;
+
+  for (ch = 0; ch < audio_channels; ch++) {
+    float *dst = (float *)av_frame->extended_data[ch];
+    for (i = 0; i < period_size; i++) {
+      dst[i] = src[i * audio_channels + ch] * (1.0f / 32768.0f);
+    }
+  }
+}
+
 static void encode_and_send_audio() {
   AVPacket pkt;
   int ret, got_output;
@@ -4181,6 +5731,11 @@ static void encode_and_send_audio() {
   pkt.data = NULL; // packet data will be allocated by the encoder
   pkt.size = 0;
 
+  int64_t encode_start_time = metrics_now();
+  if (encoder_samples != NULL) {
+    convert_samples_to_fltp();
+  }
+
   // encode the samples
   ret = avcodec_encode_audio2(ctx, &pkt, av_frame, &got_output);
   if (ret < 0) {
@@ -4188,6 +5743,7 @@ static void encode_and_send_audio() {
     log_error("error encoding audio frame: %s\n", errbuf);
     exit(EXIT_FAILURE);
   }
+  metrics_observe_since(METRICS_AUDIO_ENCODE_TIME, encode_start_time);
   if (got_output) {
 #if AUDIO_ONLY
     pkt.stream_index = hls->format_ctx->streams[0]->index; // This must be done after avcodec_encode_audio2
@@ -4219,6 +5775,9 @@ static void encode_and_send_audio() {
     memcpy(copied_data, pkt.data, pkt.size);
     pthread_mutex_lock(&rec_write_mutex);
     add_encoded_packet(pts, copied_data, pkt.size, pkt.stream_index, pkt.flags);
+    // If tcpout is started from the GOP cache after this, the packet
+    // is sent with the cache and must not be written again below.
+    int is_tcpout_enabled_at_add = is_tcpout_enabled;
     pthread_mutex_unlock(&rec_write_mutex);
 
     if (is_recording) {
@@ -4228,7 +5787,7 @@ static void encode_and_send_audio() {
       pthread_mutex_unlock(&rec_mutex);
     }
 
-    if (is_tcpout_enabled) {
+    if (is_tcpout_enabled_at_add) {
       // Setup AVPacket
       AVPacket tcp_pkt;
       av_init_packet(&tcp_pkt);
@@ -4239,9 +5798,14 @@ static void encode_and_send_audio() {
       tcp_pkt.pts = tcp_pkt.dts = pkt.pts;
 
       // Send the AVPacket
+      trace_begin(TRACE_TCP_WRITE, -1);
       pthread_mutex_lock(&tcp_mutex);
-      av_write_frame(tcp_ctx, &tcp_pkt);
+      if (is_tcpout_enabled) { // may have been disabled by the output command
+        write_tcpout_packet(&tcp_pkt);
+      }
       pthread_mutex_unlock(&tcp_mutex);
+      trace_end(TRACE_TCP_WRITE, -1);
+      metrics_add(METRICS_TCP_BYTES, pkt.size);
 
       av_freep(&tcp_pkt.data);
       av_free_packet(&tcp_pkt);
@@ -4249,23 +5813,95 @@ static void encode_and_send_audio() {
 
     if (is_hlsout_enabled) {
       pthread_mutex_lock(&mutex_writing);
+      trace_begin(TRACE_HLS_WRITE, -1);
       ret = hls_write_packet(hls, &pkt, 0);
+      trace_end(TRACE_HLS_WRITE, -1);
       pthread_mutex_unlock(&mutex_writing);
       if (ret < 0) {
         av_strerror(ret, errbuf, sizeof(errbuf));
         log_error("audio frame write error (hls): %s\n", errbuf);
         log_error("please check if the disk is full\n");
+      } else {
+        metrics_add(METRICS_HLS_BYTES, pkt.size);
       }
     }
 
     av_free_packet(&pkt);
 
     current_audio_frames++;
+    metrics_add(METRICS_AUDIO_FRAMES_ENCODED, 1);
   } else {
     log_error("error: not getting audio output");
   }
 }
 
+// Run --silencecmd with "start" or "end" as $1
+static void run_silence_command(const char *event_name) {
+  extern char **environ;
+  pid_t pid;
+  int ret, i;
+  int free_slot = -1;
+  char *argv[] = { "sh", "-c", silence_command, "sh", (char *)event_name, NULL };
+
+  // reap the previous commands (only the ones spawned here)
+  for (i = 0; i < SILENCE_COMMAND_MAX_PROCESSES; i++) {
+    if (silence_command_pids[i] != 0 &&
+        waitpid(silence_command_pids[i], NULL, WNOHANG) != 0) {
+      silence_command_pids[i] = 0;
+    }
+    if (silence_command_pids[i] == 0 && free_slot == -1) {
+      free_slot = i;
+    }
+  }
+  if (free_slot == -1) {
+    log_error("error: silencecmd not run since %d previous ones are still running\n",
+        SILENCE_COMMAND_MAX_PROCESSES);
+    return;
+  }
+
+  // posix_spawn() is used instead of fork() since it does not
+  // copy the page tables of this large process
+  ret = posix_spawn(&pid, "/bin/sh", NULL, NULL, argv, environ);
+  if (ret != 0) {
+    log_error("error: failed to run silencecmd: %s\n", strerror(ret));
+    return;
+  }
+  silence_command_pids[free_slot] = pid;
+}
+
+static void measure_audio_level(uint16_t *period_samples) {
+  AUDIOLEVEL_EVENT event;
+
+  event = audiolevel_process((int16_t *)period_samples);
+  if (event == AUDIOLEVEL_EVENT_SILENCE_START) {
+    log_info("silence detected for %.1f seconds\n", silence_duration);
+    state_set(state_dir, "silence", "true");
+    if (silence_command[0] != '\0') {
+      run_silence_command("start");
+    }
+  } else if (event == AUDIOLEVEL_EVENT_SILENCE_END) {
+    log_info("silence ended\n");
+    state_set(state_dir, "silence", "false");
+    if (silence_command[0] != '\0') {
+      run_silence_command("end");
+    }
+  }
+
+  if (is_audio_level_enabled &&
+      ++audio_level_periods_since_publish * period_size >=
+      audio_sample_rate * AUDIO_LEVEL_STATE_INTERVAL_SEC) {
+    audiolevel_stats stats;
+    char state_buf[128];
+
+    audio_level_periods_since_publish = 0;
+    audiolevel_read(&stats);
+    snprintf(state_buf, sizeof(state_buf),
+        "peak=%.1f\nrms=%.1f\nloudness=%.1f\n",
+        stats.peak_dbfs, stats.rms_dbfs, stats.loudness_lufs);
+    state_set(state_dir, "audio_level", state_buf);
+  }
+}
+
 static int read_audio_poll_mmap() {
   const snd_pcm_channel_area_t *my_areas; // mapped memory area info
   snd_pcm_sframes_t avail, commitres; // aux for frames count
@@ -4281,6 +5917,7 @@ static int read_audio_poll_mmap() {
 
   // check how many frames are ready to read or write
   avail = snd_pcm_avail_update(capture_handle);
+  audio_capture_frames = avail > 0 ? avail : 0;
   if (avail < 0) {
     if ( (error = xrun_recovery(capture_handle, avail)) < 0) {
       log_fatal("microphone error: SUSPEND recovery failed: %s\n", snd_strerror(error));
@@ -4344,35 +5981,6 @@ static int read_audio_poll_mmap() {
     size -= frames; // needed in the condition of the while loop to check if period is filled
   }
 
-  if (is_audio_preview_enabled) {
-    uint16_t *ptr;
-    int cptr;
-    int err;
-
-    if (!is_audio_preview_device_opened) {
-      open_audio_preview_device();
-      is_audio_preview_device_opened = 1;
-    }
-
-    ptr = this_samples;
-    cptr = period_size;
-    while (cptr > 0) {
-      err = snd_pcm_mmap_writei(audio_preview_handle, ptr, cptr);
-      if (err == -EAGAIN) {
-        continue;
-      }
-      if (err < 0) {
-        if (xrun_recovery(audio_preview_handle, err) < 0) {
-          log_fatal("audio preview error: %s\n", snd_strerror(err));
-          exit(EXIT_FAILURE);
-        }
-        break; // skip one period
-      }
-      ptr += err * audio_preview_channels;
-      cptr -= err;
-    }
-  }
-
   if (audio_volume_multiply != 1.0f) {
     int total_samples = period_size * audio_channels;
     int i;
@@ -4391,6 +5999,19 @@ static int read_audio_poll_mmap() {
     }
   }
 
+  if (audiomix_get_device_count() > 0) {
+    audiomix_mix((int16_t *)this_samples);
+  }
+
+  // preview is taken after mixing so that all inputs can be monitored
+  if (is_audio_preview_thread_started) {
+    push_audio_preview_period(this_samples);
+  }
+
+  if (is_audio_level_enabled || silence_duration > 0.0f) {
+    measure_audio_level(this_samples);
+  }
+
 #if AUDIO_BUFFER_CHUNKS > 0
   if (++audio_buffer_index == AUDIO_BUFFER_CHUNKS) {
     audio_buffer_index = 0;
@@ -4611,22 +6232,31 @@ static void audio_loop_poll_mmap() {
   } // end of while loop (keepRunning)
 }
 
-static void setup_tcp_output() {
+static int setup_tcp_output() {
   avformat_network_init();
   tcp_ctx = mpegts_create_context(&codec_settings);
-  mpegts_open_stream(tcp_ctx, tcp_output_dest, 0);
+  if (mpegts_try_open_stream(tcp_ctx, tcp_output_dest, 0) != 0) {
+    log_error("error: cannot open tcpout: %s\n", tcp_output_dest);
+    mpegts_destroy_context(tcp_ctx);
+    tcp_ctx = NULL;
+    avformat_network_deinit();
+    return -1;
+  }
+  return 0;
 }
 
 static void teardown_tcp_output() {
   log_debug("teardown_tcp_output\n");
   mpegts_close_stream(tcp_ctx);
   mpegts_destroy_context(tcp_ctx);
+  tcp_ctx = NULL;
   avformat_network_deinit();
 }
 
 // Check if hls_output_dir is accessible.
 // Also create HLS output directory if it doesn't exist.
-static void ensure_hls_dir_exists() {
+// Returns 0 on success, -1 on error.
+static int ensure_hls_dir_exists() {
   struct stat st;
   int err;
 
@@ -4639,25 +6269,66 @@ static void ensure_hls_dir_exists() {
       } else { // error
         log_error("error creating hls_output_dir (%s): %s\n",
             hls_output_dir, strerror(errno));
-        exit(EXIT_FAILURE);
+        return -1;
       }
     } else {
-      perror("stat hls_output_dir");
-      exit(EXIT_FAILURE);
+      log_error("error: stat hls_output_dir (%s): %s\n",
+          hls_output_dir, strerror(errno));
+      return -1;
     }
   } else {
     if (!S_ISDIR(st.st_mode)) {
       log_error("error: hls_output_dir (%s) is not a directory\n",
           hls_output_dir);
-      exit(EXIT_FAILURE);
+      return -1;
     }
   }
 
   if (access(hls_output_dir, R_OK) != 0) {
     log_error("error: cannot access hls_output_dir (%s): %s\n",
         hls_output_dir, strerror(errno));
-    exit(EXIT_FAILURE);
+    return -1;
   }
+  return 0;
+}
+
+/**
+ * Sets the output directory and the encryption of hls.
+ * Returns 0 on success, -1 on error.
+ */
+static int configure_hls_output() {
+  if (is_hls_configured) {
+    return 0;
+  }
+  hls->dir = hls_output_dir;
+  hls->num_retained_old_files = 10;
+  if (is_hls_encryption_enabled) {
+    hls->use_encryption = 1;
+
+    int uri_len = strlen(hls_encryption_key_uri) + 1;
+    hls->encryption_key_uri = malloc(uri_len);
+    if (hls->encryption_key_uri == NULL) {
+      perror("malloc for hls->encryption_key_uri");
+      return -1;
+    }
+    memcpy(hls->encryption_key_uri, hls_encryption_key_uri, uri_len);
+
+    hls->encryption_key = malloc(16);
+    if (hls->encryption_key == NULL) {
+      perror("malloc for hls->encryption_key");
+      return -1;
+    }
+    memcpy(hls->encryption_key, hls_encryption_key, 16);
+
+    hls->encryption_iv = malloc(16);
+    if (hls->encryption_iv == NULL) {
+      perror("malloc for hls->encryption_iv");
+      return -1;
+    }
+    memcpy(hls->encryption_iv, hls_encryption_iv, 16);
+  } // if (enable_hls_encryption)
+  is_hls_configured = 1;
+  return 0;
 }
 
 static void print_program_version() {
@@ -4674,8 +6345,20 @@ static void print_usage() {
   log_info("  -h, --height <num>  Height in pixels (default: %d)\n", video_height_default);
   log_info("  -v, --videobitrate <num>  Video bit rate (default: %ld)\n", video_bitrate_default);
   log_info("                      Set 0 to disable rate control\n");
+  log_info("  --abr               Adjust video bit rate when tcpout or rtspout\n");
+  log_info("                      cannot keep up\n");
+  log_info("  --abrmin <num>      Minimum video bit rate for --abr\n");
+  log_info("                      (default: 1/4 of --videobitrate)\n");
+  log_info("  --abrmax <num>      Maximum video bit rate for --abr\n");
+  log_info("                      (default: --videobitrate)\n");
+  log_info("  --idrlimit <num>    Minimum interval in seconds between IDR frames\n");
+  log_info("                      requested by hooks/keyframe (default: %.1f)\n", keyframe_request_interval_default);
+  log_info("  --autoidr           Request an IDR frame when an output is started\n");
+  log_info("                      by hooks/output\n");
   log_info("  -f, --fps <num>     Frame rate (default: %.1f)\n", video_fps_default);
   log_info("  -g, --gopsize <num>  GOP size (default: same value as fps)\n");
+  log_info("  --intrarefresh      Refresh the picture gradually over GOP size frames\n");
+  log_info("                      instead of sending an IDR frame every GOP\n");
   log_info("  --vfr               Enable variable frame rate. GOP size will be\n");
   log_info("                      dynamically controlled.\n");
   log_info("  --minfps <num>      Minimum frames per second. Implies --vfr.\n");
@@ -4699,10 +6382,28 @@ static void print_usage() {
   log_info("                      Default is mono. If it fails, stereo is used.\n");
   log_info("  -r, --samplerate <num>  Audio sample rate (default: %d)\n", audio_sample_rate_default);
   log_info("  -a, --audiobitrate <num>  Audio bit rate (default: %ld)\n", audio_bitrate_default);
+  log_info("  --audiocodec <codec>  Audio codec: aac/fdkaac/opus (default: %s)\n", audio_codec_default);
+  log_info("                      aac uses fdk-aac if available, otherwise FFmpeg's aac.\n");
+  log_info("                      opus requires --samplerate 48000/24000/16000/12000/8000\n");
+  log_info("                      and cannot be used with --rtspout.\n");
+  log_info("  --opusframe <ms>    Opus frame duration in milliseconds: 5/10/20/40/60\n");
+  log_info("                      (default: encoder default (20))\n");
   log_info("  --alsadev <dev>     ALSA microphone device (default: %s)\n", alsa_dev_default);
+  log_info("  --mixdev <dev>      Mix audio from additional ALSA capture device <dev>.\n");
+  log_info("                      Can be specified up to %d times.\n", AUDIOMIX_MAX_DEVICES);
+  log_info("  --mixgain <num>     Volume multiplier for the preceding --mixdev\n");
+  log_info("                      (0.0 .. %.1f, default: 1.0)\n", AUDIOMIX_MAX_GAIN);
   log_info("  --volume <num>      Amplify audio by multiplying the volume by <num>\n");
   log_info("                      (default: %.1f)\n", audio_volume_multiply_default);
   log_info("  --noaudio           Disable audio capturing\n");
+  log_info("  --audiolevel        Write audio peak, RMS and short-term loudness\n");
+  log_info("                      to state/audio_level every second\n");
+  log_info("  --silenceduration <sec>  Detect silence lasting <sec> seconds and\n");
+  log_info("                      write it to state/silence (default: disabled)\n");
+  log_info("  --silencethreshold <dBFS>  Audio below this RMS level is considered\n");
+  log_info("                      silent (default: %.1f)\n", silence_threshold_default);
+  log_info("  --silencecmd <cmd>  Run <cmd> with sh when silence starts or ends.\n");
+  log_info("                      $1 is set to \"start\" or \"end\".\n");
   log_info("  --audiopreview      Enable audio preview\n");
   log_info("  --audiopreviewdev <dev>  Audio preview output device (default: %s)\n", audio_preview_dev_default);
   log_info(" [HTTP Live Streaming (HLS)]\n");
@@ -4732,6 +6433,9 @@ static void print_usage() {
   log_info(" [MPEG-TS output via TCP]\n");
   log_info("  --tcpout <url>      Enable TCP output to <url>\n");
   log_info("                      (e.g. --tcpout tcp://127.0.0.1:8181)\n");
+  log_info("  --gopcache <num>    When tcpout is started by hooks/output, send the\n");
+  log_info("                      current GOP first if it is within <num> bytes\n");
+  log_info("                      (default: %ld = disabled)\n", gop_cache_size_default);
   log_info(" [camera]\n");
   log_info("  --autoex            Enable automatic control of camera exposure between\n");
   log_info("                      daylight and night modes. This forces --vfr enabled.\n");
@@ -4786,6 +6490,8 @@ static void print_usage() {
   log_info("  --time              Enable timestamp\n");
   log_info("  --timeformat <spec>  Timestamp format (see \"man strftime\" for spec)\n");
   log_info("                       (default: \"%s\")\n", timestamp_format_default);
+  log_info("                       %%L and %%f are replaced with milliseconds\n");
+  log_info("                       and frame number respectively\n");
   log_info("  --timelayout <spec>  Timestamp position (relative mode)\n");
   log_info("                       layout is comma-separated list of:\n");
   log_info("                        top middle bottom  left center right\n");
@@ -4814,6 +6520,16 @@ static void print_usage() {
   log_info("                      (must be >= 1; default: %d)\n", record_buffer_keyframes_default);
   log_info("  --statedir <dir>    Set state dir (default: %s)\n", state_dir_default);
   log_info("  --hooksdir <dir>    Set hooks dir (default: %s)\n", hooks_dir_default);
+  log_info("  --controlsock <path>  Accept JSON commands on a UNIX domain\n");
+  log_info("                        socket at <path> (default: disabled)\n");
+  log_info("  --statusshm <name>  Publish status to shared memory at\n");
+  log_info("                      /dev/shm/<name> (default: disabled)\n");
+  log_info("  --nostatefiles      Do not write files in state dir\n");
+  log_info("                      (requires --statusshm)\n");
+  log_info("  --metricsport <num>  Export Prometheus metrics via HTTP on\n");
+  log_info("                       port <num> (default: disabled)\n");
+  log_info("  --trace             Record per-frame trace events which are\n");
+  log_info("                      written by hooks/trace\n");
   log_info("  -q, --quiet         Suppress all output except errors\n");
   log_info("  --verbose           Enable verbose output\n");
   log_info("  --version           Print program version\n");
@@ -4822,6 +6538,10 @@ static void print_usage() {
 
 int main(int argc, char **argv) {
   int ret;
+  struct timespec startup_ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &startup_ts);
+  launch_time = startup_ts.tv_sec * INT64_C(1000000000) + startup_ts.tv_nsec;
 
   static struct option long_options[] = {
     { "mode", required_argument, NULL, 0},
@@ -4830,7 +6550,13 @@ int main(int argc, char **argv) {
     { "fps", required_argument, NULL, 'f' },
     { "ptsstep", required_argument, NULL, 0 },
     { "videobitrate", required_argument, NULL, 'v' },
+    { "abr", no_argument, NULL, 0 },
+    { "abrmin", required_argument, NULL, 0 },
+    { "abrmax", required_argument, NULL, 0 },
+    { "idrlimit", required_argument, NULL, 0 },
+    { "autoidr", no_argument, NULL, 0 },
     { "gopsize", required_argument, NULL, 'g' },
+    { "intrarefresh", no_argument, NULL, 0 },
     { "rotation", required_argument, NULL, 0 },
     { "hflip", no_argument, NULL, 0 },
     { "vflip", no_argument, NULL, 0 },
@@ -4841,9 +6567,13 @@ int main(int argc, char **argv) {
     { "qpinit", required_argument, NULL, 0 },
     { "dquant", required_argument, NULL, 0 },
     { "alsadev", required_argument, NULL, 0 },
+    { "mixdev", required_argument, NULL, 0 },
+    { "mixgain", required_argument, NULL, 0 },
     { "audiobitrate", required_argument, NULL, 'a' },
     { "channels", required_argument, NULL, 'c' },
     { "samplerate", required_argument, NULL, 'r' },
+    { "audiocodec", required_argument, NULL, 0 },
+    { "opusframe", required_argument, NULL, 0 },
     { "hlsdir", required_argument, NULL, 'o' },
     { "hlskeyframespersegment", required_argument, NULL, 0 },
     { "hlsnumberofsegments", required_argument, NULL, 0 },
@@ -4853,6 +6583,7 @@ int main(int argc, char **argv) {
     { "rtspaudiocontrol", required_argument, NULL, 0 },
     { "rtspaudiodata", required_argument, NULL, 0 },
     { "tcpout", required_argument, NULL, 0 },
+    { "gopcache", required_argument, NULL, 0 },
     { "vfr", no_argument, NULL, 0 },
     { "minfps", required_argument, NULL, 0 },
     { "maxfps", required_argument, NULL, 0 },
@@ -4887,8 +6618,17 @@ int main(int argc, char **argv) {
     { "timespacing", required_argument, NULL, 0 },
     { "statedir", required_argument, NULL, 0 },
     { "hooksdir", required_argument, NULL, 0 },
+    { "controlsock", required_argument, NULL, 0 },
+    { "statusshm", required_argument, NULL, 0 },
+    { "nostatefiles", no_argument, NULL, 0 },
+    { "metricsport", required_argument, NULL, 0 },
+    { "trace", no_argument, NULL, 0 },
     { "volume", required_argument, NULL, 0 },
     { "noaudio", no_argument, NULL, 0 },
+    { "audiolevel", no_argument, NULL, 0 },
+    { "silenceduration", required_argument, NULL, 0 },
+    { "silencethreshold", required_argument, NULL, 0 },
+    { "silencecmd", required_argument, NULL, 0 },
     { "audiopreview", no_argument, NULL, 0 },
     { "audiopreviewdev", required_argument, NULL, 0 },
     { "hlsenc", no_argument, NULL, 0 },
@@ -4926,6 +6666,13 @@ int main(int argc, char **argv) {
   video_hflip = video_hflip_default;
   video_vflip = video_vflip_default;
   video_bitrate = video_bitrate_default;
+  is_abr_enabled = is_abr_enabled_default;
+  keyframe_request_interval = keyframe_request_interval_default;
+  is_auto_keyframe_enabled = is_auto_keyframe_enabled_default;
+  gop_cache_size = gop_cache_size_default;
+  is_intra_refresh_enabled = is_intra_refresh_enabled_default;
+  abr_min_bitrate = abr_min_bitrate_default;
+  abr_max_bitrate = abr_max_bitrate_default;
   strncpy(video_avc_profile, video_avc_profile_default, sizeof(video_avc_profile) - 1);
   video_avc_profile[sizeof(video_avc_profile) - 1] = '\0';
   strncpy(video_avc_level, video_avc_level_default, sizeof(video_avc_level) - 1);
@@ -4939,6 +6686,14 @@ int main(int argc, char **argv) {
   audio_bitrate = audio_bitrate_default;
   audio_channels = audio_channels_default;
   audio_sample_rate = audio_sample_rate_default;
+  is_audio_level_enabled = is_audio_level_enabled_default;
+  silence_threshold = silence_threshold_default;
+  silence_duration = silence_duration_default;
+  strncpy(silence_command, silence_command_default, sizeof(silence_command) - 1);
+  silence_command[sizeof(silence_command) - 1] = '\0';
+  strncpy(audio_codec, audio_codec_default, sizeof(audio_codec) - 1);
+  audio_codec[sizeof(audio_codec) - 1] = '\0';
+  audio_frame_duration = audio_frame_duration_default;
   is_audio_preview_enabled = is_audio_preview_enabled_default;
   strncpy(audio_preview_dev, audio_preview_dev_default, sizeof(audio_preview_dev) - 1);
   audio_preview_dev[sizeof(audio_preview_dev) - 1] = '\0';
@@ -4981,6 +6736,13 @@ int main(int argc, char **argv) {
   state_dir[sizeof(state_dir) - 1] = '\0';
   strncpy(hooks_dir, hooks_dir_default, sizeof(hooks_dir) - 1);
   hooks_dir[sizeof(hooks_dir) - 1] = '\0';
+  strncpy(control_socket_path, control_socket_path_default, sizeof(control_socket_path) - 1);
+  control_socket_path[sizeof(control_socket_path) - 1] = '\0';
+  strncpy(status_shm_name, status_shm_name_default, sizeof(status_shm_name) - 1);
+  status_shm_name[sizeof(status_shm_name) - 1] = '\0';
+  is_state_file_disabled = is_state_file_disabled_default;
+  metrics_port = metrics_port_default;
+  is_trace_requested = is_trace_requested_default;
   audio_volume_multiply = audio_volume_multiply_default;
   is_hls_encryption_enabled = is_hls_encryption_enabled_default;
   hls_keyframes_per_segment = hls_keyframes_per_segment_default;
@@ -5129,6 +6891,47 @@ int main(int argc, char **argv) {
         } else if (strcmp(long_options[option_index].name, "alsadev") == 0) {
           strncpy(alsa_dev, optarg, sizeof(alsa_dev) - 1);
           alsa_dev[sizeof(alsa_dev) - 1] = '\0';
+        } else if (strcmp(long_options[option_index].name, "audiocodec") == 0) {
+          if (strcmp(optarg, "aac") != 0 &&
+              strcmp(optarg, "fdkaac") != 0 &&
+              strcmp(optarg, "opus") != 0) {
+            log_fatal("error: invalid audiocodec: %s (must be aac, fdkaac or opus)\n", optarg);
+            return EXIT_FAILURE;
+          }
+          strncpy(audio_codec, optarg, sizeof(audio_codec) - 1);
+          audio_codec[sizeof(audio_codec) - 1] = '\0';
+        } else if (strcmp(long_options[option_index].name, "opusframe") == 0) {
+          char *end;
+          long value = strtol(optarg, &end, 10);
+          if (end == optarg || *end != '\0' || errno == ERANGE) { // parse error
+            log_fatal("error: invalid opusframe: %s\n", optarg);
+            return EXIT_FAILURE;
+          }
+          if (value != 5 && value != 10 && value != 20 && value != 40 && value != 60) {
+            log_fatal("error: invalid opusframe: %ld (must be 5, 10, 20, 40 or 60)\n", value);
+            return EXIT_FAILURE;
+          }
+          audio_frame_duration = value;
+        } else if (strcmp(long_options[option_index].name, "mixdev") == 0) {
+          if (audiomix_add_device(optarg, 1.0f) != 0) {
+            log_fatal("error: too many --mixdev (max: %d)\n", AUDIOMIX_MAX_DEVICES);
+            return EXIT_FAILURE;
+          }
+        } else if (strcmp(long_options[option_index].name, "mixgain") == 0) {
+          char *end;
+          double value = strtod(optarg, &end);
+          if (end == optarg || *end != '\0' || errno == ERANGE) { // parse error
+            log_fatal("error: invalid mixgain: %s\n", optarg);
+            return EXIT_FAILURE;
+          }
+          if (value < 0.0 || value > AUDIOMIX_MAX_GAIN) {
+            log_fatal("error: invalid mixgain: %.1f (must be 0.0 .. %.1f)\n", value, AUDIOMIX_MAX_GAIN);
+            return EXIT_FAILURE;
+          }
+          if (audiomix_set_last_gain(value) != 0) {
+            log_fatal("error: --mixgain must follow --mixdev\n");
+            return EXIT_FAILURE;
+          }
         } else if (strcmp(long_options[option_index].name, "rtspout") == 0) {
           is_rtspout_enabled = 1;
         } else if (strcmp(long_options[option_index].name, "rtspvideocontrol") == 0) {
@@ -5147,6 +6950,18 @@ int main(int argc, char **argv) {
           is_tcpout_enabled = 1;
           strncpy(tcp_output_dest, optarg, sizeof(tcp_output_dest) - 1);
           tcp_output_dest[sizeof(tcp_output_dest) - 1] = '\0';
+        } else if (strcmp(long_options[option_index].name, "gopcache") == 0) {
+          char *end;
+          long value = strtol(optarg, &end, 10);
+          if (end == optarg || *end != '\0' || errno == ERANGE) { // parse error
+            log_fatal("error: invalid gopcache: %s\n", optarg);
+            return EXIT_FAILURE;
+          }
+          if (value < 0) {
+            log_fatal("error: invalid gopcache: %ld (must be >= 0)\n", value);
+            return EXIT_FAILURE;
+          }
+          gop_cache_size = value;
         } else if (strcmp(long_options[option_index].name, "vfr") == 0) {
           is_vfr_enabled = 1;
         } else if (strcmp(long_options[option_index].name, "autoex") == 0) {
@@ -5530,6 +7345,64 @@ int main(int argc, char **argv) {
         } else if (strcmp(long_options[option_index].name, "hooksdir") == 0) {
           strncpy(hooks_dir, optarg, sizeof(hooks_dir) - 1);
           hooks_dir[sizeof(hooks_dir) - 1] = '\0';
+        } else if (strcmp(long_options[option_index].name, "controlsock") == 0) {
+          strncpy(control_socket_path, optarg, sizeof(control_socket_path) - 1);
+          control_socket_path[sizeof(control_socket_path) - 1] = '\0';
+        } else if (strcmp(long_options[option_index].name, "statusshm") == 0) {
+          strncpy(status_shm_name, optarg, sizeof(status_shm_name) - 1);
+          status_shm_name[sizeof(status_shm_name) - 1] = '\0';
+        } else if (strcmp(long_options[option_index].name, "nostatefiles") == 0) {
+          is_state_file_disabled = 1;
+        } else if (strcmp(long_options[option_index].name, "metricsport") == 0) {
+          char *end;
+          long value = strtol(optarg, &end, 10);
+          if (end == optarg || *end != '\0' || errno == ERANGE) { // parse error
+            log_fatal("error: invalid metricsport: %s\n", optarg);
+            return EXIT_FAILURE;
+          }
+          if (value <= 0 || value > 65535) {
+            log_fatal("error: invalid metricsport: %ld (must be 1-65535)\n", value);
+            return EXIT_FAILURE;
+          }
+          metrics_port = value;
+        } else if (strcmp(long_options[option_index].name, "trace") == 0) {
+          is_trace_requested = 1;
+        } else if (strcmp(long_options[option_index].name, "abr") == 0) {
+          is_abr_enabled = 1;
+        } else if (strcmp(long_options[option_index].name, "idrlimit") == 0) {
+          char *end;
+          double value = strtod(optarg, &end);
+          if (end == optarg || *end != '\0' || errno == ERANGE) { // parse error
+            log_fatal("error: invalid idrlimit: %s\n", optarg);
+            return EXIT_FAILURE;
+          }
+          if (value < 0) {
+            log_fatal("error: invalid idrlimit: %.1f (must be >= 0)\n", value);
+            return EXIT_FAILURE;
+          }
+          keyframe_request_interval = value;
+        } else if (strcmp(long_options[option_index].name, "autoidr") == 0) {
+          is_auto_keyframe_enabled = 1;
+        } else if (strcmp(long_options[option_index].name, "intrarefresh") == 0) {
+          is_intra_refresh_enabled = 1;
+        } else if (strcmp(long_options[option_index].name, "abrmin") == 0 ||
+            strcmp(long_options[option_index].name, "abrmax") == 0) {
+          char *end;
+          long value = strtol(optarg, &end, 10);
+          if (end == optarg || *end != '\0' || errno == ERANGE) { // parse error
+            log_fatal("error: invalid %s: %s\n", long_options[option_index].name, optarg);
+            return EXIT_FAILURE;
+          }
+          if (value <= 0) {
+            log_fatal("error: invalid %s: %ld (must be > 0)\n", long_options[option_index].name, value);
+            return EXIT_FAILURE;
+          }
+          if (strcmp(long_options[option_index].name, "abrmin") == 0) {
+            abr_min_bitrate = value;
+          } else {
+            abr_max_bitrate = value;
+          }
+          is_abr_enabled = 1;
         } else if (strcmp(long_options[option_index].name, "volume") == 0) {
           char *end;
           double value = strtod(optarg, &end);
@@ -5545,6 +7418,35 @@ int main(int argc, char **argv) {
           audio_volume_multiply = value;
         } else if (strcmp(long_options[option_index].name, "noaudio") == 0) {
           disable_audio_capturing = 1;
+        } else if (strcmp(long_options[option_index].name, "audiolevel") == 0) {
+          is_audio_level_enabled = 1;
+        } else if (strcmp(long_options[option_index].name, "silenceduration") == 0) {
+          char *end;
+          double value = strtod(optarg, &end);
+          if (end == optarg || *end != '\0' || errno == ERANGE) { // parse error
+            log_fatal("error: invalid silenceduration: %s\n", optarg);
+            return EXIT_FAILURE;
+          }
+          if (value <= 0.0) {
+            log_fatal("error: invalid silenceduration: %.1f (must be > 0.0)\n", value);
+            return EXIT_FAILURE;
+          }
+          silence_duration = value;
+        } else if (strcmp(long_options[option_index].name, "silencethreshold") == 0) {
+          char *end;
+          double value = strtod(optarg, &end);
+          if (end == optarg || *end != '\0' || errno == ERANGE) { // parse error
+            log_fatal("error: invalid silencethreshold: %s\n", optarg);
+            return EXIT_FAILURE;
+          }
+          if (value > 0.0) {
+            log_fatal("error: invalid silencethreshold: %.1f (must be <= 0.0)\n", value);
+            return EXIT_FAILURE;
+          }
+          silence_threshold = value;
+        } else if (strcmp(long_options[option_index].name, "silencecmd") == 0) {
+          strncpy(silence_command, optarg, sizeof(silence_command) - 1);
+          silence_command[sizeof(silence_command) - 1] = '\0';
         } else if (strcmp(long_options[option_index].name, "audiopreview") == 0) {
           is_audio_preview_enabled = 1;
           break;
@@ -5849,6 +7751,20 @@ int main(int argc, char **argv) {
     log_warn("warning: --minfps and --maxfps might not work because width (%d) / height (%d) >= approx 1.45\n", video_width, video_height);
   }
 
+  if (is_state_file_disabled && status_shm_name[0] == '\0') {
+    log_fatal("error: --nostatefiles requires --statusshm\n");
+    return EXIT_FAILURE;
+  }
+
+  if (is_rtspout_enabled && strcmp(audio_codec, "opus") == 0) {
+    log_fatal("error: --rtspout supports only AAC audio (--audiocodec opus was given)\n");
+    return EXIT_FAILURE;
+  }
+  if (mpegts_find_audio_encoder(audio_codec) == NULL) {
+    log_fatal("error: audio encoder for %s is not available in libavcodec\n", audio_codec);
+    return EXIT_FAILURE;
+  }
+
   fr_q16 = video_fps * 65536;
   if (video_pts_step == video_pts_step_default) {
     video_pts_step = round(90000 / video_fps);
@@ -5861,6 +7777,23 @@ int main(int argc, char **argv) {
   if (video_gop_size == video_gop_size_default) {
     video_gop_size = ceil(video_fps);
   }
+  if (is_abr_enabled) {
+    if (video_bitrate == 0) {
+      log_fatal("error: --abr cannot be used with --videobitrate 0\n");
+      return EXIT_FAILURE;
+    }
+    if (abr_max_bitrate == 0) {
+      abr_max_bitrate = video_bitrate;
+    }
+    if (abr_min_bitrate == 0) {
+      abr_min_bitrate = video_bitrate / 4;
+    }
+    if (abr_min_bitrate > abr_max_bitrate) {
+      log_fatal("error: --abrmin (%ld) is larger than --abrmax (%ld)\n",
+          abr_min_bitrate, abr_max_bitrate);
+      return EXIT_FAILURE;
+    }
+  }
   mpegts_set_config(video_bitrate, video_width, video_height);
   audio_min_value = (int) (-32768 / audio_volume_multiply);
   audio_max_value = (int) (32767 / audio_volume_multiply);
@@ -5870,16 +7803,29 @@ int main(int argc, char **argv) {
     exit(EXIT_FAILURE);
   }
 
+  // From now on, messages are written by a background thread so that
+  // a slow console does not stall the camera and audio callbacks.
+  // atexit() writes out the pending messages when exit() is called.
+  if (log_start_thread() == 0) {
+    atexit(log_stop_thread);
+  }
+
   log_debug("video_width=%d\n", video_width);
   log_debug("video_height=%d\n", video_height);
   log_debug("video_fps=%f\n", video_fps);
   log_debug("fr_q16=%d\n", fr_q16);
   log_debug("video_pts_step=%d\n", video_pts_step);
   log_debug("video_gop_size=%d\n", video_gop_size);
+  log_debug("is_intra_refresh_enabled=%d\n", is_intra_refresh_enabled);
   log_debug("video_rotation=%d\n", video_rotation);
   log_debug("video_hflip=%d\n", video_hflip);
   log_debug("video_vflip=%d\n", video_vflip);
   log_debug("video_bitrate=%ld\n", video_bitrate);
+  log_debug("is_abr_enabled=%d\n", is_abr_enabled);
+  log_debug("abr_min_bitrate=%ld\n", abr_min_bitrate);
+  log_debug("abr_max_bitrate=%ld\n", abr_max_bitrate);
+  log_debug("keyframe_request_interval=%.1f\n", keyframe_request_interval);
+  log_debug("is_auto_keyframe_enabled=%d\n", is_auto_keyframe_enabled);
   log_debug("video_avc_profile=%s\n", video_avc_profile);
   log_debug("video_avc_level=%s\n", video_avc_level);
   log_debug("video_qp_min=%d\n", video_qp_min);
@@ -5887,9 +7833,16 @@ int main(int argc, char **argv) {
   log_debug("video_qp_initial=%d\n", video_qp_initial);
   log_debug("video_slice_dquant=%d\n", video_slice_dquant);
   log_debug("alsa_dev=%s\n", alsa_dev);
+  log_debug("mix_devices=%d\n", audiomix_get_device_count());
   log_debug("audio_channels=%d\n", audio_channels);
   log_debug("audio_sample_rate=%d\n", audio_sample_rate);
   log_debug("audio_bitrate=%ld\n", audio_bitrate);
+  log_debug("audio_codec=%s\n", audio_codec);
+  log_debug("is_audio_level_enabled=%d\n", is_audio_level_enabled);
+  log_debug("silence_threshold=%.1f\n", silence_threshold);
+  log_debug("silence_duration=%.1f\n", silence_duration);
+  log_debug("silence_command=%s\n", silence_command);
+  log_debug("audio_frame_duration=%d\n", audio_frame_duration);
   log_debug("audio_volume_multiply=%f\n", audio_volume_multiply);
   log_debug("is_hlsout_enabled=%d\n", is_hlsout_enabled);
   log_debug("is_hls_encryption_enabled=%d\n", is_hls_encryption_enabled);
@@ -5910,6 +7863,7 @@ int main(int argc, char **argv) {
   log_debug("rtsp_audio_data_path=%s\n", rtsp_audio_data_path);
   log_debug("tcp_enabled=%d\n", is_tcpout_enabled);
   log_debug("tcp_output_dest=%s\n", tcp_output_dest);
+  log_debug("gop_cache_size=%ld\n", gop_cache_size);
   log_debug("auto_exposure_enabled=%d\n", is_auto_exposure_enabled);
   log_debug("auto_exposure_threshold=%f\n", auto_exposure_threshold);
   log_debug("is_vfr_enabled=%d\n", is_vfr_enabled);
@@ -5963,6 +7917,11 @@ int main(int argc, char **argv) {
   log_debug("record_buffer_keyframes=%d\n", record_buffer_keyframes);
   log_debug("state_dir=%s\n", state_dir);
   log_debug("hooks_dir=%s\n", hooks_dir);
+  log_debug("control_socket_path=%s\n", control_socket_path);
+  log_debug("status_shm_name=%s\n", status_shm_name);
+  log_debug("is_state_file_disabled=%d\n", is_state_file_disabled);
+  log_debug("metrics_port=%d\n", metrics_port);
+  log_debug("is_trace_requested=%d\n", is_trace_requested);
 
   video_width_32 = (video_width+31)&~31;
   video_height_16 = (video_height+15)&~15;
@@ -5971,16 +7930,42 @@ int main(int argc, char **argv) {
     if (state_create_dir(state_dir) != 0) {
       return EXIT_FAILURE;
     }
+    if (is_state_file_disabled) {
+      state_set_enabled(0);
+    }
     if (hooks_create_dir(hooks_dir) != 0) {
       return EXIT_FAILURE;
     }
+    if (status_shm_name[0] != '\0') {
+      if (status_open(status_shm_name) != 0) {
+        return EXIT_FAILURE;
+      }
+      status_set_audio_muted(is_audio_muted);
+    }
+    if (metrics_port != 0) {
+      if (metrics_start(metrics_port) != 0) {
+        return EXIT_FAILURE;
+      }
+      log_info("serving metrics on port %d\n", metrics_port);
+      metrics_set(METRICS_VIDEO_TARGET_BITRATE, video_bitrate);
+    }
+    if (is_abr_enabled) {
+      abr_init(abr_min_bitrate, abr_max_bitrate, video_fps);
+    }
+    if (is_trace_requested) {
+      if (trace_init() != 0) {
+        return EXIT_FAILURE;
+      }
+    }
 
     create_dir(rec_dir);
     create_dir(rec_tmp_dir);
     create_dir(rec_archive_dir);
 
     if (is_hlsout_enabled) {
-      ensure_hls_dir_exists();
+      if (ensure_hls_dir_exists() != 0) {
+        exit(EXIT_FAILURE);
+      }
     }
 
     state_set(state_dir, "record", "false");
@@ -5988,9 +7973,22 @@ int main(int argc, char **argv) {
     if (clear_hooks(hooks_dir) != 0) {
       log_error("error: clear_hooks() failed\n");
     }
+    // The control socket is created before the hooks thread starts,
+    // since control_start() changes the umask temporarily.
+    if (control_socket_path[0] != '\0') {
+      if (control_start(control_socket_path, on_control_command) != 0) {
+        log_fatal("error: cannot start control socket: %s\n", control_socket_path);
+        return EXIT_FAILURE;
+      }
+      log_info("listening for commands on %s\n", control_socket_path);
+    }
     start_watching_hooks(&hooks_thread, hooks_dir, on_file_create, 1);
 
     setup_socks();
+
+    if (gop_cache_size > 0) {
+      start_tcpout_replay_thread();
+    }
   }
 
   if (is_preview_enabled || is_clock_enabled) {
@@ -6048,16 +8046,22 @@ int main(int argc, char **argv) {
       codec_settings.audio_bit_rate = 1000;
       codec_settings.audio_channels = audio_channels;
       codec_settings.audio_profile = FF_PROFILE_AAC_LOW;
+      codec_settings.audio_codec = audio_codec;
+      codec_settings.audio_frame_duration = audio_frame_duration;
     } else {
       preconfigure_microphone();
       codec_settings.audio_sample_rate = audio_sample_rate;
       codec_settings.audio_bit_rate = audio_bitrate;
       codec_settings.audio_channels = audio_channels;
       codec_settings.audio_profile = FF_PROFILE_AAC_LOW;
+      codec_settings.audio_codec = audio_codec;
+      codec_settings.audio_frame_duration = audio_frame_duration;
     }
 
     if (is_tcpout_enabled) {
-      setup_tcp_output();
+      if (setup_tcp_output() != 0) {
+        exit(EXIT_FAILURE);
+      }
     }
 
     // From http://tools.ietf.org/html/draft-pantos-http-live-streaming-12#section-6.2.1
@@ -6074,33 +8078,9 @@ int main(int argc, char **argv) {
 #endif
 
     if (is_hlsout_enabled) {
-      hls->dir = hls_output_dir;
-      hls->num_retained_old_files = 10;
-      if (is_hls_encryption_enabled) {
-        hls->use_encryption = 1;
-
-        int uri_len = strlen(hls_encryption_key_uri) + 1;
-        hls->encryption_key_uri = malloc(uri_len);
-        if (hls->encryption_key_uri == NULL) {
-          perror("malloc for hls->encryption_key_uri");
-          return 1;
-        }
-        memcpy(hls->encryption_key_uri, hls_encryption_key_uri, uri_len);
-
-        hls->encryption_key = malloc(16);
-        if (hls->encryption_key == NULL) {
-          perror("malloc for hls->encryption_key");
-          return 1;
-        }
-        memcpy(hls->encryption_key, hls_encryption_key, 16);
-
-        hls->encryption_iv = malloc(16);
-        if (hls->encryption_iv == NULL) {
-          perror("malloc for hls->encryption_iv");
-          return 1;
-        }
-        memcpy(hls->encryption_iv, hls_encryption_iv, 16);
-      } // if (enable_hls_encryption)
+      if (configure_hls_output() != 0) {
+        return 1;
+      }
     }
 
     setup_av_frame(hls->format_ctx);
@@ -6114,6 +8094,22 @@ int main(int argc, char **argv) {
         log_fatal("error: configure_audio_capture_device: ret=%d\n", ret);
         exit(EXIT_FAILURE);
       }
+      if (audiomix_get_device_count() > 0) {
+        if (audiomix_start(audio_sample_rate, audio_channels, period_size) != 0) {
+          log_fatal("error: failed to start --mixdev capturing\n");
+          exit(EXIT_FAILURE);
+        }
+      }
+      if (is_audio_preview_enabled) {
+        start_audio_preview_thread();
+      }
+      if (is_audio_level_enabled || silence_duration > 0.0f) {
+        audiolevel_init(audio_sample_rate, audio_channels, period_size);
+        if (silence_duration > 0.0f) {
+          audiolevel_set_silence_detection(silence_threshold, silence_duration);
+          state_set(state_dir, "silence", "false");
+        }
+      }
     }
 
     prepare_encoded_packets();
@@ -6127,6 +8123,9 @@ int main(int argc, char **argv) {
   text_init();
   // setup timestamp
   if (is_timestamp_enabled) {
+    struct timespec text_start_ts;
+    clock_gettime(CLOCK_MONOTONIC, &text_start_ts);
+
     if (timestamp_font_file[0] != 0) {
       timestamp_init(timestamp_font_file, timestamp_font_face_index,
           timestamp_font_points, timestamp_font_dpi);
@@ -6150,6 +8149,13 @@ int main(int argc, char **argv) {
     timestamp_set_stroke_width(timestamp_stroke_width);
     timestamp_set_letter_spacing(timestamp_letter_spacing);
     timestamp_fix_position(video_width_32, video_height_16);
+    timestamp_finish_init();
+
+    struct timespec text_end_ts;
+    clock_gettime(CLOCK_MONOTONIC, &text_end_ts);
+    log_info("startup: timestamp font ready in %.1f ms\n",
+        (text_end_ts.tv_sec - text_start_ts.tv_sec) * 1000.0f +
+        (text_end_ts.tv_nsec - text_start_ts.tv_nsec) / 1000000.0f);
   }
 
   if (query_and_exit) {
@@ -6167,6 +8173,15 @@ int main(int argc, char **argv) {
 
     log_debug("shutdown sequence start\n");
 
+    // Commands and hooks use the outputs, so stop them first
+    log_debug("control_stop\n");
+    control_stop();
+
+    log_debug("stop_watching_hooks\n");
+    stop_watching_hooks();
+    log_debug("pthread_join hooks_thread\n");
+    pthread_join(hooks_thread, NULL);
+
     if (is_recording) {
       rec_thread_needs_write = 1;
       pthread_cond_signal(&rec_cond);
@@ -6183,6 +8198,11 @@ int main(int argc, char **argv) {
       pthread_cond_wait(&camera_finish_cond, &camera_finish_mutex);
     }
     pthread_mutex_unlock(&camera_finish_mutex);
+
+    if (is_tcpout_replay_thread_started) {
+      log_debug("stop_tcpout_replay_thread\n");
+      stop_tcpout_replay_thread();
+    }
   }
 
   stop_openmax_capturing();
@@ -6199,6 +8219,17 @@ int main(int argc, char **argv) {
     if (!disable_audio_capturing) {
       log_debug("teardown_audio_capture_device\n");
       teardown_audio_capture_device();
+      if (audiomix_get_device_count() > 0) {
+        log_debug("audiomix_stop\n");
+        audiomix_stop();
+      }
+      if (is_audio_level_enabled || silence_duration > 0.0f) {
+        audiolevel_teardown();
+      }
+      if (is_audio_preview_thread_started) {
+        log_debug("stop_audio_preview_thread\n");
+        stop_audio_preview_thread();
+      }
       if (is_audio_preview_device_opened) {
         log_debug("teardown_audio_preview_device\n");
         teardown_audio_preview_device();
@@ -6215,11 +8246,16 @@ int main(int argc, char **argv) {
   pthread_mutex_destroy(&rec_write_mutex);
   pthread_mutex_destroy(&camera_finish_mutex);
   pthread_mutex_destroy(&tcp_mutex);
+  pthread_mutex_destroy(&tcpout_replay_write_mutex);
+  pthread_mutex_destroy(&rtsp_mutex);
+  pthread_mutex_destroy(&audio_preview_mutex);
   pthread_cond_destroy(&rec_cond);
+  pthread_cond_destroy(&tcpout_replay_cond);
+  pthread_cond_destroy(&audio_preview_cond);
   pthread_cond_destroy(&camera_finish_cond);
 
   if (!query_and_exit) {
-    if (is_tcpout_enabled) {
+    if (tcp_ctx != NULL) {
       teardown_tcp_output();
     }
 
@@ -6229,15 +8265,19 @@ int main(int argc, char **argv) {
     log_debug("free_encoded_packets\n");
     free_encoded_packets();
 
-    log_debug("stop_watching_hooks\n");
-    stop_watching_hooks();
-    log_debug("pthread_join hooks_thread\n");
-    pthread_join(hooks_thread, NULL);
+    log_debug("status_close\n");
+    status_close();
+
+    log_debug("metrics_stop\n");
+    metrics_stop();
   }
 
   log_debug("free keyframe_pointers\n");
   free(keyframe_pointers);
 
+  log_debug("trace_teardown\n");
+  trace_teardown();
+
   log_debug("shutdown successful\n");
   return 0;
 }
@@ -2,6 +2,8 @@
 #include <time.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include "text.h"
 #include "subtitle.h"
@@ -11,6 +13,44 @@ const static char *default_font_name = "sans";
 static int text_id = -1;
 static int64_t hide_time = 0;
 
+// Cues are rendered this many nanoseconds before they appear
+#define SCHEDULE_LOOKAHEAD_NSEC INT64_C(5000000000)
+// Maximum number of rendered cues waiting to appear
+#define SCHEDULE_MAX_PREPARED_CUES 8
+// Interval at which the schedule worker looks for cues to render
+#define SCHEDULE_POLL_INTERVAL_NSEC 100000000
+// Cues use the same font size as hooks/subtitle by default
+#define SCHEDULE_FONT_POINTS 28
+#define SCHEDULE_FONT_DPI 96
+
+// A cue in SRT or WebVTT
+typedef struct subtitle_cue {
+  int64_t start_time; // nanoseconds from the start of the schedule
+  int64_t end_time;
+  char *text;
+  size_t text_len;
+  int text_id; // -1 until the worker creates the text
+  int is_shown;
+  int is_finished;
+} subtitle_cue;
+
+// Cues sorted by start_time. cues and num_cues do not change while
+// the worker is running, and the others are guarded by schedule_mutex.
+static subtitle_cue *cues = NULL;
+static int num_cues = 0;
+static int next_prepare_cue = 0; // first cue which has no text yet
+static int first_active_cue = 0; // first cue which has not finished
+static int64_t schedule_start_time;
+static char *schedule_font_file = NULL;
+static int schedule_face_index;
+static pthread_t schedule_thread;
+static int is_schedule_running = 0;
+static int is_schedule_stopping = 0;
+static pthread_mutex_t schedule_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t schedule_cond = PTHREAD_COND_INITIALIZER;
+
+static void subtitle_schedule_update();
+
 /**
  * Initializes the subtitle library with a font name.
  */
@@ -59,6 +99,7 @@ void subtitle_init(const char *font_file, long face_index, int points, int dpi)
  * Destroys the resources used by subtitle library.
  */
 void subtitle_shutdown() {
+  subtitle_schedule_stop();
   if (text_id != -1) {
     text_destroy(text_id);
     text_id = -1;
@@ -143,6 +184,10 @@ void subtitle_set_align(TEXT_ALIGN text_align) {
 void subtitle_update() {
   struct timespec ts;
 
+  if (is_schedule_running) {
+    subtitle_schedule_update();
+  }
+
   if (hide_time > 0) {
     clock_gettime(CLOCK_MONOTONIC, &ts);
     int64_t current_time = ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
@@ -185,3 +230,346 @@ void subtitle_clear() {
     text_clear(text_id);
   }
 }
+
+static int64_t get_monotonic_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+/**
+ * Parses a cue timestamp like "01:02:03,456" (SRT), "01:02:03.456"
+ * or "02:03.456" (WebVTT). Returns the pointer to the character after
+ * the timestamp, or NULL on error.
+ */
+static const char *parse_cue_time(const char *p, int64_t *nsec) {
+  int64_t fields[3];
+  int num_fields = 0;
+  char *end;
+
+  while (*p == ' ' || *p == '\t') {
+    p++;
+  }
+  while (1) {
+    if (num_fields == 3) {
+      return NULL;
+    }
+    fields[num_fields++] = strtol(p, &end, 10);
+    if (end == p) {
+      return NULL;
+    }
+    p = end;
+    if (*p != ':') {
+      break;
+    }
+    p++;
+  }
+  if (num_fields < 2 || (*p != ',' && *p != '.')) {
+    return NULL;
+  }
+  p++;
+  long millis = strtol(p, &end, 10);
+  if (end - p != 3) {
+    return NULL;
+  }
+  int64_t seconds = 0;
+  int i;
+  for (i = 0; i < num_fields; i++) {
+    seconds = seconds * 60 + fields[i];
+  }
+  *nsec = seconds * INT64_C(1000000000) + millis * INT64_C(1000000);
+  return end;
+}
+
+/**
+ * Appends a line of cue text to cue->text, removing markup
+ * such as <i> and <c.yellow>.
+ */
+static void append_cue_text(subtitle_cue *cue, const char *line, size_t line_len) {
+  char *text = realloc(cue->text, cue->text_len + line_len + 2);
+  if (text == NULL) {
+    perror("realloc for subtitle cue");
+    return;
+  }
+  cue->text = text;
+  if (cue->text_len > 0) {
+    text[cue->text_len++] = '\n';
+  }
+  int is_in_tag = 0;
+  size_t i;
+  for (i = 0; i < line_len; i++) {
+    if (line[i] == '<') {
+      is_in_tag = 1;
+    } else if (line[i] == '>' && is_in_tag) {
+      is_in_tag = 0;
+    } else if (!is_in_tag) {
+      text[cue->text_len++] = line[i];
+    }
+  }
+  text[cue->text_len] = '\0';
+}
+
+static int compare_cues(const void *a, const void *b) {
+  int64_t start_a = ((const subtitle_cue *) a)->start_time;
+  int64_t start_b = ((const subtitle_cue *) b)->start_time;
+  return (start_a > start_b) - (start_a < start_b);
+}
+
+/**
+ * Parses SRT or WebVTT data into cues.
+ * Returns the number of cues, or -1 on error.
+ */
+static int parse_cues(const char *data, size_t data_len, subtitle_cue **parsed_cues) {
+  subtitle_cue *list = NULL;
+  int count = 0;
+  int capacity = 0;
+  subtitle_cue *cue = NULL; // cue which is receiving text lines
+  const char *p = data;
+  const char *data_end = data + data_len;
+
+  if (data_len >= 3 && memcmp(p, "\xef\xbb\xbf", 3) == 0) { // UTF-8 BOM
+    p += 3;
+  }
+  while (p < data_end) {
+    const char *line = p;
+    const char *line_end = memchr(p, '\n', data_end - p);
+    if (line_end == NULL) {
+      line_end = data_end;
+    }
+    p = line_end + 1;
+    size_t line_len = line_end - line;
+    if (line_len > 0 && line[line_len-1] == '\r') {
+      line_len--;
+    }
+
+    if (line_len == 0) { // blank line ends a cue
+      cue = NULL;
+      continue;
+    }
+    if (cue != NULL) {
+      append_cue_text(cue, line, line_len);
+      continue;
+    }
+
+    // Lines before the timing line (SRT counter, WebVTT header,
+    // cue identifier and NOTE blocks) are ignored
+    const char *arrow = NULL;
+    if (line_len >= 3) {
+      const char *q;
+      for (q = line; q + 3 <= line + line_len; q++) {
+        if (memcmp(q, "-->", 3) == 0) {
+          arrow = q;
+          break;
+        }
+      }
+    }
+    if (arrow == NULL) {
+      continue;
+    }
+
+    int64_t start_time, end_time;
+    char timing[128];
+    size_t timing_len = line_len < sizeof(timing) - 1 ? line_len : sizeof(timing) - 1;
+    memcpy(timing, line, timing_len);
+    timing[timing_len] = '\0';
+    if (parse_cue_time(timing, &start_time) == NULL ||
+        parse_cue_time(timing + (arrow - line) + 3, &end_time) == NULL) {
+      fprintf(stderr, "subtitle schedule: invalid timing: %s\n", timing);
+      continue;
+    }
+
+    if (count == capacity) {
+      capacity = capacity == 0 ? 64 : capacity * 2;
+      subtitle_cue *new_list = realloc(list, sizeof(subtitle_cue) * capacity);
+      if (new_list == NULL) {
+        perror("realloc for subtitle cues");
+        break;
+      }
+      list = new_list;
+    }
+    cue = &list[count++];
+    cue->start_time = start_time;
+    cue->end_time = end_time;
+    cue->text = NULL;
+    cue->text_len = 0;
+    cue->text_id = -1;
+    cue->is_shown = 0;
+    cue->is_finished = 0;
+  }
+
+  if (count > 0) {
+    qsort(list, count, sizeof(subtitle_cue), compare_cues);
+  }
+  *parsed_cues = list;
+  return count;
+}
+
+/**
+ * Creates an invisible text for the cue and queues it to the render worker.
+ */
+static int prepare_cue(const subtitle_cue *cue) {
+  int cue_text_id = text_create(schedule_font_file, schedule_face_index,
+      SCHEDULE_FONT_POINTS, SCHEDULE_FONT_DPI);
+  if (cue_text_id == -1) {
+    return -1;
+  }
+  text_set_stroke_color(cue_text_id, 0x000000);
+  text_set_letter_spacing(cue_text_id, 1);
+  text_set_color(cue_text_id, 0xffffff);
+  text_set_layout(cue_text_id,
+      LAYOUT_ALIGN_BOTTOM | LAYOUT_ALIGN_CENTER, // layout alignment for the box
+      0, // horizontal margin from the right edge
+      35); // vertical margin from the bottom edge
+  text_set_align(cue_text_id, TEXT_ALIGN_CENTER); // text alignment inside the box
+  text_set_visibility(cue_text_id, 0, 0); // until the cue starts
+  text_set_text(cue_text_id, cue->text, cue->text_len);
+  redraw_text(cue_text_id);
+  return cue_text_id;
+}
+
+/**
+ * Worker which creates the texts of upcoming cues so that they are
+ * already rendered when subtitle_schedule_update() shows them.
+ */
+static void *schedule_loop(void *arg) {
+  pthread_mutex_lock(&schedule_mutex);
+  while (!is_schedule_stopping && next_prepare_cue < num_cues) {
+    int64_t elapsed = get_monotonic_time() - schedule_start_time;
+    subtitle_cue *cue = &cues[next_prepare_cue];
+    if (cue->start_time <= elapsed + SCHEDULE_LOOKAHEAD_NSEC &&
+        next_prepare_cue - first_active_cue < SCHEDULE_MAX_PREPARED_CUES) {
+      if (cue->end_time <= elapsed || cue->text_len == 0) { // too late or empty
+        cue->is_finished = 1;
+        next_prepare_cue++;
+        continue;
+      }
+      // cue is not touched by the camera thread until next_prepare_cue passes it
+      pthread_mutex_unlock(&schedule_mutex);
+      int cue_text_id = prepare_cue(cue);
+      pthread_mutex_lock(&schedule_mutex);
+      cue->text_id = cue_text_id;
+      if (cue_text_id == -1) {
+        cue->is_finished = 1;
+      }
+      next_prepare_cue++;
+      continue;
+    }
+
+    struct timespec timeout;
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_nsec += SCHEDULE_POLL_INTERVAL_NSEC;
+    if (timeout.tv_nsec >= 1000000000) {
+      timeout.tv_sec++;
+      timeout.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&schedule_cond, &schedule_mutex, &timeout);
+  }
+  pthread_mutex_unlock(&schedule_mutex);
+  return NULL;
+}
+
+/**
+ * Shows and hides the cues whose start or end time has come.
+ * This runs on the camera thread right before text_draw_all(), so
+ * a cue switch happens exactly on a frame.
+ */
+static void subtitle_schedule_update() {
+  int i;
+  int has_finished_cue = 0;
+  int64_t elapsed = get_monotonic_time() - schedule_start_time;
+
+  pthread_mutex_lock(&schedule_mutex);
+  if (!is_schedule_running) { // stopped by the hooks thread
+    pthread_mutex_unlock(&schedule_mutex);
+    return;
+  }
+  for (i = first_active_cue; i < next_prepare_cue; i++) {
+    subtitle_cue *cue = &cues[i];
+    if (cue->is_finished) {
+      continue;
+    }
+    if (elapsed >= cue->end_time) {
+      text_destroy(cue->text_id);
+      cue->text_id = -1;
+      cue->is_finished = 1;
+    } else if (elapsed >= cue->start_time && !cue->is_shown) {
+      text_set_visibility(cue->text_id, 1, 1);
+      cue->is_shown = 1;
+    }
+  }
+  while (first_active_cue < next_prepare_cue && cues[first_active_cue].is_finished) {
+    first_active_cue++;
+    has_finished_cue = 1;
+  }
+  if (has_finished_cue) {
+    pthread_cond_signal(&schedule_cond);
+  }
+  pthread_mutex_unlock(&schedule_mutex);
+}
+
+/**
+ * Starts showing the cues in SRT or WebVTT data. Cue times are relative
+ * to the time this function is called. The current schedule is replaced.
+ */
+int subtitle_schedule_start(const char *data, size_t data_len) {
+  subtitle_cue *parsed_cues;
+  int count;
+  int face_index;
+
+  subtitle_schedule_stop();
+
+  if (schedule_font_file == NULL) {
+    if (text_select_font_file(default_font_name, &schedule_font_file, &face_index) != 0) {
+      schedule_font_file = NULL;
+      fprintf(stderr, "subtitle schedule: font not found: %s\n", default_font_name);
+      return -1;
+    }
+    schedule_face_index = face_index;
+  }
+
+  count = parse_cues(data, data_len, &parsed_cues);
+  if (count <= 0) {
+    free(parsed_cues);
+    fprintf(stderr, "subtitle schedule: no cues found\n");
+    return -1;
+  }
+
+  cues = parsed_cues;
+  num_cues = count;
+  next_prepare_cue = 0;
+  first_active_cue = 0;
+  is_schedule_stopping = 0;
+  schedule_start_time = get_monotonic_time();
+  pthread_create(&schedule_thread, NULL, schedule_loop, NULL);
+  pthread_mutex_lock(&schedule_mutex);
+  is_schedule_running = 1;
+  pthread_mutex_unlock(&schedule_mutex);
+  return 0;
+}
+
+/**
+ * Stops the schedule and removes its cues from the screen.
+ */
+void subtitle_schedule_stop() {
+  int i;
+
+  if (!is_schedule_running) {
+    return;
+  }
+  pthread_mutex_lock(&schedule_mutex);
+  is_schedule_running = 0;
+  is_schedule_stopping = 1;
+  pthread_cond_signal(&schedule_cond);
+  pthread_mutex_unlock(&schedule_mutex);
+  pthread_join(schedule_thread, NULL);
+
+  for (i = 0; i < num_cues; i++) {
+    if (cues[i].text_id != -1) {
+      text_destroy(cues[i].text_id);
+    }
+    free(cues[i].text);
+  }
+  free(cues);
+  cues = NULL;
+  num_cues = 0;
+}
@@ -83,4 +83,17 @@ void subtitle_show(const char *text, size_t text_len, float duration_sec);
  */
 void subtitle_clear();
 
+/**
+ * Starts showing the cues in SRT or WebVTT data. Upcoming cues are
+ * rendered ahead of time and switched by subtitle_update().
+ * Cue times are relative to the time this function is called.
+ * Returns 0 on success, -1 if no cues are found.
+ */
+int subtitle_schedule_start(const char *data, size_t data_len);
+
+/**
+ * Stops the schedule started by subtitle_schedule_start().
+ */
+void subtitle_schedule_stop();
+
 #endif // PICAM_SUBTITLE_H
@@ -1,6 +1,12 @@
 #include <stdint.h>
 #include <math.h>
+#include <pthread.h>
 #include <time.h> // clock()
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
 #include "log.h"
 
 // FreeType
@@ -9,6 +15,7 @@
 #include FT_GLYPH_H
 #include FT_OUTLINE_H
 #include FT_STROKER_H
+#include FT_SIZES_H
 
 // HarfBuzz
 #include <hb.h>
@@ -22,6 +29,19 @@
 static const int BYTES_PER_PIXEL = 4;
 static const int DEFAULT_TAB_WIDTH = 80;
 
+// Number of hash buckets in the glyph cache (must be a power of 2)
+#define GLYPH_CACHE_BUCKETS 1024
+
+// The whole glyph cache is flushed when it holds more entries than this
+#define GLYPH_CACHE_MAX_ENTRIES 4096
+
+// Font names resolved by fontconfig are kept in this file under
+// $XDG_CACHE_HOME (or ~/.cache) so that the next start can skip fontconfig
+#define FONT_CACHE_FILE_NAME "picam-fonts.cache"
+
+// Initial number of slots in textdata_list. It is doubled when full.
+#define TEXTDATA_LIST_INITIAL_CAPACITY 16
+
 #ifndef unlikely
 #ifdef __GNUC__
 #define unlikely(x) __builtin_expect(!!(x), 0)
@@ -55,10 +75,39 @@ typedef enum BlendMode {
 // If You really need it, use multiple dispmanx layers (or EGL overlay) and let the hardware do the blending
 //#define USE_ARGB_PIXEL_BLENDING
 
+// A horizontal run of pixels which are not fully transparent
+typedef struct TextRun {
+  uint16_t row;
+  uint16_t col;
+  uint16_t len;
+  uint32_t offset; // index of the first pixel in the packed arrays
+} TextRun;
+
+// Rendered text stored as runs so that compositing skips transparent
+// pixels. Pixels of all runs are packed back to back in each array.
+typedef struct TextOverlay {
+  TextRun *runs;
+  int num_runs;
+  uint32_t *argb; // for preview
+  uint8_t *y; // premultiplied by alpha
+  uint8_t *alpha;
+
+  // 2x2 subsampled U and V premultiplied by the averaged alpha.
+  // Block boundaries depend on the parity of the position on the canvas.
+  TextRun *chroma_runs;
+  int num_chroma_runs;
+  uint8_t *u;
+  uint8_t *v;
+  uint8_t *chroma_alpha;
+  int chroma_parity_x;
+  int chroma_parity_y;
+} TextOverlay;
+
 // Represents a text object
 typedef struct TextData {
   int id;
-  uint8_t *bitmap; // ARGB linear array (4 bytes per pixel)
+  uint8_t *bitmap; // ARGB linear array (4 bytes per pixel), only while drawing glyphs
+  TextOverlay overlay; // built from bitmap at redraw time
   struct TextData *next_textdata;
 
   LAYOUT_MODE layout_mode;
@@ -90,10 +139,30 @@ typedef struct TextData {
   BlendMode blend_mode;
   char *text;
   int32_t text_len;
-  FT_Face face;
+  FT_Face face; // NULL until text_load_face() is called
+  struct FaceEntry *face_entry; // shared face which face belongs to
+  FT_Size ft_size; // size of this text in the shared face
+  // font which is opened by text_load_face()
+  char *font_file;
+  long face_index;
+  float point;
+  int dpi;
+  int is_image; // created by text_create_image()
   float line_height_multiply;
   float tab_scale;
 
+  // HarfBuzz objects reused across redraws (created on first use)
+  hb_font_t *hb_font;
+  hb_buffer_t *hb_buffer;
+
+  // pre-rendered characters for redraw_text_from_atlas()
+  struct TextAtlas *atlas;
+
+  // Snapshot waiting for the render worker
+  struct TextData *pending_render;
+  // Incremented on each redraw or clear so that stale renders are discarded
+  unsigned int redraw_epoch;
+
   // baton
   int pen_x;
   int pen_y;
@@ -105,9 +174,50 @@ typedef struct TextData {
   // text visibility
   int in_preview;
   int in_video;
+
+  // next text in destroyed_textdata
+  struct TextData *next_destroyed;
+
+  // area of the preview canvas covered when the text was last drawn there
+  text_rect preview_rect;
+  // nonzero if the bitmap has been replaced since it was drawn on the preview
+  int is_preview_dirty;
 } TextData;
 
+// A font face shared by the texts using the same file and face index.
+// Each text has its own FT_Size in the face, which is activated by
+// text_load_face() before the face is used. Guarded by render_mutex.
+typedef struct FaceEntry {
+  char *font_file;
+  long face_index;
+  FT_Face face;
+  int ref_count;
+  struct FaceEntry *next;
+} FaceEntry;
+
+static FaceEntry *face_registry = NULL;
+
+static char *copy_string(const char *str) {
+  size_t len = strlen(str) + 1;
+  char *copy = malloc(len);
+  if (copy == NULL) {
+    fprintf(stderr, "cannot allocate memory for string: %d bytes\n", len);
+    exit(EXIT_FAILURE);
+  }
+  memcpy(copy, str, len);
+  return copy;
+}
+
+// The camera thread reads textdata_list and max_text_id without a lock.
+// When the list is full, a larger copy is published instead of realloc()ing
+// it, and the old one is kept in retired_textdata_lists until text_teardown().
 static TextData **textdata_list = NULL;
+static int textdata_list_capacity = 0;
+// The capacity is doubled each time, so this never fills up
+static TextData **retired_textdata_lists[sizeof(int) * 8];
+static int num_retired_textdata_lists = 0;
+// area of the preview canvas left behind by destroyed texts
+static text_rect removed_preview_rect = { 0, 0, 0, 0 };
 static FT_Library ft_library;
 static int max_text_id = 0;
 
@@ -116,105 +226,433 @@ static FT_Int32 ft_load_flags = FT_LOAD_FORCE_AUTOHINT;
 // FT_LOAD_NO_HINTING -> blurrier but better shape
 // FT_LOAD_FORCE_AUTOHINT -> blurrier but readable, better shape than default
 
-typedef struct span_sizer_data {
+typedef enum GLYPH_MASK_KIND {
+  GLYPH_MASK_FILL = 0,
+  GLYPH_MASK_STROKE = 1,
+} GLYPH_MASK_KIND;
+
+// A row of spans in GlyphMask
+typedef struct glyph_span_row {
+  int y;
+  int start; // index of the first span in GlyphMask.spans
+  int count;
+} glyph_span_row;
+
+// Pre-rasterized coverage of a glyph. Spans are relative to the glyph
+// origin exactly as FreeType passes them to gray_spans callback,
+// so drawing a cached glyph is a replay of span_writer_callback().
+typedef struct GlyphMask {
+  // cache key
+  FT_Face face;
+  FT_Fixed x_scale;
+  FT_Fixed y_scale;
+  FT_UInt glyph_index;
+  GLYPH_MASK_KIND kind;
+  FT_Fixed stroke_radius;
+
+  int is_valid; // 0 if the glyph could not be rasterized
+  FT_Span *spans;
+  int num_spans;
+  int spans_capacity;
+  glyph_span_row *rows;
+  int num_rows;
+  int rows_capacity;
+
+  // bounding box of the spans
   int min_span_x;
   int max_span_x;
   int min_y;
   int max_y;
-} span_sizer_data;
+
+  struct GlyphMask *next; // next entry in the same bucket
+} GlyphMask;
+
+// Glyph cache shared by all text objects. Texts are redrawn from both
+// the camera thread (timestamp) and the hooks thread (subtitle), so
+// the cache and the masks it returns are guarded by glyph_cache_mutex.
+static GlyphMask *glyph_cache[GLYPH_CACHE_BUCKETS];
+static int glyph_cache_entries = 0;
+static pthread_mutex_t glyph_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Texts are shaped and rasterized on the render worker so that
+// the camera thread only has to composite ready bitmaps.
+static pthread_t render_thread;
+static int is_render_thread_started = 0;
+static int is_render_thread_stopping = 0;
+// Guards pending_render, redraw_epoch and textdata_list
+static pthread_mutex_t render_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t render_queue_cond = PTHREAD_COND_INITIALIZER;
+// Held while glyphs are shaped and rasterized. Must be locked
+// before render_queue_mutex when both are needed.
+static pthread_mutex_t render_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Texts removed from textdata_list, which are freed by the render worker
+// so that the camera thread does not wait for render_mutex.
+// Guarded by render_queue_mutex.
+static TextData *destroyed_textdata = NULL;
+
+// Fixed-advance cells of pre-rendered ASCII characters.
+// Every cell has the same size and the same glyph origin.
+typedef struct TextAtlas {
+  uint8_t *cells[128]; // ARGB bitmap for each character, NULL if not in the atlas
+  int cell_width;
+  int cell_height;
+  int origin_x; // glyph origin from the left edge of a cell
+  int advance; // distance between the origins of adjacent cells
+  int line_height; // default line spacing of the face, rounded up
+
+  // Reused by redraw_text_from_atlas() on every update
+  uint8_t *bitmap;
+  int bitmap_size;
+  struct TextData *spare_snapshot; // the last applied snapshot
+} TextAtlas;
 
 // function prototypes
 static void text_destroy_real(int text_id);
+static void free_destroyed_textdata();
+static void text_free_textdata(TextData *textdata);
+static int text_load_face(TextData *textdata);
+static void free_snapshot(TextData *snapshot);
+static TextData *snapshot_textdata_into(TextData *snapshot, TextData *textdata);
+static void rect_union(text_rect *dst, const text_rect *src);
+static void build_overlay(TextData *textdata);
+static void font_cache_clear();
+static void cancel_redraw(TextData *textdata);
+static void get_textdata_position(TextData *textdata,
+    int canvas_width, int canvas_height, int *x, int *y);
+static void *render_loop(void *arg);
+void span_writer_callback(int y, int count, const FT_Span* spans, void *user);
+
+static void text_free_chroma_overlay(TextOverlay *overlay) {
+  free(overlay->chroma_runs);
+  free(overlay->u);
+  free(overlay->v);
+  free(overlay->chroma_alpha);
+  overlay->chroma_runs = NULL;
+  overlay->num_chroma_runs = 0;
+  overlay->u = NULL;
+  overlay->v = NULL;
+  overlay->chroma_alpha = NULL;
+}
+
+static void text_free_bitmap(TextData *textdata) {
+  free(textdata->bitmap);
+  textdata->bitmap = NULL;
+  free(textdata->overlay.runs);
+  free(textdata->overlay.argb);
+  free(textdata->overlay.y);
+  free(textdata->overlay.alpha);
+  text_free_chroma_overlay(&textdata->overlay);
+  memset(&textdata->overlay, 0, sizeof(TextOverlay));
+}
+
+static void text_free_atlas(TextData *textdata) {
+  if (textdata->atlas != NULL) {
+    int i;
+    for (i = 0; i < 128; i++) {
+      free(textdata->atlas->cells[i]);
+    }
+    free(textdata->atlas->bitmap);
+    if (textdata->atlas->spare_snapshot != NULL) {
+      free_snapshot(textdata->atlas->spare_snapshot);
+    }
+    free(textdata->atlas);
+    textdata->atlas = NULL;
+  }
+}
+
+static void glyph_mask_free(GlyphMask *mask) {
+  free(mask->spans);
+  free(mask->rows);
+  free(mask);
+}
 
 /**
- * Initialize text library.
+ * Frees all entries in the glyph cache.
+ * glyph_cache_mutex must be held by the caller.
  */
-void text_init() {
-  FT_Error      fterr;
-
-  fterr = FT_Init_FreeType( &ft_library );
-  if (fterr) {
-    fprintf(stderr, "error: freetype initialization failed: %d\n", fterr);
-    return;
+static void glyph_cache_flush() {
+  int i;
+  for (i = 0; i < GLYPH_CACHE_BUCKETS; i++) {
+    GlyphMask *mask = glyph_cache[i];
+    while (mask != NULL) {
+      GlyphMask *next = mask->next;
+      glyph_mask_free(mask);
+      mask = next;
+    }
+    glyph_cache[i] = NULL;
   }
+  glyph_cache_entries = 0;
 }
 
 /**
- * Shutdown text library.
+ * Removes the entries for the face from the glyph cache.
+ * This must be called before the face is released since
+ * another face may be allocated at the same address.
  */
-void text_teardown() {
+static void glyph_cache_remove_face(FT_Face face) {
   int i;
-  for (i = 0; i < max_text_id; i++) {
-    if (textdata_list[i] != NULL)  {
-      text_destroy(i+1);
+  pthread_mutex_lock(&glyph_cache_mutex);
+  for (i = 0; i < GLYPH_CACHE_BUCKETS; i++) {
+    GlyphMask **link = &glyph_cache[i];
+    while (*link != NULL) {
+      GlyphMask *mask = *link;
+      if (mask->face == face) {
+        *link = mask->next;
+        glyph_mask_free(mask);
+        glyph_cache_entries--;
+      } else {
+        link = &mask->next;
+      }
     }
   }
+  pthread_mutex_unlock(&glyph_cache_mutex);
+}
 
-  FT_Done_FreeType(ft_library);
+// callback function for storing the spans of a glyph into GlyphMask
+static void span_collector_callback(int y, int count, const FT_Span* spans, void *user) {
+  GlyphMask *mask = (GlyphMask *) user;
+
+  if (mask->num_rows == mask->rows_capacity) {
+    int capacity = mask->rows_capacity ? mask->rows_capacity * 2 : 32;
+    glyph_span_row *rows = realloc(mask->rows, sizeof(glyph_span_row) * capacity);
+    if (rows == NULL) {
+      fprintf(stderr, "cannot allocate memory for glyph span rows: %d bytes\n",
+          sizeof(glyph_span_row) * capacity);
+      exit(EXIT_FAILURE);
+    }
+    mask->rows = rows;
+    mask->rows_capacity = capacity;
+  }
+  if (mask->num_spans + count > mask->spans_capacity) {
+    int capacity = mask->spans_capacity ? mask->spans_capacity * 2 : 64;
+    while (capacity < mask->num_spans + count) {
+      capacity *= 2;
+    }
+    FT_Span *new_spans = realloc(mask->spans, sizeof(FT_Span) * capacity);
+    if (new_spans == NULL) {
+      fprintf(stderr, "cannot allocate memory for glyph spans: %d bytes\n",
+          sizeof(FT_Span) * capacity);
+      exit(EXIT_FAILURE);
+    }
+    mask->spans = new_spans;
+    mask->spans_capacity = capacity;
+  }
+
+  glyph_span_row *row = &mask->rows[mask->num_rows++];
+  row->y = y;
+  row->start = mask->num_spans;
+  row->count = count;
+  memcpy(mask->spans + mask->num_spans, spans, sizeof(FT_Span) * count);
+  mask->num_spans += count;
+
+  if (y < mask->min_y) {
+    mask->min_y = y;
+  }
+  if (y > mask->max_y) {
+    mask->max_y = y;
+  }
+  int i;
+  for (i = 0 ; i < count; i++) {
+    if (spans[i].x + spans[i].len > mask->max_span_x) {
+      mask->max_span_x = spans[i].x + spans[i].len;
+    }
+    if (spans[i].x < mask->min_span_x) {
+      mask->min_span_x = spans[i].x;
+    }
+  }
 }
 
 /**
- * Creates a new text object and returns the text id.
+ * Loads and rasterizes the glyph into the mask.
  */
-int text_create(const char *font_file, long face_index, float point, int dpi) {
+static void glyph_mask_render(GlyphMask *mask) {
   FT_Error fterr;
-  FT_Face face;
 
-  if (ft_library == NULL) {
-    text_init();
+  fterr = FT_Load_Glyph(mask->face, mask->glyph_index, ft_load_flags);
+  if (fterr) {
+    fprintf(stderr, "failed to load %08x (freetype error code=%d)\n", mask->glyph_index, fterr);
+    return;
+  }
+  if (mask->face->glyph->format != FT_GLYPH_FORMAT_OUTLINE) {
+    fprintf(stderr, "unsupported glyph format: %4s\n", (char *)&mask->face->glyph->format);
+    return;
   }
 
-  fterr = FT_New_Face( ft_library, font_file, face_index, &face );
-  if (fterr == FT_Err_Unknown_File_Format) {
-    fprintf(stderr, "text_create() failed: font format is unsupported\n");
-    return -1;
-  } else if (fterr == FT_Err_Cannot_Open_Resource) {
-    fprintf(stderr, "text_create() failed: cannot open the font file\n");
-    return -1;
-  } else if (fterr == FT_Err_Invalid_Argument) {
-    fprintf(stderr, "text_create() failed: maybe the font face index is invalid\n");
-    return -1;
-  } else if (fterr) {
-    fprintf(stderr, "text_create() failed: failed to open the font file; error=%d\n", fterr);
-    return -1;
-  } else if (face == NULL) {
-    fprintf(stderr, "text_create() failed: failed to open the font file\n");
-    return -1;
+  FT_Raster_Params ftr_params;
+  memset(&ftr_params, 0, sizeof(ftr_params));
+  ftr_params.target = 0; // we use callback instead of this
+  ftr_params.flags = FT_RASTER_FLAG_DIRECT | FT_RASTER_FLAG_AA; // antialiasing with callback
+  ftr_params.user = mask; // user data
+  ftr_params.gray_spans = span_collector_callback; // callback func
+
+  mask->min_span_x = INT_MAX;
+  mask->max_span_x = INT_MIN;
+  mask->min_y = INT_MAX;
+  mask->max_y = INT_MIN;
+
+  if (mask->kind == GLYPH_MASK_STROKE) {
+    FT_Stroker stroker;
+    FT_Stroker_New(ft_library, &stroker);
+    FT_Stroker_Set(stroker, mask->stroke_radius, FT_STROKER_LINECAP_ROUND,
+        FT_STROKER_LINEJOIN_ROUND, 0);
+
+    FT_Glyph glyph;
+    FT_Get_Glyph(mask->face->glyph, &glyph);
+    FT_Glyph_StrokeBorder(&glyph, stroker, 0, 1);
+
+    fterr = FT_Outline_Render(ft_library, &((FT_OutlineGlyph)glyph)->outline, &ftr_params);
+
+    // Tidy up
+    FT_Stroker_Done(stroker);
+    FT_Done_Glyph(glyph);
+  } else {
+    fterr = FT_Outline_Render(ft_library, &mask->face->glyph->outline, &ftr_params);
+  }
+  if (fterr) {
+    fprintf(stderr, "FT_Outline_Render() failed; err=%d\n", fterr);
+    return;
   }
+  mask->is_valid = 1;
+}
 
-  fterr = FT_Set_Char_Size(
-    face,       // FT_Face
-    point * 64, // char_width in 1/64th of points
-    0,          // char_height in 1/64th of points (0 == same as width)
-    dpi,        // horizontal device resolution (dpi)
-    0);         // vertical device resolution (0 == same as horizontal resolution)
+/**
+ * Returns the cached mask for the glyph at the current size of the face.
+ * The glyph is rasterized on a cache miss. The returned mask is valid
+ * only while glyph_cache_mutex is held by the caller.
+ */
+static GlyphMask *glyph_cache_get(FT_Face face, FT_UInt glyph_index,
+    GLYPH_MASK_KIND kind, FT_Fixed stroke_radius) {
+  FT_Fixed x_scale = face->size->metrics.x_scale;
+  FT_Fixed y_scale = face->size->metrics.y_scale;
+  if (kind == GLYPH_MASK_FILL) {
+    stroke_radius = 0;
+  }
+  unsigned int hash = (((uintptr_t)face >> 4) ^ (glyph_index * 2654435761u) ^
+      (x_scale >> 6) ^ (stroke_radius << 1) ^ kind) & (GLYPH_CACHE_BUCKETS - 1);
+
+  GlyphMask *mask;
+  for (mask = glyph_cache[hash]; mask != NULL; mask = mask->next) {
+    if (mask->face == face && mask->glyph_index == glyph_index &&
+        mask->kind == kind && mask->stroke_radius == stroke_radius &&
+        mask->x_scale == x_scale && mask->y_scale == y_scale) {
+      return mask;
+    }
+  }
+
+  // cache miss
+  if (glyph_cache_entries >= GLYPH_CACHE_MAX_ENTRIES) {
+    glyph_cache_flush();
+  }
+  mask = calloc(1, sizeof(GlyphMask));
+  if (mask == NULL) {
+    fprintf(stderr, "cannot allocate memory for GlyphMask: %d bytes\n",
+        sizeof(GlyphMask));
+    exit(EXIT_FAILURE);
+  }
+  mask->face = face;
+  mask->x_scale = x_scale;
+  mask->y_scale = y_scale;
+  mask->glyph_index = glyph_index;
+  mask->kind = kind;
+  mask->stroke_radius = stroke_radius;
+  glyph_mask_render(mask);
+
+  mask->next = glyph_cache[hash];
+  glyph_cache[hash] = mask;
+  glyph_cache_entries++;
+
+  return mask;
+}
+
+/**
+ * Draws the cached glyph into the bitmap of textdata
+ * at (textdata->pen_x, textdata->pen_y).
+ */
+static void glyph_mask_draw(GlyphMask *mask, TextData *textdata) {
+  int i;
+  for (i = 0; i < mask->num_rows; i++) {
+    span_writer_callback(mask->rows[i].y, mask->rows[i].count,
+        mask->spans + mask->rows[i].start, textdata);
+  }
+}
+
+/**
+ * Returns the HarfBuzz buffer of the text object, emptied for shaping.
+ */
+static hb_buffer_t *text_prepare_hb_buffer(TextData *textdata) {
+  hb_buffer_clear_contents(textdata->hb_buffer);
+  hb_buffer_set_direction(textdata->hb_buffer, HB_DIRECTION_LTR);
+  hb_buffer_set_script(textdata->hb_buffer, HB_SCRIPT_COMMON);
+  hb_buffer_set_language(textdata->hb_buffer, hb_language_get_default());
+  return textdata->hb_buffer;
+}
+
+/**
+ * Initialize text library.
+ */
+void text_init() {
+  FT_Error      fterr;
+
+  fterr = FT_Init_FreeType( &ft_library );
   if (fterr) {
-    fprintf(stderr, "error: failed to set font size\n");
-    return -1;
+    fprintf(stderr, "error: freetype initialization failed: %d\n", fterr);
+    return;
   }
 
-  // find available text id
-  int text_id = 0;
+  is_render_thread_stopping = 0;
+  if (pthread_create(&render_thread, NULL, render_loop, NULL) != 0) {
+    perror("pthread_create for render_thread");
+    // texts will be drawn synchronously
+  } else {
+    is_render_thread_started = 1;
+  }
+}
+
+/**
+ * Shutdown text library.
+ */
+void text_teardown() {
   int i;
   for (i = 0; i < max_text_id; i++) {
-    if (textdata_list[i] == NULL) {
-      text_id = i + 1;
-      break;
+    if (textdata_list[i] != NULL)  {
+      text_destroy_real(i+1);
     }
   }
 
-  if (text_id == 0) { // no available slots
-    // expand textdata_list
-    max_text_id++;
-    textdata_list = realloc(textdata_list, sizeof(TextData) * max_text_id);
-    if (textdata_list == NULL) {
-      fprintf(stderr, "cannot allocate memory for textdata_list: %d bytes\n",
-          sizeof(TextData) * max_text_id);
-      exit(EXIT_FAILURE);
-    }
-    text_id = max_text_id;
+  if (is_render_thread_started) {
+    pthread_mutex_lock(&render_queue_mutex);
+    is_render_thread_stopping = 1;
+    pthread_cond_signal(&render_queue_cond);
+    pthread_mutex_unlock(&render_queue_mutex);
+    pthread_join(render_thread, NULL);
+    is_render_thread_started = 0;
   }
+  pthread_mutex_lock(&render_mutex);
+  free_destroyed_textdata();
+  pthread_mutex_unlock(&render_mutex);
+
+  for (i = 0; i < num_retired_textdata_lists; i++) {
+    free(retired_textdata_lists[i]);
+  }
+  num_retired_textdata_lists = 0;
+  free(textdata_list);
+  textdata_list = NULL;
+  textdata_list_capacity = 0;
+  max_text_id = 0;
+
+  pthread_mutex_lock(&glyph_cache_mutex);
+  glyph_cache_flush();
+  pthread_mutex_unlock(&glyph_cache_mutex);
+
+  font_cache_clear();
 
+  FT_Done_FreeType(ft_library);
+}
+
+/**
+ * Allocates a TextData with default values.
+ */
+static TextData *text_new_textdata() {
   TextData *textdata = malloc(sizeof(TextData));
   if (textdata == NULL) {
     fprintf(stderr, "cannot allocate memory for textdata: %d bytes\n",
@@ -222,8 +660,9 @@ int text_create(const char *font_file, long face_index, float point, int dpi) {
     exit(EXIT_FAILURE);
   }
   // initialize values
-  textdata->id = text_id;
+  textdata->id = 0;
   textdata->bitmap = NULL;
+  memset(&textdata->overlay, 0, sizeof(TextOverlay));
   textdata->is_bitmap_ready = 0;
   textdata->has_changed = 0;
   textdata->will_dispose_bitmap = 0;
@@ -236,9 +675,21 @@ int text_create(const char *font_file, long face_index, float point, int dpi) {
   textdata->letter_spacing = 0;
   textdata->blend_mode = BLEND_MODE_NORMAL;
   textdata->text = NULL;
-  textdata->face = face;
+  textdata->face = NULL;
+  textdata->face_entry = NULL;
+  textdata->ft_size = NULL;
+  textdata->font_file = NULL;
+  textdata->face_index = 0;
+  textdata->point = 0.0f;
+  textdata->dpi = 0;
+  textdata->is_image = 0;
   textdata->line_height_multiply = 1.0f;
   textdata->tab_scale = 1.0f;
+  textdata->hb_font = NULL;
+  textdata->hb_buffer = NULL;
+  textdata->atlas = NULL;
+  textdata->pending_render = NULL;
+  textdata->redraw_epoch = 0;
   textdata->layout_mode = LAYOUT_MODE_ABSOLUTE;
   textdata->x = 0;
   textdata->y = 0;
@@ -246,83 +697,345 @@ int text_create(const char *font_file, long face_index, float point, int dpi) {
   textdata->pen_y = 0;
   textdata->in_preview = 1;
   textdata->in_video = 1;
+  memset(&textdata->preview_rect, 0, sizeof(text_rect));
+  textdata->is_preview_dirty = 0;
   textdata->next_textdata = NULL;
-  textdata_list[text_id-1] = textdata;
+  textdata->next_destroyed = NULL;
 
-  return text_id;
+  return textdata;
 }
 
 /**
- * Returns the width of a tab for the FT_Face.
+ * Returns textdata_list and stores the number of text ids in count.
+ * This can be called without a lock. The returned list stays valid
+ * until text_teardown() even if textdata_list is replaced meanwhile.
  */
-int text_get_tab_width(TextData *textdata) {
-  FT_Error error;
+static TextData **load_textdata_list(int *count) {
+  // textdata_list is published before max_text_id
+  *count = __atomic_load_n(&max_text_id, __ATOMIC_ACQUIRE);
+  return __atomic_load_n(&textdata_list, __ATOMIC_ACQUIRE);
+}
 
-  // Get glyph_index of character 'm'
-  FT_UInt glyph_index = FT_Get_Char_Index(textdata->face, (FT_ULong) 'm');
-  if (glyph_index == 0) { // undefined character code
-    fprintf(stderr, "warn: character 'm' not found in the font file; "
-        "using default tab_width (%dpx)\n", DEFAULT_TAB_WIDTH);
-    return DEFAULT_TAB_WIDTH;
-  }
+/**
+ * Assigns an available text id to textdata and puts it into textdata_list.
+ * Texts are created from several threads, so the slot is searched and
+ * filled while holding render_queue_mutex.
+ */
+static int text_add_textdata(TextData *textdata) {
+  int text_id = 0;
+  int i;
 
-  // Load the glyph into slot (textdata->face->glyph)
-  error = FT_Load_Glyph(textdata->face, glyph_index, FT_LOAD_DEFAULT);
-  if (error) {
-    fprintf(stderr, "load glyph error: %d\n", error);
-    fprintf(stderr, "warn: using default tab_width (%dpx)\n", DEFAULT_TAB_WIDTH);
-    return DEFAULT_TAB_WIDTH;
+  pthread_mutex_lock(&render_queue_mutex);
+  // find available text id
+  for (i = 0; i < max_text_id; i++) {
+    if (textdata_list[i] == NULL) {
+      text_id = i + 1;
+      break;
+    }
   }
-  float m_width = textdata->face->glyph->linearHoriAdvance / 65536.0f;
-  m_width *= textdata->tab_scale;
-  int tab_width = roundf(m_width * 4.5f);
-  if (tab_width < 0) {
-    tab_width = 0;
+  if (text_id == 0) { // no available slots
+    if (max_text_id == textdata_list_capacity) {
+      // expand textdata_list
+      int new_capacity = (textdata_list_capacity == 0) ?
+        TEXTDATA_LIST_INITIAL_CAPACITY : textdata_list_capacity * 2;
+      TextData **new_list = calloc(new_capacity, sizeof(TextData *));
+      if (new_list == NULL) {
+        fprintf(stderr, "cannot allocate memory for textdata_list: %d bytes\n",
+            sizeof(TextData *) * new_capacity);
+        exit(EXIT_FAILURE);
+      }
+      if (textdata_list != NULL) {
+        memcpy(new_list, textdata_list, sizeof(TextData *) * max_text_id);
+        retired_textdata_lists[num_retired_textdata_lists++] = textdata_list;
+      }
+      __atomic_store_n(&textdata_list, new_list, __ATOMIC_RELEASE);
+      textdata_list_capacity = new_capacity;
+    }
+    text_id = max_text_id + 1;
   }
-  return tab_width;
+  textdata->id = text_id;
+  __atomic_store_n(&textdata_list[text_id-1], textdata, __ATOMIC_RELEASE);
+  if (text_id > max_text_id) {
+    __atomic_store_n(&max_text_id, text_id, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&render_queue_mutex);
+
+  return text_id;
 }
 
 /**
- * Sets letter spacing.
+ * Creates a new text object and returns the text id.
  */
-int text_set_letter_spacing(int text_id, int pixels) {
-  if (text_id <= 0 || text_id > max_text_id) {
-    return -1; // non-existent text id
+int text_create(const char *font_file, long face_index, float point, int dpi) {
+  if (access(font_file, R_OK) != 0) {
+    fprintf(stderr, "text_create() failed: cannot open the font file: %s\n", font_file);
+    return -1;
   }
-  TextData *textdata = textdata_list[text_id-1];
-  textdata->letter_spacing = pixels;
-  return 0;
-}
 
-/**
- * Sets stroke color.
- */
-int text_set_stroke_color(int text_id, uint32_t color) {
-  if (text_id <= 0 || text_id > max_text_id) {
-    return -1; // non-existent text id
+  TextData *textdata = text_new_textdata();
+  size_t font_file_len = strlen(font_file) + 1;
+  textdata->font_file = malloc(font_file_len);
+  if (textdata->font_file == NULL) {
+    fprintf(stderr, "cannot allocate memory for font file name: %d bytes\n",
+        font_file_len);
+    exit(EXIT_FAILURE);
   }
-  TextData *textdata = textdata_list[text_id-1];
-  textdata->stroke_color = color;
-  return 0;
+  memcpy(textdata->font_file, font_file, font_file_len);
+  textdata->face_index = face_index;
+  textdata->point = point;
+  textdata->dpi = dpi;
+
+  // Open the face through the registry so that an invalid font file
+  // is reported here rather than on the render path. The face is
+  // shared with the other texts which use the same font.
+  pthread_mutex_lock(&render_mutex);
+  if (text_load_face(textdata) != 0) {
+    text_free_textdata(textdata);
+    pthread_mutex_unlock(&render_mutex);
+    fprintf(stderr, "text_create() failed: cannot load the font: %s\n", font_file);
+    return -1;
+  }
+  pthread_mutex_unlock(&render_mutex);
+  return text_add_textdata(textdata);
 }
 
 /**
- * Sets stroke border width in points.
+ * Returns the shared face for the font file and face index, opening
+ * it if no text uses it yet. The caller must hold render_mutex.
+ * Returns NULL if the face cannot be opened.
  */
-int text_set_stroke_width(int text_id, float stroke_width) {
-  if (text_id <= 0 || text_id > max_text_id) {
-    return -1; // non-existent text id
+static FaceEntry *face_registry_acquire(const char *font_file, long face_index) {
+  FT_Error fterr;
+  FT_Face face;
+  FaceEntry *entry;
+
+  for (entry = face_registry; entry != NULL; entry = entry->next) {
+    if (entry->face_index == face_index && strcmp(entry->font_file, font_file) == 0) {
+      entry->ref_count++;
+      return entry;
+    }
   }
-  TextData *textdata = textdata_list[text_id-1];
-  textdata->stroke_width = stroke_width;
-  return 0;
+
+  fterr = FT_New_Face( ft_library, font_file, face_index, &face );
+  if (fterr == FT_Err_Unknown_File_Format) {
+    fprintf(stderr, "text_load_face() failed: font format is unsupported\n");
+    return NULL;
+  } else if (fterr == FT_Err_Cannot_Open_Resource) {
+    fprintf(stderr, "text_load_face() failed: cannot open the font file\n");
+    return NULL;
+  } else if (fterr == FT_Err_Invalid_Argument) {
+    fprintf(stderr, "text_load_face() failed: maybe the font face index is invalid\n");
+    return NULL;
+  } else if (fterr) {
+    fprintf(stderr, "text_load_face() failed: failed to open the font file; error=%d\n", fterr);
+    return NULL;
+  } else if (face == NULL) {
+    fprintf(stderr, "text_load_face() failed: failed to open the font file\n");
+    return NULL;
+  }
+
+  entry = malloc(sizeof(FaceEntry));
+  if (entry == NULL) {
+    fprintf(stderr, "cannot allocate memory for face entry\n");
+    exit(EXIT_FAILURE);
+  }
+  entry->font_file = copy_string(font_file);
+  entry->face_index = face_index;
+  entry->face = face;
+  entry->ref_count = 1;
+  entry->next = face_registry;
+  face_registry = entry;
+  return entry;
 }
 
 /**
- * Sets text fill color.
+ * Releases a face returned by face_registry_acquire(). The face is
+ * closed when no text uses it. The caller must hold render_mutex.
  */
-int text_set_color(int text_id, int color) {
-  if (text_id <= 0 || text_id > max_text_id) {
+static void face_registry_release(FaceEntry *target) {
+  FaceEntry **entry_p = &face_registry;
+
+  if (--target->ref_count > 0) {
+    return;
+  }
+  while (*entry_p != NULL) {
+    if (*entry_p == target) {
+      *entry_p = target->next;
+      break;
+    }
+    entry_p = &(*entry_p)->next;
+  }
+  glyph_cache_remove_face(target->face);
+  FT_Done_Face(target->face);
+  free(target->font_file);
+  free(target);
+}
+
+/**
+ * Opens the font face of the text if it has not been opened yet, and
+ * activates the size of the text in the shared face. This has to be
+ * called before the face is used, while holding render_mutex (or being
+ * the only user of the face).
+ * Returns 0 on success.
+ */
+static int text_load_face(TextData *textdata) {
+  FT_Error fterr;
+  FaceEntry *entry;
+  FT_Size size;
+
+  if (textdata->face != NULL) {
+    FT_Activate_Size(textdata->ft_size);
+    return 0;
+  }
+  if (textdata->is_image || textdata->font_file == NULL) {
+    return -1;
+  }
+  if (ft_library == NULL) {
+    text_init();
+  }
+
+  entry = face_registry_acquire(textdata->font_file, textdata->face_index);
+  if (entry == NULL) {
+    return -1;
+  }
+
+  fterr = FT_New_Size(entry->face, &size);
+  if (fterr) {
+    fprintf(stderr, "error: failed to create font size: %d\n", fterr);
+    face_registry_release(entry);
+    return -1;
+  }
+  FT_Activate_Size(size);
+  fterr = FT_Set_Char_Size(
+    entry->face, // FT_Face
+    textdata->point * 64, // char_width in 1/64th of points
+    0,          // char_height in 1/64th of points (0 == same as width)
+    textdata->dpi, // horizontal device resolution (dpi)
+    0);         // vertical device resolution (0 == same as horizontal resolution)
+  if (fterr) {
+    fprintf(stderr, "error: failed to set font size\n");
+    FT_Done_Size(size);
+    face_registry_release(entry);
+    return -1;
+  }
+
+  // hb-ft reads glyph metrics through the active size of the face
+  textdata->hb_font = hb_ft_font_create(entry->face, NULL);
+  textdata->hb_buffer = hb_buffer_create();
+  textdata->face_entry = entry;
+  textdata->ft_size = size;
+  textdata->face = entry->face;
+  return 0;
+}
+
+/**
+ * Creates a text object which shows an ARGB image instead of glyphs.
+ * argb is taken over and freed by the text library.
+ */
+int text_create_image(uint32_t *argb, int width, int height) {
+  TextData *textdata = text_new_textdata();
+  textdata->is_image = 1;
+  textdata->bitmap = (uint8_t *) argb;
+  textdata->width = width;
+  textdata->height = height;
+  textdata->bounds_left = 0;
+  textdata->bounds_right = width;
+  textdata->bounds_top = 0;
+  textdata->bounds_bottom = height;
+  build_overlay(textdata);
+  // Chroma is built when the image is drawn on the video. No position
+  // has this parity, so the first draw always builds it.
+  textdata->overlay.chroma_parity_x = -1;
+  textdata->overlay.chroma_parity_y = -1;
+
+  return text_add_textdata(textdata);
+}
+
+/**
+ * Starts drawing the image created by text_create_image().
+ */
+int text_show_image(int text_id) {
+  if (text_id <= 0 || text_id > max_text_id) {
+    return -1; // non-existent text id
+  }
+  TextData *textdata = textdata_list[text_id-1];
+  textdata->has_changed = 1;
+  textdata->is_preview_dirty = 1;
+  __atomic_store_n(&textdata->is_bitmap_ready, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/**
+ * Returns the width of a tab for the FT_Face.
+ */
+int text_get_tab_width(TextData *textdata) {
+  FT_Error error;
+
+  // Get glyph_index of character 'm'
+  FT_UInt glyph_index = FT_Get_Char_Index(textdata->face, (FT_ULong) 'm');
+  if (glyph_index == 0) { // undefined character code
+    fprintf(stderr, "warn: character 'm' not found in the font file; "
+        "using default tab_width (%dpx)\n", DEFAULT_TAB_WIDTH);
+    return DEFAULT_TAB_WIDTH;
+  }
+
+  // Load the glyph into slot (textdata->face->glyph)
+  error = FT_Load_Glyph(textdata->face, glyph_index, FT_LOAD_DEFAULT);
+  if (error) {
+    fprintf(stderr, "load glyph error: %d\n", error);
+    fprintf(stderr, "warn: using default tab_width (%dpx)\n", DEFAULT_TAB_WIDTH);
+    return DEFAULT_TAB_WIDTH;
+  }
+  float m_width = textdata->face->glyph->linearHoriAdvance / 65536.0f;
+  m_width *= textdata->tab_scale;
+  int tab_width = roundf(m_width * 4.5f);
+  if (tab_width < 0) {
+    tab_width = 0;
+  }
+  return tab_width;
+}
+
+/**
+ * Sets letter spacing.
+ */
+int text_set_letter_spacing(int text_id, int pixels) {
+  if (text_id <= 0 || text_id > max_text_id) {
+    return -1; // non-existent text id
+  }
+  TextData *textdata = textdata_list[text_id-1];
+  textdata->letter_spacing = pixels;
+  return 0;
+}
+
+/**
+ * Sets stroke color.
+ */
+int text_set_stroke_color(int text_id, uint32_t color) {
+  if (text_id <= 0 || text_id > max_text_id) {
+    return -1; // non-existent text id
+  }
+  TextData *textdata = textdata_list[text_id-1];
+  textdata->stroke_color = color;
+  return 0;
+}
+
+/**
+ * Sets stroke border width in points.
+ */
+int text_set_stroke_width(int text_id, float stroke_width) {
+  if (text_id <= 0 || text_id > max_text_id) {
+    return -1; // non-existent text id
+  }
+  TextData *textdata = textdata_list[text_id-1];
+  textdata->stroke_width = stroke_width;
+  return 0;
+}
+
+/**
+ * Sets text fill color.
+ */
+int text_set_color(int text_id, int color) {
+  if (text_id <= 0 || text_id > max_text_id) {
     return -1; // non-existent text id
   }
   TextData *textdata = textdata_list[text_id-1];
@@ -340,6 +1053,7 @@ int text_set_visibility(int text_id, int in_preview, int in_video) {
   TextData *textdata = textdata_list[text_id-1];
   textdata->in_preview = in_preview;
   textdata->in_video = in_video;
+  textdata->has_changed = 1;
   return 0;
 }
 
@@ -369,6 +1083,16 @@ int text_set_tab_scale(int text_id, float multiply) {
   return 0;
 }
 
+/**
+ * Returns the default line spacing of the active size of the face.
+ * render_mutex must be held by the caller, and the face of textdata
+ * must have been loaded by text_load_face().
+ */
+static float get_line_height(TextData *textdata) {
+  return (textdata->face->size->metrics.height >> 6) +
+    ((textdata->face->size->metrics.height & 0x3f) / 64.0f);
+}
+
 /**
  * Returns the default line spacing in pixels.
  */
@@ -377,9 +1101,14 @@ float text_get_line_height(int text_id) {
     return -1; // non-existent text id
   }
   TextData *textdata = textdata_list[text_id-1];
-
-  return ((textdata->face->size->metrics.height >> 6) +
-      ((textdata->face->size->metrics.height & 0x3f) / 64.0f));
+  float line_height = -1;
+  pthread_mutex_lock(&render_mutex);
+  if (text_load_face(textdata) == 0) {
+    // The size of this text is active until render_mutex is released
+    line_height = get_line_height(textdata);
+  }
+  pthread_mutex_unlock(&render_mutex);
+  return line_height;
 }
 
 /**
@@ -391,9 +1120,15 @@ float text_get_ascender(int text_id) {
     return -1; // non-existent text id
   }
   TextData *textdata = textdata_list[text_id-1];
-
-  return (textdata->face->size->metrics.ascender >> 6) +
-    ((textdata->face->size->metrics.ascender & 0x3f) / 64.0f);
+  float ascender = -1;
+  pthread_mutex_lock(&render_mutex);
+  if (text_load_face(textdata) == 0) {
+    // The size of this text is active until render_mutex is released
+    ascender = (textdata->face->size->metrics.ascender >> 6) +
+      ((textdata->face->size->metrics.ascender & 0x3f) / 64.0f);
+  }
+  pthread_mutex_unlock(&render_mutex);
+  return ascender;
 }
 
 /**
@@ -481,24 +1216,80 @@ int text_set_text(int text_id, const char *utf8_text, const size_t text_bytes) {
 }
 
 /**
- * Actually destroyes the resources used by the text object.
+ * Removes the text object from textdata_list. Its resources are freed
+ * by the render worker, which may still be drawing it.
  */
 static void text_destroy_real(int text_id) {
   if (text_id <= 0 || text_id > max_text_id) {
     return; // non-existent text id
   }
+  pthread_mutex_lock(&render_queue_mutex);
   TextData *textdata = textdata_list[text_id-1];
-  if (textdata->bitmap != NULL) {
-    free(textdata->bitmap);
+  if (textdata == NULL) {
+    pthread_mutex_unlock(&render_queue_mutex);
+    return;
+  }
+  cancel_redraw(textdata);
+  __atomic_store_n(&textdata_list[text_id-1], NULL, __ATOMIC_RELEASE);
+  rect_union(&removed_preview_rect, &textdata->preview_rect);
+  textdata->next_destroyed = destroyed_textdata;
+  destroyed_textdata = textdata;
+  pthread_cond_signal(&render_queue_cond);
+  pthread_mutex_unlock(&render_queue_mutex);
+
+  if (!is_render_thread_started) {
+    // No render worker; texts are drawn by redraw_text_sync()
+    pthread_mutex_lock(&render_mutex);
+    free_destroyed_textdata();
+    pthread_mutex_unlock(&render_mutex);
+  }
+}
+
+/**
+ * Frees the texts removed by text_destroy_real().
+ * render_mutex must be held by the caller.
+ */
+static void free_destroyed_textdata() {
+  pthread_mutex_lock(&render_queue_mutex);
+  TextData *textdata = destroyed_textdata;
+  destroyed_textdata = NULL;
+  pthread_mutex_unlock(&render_queue_mutex);
+
+  while (textdata != NULL) {
+    TextData *next = textdata->next_destroyed;
+    text_free_textdata(textdata);
+    textdata = next;
   }
+}
+
+/**
+ * Frees the resources used by the text object.
+ */
+static void text_free_textdata(TextData *textdata) {
+  // A render which has finished after cancel_redraw() is discarded
+  // since redraw_epoch has changed, but free it just in case.
+  TextData *snapshot = __atomic_exchange_n(&textdata->next_textdata,
+      NULL, __ATOMIC_ACQ_REL);
+  if (snapshot != NULL) {
+    free_snapshot(snapshot);
+  }
+  text_free_bitmap(textdata);
   if (textdata->text != NULL) {
     free(textdata->text);
   }
+  text_free_atlas(textdata);
+  if (textdata->hb_buffer != NULL) {
+    hb_buffer_destroy(textdata->hb_buffer);
+  }
+  if (textdata->hb_font != NULL) {
+    hb_font_destroy(textdata->hb_font);
+  }
   if (textdata->face != NULL) {
-    FT_Done_Face(textdata->face);
+    FT_Done_Size(textdata->ft_size);
+    face_registry_release(textdata->face_entry);
   }
+  free(textdata->font_file);
   free(textdata);
-  textdata_list[text_id-1] = NULL;
 }
 
 /**
@@ -516,35 +1307,11 @@ int text_destroy(int text_id) {
   return 0;
 }
 
-// callback function for measuring the bounding box for the text.
-static void span_sizer_callback(int y, int count, const FT_Span* spans, void *user) {
-  span_sizer_data *sizer_data = (span_sizer_data *) user;
-
-  if (y < sizer_data->min_y) {
-    sizer_data->min_y = y;
-  }
-  if (y > sizer_data->max_y) {
-    sizer_data->max_y = y;
-  }
-  int i;
-  for (i = 0 ; i < count; i++) {
-    if (spans[i].x + spans[i].len > sizer_data->max_span_x) {
-      sizer_data->max_span_x = spans[i].x + spans[i].len;
-    }
-    if (spans[i].x < sizer_data->min_span_x) {
-      sizer_data->min_span_x = spans[i].x;
-    }
-  }
-}
-
 /**
  * Calculates a bounding box for the text object.
+ * render_mutex must be held by the caller.
  */
-int text_get_bounds(int text_id, const char *text, size_t text_len, text_bounds *bounds) {
-  if (text_id <= 0 || text_id > max_text_id) {
-    return -1; // non-existent text id
-  }
-
+static int get_text_bounds(TextData *textdata, const char *text, size_t text_len, text_bounds *bounds) {
   if (text_len == 0) {
     bounds->left = 0;
     bounds->right = 0;
@@ -555,33 +1322,15 @@ int text_get_bounds(int text_id, const char *text, size_t text_len, text_bounds
     return 0;
   }
 
-  TextData *textdata = textdata_list[text_id-1];
-
-  hb_font_t *hb_ft_font = hb_ft_font_create(textdata->face, NULL);
-  hb_buffer_t *buf = hb_buffer_create();
-  hb_buffer_set_direction(buf, HB_DIRECTION_LTR);
-  hb_buffer_set_script(buf, HB_SCRIPT_COMMON);
-  hb_buffer_set_language(buf, hb_language_get_default());
-
+  hb_buffer_t *buf = text_prepare_hb_buffer(textdata);
   hb_buffer_add_utf8(buf, text, text_len, 0, text_len);
-  hb_shape(hb_ft_font, buf, NULL, 0);
+  hb_shape(textdata->hb_font, buf, NULL, 0);
 
   unsigned int glyph_count;
   hb_glyph_info_t *glyph_info = hb_buffer_get_glyph_infos(buf, &glyph_count);
   hb_glyph_position_t *glyph_pos = hb_buffer_get_glyph_positions(buf, &glyph_count);
 
-  FT_Error fterr;
-  span_sizer_data sizer_data;
-
-  FT_Raster_Params ftr_params;
-  memset(&ftr_params, 0, sizeof(ftr_params));
-  ftr_params.target = 0; // we use callback instead of this
-  ftr_params.flags = FT_RASTER_FLAG_DIRECT | FT_RASTER_FLAG_AA; // antialiasing with callback
-  ftr_params.user = &sizer_data; // user data
-  ftr_params.black_spans = 0; // unused
-  ftr_params.bit_set = 0; // unused
-  ftr_params.bit_test = 0; // unused
-  ftr_params.gray_spans = span_sizer_callback; // callback func
+  FT_Fixed stroke_radius = textdata->stroke_width * 64;
 
   int max_x = INT_MIN;
   int min_x = INT_MAX;
@@ -606,70 +1355,43 @@ int text_get_bounds(int text_id, const char *text, size_t text_len, text_bounds
       continue;
     }
 
-    fterr = FT_Load_Glyph(textdata->face, glyph_info[j].codepoint, ft_load_flags);
-    if (fterr) {
-      fprintf(stderr, "failed to load %08x (freetype error code=%d)\n",  glyph_info[j].codepoint, fterr);
-    } else {
-      if (textdata->face->glyph->format != FT_GLYPH_FORMAT_OUTLINE) {
-        fprintf(stderr, "unsupported glyph format: %4s\n", (char *)&textdata->face->glyph->format);
-      } else {
-        float gx = total_advance_x + (glyph_pos[j].x_offset / 64.0f);
-        float gy = total_advance_y + (glyph_pos[j].y_offset / 64.0f);
-
-        sizer_data.min_span_x = INT_MAX;
-        sizer_data.max_span_x = INT_MIN;
-        sizer_data.min_y = INT_MAX;
-        sizer_data.max_y = INT_MIN;
-
-        FT_Stroker stroker;
-        FT_Stroker_New(ft_library, &stroker);
-        FT_Fixed radius = textdata->stroke_width * 64;
-        FT_Stroker_Set(stroker, radius, FT_STROKER_LINECAP_ROUND,
-            FT_STROKER_LINEJOIN_ROUND, 0);
-
-        FT_Glyph glyph;
-        FT_Get_Glyph(textdata->face->glyph, &glyph);
-        FT_Glyph_StrokeBorder(&glyph, stroker, 0, 1);
-
-        fterr = FT_Outline_Render(ft_library,
-            &((FT_OutlineGlyph)glyph)->outline, &ftr_params);
-        if (fterr) {
-          fprintf(stderr, "FT_Outline_Render() failed; err=%d\n", fterr);
+    // Bounds are measured with the stroked outline
+    pthread_mutex_lock(&glyph_cache_mutex);
+    GlyphMask *mask = glyph_cache_get(textdata->face, glyph_info[j].codepoint,
+        GLYPH_MASK_STROKE, stroke_radius);
+    if (mask->is_valid) {
+      float gx = total_advance_x + (glyph_pos[j].x_offset / 64.0f);
+      float gy = total_advance_y + (glyph_pos[j].y_offset / 64.0f);
+
+      if (mask->min_span_x != INT_MAX) {
+        if (min_x > mask->min_span_x + (int)gx) {
+          min_x = mask->min_span_x + (int)gx;
         }
-
-        // Tidy up
-        FT_Stroker_Done(stroker);
-        FT_Done_Glyph(glyph);
-
-        if (sizer_data.min_span_x != INT_MAX) {
-          if (min_x > sizer_data.min_span_x + (int)gx) {
-            min_x = sizer_data.min_span_x + (int)gx;
-          }
-          if (max_x < sizer_data.max_span_x + ceil(gx)) {
-            max_x = sizer_data.max_span_x + ceil(gx);
-          }
-          if (min_y > sizer_data.min_y + (int)gy) {
-            min_y = sizer_data.min_y + (int)gy;
-          }
-          if (max_y < sizer_data.max_y + ceil(gy)) {
-            max_y = sizer_data.max_y + ceil(gy);
-          }
-        } else { // empty glyph
-          if (min_x > gx) {
-            min_x = (int)gx;
-          }
-          if (max_x < gx) {
-            max_x = ceil(gx);
-          }
-          if (min_y > gy) {
-            min_y = (int)gy;
-          }
-          if (max_y < gy) {
-            max_y = ceil(gy);
-          }
+        if (max_x < mask->max_span_x + ceil(gx)) {
+          max_x = mask->max_span_x + ceil(gx);
+        }
+        if (min_y > mask->min_y + (int)gy) {
+          min_y = mask->min_y + (int)gy;
+        }
+        if (max_y < mask->max_y + ceil(gy)) {
+          max_y = mask->max_y + ceil(gy);
+        }
+      } else { // empty glyph
+        if (min_x > gx) {
+          min_x = (int)gx;
+        }
+        if (max_x < gx) {
+          max_x = ceil(gx);
+        }
+        if (min_y > gy) {
+          min_y = (int)gy;
+        }
+        if (max_y < gy) {
+          max_y = ceil(gy);
         }
       }
     }
+    pthread_mutex_unlock(&glyph_cache_mutex);
 
     total_advance_x += glyph_pos[j].x_advance / 64.0f;
     total_advance_y += glyph_pos[j].y_advance / 64.0f;
@@ -699,9 +1421,6 @@ int text_get_bounds(int text_id, const char *text, size_t text_len, text_bounds
   int top = - max_y;
   int bottom = - max_y + bbox_h;
 
-  hb_buffer_destroy(buf);
-  hb_font_destroy(hb_ft_font);
-
   bounds->left = left;
   bounds->right = right;
   bounds->top = top;
@@ -716,6 +1435,22 @@ int text_get_bounds(int text_id, const char *text, size_t text_len, text_bounds
   return 0;
 }
 
+/**
+ * Calculates a bounding box for the text object.
+ */
+int text_get_bounds(int text_id, const char *text, size_t text_len, text_bounds *bounds) {
+  if (text_id <= 0 || text_id > max_text_id) {
+    return -1; // non-existent text id
+  }
+  pthread_mutex_lock(&render_mutex);
+  int ret = text_load_face(textdata_list[text_id-1]);
+  if (ret == 0) {
+    ret = get_text_bounds(textdata_list[text_id-1], text, text_len, bounds);
+  }
+  pthread_mutex_unlock(&render_mutex);
+  return ret;
+}
+
 // NOTE: PI is little-endian so the actual color order in memory is as below
 typedef union {
   uint32_t x;
@@ -791,70 +1526,409 @@ void span_writer_callback(int y, int count, const FT_Span* spans, void *user) {
   }
 }
 
+// x / 255 with rounding, exact for 0 <= x <= 255 * 255
+static inline int div255(int x) {
+  return (x + 128 + ((x + 128) >> 8)) >> 8;
+}
+
 /**
- * Draws glyphs to internal bitmap.
+ * Converts the ARGB bitmap into runs of non-transparent pixels along with
+ * premultiplied Y so that text_draw_all() neither converts colors nor
+ * visits transparent pixels for each frame. The bitmap is kept.
  */
-static int draw_glyphs(TextData *textdata) {
-  // count \n in the string
-  int *line_start_pos = malloc(sizeof(int));
-  if (line_start_pos == NULL) {
-    fprintf(stderr, "cannot allocate memory for line_start_pos: %d bytes\n",
-        sizeof(int));
-    exit(EXIT_FAILURE);
-  }
-  line_start_pos[0] = 0; // stores the starting positions of each line
-  int lines = 1;
-  int i;
-  int contains_tab = 0;
-  for (i = 0; i < textdata->text_len; i++) {
-    if (textdata->text[i] == '\n') {
-      if (i < textdata->text_len) {
-        int *more_line_start_pos = realloc(line_start_pos, sizeof(int) * (lines + 1));
-        if (more_line_start_pos == NULL) {
-          free(line_start_pos);
-          fprintf(stderr, "cannot allocate memory for line_start_pos: %d bytes\n",
-              sizeof(int) * (lines + 1));
-          exit(EXIT_FAILURE);
+static void convert_bitmap_to_overlay(TextData *textdata) {
+  TextOverlay *overlay = &textdata->overlay;
+  uint32_t *pixels = (uint32_t *) textdata->bitmap;
+  int num_runs = 0;
+  int num_pixels = 0;
+  int row, col;
+
+  memset(overlay, 0, sizeof(TextOverlay));
+
+  // Count runs and pixels
+  for (row = 0; row < textdata->height; row++) {
+    uint32_t *line = pixels + row * textdata->width;
+    for (col = 0; col < textdata->width; col++) {
+      if (line[col] >> 24) {
+        if (col == 0 || (line[col-1] >> 24) == 0) {
+          num_runs++;
         }
-        line_start_pos = more_line_start_pos;
-        line_start_pos[lines] = i + 1;
+        num_pixels++;
       }
-      lines++;
-    } else if (textdata->text[i] == '\t') {
-      if (!contains_tab) {
-        contains_tab = 1;
+    }
+  }
+
+  if (num_runs > 0) {
+    overlay->runs = malloc(sizeof(TextRun) * num_runs);
+    overlay->argb = malloc(sizeof(uint32_t) * num_pixels);
+    overlay->y = malloc(num_pixels);
+    overlay->alpha = malloc(num_pixels);
+    if (overlay->runs == NULL || overlay->argb == NULL ||
+        overlay->y == NULL || overlay->alpha == NULL) {
+      fprintf(stderr, "cannot allocate memory for text overlay: %d pixels\n",
+          num_pixels);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  int offset = 0;
+  TextRun *run = NULL;
+  for (row = 0; row < textdata->height; row++) {
+    uint32_t *line = pixels + row * textdata->width;
+    for (col = 0; col < textdata->width; col++) {
+      color_argb_t color;
+      color.x = line[col];
+      if (color.c.a == 0) {
+        run = NULL;
+        continue;
+      }
+      if (run == NULL) {
+        run = &overlay->runs[overlay->num_runs++];
+        run->row = row;
+        run->col = col;
+        run->len = 0;
+        run->offset = offset;
       }
+      uint8_t y = ( (  66 * color.c.r + 129 * color.c.g +  25 * color.c.b + 128) >> 8) + 16;
+      overlay->argb[offset] = color.x;
+      overlay->y[offset] = div255(y * color.c.a);
+      overlay->alpha[offset] = color.c.a;
+      run->len++;
+      offset++;
     }
+    run = NULL; // runs do not span rows
   }
+}
 
-  int tab_width;
-  if (contains_tab) {
-    // Calculate tab width
-    tab_width = text_get_tab_width(textdata);
-  } else {
-    tab_width = 0; // We will not use this variable
+/**
+ * Same as convert_bitmap_to_overlay() but the bitmap is released.
+ */
+static void build_overlay(TextData *textdata) {
+  convert_bitmap_to_overlay(textdata);
+  free(textdata->bitmap);
+  textdata->bitmap = NULL;
+}
+
+/**
+ * Computes 2x2 subsampled chroma runs for the text placed at
+ * a canvas position whose parity is (parity_x, parity_y).
+ */
+static void build_chroma_overlay(TextData *textdata, int parity_x, int parity_y) {
+  TextOverlay *overlay = &textdata->overlay;
+  text_free_chroma_overlay(overlay);
+  overlay->chroma_parity_x = parity_x;
+  overlay->chroma_parity_y = parity_y;
+  if (overlay->num_runs == 0) {
+    return;
   }
 
-  // calculate the maximum width among all lines
-  int max_width = 0;
-  int max_height = 0;
-  text_bounds *text_bounds_list = NULL;
-  text_bounds_list = calloc(1, sizeof(text_bounds) * lines);
-  if (text_bounds_list == NULL) {
-    fprintf(stderr, "cannot allocate memory for text_bounds_list: %d bytes\n",
-        sizeof(text_bounds) * lines);
+  // Accumulate alpha and premultiplied U/V for each block
+  int chroma_width = (textdata->width + parity_x + 1) / 2;
+  int chroma_height = (textdata->height + parity_y + 1) / 2;
+  int num_blocks = chroma_width * chroma_height;
+  int *sums = calloc(num_blocks * 3, sizeof(int));
+  if (sums == NULL) {
+    fprintf(stderr, "cannot allocate memory for chroma sums: %d bytes\n",
+        num_blocks * 3 * sizeof(int));
     exit(EXIT_FAILURE);
   }
-  int min_left = 0;
-  for (i = 0; i < lines; i++) {
-    size_t len;
-    if (i + 1 == lines) {
-      len = textdata->text_len - line_start_pos[i];
+  int *alpha_sums = sums;
+  int *u_sums = sums + num_blocks;
+  int *v_sums = sums + num_blocks * 2;
+  int i, j;
+  for (i = 0; i < overlay->num_runs; i++) {
+    TextRun *run = &overlay->runs[i];
+    int block_row = ((run->row + parity_y) / 2) * chroma_width;
+    for (j = 0; j < run->len; j++) {
+      int block = block_row + (run->col + j + parity_x) / 2;
+      color_argb_t color;
+      color.x = overlay->argb[run->offset + j];
+      int u = ( ( -38 * color.c.r -  74 * color.c.g + 112 * color.c.b + 128) >> 8) + 128;
+      int v = ( ( 112 * color.c.r -  94 * color.c.g -  18 * color.c.b + 128) >> 8) + 128;
+      alpha_sums[block] += color.c.a;
+      u_sums[block] += u * color.c.a;
+      v_sums[block] += v * color.c.a;
+    }
+  }
+
+  // Count runs and blocks
+  int num_runs = 0;
+  int num_covered = 0;
+  for (i = 0; i < num_blocks; i++) {
+    if (alpha_sums[i] > 0) {
+      if (i % chroma_width == 0 || alpha_sums[i-1] == 0) {
+        num_runs++;
+      }
+      num_covered++;
+    }
+  }
+  overlay->chroma_runs = malloc(sizeof(TextRun) * num_runs);
+  overlay->u = malloc(num_covered);
+  overlay->v = malloc(num_covered);
+  overlay->chroma_alpha = malloc(num_covered);
+  if (overlay->chroma_runs == NULL || overlay->u == NULL ||
+      overlay->v == NULL || overlay->chroma_alpha == NULL) {
+    fprintf(stderr, "cannot allocate memory for chroma overlay: %d blocks\n",
+        num_covered);
+    exit(EXIT_FAILURE);
+  }
+
+  int offset = 0;
+  TextRun *run = NULL;
+  for (i = 0; i < num_blocks; i++) {
+    if (i % chroma_width == 0 || alpha_sums[i] == 0) {
+      run = NULL;
+    }
+    if (alpha_sums[i] == 0) {
+      continue;
+    }
+    if (run == NULL) {
+      run = &overlay->chroma_runs[overlay->num_chroma_runs++];
+      run->row = i / chroma_width;
+      run->col = i % chroma_width;
+      run->len = 0;
+      run->offset = offset;
+    }
+    overlay->chroma_alpha[offset] = (alpha_sums[i] + 2) / 4;
+    overlay->u[offset] = (u_sums[i] + 510) / 1020;
+    overlay->v[offset] = (v_sums[i] + 510) / 1020;
+    run->len++;
+    offset++;
+  }
+
+  free(sums);
+}
+
+/**
+ * Clips a run placed at (pen_x, pen_y) to the clip rectangle. Returns the
+ * number of pixels to draw, and sets the canvas position and the index of
+ * the first pixel in the packed arrays.
+ */
+static inline int clip_run(const TextRun *run, int pen_x, int pen_y,
+    const text_rect *clip, int *x, int *y, int *offset) {
+  *y = pen_y + run->row;
+  if (*y < clip->y || *y >= clip->y + clip->height) {
+    return 0;
+  }
+  int start = pen_x + run->col;
+  int end = start + run->len;
+  *offset = run->offset;
+  if (start < clip->x) {
+    *offset += clip->x - start;
+    start = clip->x;
+  }
+  if (end > clip->x + clip->width) {
+    end = clip->x + clip->width;
+  }
+  *x = start;
+  return end - start;
+}
+
+/**
+ * Blends a row of premultiplied samples into a plane of a video frame:
+ * dst = dst * (255 - alpha) / 255 + src
+ */
+static inline void blend_row(uint8_t *dst, const uint8_t *src, const uint8_t *alpha, int len) {
+  int i = 0;
+#ifdef __ARM_NEON__
+  for (; i + 8 <= len; i += 8) {
+    uint8x8_t inv_alpha = vmvn_u8(vld1_u8(alpha + i)); // 255 - alpha
+    uint16x8_t product = vmull_u8(vld1_u8(dst + i), inv_alpha);
+    uint8x8_t scaled = vraddhn_u16(product, vrshrq_n_u16(product, 8)); // div255
+    vst1_u8(dst + i, vqadd_u8(scaled, vld1_u8(src + i)));
+  }
+#endif
+  for (; i < len; i++) {
+    int value = div255(dst[i] * (255 - alpha[i])) + src[i];
+    dst[i] = (value > 255) ? 255 : value;
+  }
+}
+
+/**
+ * Returns a copy of the text object to be rendered.
+ * The copy has its own text so that text_set_text() can be called
+ * while the copy is being rendered.
+ */
+static TextData *snapshot_textdata(TextData *textdata) {
+  TextData *snapshot = malloc(sizeof(TextData));
+  if (snapshot == NULL) {
+    fprintf(stderr, "cannot allocate memory for textdata: %d bytes\n",
+        sizeof(TextData));
+    exit(EXIT_FAILURE);
+  }
+  snapshot->text = NULL;
+  return snapshot_textdata_into(snapshot, textdata);
+}
+
+/**
+ * Same as snapshot_textdata() but reuses a snapshot which has been
+ * applied. Its text buffer is reused if the length is the same.
+ */
+static TextData *snapshot_textdata_into(TextData *snapshot, TextData *textdata) {
+  char *text = snapshot->text;
+  int text_len = (text != NULL) ? snapshot->text_len : 0;
+  memcpy(snapshot, textdata, sizeof(TextData));
+  snapshot->bitmap = NULL;
+  memset(&snapshot->overlay, 0, sizeof(TextOverlay));
+  snapshot->next_textdata = NULL;
+  snapshot->pending_render = NULL;
+  snapshot->text = NULL;
+  if (textdata->text != NULL) {
+    if (text != NULL && text_len == textdata->text_len) {
+      snapshot->text = text;
+      text = NULL;
+    } else {
+      snapshot->text = malloc(textdata->text_len);
+    }
+    if (snapshot->text == NULL) {
+      fprintf(stderr, "cannot allocate memory for snapshot text: %d bytes\n",
+          textdata->text_len);
+      exit(EXIT_FAILURE);
+    }
+    memcpy(snapshot->text, textdata->text, textdata->text_len);
+  }
+  free(text);
+  return snapshot;
+}
+
+static void free_snapshot(TextData *snapshot) {
+  text_free_bitmap(snapshot);
+  free(snapshot->text);
+  free(snapshot);
+}
+
+/**
+ * Converts the bitmap drawn into snapshot into overlay runs.
+ */
+static void prepare_snapshot_overlay(TextData *snapshot) {
+  build_overlay(snapshot);
+  // The position is known in advance unless the layout depends on the size
+  if (snapshot->layout_mode == LAYOUT_MODE_ABSOLUTE) {
+    build_chroma_overlay(snapshot, snapshot->x & 1, snapshot->y & 1);
+  } else {
+    build_chroma_overlay(snapshot, 0, 0);
+  }
+}
+
+/**
+ * Makes the rendered snapshot visible on the next text_draw_all().
+ * The snapshot is taken over by this function.
+ */
+static void publish_textdata(TextData *textdata, TextData *snapshot) {
+  TextData *old_snapshot = __atomic_exchange_n(&textdata->next_textdata,
+      snapshot, __ATOMIC_ACQ_REL);
+  if (old_snapshot != NULL) {
+    // the previous one has not been drawn yet
+    free_snapshot(old_snapshot);
+  }
+}
+
+/**
+ * Replaces the drawn bitmap of textdata with the one in snapshot.
+ * The snapshot is freed, or kept for the next redraw_text_from_atlas().
+ */
+static void apply_textdata(TextData *textdata, TextData *snapshot) {
+  text_free_bitmap(textdata);
+  textdata->overlay = snapshot->overlay;
+  memset(&snapshot->overlay, 0, sizeof(TextOverlay));
+  textdata->bounds_top = snapshot->bounds_top;
+  textdata->bounds_left = snapshot->bounds_left;
+  textdata->bounds_right = snapshot->bounds_right;
+  textdata->bounds_bottom = snapshot->bounds_bottom;
+  textdata->width = snapshot->width;
+  textdata->height = snapshot->height;
+  textdata->is_bitmap_ready = 1;
+  textdata->has_changed = 1;
+  textdata->is_preview_dirty = 1;
+  if (textdata->atlas != NULL && textdata->atlas->spare_snapshot == NULL) {
+    textdata->atlas->spare_snapshot = snapshot;
+  } else {
+    free_snapshot(snapshot);
+  }
+}
+
+/**
+ * Removes the redraw that has been requested but not drawn yet.
+ * render_queue_mutex must be held by the caller.
+ */
+static void cancel_redraw(TextData *textdata) {
+  textdata->redraw_epoch++;
+  if (textdata->pending_render != NULL) {
+    free_snapshot(textdata->pending_render);
+    textdata->pending_render = NULL;
+  }
+  TextData *snapshot = __atomic_exchange_n(&textdata->next_textdata,
+      NULL, __ATOMIC_ACQ_REL);
+  if (snapshot != NULL) {
+    free_snapshot(snapshot);
+  }
+}
+
+/**
+ * Draws glyphs into the bitmap of snapshot.
+ * render_mutex must be held by the caller.
+ */
+static int draw_glyphs(TextData *textdata) {
+  // count \n in the string
+  int *line_start_pos = malloc(sizeof(int));
+  if (line_start_pos == NULL) {
+    fprintf(stderr, "cannot allocate memory for line_start_pos: %d bytes\n",
+        sizeof(int));
+    exit(EXIT_FAILURE);
+  }
+  line_start_pos[0] = 0; // stores the starting positions of each line
+  int lines = 1;
+  int i;
+  int contains_tab = 0;
+  for (i = 0; i < textdata->text_len; i++) {
+    if (textdata->text[i] == '\n') {
+      if (i < textdata->text_len) {
+        int *more_line_start_pos = realloc(line_start_pos, sizeof(int) * (lines + 1));
+        if (more_line_start_pos == NULL) {
+          free(line_start_pos);
+          fprintf(stderr, "cannot allocate memory for line_start_pos: %d bytes\n",
+              sizeof(int) * (lines + 1));
+          exit(EXIT_FAILURE);
+        }
+        line_start_pos = more_line_start_pos;
+        line_start_pos[lines] = i + 1;
+      }
+      lines++;
+    } else if (textdata->text[i] == '\t') {
+      if (!contains_tab) {
+        contains_tab = 1;
+      }
+    }
+  }
+
+  int tab_width;
+  if (contains_tab) {
+    // Calculate tab width
+    tab_width = text_get_tab_width(textdata);
+  } else {
+    tab_width = 0; // We will not use this variable
+  }
+
+  // calculate the maximum width among all lines
+  int max_width = 0;
+  int max_height = 0;
+  text_bounds *text_bounds_list = NULL;
+  text_bounds_list = calloc(1, sizeof(text_bounds) * lines);
+  if (text_bounds_list == NULL) {
+    fprintf(stderr, "cannot allocate memory for text_bounds_list: %d bytes\n",
+        sizeof(text_bounds) * lines);
+    exit(EXIT_FAILURE);
+  }
+  int min_left = 0;
+  for (i = 0; i < lines; i++) {
+    size_t len;
+    if (i + 1 == lines) {
+      len = textdata->text_len - line_start_pos[i];
     } else {
       len = line_start_pos[i+1] - line_start_pos[i] - 1;
     }
     if (len > 0) {
-      text_get_bounds(textdata->id,
+      get_text_bounds(textdata,
           textdata->text + line_start_pos[i], len, &text_bounds_list[i]);
       if (text_bounds_list[i].width > max_width) {
         max_width = text_bounds_list[i].width;
@@ -871,7 +1945,7 @@ static int draw_glyphs(TextData *textdata) {
   }
 
   // adjust line height when the stroke width is large
-  float line_height = text_get_line_height(textdata->id);
+  float line_height = get_line_height(textdata);
   if (max_height > line_height) {
     line_height = max_height;
   }
@@ -883,14 +1957,7 @@ static int draw_glyphs(TextData *textdata) {
     max_width = 0;
   }
 
-  TextData *tmp_textdata = malloc(sizeof(TextData));
-  if (tmp_textdata == NULL) {
-    fprintf(stderr, "cannot allocate memory for textdata: %d bytes\n",
-        sizeof(TextData));
-    exit(EXIT_FAILURE);
-  }
-  memcpy(tmp_textdata, textdata, sizeof(TextData));
-
+  TextData *tmp_textdata = textdata;
   tmp_textdata->width = max_width;
   tmp_textdata->height = ceil(box_height);
   tmp_textdata->bitmap = calloc(1, tmp_textdata->width * tmp_textdata->height * BYTES_PER_PIXEL);
@@ -900,16 +1967,13 @@ static int draw_glyphs(TextData *textdata) {
     exit(EXIT_FAILURE);
   }
 
-  hb_font_t *hb_ft_font = hb_ft_font_create(tmp_textdata->face, NULL);
-  hb_buffer_t *buf = hb_buffer_create();
+  FT_Fixed stroke_radius = tmp_textdata->stroke_width * 64;
 
   // draw text line by line
   float start_x = 0;
   float start_y = 0;
   for (i = 0; i < lines; i++) {
-    hb_buffer_set_direction(buf, HB_DIRECTION_LTR);
-    hb_buffer_set_script(buf, HB_SCRIPT_COMMON);
-    hb_buffer_set_language(buf, hb_language_get_default());
+    hb_buffer_t *buf = text_prepare_hb_buffer(textdata);
 
     tmp_textdata->bounds_left = text_bounds_list[i].left;
     tmp_textdata->bounds_right = text_bounds_list[i].right;
@@ -936,26 +2000,17 @@ static int draw_glyphs(TextData *textdata) {
       len = line_start_pos[i+1] - line_start_pos[i] - 1;
     }
 
-    FT_Error fterr;
     hb_buffer_add_utf8(buf, tmp_textdata->text + line_start_pos[i], len, 0, len);
-    hb_shape(hb_ft_font, buf, NULL, 0);
+    hb_shape(textdata->hb_font, buf, NULL, 0);
 
     unsigned int glyph_count;
     hb_glyph_info_t *glyph_info = hb_buffer_get_glyph_infos(buf, &glyph_count);
     hb_glyph_position_t *glyph_pos = hb_buffer_get_glyph_positions(buf, &glyph_count);
 
-    FT_Raster_Params ftr_params;
-    memset(&ftr_params, 0, sizeof(ftr_params));
-    ftr_params.target = 0; // we use callback instead of this
-    ftr_params.flags = FT_RASTER_FLAG_DIRECT | FT_RASTER_FLAG_AA; // antialiasing with callback
-    ftr_params.user = tmp_textdata; // user data
-    ftr_params.black_spans = 0; // unused
-    ftr_params.bit_set = 0; // unused
-    ftr_params.bit_test = 0; // unused
-    ftr_params.gray_spans = span_writer_callback; // callback func
-
     x += 0 - min_left; // XXX: OK?
 
+    // Glyphs are blitted from the cache; only unseen glyphs are rasterized
+    pthread_mutex_lock(&glyph_cache_mutex);
     int j;
     for (j = 0; j < glyph_count; j++) {
       // glyph_info.cluster indicates the index of the character in the input text
@@ -968,77 +2023,32 @@ static int draw_glyphs(TextData *textdata) {
         }
         continue;
       }
-      fterr = FT_Load_Glyph(tmp_textdata->face, glyph_info[j].codepoint, ft_load_flags);
-      if (fterr) {
-        fprintf(stderr, "failed to load %08x (freetype error code=%d)\n",  glyph_info[j].codepoint, fterr);
-      } else {
-        if (tmp_textdata->face->glyph->format != FT_GLYPH_FORMAT_OUTLINE) {
-          fprintf(stderr, "unsupported glyph format: %4s\n", (char *)&tmp_textdata->face->glyph->format);
-        } else {
-          int gx = x + (glyph_pos[j].x_offset/64);
-          int gy = y - (glyph_pos[j].y_offset/64);
-          tmp_textdata->pen_x = gx;
-          tmp_textdata->pen_y = gy;
-
-          if (tmp_textdata->stroke_width > 0.0f) {
-            FT_Stroker stroker;
-            FT_Stroker_New(ft_library, &stroker);
-            FT_Fixed radius = tmp_textdata->stroke_width * 64;
-            FT_Stroker_Set(stroker, radius, FT_STROKER_LINECAP_ROUND,
-                FT_STROKER_LINEJOIN_ROUND, 0);
-
-            FT_Glyph glyph;
-            FT_Get_Glyph(tmp_textdata->face->glyph, &glyph);
-            FT_Glyph_StrokeBorder(&glyph, stroker, 0, 1);
-
-            tmp_textdata->is_stroke = 1;
-            fterr = FT_Outline_Render(ft_library, &((FT_OutlineGlyph)glyph)->outline, &ftr_params);
-            if (fterr) {
-              fprintf(stderr, "FT_Outline_Render() failed; err=%d\n", fterr);
-            }
-
-            // Tidy up
-            FT_Stroker_Done(stroker);
-            FT_Done_Glyph(glyph);
-          }
-
-          tmp_textdata->is_stroke = 0;
-          fterr = FT_Outline_Render(ft_library, &tmp_textdata->face->glyph->outline, &ftr_params);
-          if (fterr) {
-            fprintf(stderr, "FT_Outline_Render() failed; err=%d\n", fterr);
-          }
+      tmp_textdata->pen_x = x + (glyph_pos[j].x_offset/64);
+      tmp_textdata->pen_y = y - (glyph_pos[j].y_offset/64);
+
+      GlyphMask *mask;
+      if (tmp_textdata->stroke_width > 0.0f) {
+        mask = glyph_cache_get(tmp_textdata->face, glyph_info[j].codepoint,
+            GLYPH_MASK_STROKE, stroke_radius);
+        if (mask->is_valid) {
+          tmp_textdata->is_stroke = 1;
+          glyph_mask_draw(mask, tmp_textdata);
         }
       }
 
+      mask = glyph_cache_get(tmp_textdata->face, glyph_info[j].codepoint,
+          GLYPH_MASK_FILL, 0);
+      if (mask->is_valid) {
+        tmp_textdata->is_stroke = 0;
+        glyph_mask_draw(mask, tmp_textdata);
+      }
+
       x += glyph_pos[j].x_advance/64 + tmp_textdata->letter_spacing;
       y -= glyph_pos[j].y_advance/64;
     }
-
-    hb_buffer_clear_contents(buf);
+    pthread_mutex_unlock(&glyph_cache_mutex);
   }
 
-  if (textdata->is_bitmap_ready) {
-    // queue next textdata
-    tmp_textdata->is_bitmap_ready = 1;
-    tmp_textdata->has_changed = 1;
-    textdata->next_textdata = tmp_textdata;
-  } else {
-    // use existing textdata
-    textdata->bitmap = tmp_textdata->bitmap;
-    textdata->bounds_top = tmp_textdata->bounds_top;
-    textdata->bounds_left = tmp_textdata->bounds_left;
-    textdata->bounds_right = tmp_textdata->bounds_right;
-    textdata->bounds_bottom = tmp_textdata->bounds_bottom;
-    textdata->width = tmp_textdata->width;
-    textdata->height = tmp_textdata->height;
-    textdata->is_bitmap_ready = 1;
-    textdata->has_changed = 1;
-    free(tmp_textdata);
-  }
-
-  hb_buffer_destroy(buf);
-  hb_font_destroy(hb_ft_font);
-
   free(line_start_pos);
   if (text_bounds_list != NULL) {
     free(text_bounds_list);
@@ -1048,15 +2058,353 @@ static int draw_glyphs(TextData *textdata) {
 }
 
 /**
- * Draw glyphs to internal buffer. Once this is called, the bitmap
- * will appear when text_draw_all() is called.
+ * Requests the render worker to draw glyphs to internal buffer.
+ * The bitmap will appear on the first text_draw_all() after
+ * the drawing is finished.
  */
 int redraw_text(int text_id) {
+  if (text_id <= 0 || text_id > max_text_id) {
+    return -1; // non-existent text id
+  }
+  if (textdata_list[text_id-1]->is_image) {
+    return -1; // images have no glyphs
+  }
+  if (!is_render_thread_started) {
+    return redraw_text_sync(text_id);
+  }
+  pthread_mutex_lock(&render_queue_mutex);
+  TextData *textdata = textdata_list[text_id-1];
+  // Only the latest request is rendered
+  if (textdata->pending_render != NULL) {
+    free_snapshot(textdata->pending_render);
+  }
+  textdata->pending_render = snapshot_textdata(textdata);
+  pthread_cond_signal(&render_queue_cond);
+  pthread_mutex_unlock(&render_queue_mutex);
+  return 0;
+}
+
+/**
+ * Draw glyphs on the calling thread and replace the bitmap immediately.
+ */
+int redraw_text_sync(int text_id) {
+  if (text_id <= 0 || text_id > max_text_id) {
+    return -1; // non-existent text id
+  }
+  if (textdata_list[text_id-1]->is_image) {
+    return -1; // images have no glyphs
+  }
+  pthread_mutex_lock(&render_mutex);
+  if (text_load_face(textdata_list[text_id-1]) != 0) {
+    pthread_mutex_unlock(&render_mutex);
+    return -1;
+  }
+  pthread_mutex_lock(&render_queue_mutex);
+  TextData *textdata = textdata_list[text_id-1];
+  cancel_redraw(textdata);
+  TextData *snapshot = snapshot_textdata(textdata);
+  pthread_mutex_unlock(&render_queue_mutex);
+
+  draw_glyphs(snapshot);
+  prepare_snapshot_overlay(snapshot);
+  apply_textdata(textdata, snapshot);
+  pthread_mutex_unlock(&render_mutex);
+  return 0;
+}
+
+/**
+ * Render worker: draws the snapshots queued by redraw_text().
+ */
+static void *render_loop(void *arg) {
+  int i;
+  pthread_mutex_lock(&render_queue_mutex);
+  while (!is_render_thread_stopping) {
+    if (destroyed_textdata != NULL) {
+      pthread_mutex_unlock(&render_queue_mutex);
+      pthread_mutex_lock(&render_mutex);
+      free_destroyed_textdata();
+      pthread_mutex_unlock(&render_mutex);
+      pthread_mutex_lock(&render_queue_mutex);
+      continue;
+    }
+    int has_pending_render = 0;
+    for (i = 0; i < max_text_id; i++) {
+      if (textdata_list[i] != NULL && textdata_list[i]->pending_render != NULL) {
+        has_pending_render = 1;
+        break;
+      }
+    }
+    if (!has_pending_render) {
+      pthread_cond_wait(&render_queue_cond, &render_queue_mutex);
+      continue;
+    }
+    pthread_mutex_unlock(&render_queue_mutex);
+
+    // The text may be destroyed until render_mutex is acquired,
+    // so look up the request again.
+    pthread_mutex_lock(&render_mutex);
+    pthread_mutex_lock(&render_queue_mutex);
+    TextData *textdata = (i < max_text_id) ? textdata_list[i] : NULL;
+    TextData *snapshot = NULL;
+    if (textdata != NULL) {
+      snapshot = textdata->pending_render;
+      textdata->pending_render = NULL;
+    }
+    pthread_mutex_unlock(&render_queue_mutex);
+
+    if (snapshot != NULL && text_load_face(textdata) != 0) {
+      free_snapshot(snapshot); // the text cannot be drawn
+      snapshot = NULL;
+    }
+    if (snapshot != NULL) {
+      // The face may have been opened after the snapshot was taken
+      snapshot->face = textdata->face;
+      snapshot->hb_font = textdata->hb_font;
+      snapshot->hb_buffer = textdata->hb_buffer;
+      draw_glyphs(snapshot);
+      prepare_snapshot_overlay(snapshot);
+
+      pthread_mutex_lock(&render_queue_mutex);
+      if (snapshot->redraw_epoch == textdata->redraw_epoch) {
+        publish_textdata(textdata, snapshot);
+      } else { // cleared or redrawn in the meantime
+        free_snapshot(snapshot);
+      }
+      pthread_mutex_unlock(&render_queue_mutex);
+    }
+    pthread_mutex_unlock(&render_mutex);
+    pthread_mutex_lock(&render_queue_mutex);
+  }
+  pthread_mutex_unlock(&render_queue_mutex);
+  return NULL;
+}
+
+/**
+ * Builds the atlas for text_build_atlas().
+ * render_mutex must be held by the caller.
+ */
+static int build_atlas(TextData *textdata, const char *chars) {
+  text_free_atlas(textdata);
+
+  TextAtlas *atlas = calloc(1, sizeof(TextAtlas));
+  if (atlas == NULL) {
+    fprintf(stderr, "cannot allocate memory for TextAtlas: %d bytes\n",
+        sizeof(TextAtlas));
+    exit(EXIT_FAILURE);
+  }
+
+  FT_UInt glyph_indexes[128];
+  int is_included[128];
+  memset(is_included, 0, sizeof(is_included));
+  FT_Fixed stroke_radius = textdata->stroke_width * 64;
+  int min_x = INT_MAX;
+  int max_x = INT_MIN;
+  int min_y = INT_MAX;
+  int max_y = INT_MIN;
+  int max_advance = 0;
+  const unsigned char *c;
+
+  // Measure the common bounds of all characters
+  for (c = (const unsigned char *)chars; *c != '\0'; c++) {
+    if (*c < 0x20 || *c >= 0x7f || is_included[*c]) {
+      continue; // only printable ASCII is supported
+    }
+    hb_buffer_t *buf = text_prepare_hb_buffer(textdata);
+    hb_buffer_add_utf8(buf, (const char *)c, 1, 0, 1);
+    hb_shape(textdata->hb_font, buf, NULL, 0);
+    unsigned int glyph_count;
+    hb_glyph_info_t *glyph_info = hb_buffer_get_glyph_infos(buf, &glyph_count);
+    hb_glyph_position_t *glyph_pos = hb_buffer_get_glyph_positions(buf, &glyph_count);
+    if (glyph_count != 1) {
+      continue;
+    }
+
+    pthread_mutex_lock(&glyph_cache_mutex);
+    GlyphMask *mask = glyph_cache_get(textdata->face, glyph_info[0].codepoint,
+        GLYPH_MASK_STROKE, stroke_radius);
+    if (mask->is_valid) {
+      if (mask->min_span_x != INT_MAX) {
+        if (min_x > mask->min_span_x) {
+          min_x = mask->min_span_x;
+        }
+        if (max_x < mask->max_span_x) {
+          max_x = mask->max_span_x;
+        }
+        if (min_y > mask->min_y) {
+          min_y = mask->min_y;
+        }
+        if (max_y < mask->max_y) {
+          max_y = mask->max_y;
+        }
+      }
+      if (max_advance < glyph_pos[0].x_advance / 64) {
+        max_advance = glyph_pos[0].x_advance / 64;
+      }
+      glyph_indexes[*c] = glyph_info[0].codepoint;
+      is_included[*c] = 1;
+    }
+    pthread_mutex_unlock(&glyph_cache_mutex);
+  }
+  if (min_x == INT_MAX) {
+    fprintf(stderr, "text_build_atlas: no glyph to render: %s\n", chars);
+    free(atlas);
+    return -1;
+  }
+
+  atlas->cell_width = max_x - min_x;
+  atlas->cell_height = max_y - min_y + 1;
+  atlas->origin_x = -min_x;
+  atlas->advance = max_advance + textdata->letter_spacing;
+
+  // Render each character into its cell
+  TextData celldata;
+  memcpy(&celldata, textdata, sizeof(TextData));
+  celldata.width = atlas->cell_width;
+  celldata.height = atlas->cell_height;
+  celldata.bounds_top = -max_y;
+  celldata.pen_x = atlas->origin_x;
+  celldata.pen_y = 0;
+  int i;
+  for (i = 0; i < 128; i++) {
+    if (!is_included[i]) {
+      continue;
+    }
+    celldata.bitmap = calloc(1, atlas->cell_width * atlas->cell_height * BYTES_PER_PIXEL);
+    if (celldata.bitmap == NULL) {
+      fprintf(stderr, "cannot allocate memory for atlas cell: %d bytes\n",
+          atlas->cell_width * atlas->cell_height * BYTES_PER_PIXEL);
+      exit(EXIT_FAILURE);
+    }
+    pthread_mutex_lock(&glyph_cache_mutex);
+    GlyphMask *mask;
+    if (celldata.stroke_width > 0.0f) {
+      mask = glyph_cache_get(celldata.face, glyph_indexes[i],
+          GLYPH_MASK_STROKE, stroke_radius);
+      if (mask->is_valid) {
+        celldata.is_stroke = 1;
+        glyph_mask_draw(mask, &celldata);
+      }
+    }
+    mask = glyph_cache_get(celldata.face, glyph_indexes[i], GLYPH_MASK_FILL, 0);
+    if (mask->is_valid) {
+      celldata.is_stroke = 0;
+      glyph_mask_draw(mask, &celldata);
+    }
+    pthread_mutex_unlock(&glyph_cache_mutex);
+    atlas->cells[i] = celldata.bitmap;
+  }
+
+  // Taken here so that redraw_text_from_atlas() does not need render_mutex
+  atlas->line_height = ceil(get_line_height(textdata));
+
+  textdata->atlas = atlas;
+  return 0;
+}
+
+/**
+ * Pre-renders the given ASCII characters into an atlas of fixed-advance
+ * cells. The atlas has to be rebuilt after the style of the text is changed.
+ */
+int text_build_atlas(int text_id, const char *chars) {
+  if (text_id <= 0 || text_id > max_text_id) {
+    return -1; // non-existent text id
+  }
+  pthread_mutex_lock(&render_mutex);
+  int ret = text_load_face(textdata_list[text_id-1]);
+  if (ret == 0) {
+    ret = build_atlas(textdata_list[text_id-1], chars);
+  }
+  pthread_mutex_unlock(&render_mutex);
+  return ret;
+}
+
+/**
+ * Draws the current text by compositing the cells in the atlas.
+ * Returns -1 if the text contains a character that is not in the atlas.
+ */
+int redraw_text_from_atlas(int text_id) {
   if (text_id <= 0 || text_id > max_text_id) {
     return -1; // non-existent text id
   }
   TextData *textdata = textdata_list[text_id-1];
-  draw_glyphs(textdata);
+  TextAtlas *atlas = textdata->atlas;
+  if (atlas == NULL || textdata->text_len == 0) {
+    return -1;
+  }
+  int i;
+  for (i = 0; i < textdata->text_len; i++) {
+    unsigned char c = textdata->text[i];
+    if (c >= 128 || atlas->cells[c] == NULL) {
+      return -1; // also rejects newlines and tabs
+    }
+  }
+
+  // Keep the leftmost ink inside the bitmap
+  int start_x = (atlas->origin_x > 0) ? atlas->origin_x : 0;
+  int right = start_x + (textdata->text_len - 1) * atlas->advance - atlas->origin_x + atlas->cell_width;
+  int min_width = start_x + textdata->text_len * atlas->advance;
+  int line_height = atlas->line_height;
+
+  // Supersede any redraw which is queued or being rendered
+  pthread_mutex_lock(&render_queue_mutex);
+  cancel_redraw(textdata);
+  TextData *tmp_textdata;
+  if (atlas->spare_snapshot != NULL) {
+    tmp_textdata = snapshot_textdata_into(atlas->spare_snapshot, textdata);
+    atlas->spare_snapshot = NULL;
+  } else {
+    tmp_textdata = snapshot_textdata(textdata);
+  }
+  pthread_mutex_unlock(&render_queue_mutex);
+
+  tmp_textdata->width = (right > min_width) ? right : min_width;
+  tmp_textdata->height = (atlas->cell_height > line_height) ? atlas->cell_height : line_height;
+  int bitmap_size = tmp_textdata->width * tmp_textdata->height * BYTES_PER_PIXEL;
+  if (bitmap_size > atlas->bitmap_size) {
+    free(atlas->bitmap);
+    atlas->bitmap = malloc(bitmap_size);
+    if (atlas->bitmap == NULL) {
+      fprintf(stderr, "cannot allocate memory for text bitmap: %d bytes\n",
+          bitmap_size);
+      exit(EXIT_FAILURE);
+    }
+    atlas->bitmap_size = bitmap_size;
+  }
+  memset(atlas->bitmap, 0, bitmap_size);
+  tmp_textdata->bitmap = atlas->bitmap;
+
+  for (i = 0; i < textdata->text_len; i++) {
+    uint32_t *cell = (uint32_t *) atlas->cells[(unsigned char) textdata->text[i]];
+    int cell_x = start_x + i * atlas->advance - atlas->origin_x;
+    int row, col;
+    for (row = 0; row < atlas->cell_height; row++) {
+      uint32_t *dest = (uint32_t *) tmp_textdata->bitmap + row * tmp_textdata->width + cell_x;
+      uint32_t *src = cell + row * atlas->cell_width;
+      for (col = 0; col < atlas->cell_width; col++) {
+        color_argb_t fg_color;
+        fg_color.x = src[col];
+        if (fg_color.c.a == 0) {
+          continue;
+        }
+        if (fg_color.c.a == 255 || dest[col] == 0) {
+          dest[col] = fg_color.x;
+        } else { // the stroke overlaps with the neighboring cell
+          color_argb_t bg_color;
+          bg_color.x = dest[col];
+          dest[col] = blend_colors_argb(bg_color, fg_color, BLEND_MODE_NORMAL).x;
+        }
+      }
+    }
+  }
+
+  convert_bitmap_to_overlay(tmp_textdata);
+  tmp_textdata->bitmap = NULL; // owned by the atlas
+  if (tmp_textdata->layout_mode == LAYOUT_MODE_ABSOLUTE) {
+    build_chroma_overlay(tmp_textdata, tmp_textdata->x & 1, tmp_textdata->y & 1);
+  } else {
+    build_chroma_overlay(tmp_textdata, 0, 0);
+  }
+  publish_textdata(textdata, tmp_textdata);
   return 0;
 }
 
@@ -1069,6 +2417,9 @@ int text_clear(int text_id) {
     return -1; // non-existent text id
   }
   TextData *textdata = textdata_list[text_id-1];
+  pthread_mutex_lock(&render_queue_mutex);
+  cancel_redraw(textdata);
+  pthread_mutex_unlock(&render_queue_mutex);
   textdata->is_bitmap_ready = 0;
   textdata->has_changed = 1;
   return 0;
@@ -1081,7 +2432,16 @@ int text_get_position(int text_id, int canvas_width, int canvas_height, int *x,
   if (text_id <= 0 || text_id > max_text_id) {
     return -1; // non-existent text id
   }
-  TextData *textdata = textdata_list[text_id-1];
+  get_textdata_position(textdata_list[text_id-1],
+      canvas_width, canvas_height, x, y);
+  return 0;
+}
+
+/**
+ * Calculates the top-left corner position for textdata on the canvas.
+ */
+static void get_textdata_position(TextData *textdata,
+    int canvas_width, int canvas_height, int *x, int *y) {
   if (textdata->layout_mode == LAYOUT_MODE_ALIGN) {
     float start_x, start_y;
     int horizontal_align = textdata->layout_align & LAYOUT_ALIGN_HORIZONTAL_MASK;
@@ -1106,28 +2466,28 @@ int text_get_position(int text_id, int canvas_width, int canvas_height, int *x,
     *x = textdata->x;
     *y = textdata->y;
   }
-  return 0;
 }
 
 /**
- * Draw all text objects to the canvas.
- *
- * returns: nonzero if the canvas content has been changed
+ * Destroys the texts scheduled for destruction and takes the bitmaps
+ * published by the render worker.
+ * Returns nonzero if any text has changed.
  */
-int text_draw_all(uint8_t *canvas, int canvas_width, int canvas_height, int is_video) {
+static int update_textdata_list() {
   int i;
   int has_anything_changed = 0;
-  int canvas_bytes_per_pixel = (is_video) ? 1 : BYTES_PER_PIXEL; // note: in YUV we're poinig to Y planar pixel
-  //clock_t start_time = clock();
+  int num_texts;
+  TextData **list = load_textdata_list(&num_texts);
 
   // Check if any of textdata_list should be destroyed by will_destroy_text_id
-  for (i = 0; i < max_text_id; i++) {
-    TextData *textdata = textdata_list[i];
+  for (i = 0; i < num_texts; i++) {
+    TextData *textdata = __atomic_load_n(&list[i], __ATOMIC_ACQUIRE);
     if (textdata != NULL &&
         textdata->is_bitmap_ready &&
         textdata->will_destroy_text_id != -1 &&
-        textdata->will_destroy_text_id <= max_text_id) {
-      TextData *destroy_textdata = textdata_list[textdata->will_destroy_text_id-1];
+        textdata->will_destroy_text_id <= num_texts) {
+      TextData *destroy_textdata = __atomic_load_n(
+          &list[textdata->will_destroy_text_id-1], __ATOMIC_ACQUIRE);
       if (destroy_textdata != NULL &&
           destroy_textdata->will_dispose_bitmap != 1) {
         text_destroy(destroy_textdata->id);
@@ -1137,92 +2497,130 @@ int text_draw_all(uint8_t *canvas, int canvas_width, int canvas_height, int is_v
     }
   }
 
-  for (i = 0; i < max_text_id; i++) {
-    TextData *textdata = textdata_list[i];
+  for (i = 0; i < num_texts; i++) {
+    TextData *textdata = __atomic_load_n(&list[i], __ATOMIC_ACQUIRE);
     if (textdata != NULL) {
-      if (textdata->next_textdata != NULL) {
-        // Copy the contents of next_textdata to textdata
-        free(textdata->bitmap);
-        TextData *next_textdata = textdata->next_textdata;
-        memcpy(textdata, next_textdata, sizeof(TextData));
-        free(next_textdata);
+      // Take the bitmap published by the render worker
+      TextData *next_textdata = __atomic_exchange_n(&textdata->next_textdata,
+          NULL, __ATOMIC_ACQ_REL);
+      if (next_textdata != NULL) {
+        apply_textdata(textdata, next_textdata);
         has_anything_changed = 1; // we're replacing old textdata with new one
       }
       has_anything_changed |= textdata->has_changed;
       textdata->has_changed = 0;
       if (textdata->will_dispose_bitmap) {
         text_destroy_real(textdata->id);
+      }
+    }
+  }
+  return has_anything_changed;
+}
+
+/**
+ * Draws the part of a text that falls inside clip to the canvas.
+ */
+static void draw_textdata(TextData *textdata, uint8_t *canvas,
+    int canvas_width, int canvas_height, int is_video, const text_rect *clip) {
+  if (!textdata->is_bitmap_ready) {
+    return;
+  }
+  if ((is_video && !textdata->in_video)
+      || (!is_video && !textdata->in_preview)) {
+    return; // skip this textdata if we don't want to show it on this medium
+  }
+  int pen_x, pen_y;
+  get_textdata_position(textdata, canvas_width, canvas_height, &pen_x, &pen_y);
+
+  if (pen_x >= clip->x + clip->width || pen_x + textdata->width <= clip->x ||
+      pen_y >= clip->y + clip->height || pen_y + textdata->height <= clip->y) {
+    return; // entirely out of bounds
+  }
+  TextOverlay *overlay = &textdata->overlay;
+  int x, y, offset, len;
+  int j;
+  if (is_video) { // YUV420PackedPlanar video frame
+    if (textdata->blend_mode != BLEND_MODE_NORMAL) {
+      // TODO: Implement other blending modes
+      fprintf(stderr, "blending mode not implemented: %d\n",
+          textdata->blend_mode);
+      return;
+    }
+    for (j = 0; j < overlay->num_runs; j++) {
+      len = clip_run(&overlay->runs[j], pen_x, pen_y, clip, &x, &y, &offset);
+      if (len > 0) {
+        blend_row(canvas + y * canvas_width + x,
+            overlay->y + offset, overlay->alpha + offset, len);
+      }
+    }
+
+    // U and V planes follow the Y plane at half resolution
+    int chroma_pen_x = pen_x >> 1; // rounds toward negative infinity
+    int chroma_pen_y = pen_y >> 1;
+    int parity_x = pen_x - chroma_pen_x * 2;
+    int parity_y = pen_y - chroma_pen_y * 2;
+    if (parity_x != overlay->chroma_parity_x ||
+        parity_y != overlay->chroma_parity_y) {
+      build_chroma_overlay(textdata, parity_x, parity_y);
+    }
+    int chroma_canvas_width = canvas_width / 2;
+    int chroma_canvas_height = canvas_height / 2;
+    text_rect chroma_clip = { clip->x / 2, clip->y / 2,
+      (clip->x + clip->width) / 2 - clip->x / 2,
+      (clip->y + clip->height) / 2 - clip->y / 2 };
+    uint8_t *canvas_u = canvas + canvas_width * canvas_height;
+    uint8_t *canvas_v = canvas_u + chroma_canvas_width * chroma_canvas_height;
+    for (j = 0; j < overlay->num_chroma_runs; j++) {
+      len = clip_run(&overlay->chroma_runs[j], chroma_pen_x, chroma_pen_y,
+          &chroma_clip, &x, &y, &offset);
+      if (len > 0) {
+        int canvas_offset = y * chroma_canvas_width + x;
+        blend_row(canvas_u + canvas_offset, overlay->u + offset,
+            overlay->chroma_alpha + offset, len);
+        blend_row(canvas_v + canvas_offset, overlay->v + offset,
+            overlay->chroma_alpha + offset, len);
+      }
+    }
+  } else { // ARGB preview canvas
+    uint32_t *canvas_pixels = (uint32_t *) canvas;
+    for (j = 0; j < overlay->num_runs; j++) {
+      len = clip_run(&overlay->runs[j], pen_x, pen_y, clip, &x, &y, &offset);
+      if (len <= 0) {
         continue;
       }
-      if (textdata->is_bitmap_ready) {
-        if ((is_video && !textdata->in_video)
-            || (!is_video && !textdata->in_preview)) {
-          continue; // skip this textdata if we don't want to show it on this medium
-        }
-        int pen_x, pen_y;
-        text_get_position(textdata->id, canvas_width, canvas_height, &pen_x, &pen_y);
-        int row, col;
-        for (row = 0; row < textdata->height; row++) {
-          if (pen_y + row < 0) {
-            continue;
-          }
-          if (pen_y + row >= canvas_height) { // out of bounds
-            break;
-          }
-          for (col = 0; col < textdata->width; col++) {
-            if (pen_x + col < 0) {
-              continue;
-            }
-            if (pen_x + col >= canvas_width) { // out of bounds
-              break;
-            }
-            int offset = (row * textdata->width + col) * BYTES_PER_PIXEL;
-            color_argb_t color;
-            color.x = *((uint32_t*) (textdata->bitmap + offset));
-            uint8_t* canvas_pixel = canvas + ((pen_y + row) * canvas_width + (pen_x + col)) * canvas_bytes_per_pixel;
-
-            if (is_video) { // YUV420PackedPlanar video frame
-              uint8_t opacity = color.c.a;
-              uint8_t y = ( (  66 * color.c.r + 129 * color.c.g +  25 * color.c.b + 128) >> 8) + 16;
-#if 0
-              uint8_t u = ( ( -38 * color.c.r -  74 * color.c.g + 112 * color.c.b + 128) >> 8) + 128;
-              uint8_t v = ( ( 112 * color.c.r -  94 * color.c.g -  18 * color.c.b + 128) >> 8) + 128;
-              (void)u; (void)v;
-#endif
-              if (opacity == 255) {
-                if (textdata->blend_mode == BLEND_MODE_NORMAL) {
-                  *canvas_pixel = y;
-                  // TODO: update U and V
-                } else {
-                  // TODO: Implement other blending modes
-                  fprintf(stderr, "blending mode not implemented: %d\n",
-                      textdata->blend_mode);
-                }
-              } else if (opacity > 0) {
-                // Blend colors
-                uint8_t orig_color_y = *canvas_pixel;
-                float intensity = opacity / 255.0f;
-                if (textdata->blend_mode == BLEND_MODE_NORMAL) {
-                  *canvas_pixel = orig_color_y * (1 - intensity) + y * intensity;
-                } else {
-                  // TODO: Implement other blending modes
-                  fprintf(stderr, "blending mode not implemented: %d\n",
-                      textdata->blend_mode);
-                }
-              }
-            } else { // ARGB preview canvas
+      uint32_t *dst = canvas_pixels + y * canvas_width + x;
 #ifdef USE_ARGB_PIXEL_BLENDING
-              color_argb_t bg_color, new_color;
-              bg_color.x = *((uint32_t*) canvas_pixel);
-              new_color = blend_colors_argb(bg_color, color, textdata->blend_mode);
-              *((uint32_t*) canvas_pixel) = new_color.x;
+      int col;
+      for (col = 0; col < len; col++) {
+        color_argb_t bg_color, fg_color;
+        bg_color.x = dst[col];
+        fg_color.x = overlay->argb[offset + col];
+        dst[col] = blend_colors_argb(bg_color, fg_color, textdata->blend_mode).x;
+      }
 #else
-              *((uint32_t*) canvas_pixel) = color.x;
+      memcpy(dst, overlay->argb + offset, len * BYTES_PER_PIXEL);
 #endif
-            }
-          }
-        }
-      }
+    }
+  }
+}
+
+/**
+ * Draw all text objects to the canvas.
+ *
+ * returns: nonzero if the canvas content has been changed
+ */
+int text_draw_all(uint8_t *canvas, int canvas_width, int canvas_height, int is_video) {
+  int i;
+  text_rect clip = { 0, 0, canvas_width, canvas_height };
+  //clock_t start_time = clock();
+
+  int has_anything_changed = update_textdata_list();
+  int num_texts;
+  TextData **list = load_textdata_list(&num_texts);
+  for (i = 0; i < num_texts; i++) {
+    TextData *textdata = __atomic_load_n(&list[i], __ATOMIC_ACQUIRE);
+    if (textdata != NULL) {
+      draw_textdata(textdata, canvas, canvas_width, canvas_height, is_video, &clip);
     }
   }
   //log_debug("\n\ntext_draw_all(is_video=%d) took %d ms, has_changed=%d\n", is_video, (clock() - start_time) * 1000 / CLOCKS_PER_SEC, has_anything_changed);
@@ -1230,10 +2628,264 @@ int text_draw_all(uint8_t *canvas, int canvas_width, int canvas_height, int is_v
 }
 
 /**
- * Select an appropriate font file and face index by a font name.
+ * Extends dst to the bounding box of dst and src. Empty rects are ignored.
  */
-int text_select_font_file(const char *name, char **font_file, int *face_index) {
-  FcInit();
+static void rect_union(text_rect *dst, const text_rect *src) {
+  if (src->width <= 0 || src->height <= 0) {
+    return;
+  }
+  if (dst->width <= 0 || dst->height <= 0) {
+    *dst = *src;
+    return;
+  }
+  int right = dst->x + dst->width;
+  int bottom = dst->y + dst->height;
+  if (src->x + src->width > right) {
+    right = src->x + src->width;
+  }
+  if (src->y + src->height > bottom) {
+    bottom = src->y + src->height;
+  }
+  if (src->x < dst->x) {
+    dst->x = src->x;
+  }
+  if (src->y < dst->y) {
+    dst->y = src->y;
+  }
+  dst->width = right - dst->x;
+  dst->height = bottom - dst->y;
+}
+
+/**
+ * Adds rect to the list of dirty rectangles. A rect overlapping one in the
+ * list is merged into it, and once the list is full the rest are merged
+ * into the last entry.
+ */
+static void add_dirty_rect(text_rect *rects, int *num_rects, int max_rects,
+    const text_rect *rect) {
+  int i;
+  if (rect->width <= 0 || rect->height <= 0 || max_rects <= 0) {
+    return;
+  }
+  for (i = 0; i < *num_rects; i++) {
+    if (rect->x < rects[i].x + rects[i].width && rects[i].x < rect->x + rect->width &&
+        rect->y < rects[i].y + rects[i].height && rects[i].y < rect->y + rect->height) {
+      rect_union(&rects[i], rect);
+      return;
+    }
+  }
+  if (*num_rects < max_rects) {
+    rects[(*num_rects)++] = *rect;
+  } else {
+    rect_union(&rects[*num_rects - 1], rect);
+  }
+}
+
+int text_get_preview_dirty_rects(int canvas_width, int canvas_height,
+    text_rect *rects, int max_rects) {
+  int i;
+  int num_rects = 0;
+
+  update_textdata_list();
+
+  add_dirty_rect(rects, &num_rects, max_rects, &removed_preview_rect);
+  memset(&removed_preview_rect, 0, sizeof(text_rect));
+
+  int num_texts;
+  TextData **list = load_textdata_list(&num_texts);
+  for (i = 0; i < num_texts; i++) {
+    TextData *textdata = __atomic_load_n(&list[i], __ATOMIC_ACQUIRE);
+    if (textdata == NULL) {
+      continue;
+    }
+    text_rect rect = { 0, 0, 0, 0 };
+    if (textdata->is_bitmap_ready && textdata->in_preview) {
+      int pen_x, pen_y;
+      get_textdata_position(textdata, canvas_width, canvas_height, &pen_x, &pen_y);
+      int right = pen_x + textdata->width;
+      int bottom = pen_y + textdata->height;
+      rect.x = pen_x < 0 ? 0 : pen_x;
+      rect.y = pen_y < 0 ? 0 : pen_y;
+      rect.width = (right > canvas_width ? canvas_width : right) - rect.x;
+      rect.height = (bottom > canvas_height ? canvas_height : bottom) - rect.y;
+      if (rect.width <= 0 || rect.height <= 0) {
+        memset(&rect, 0, sizeof(text_rect)); // entirely out of bounds
+      }
+    }
+    if (textdata->is_preview_dirty ||
+        memcmp(&rect, &textdata->preview_rect, sizeof(text_rect)) != 0) {
+      add_dirty_rect(rects, &num_rects, max_rects, &textdata->preview_rect);
+      add_dirty_rect(rects, &num_rects, max_rects, &rect);
+      textdata->preview_rect = rect;
+      textdata->is_preview_dirty = 0;
+    }
+  }
+  return num_rects;
+}
+
+void text_draw_preview_rect(uint8_t *canvas, int canvas_width, int canvas_height,
+    const text_rect *clip) {
+  int i;
+  int num_texts;
+  TextData **list = load_textdata_list(&num_texts);
+  for (i = 0; i < num_texts; i++) {
+    TextData *textdata = __atomic_load_n(&list[i], __ATOMIC_ACQUIRE);
+    if (textdata != NULL) {
+      draw_textdata(textdata, canvas, canvas_width, canvas_height, 0, clip);
+    }
+  }
+}
+
+// A font name resolved by fontconfig
+typedef struct font_cache_entry {
+  char *name;
+  char *font_file;
+  int face_index;
+  time_t mtime; // modification time of font_file when it was resolved
+  struct font_cache_entry *next;
+} font_cache_entry;
+
+static font_cache_entry *font_cache = NULL;
+static int is_font_cache_loaded = 0;
+static int is_fontconfig_initialized = 0;
+static pthread_mutex_t font_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Writes the path of the font cache file to buf.
+ * Returns 0 on success, -1 if the location cannot be determined.
+ */
+static int get_font_cache_path(char *buf, size_t buf_len) {
+  const char *cache_home = getenv("XDG_CACHE_HOME");
+  if (cache_home != NULL && cache_home[0] != '\0') {
+    snprintf(buf, buf_len, "%s/" FONT_CACHE_FILE_NAME, cache_home);
+    return 0;
+  }
+  const char *home = getenv("HOME");
+  if (home == NULL || home[0] == '\0') {
+    return -1;
+  }
+  char dir[256];
+  snprintf(dir, sizeof(dir), "%s/.cache", home);
+  mkdir(dir, 0755); // may already exist
+  snprintf(buf, buf_len, "%s/" FONT_CACHE_FILE_NAME, dir);
+  return 0;
+}
+
+static void font_cache_add(const char *name, const char *font_file,
+    int face_index, time_t mtime) {
+  font_cache_entry *entry = malloc(sizeof(font_cache_entry));
+  if (entry == NULL) {
+    fprintf(stderr, "cannot allocate memory for font cache entry\n");
+    exit(EXIT_FAILURE);
+  }
+  entry->name = copy_string(name);
+  entry->font_file = copy_string(font_file);
+  entry->face_index = face_index;
+  entry->mtime = mtime;
+  entry->next = font_cache;
+  font_cache = entry;
+}
+
+static void font_cache_remove(font_cache_entry *target) {
+  font_cache_entry **entry_p = &font_cache;
+  while (*entry_p != NULL) {
+    if (*entry_p == target) {
+      *entry_p = target->next;
+      free(target->name);
+      free(target->font_file);
+      free(target);
+      return;
+    }
+    entry_p = &(*entry_p)->next;
+  }
+}
+
+/**
+ * Frees the in-memory font cache and finalizes fontconfig.
+ */
+static void font_cache_clear() {
+  pthread_mutex_lock(&font_cache_mutex);
+  while (font_cache != NULL) {
+    font_cache_remove(font_cache);
+  }
+  is_font_cache_loaded = 0;
+  if (is_fontconfig_initialized) {
+    FcFini();
+    is_fontconfig_initialized = 0;
+  }
+  pthread_mutex_unlock(&font_cache_mutex);
+}
+
+/**
+ * Reads the font cache file. Each line is
+ * <name> TAB <font file> TAB <face index> TAB <mtime>.
+ */
+static void font_cache_load() {
+  char path[256];
+  char line[1024];
+  FILE *fp;
+
+  is_font_cache_loaded = 1;
+  if (get_font_cache_path(path, sizeof(path)) != 0) {
+    return;
+  }
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    return; // not created yet
+  }
+  while (fgets(line, sizeof(line), fp)) {
+    char *name = strtok(line, "\t\n");
+    char *font_file = strtok(NULL, "\t\n");
+    char *face_index = strtok(NULL, "\t\n");
+    char *mtime = strtok(NULL, "\t\n");
+    if (name == NULL || font_file == NULL || face_index == NULL || mtime == NULL) {
+      continue; // broken line
+    }
+    font_cache_add(name, font_file, atoi(face_index), (time_t) atoll(mtime));
+  }
+  fclose(fp);
+}
+
+static void font_cache_save() {
+  char path[256];
+  char tmp_path[272];
+  FILE *fp;
+  font_cache_entry *entry;
+
+  if (get_font_cache_path(path, sizeof(path)) != 0) {
+    return;
+  }
+  // Replace the file atomically so that a concurrent start never reads
+  // a partially written cache
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, getpid());
+  fp = fopen(tmp_path, "w");
+  if (fp == NULL) {
+    return; // the cache is optional
+  }
+  for (entry = font_cache; entry != NULL; entry = entry->next) {
+    fprintf(fp, "%s\t%s\t%d\t%lld\n", entry->name, entry->font_file,
+        entry->face_index, (long long) entry->mtime);
+  }
+  if (fclose(fp) != 0 || rename(tmp_path, path) != 0) {
+    unlink(tmp_path);
+  }
+}
+
+/**
+ * Resolves the font name with fontconfig.
+ * Returns 0 on success.
+ */
+static int match_font_file(const char *name, char **font_file, int *face_index) {
+  int ret = -1;
+
+  // FcInit() scans the font directories, which takes seconds on a Pi,
+  // so fontconfig is kept initialized until text_teardown()
+  if (!is_fontconfig_initialized) {
+    if (!FcInit()) {
+      return -1;
+    }
+    is_fontconfig_initialized = 1;
+  }
 
   FcPattern *pattern = FcNameParse((const FcChar8 *)name);
   FcConfigSubstitute(0, pattern, FcMatchPattern);
@@ -1242,30 +2894,59 @@ int text_select_font_file(const char *name, char **font_file, int *face_index) {
   FcResult result = FcResultMatch;
   FcPattern *match = FcFontMatch(NULL, pattern, &result);
   FcPatternDestroy(pattern);
-  if (result != FcResultMatch) {
+  if (result != FcResultMatch || match == NULL) {
     return -1;
   }
 
   FcChar8 *path;
-  if (FcPatternGetString(match, FC_FILE, 0, &path) == FcResultMatch) {
-    size_t path_len = strlen((const char *)path) + 1;
-    *font_file = malloc(path_len);
-    memcpy(*font_file, path, path_len);
-  } else {
-    return -1;
-  }
   int index;
-  if (FcPatternGetInteger(match, FC_INDEX, 0, &index) == FcResultMatch) {
+  if (FcPatternGetString(match, FC_FILE, 0, &path) == FcResultMatch &&
+      FcPatternGetInteger(match, FC_INDEX, 0, &index) == FcResultMatch) {
+    *font_file = copy_string((const char *)path);
     *face_index = index;
-  } else {
-    return -1;
+    ret = 0;
   }
 
   FcPatternDestroy(match);
+  return ret;
+}
 
-  FcFini();
+/**
+ * Select an appropriate font file and face index by a font name.
+ */
+int text_select_font_file(const char *name, char **font_file, int *face_index) {
+  font_cache_entry *entry;
+  struct stat st;
+  int ret = 0;
 
-  return 0;
+  pthread_mutex_lock(&font_cache_mutex);
+  if (!is_font_cache_loaded) {
+    font_cache_load();
+  }
+  for (entry = font_cache; entry != NULL; entry = entry->next) {
+    if (strcmp(entry->name, name) == 0) {
+      break;
+    }
+  }
+  if (entry != NULL) {
+    // The entry is stale if the font file has been replaced or removed
+    if (stat(entry->font_file, &st) == 0 && st.st_mtime == entry->mtime) {
+      *font_file = copy_string(entry->font_file);
+      *face_index = entry->face_index;
+      pthread_mutex_unlock(&font_cache_mutex);
+      return 0;
+    }
+    font_cache_remove(entry);
+  }
+
+  if (match_font_file(name, font_file, face_index) != 0) {
+    ret = -1;
+  } else if (strpbrk(name, "\t\n") == NULL && stat(*font_file, &st) == 0) {
+    font_cache_add(name, *font_file, *face_index, st.st_mtime);
+    font_cache_save();
+  }
+  pthread_mutex_unlock(&font_cache_mutex);
+  return ret;
 }
 
 /**
@@ -35,6 +35,14 @@ typedef struct text_bounds {
   int height;
 } text_bounds;
 
+// Represents a rectangular area of the canvas
+typedef struct text_rect {
+  int x;
+  int y;
+  int width;
+  int height;
+} text_rect;
+
 /**
  * Initializes text library.
  */
@@ -50,6 +58,18 @@ void text_teardown();
  */
 int text_create(const char *font_file, long face_index, float point, int dpi);
 
+/**
+ * Creates a text object which shows an ARGB image instead of glyphs,
+ * and returns the text id. argb is freed by the text library.
+ * The image is not drawn until text_show_image() is called.
+ */
+int text_create_image(uint32_t *argb, int width, int height);
+
+/**
+ * Starts drawing the image created by text_create_image().
+ */
+int text_show_image(int text_id);
+
 /**
  * Sets letter spacing.
  */
@@ -135,11 +155,32 @@ int text_destroy(int text_id);
 int text_get_bounds(int text_id, const char *text, size_t text_len, text_bounds *bounds);
 
 /**
- * Draw glyphs to internal buffer. Once this is called, the bitmap
- * will appear when text_draw_all() is called.
+ * Requests the render worker to draw glyphs to internal buffer.
+ * The bitmap will appear on the first text_draw_all() after
+ * the drawing is finished.
  */
 int redraw_text(int text_id);
 
+/**
+ * Draws glyphs on the calling thread and replaces the bitmap immediately.
+ * This must not be called while text_draw_all() may be running.
+ */
+int redraw_text_sync(int text_id);
+
+/**
+ * Pre-renders the given ASCII characters into fixed-advance cells.
+ * The atlas has to be rebuilt after the style of the text is changed.
+ */
+int text_build_atlas(int text_id, const char *chars);
+
+/**
+ * Draws the current text by copying the cells built by text_build_atlas()
+ * instead of shaping and rasterizing glyphs. The text is laid out with
+ * fixed advance. Returns -1 if the text contains a character which is not
+ * in the atlas, in which case redraw_text() should be used.
+ */
+int redraw_text_from_atlas(int text_id);
+
 /**
  * Draw all text objects to the canvas.
  * we support writing on two types of canvas: ARGB8888 (is_video = 0) and YUV420PackedPlanar (is_video = 1)
@@ -148,6 +189,23 @@ int redraw_text(int text_id);
  */
 int text_draw_all(uint8_t *canvas, int canvas_width, int canvas_height, int is_video);
 
+/**
+ * Collects the areas of the ARGB preview canvas which have to be redrawn
+ * since the last call: the previous and the current box of each changed
+ * text. Nearby areas are merged so that at most max_rects are returned.
+ *
+ * returns: the number of rectangles stored in rects
+ */
+int text_get_preview_dirty_rects(int canvas_width, int canvas_height,
+    text_rect *rects, int max_rects);
+
+/**
+ * Draws the part of the preview texts that falls inside clip to the
+ * ARGB canvas. The area should be cleared beforehand.
+ */
+void text_draw_preview_rect(uint8_t *canvas, int canvas_width, int canvas_height,
+    const text_rect *clip);
+
 /**
  * Clear the text. Once this is called, the bitmap will not be drawn
  * until text_set_text() is called.
@@ -12,6 +12,96 @@ const static char *default_font_name = "Nimbus Mono L,monospace";
 static int text_id = -1;
 static char time_format[128];
 static time_t last_time_drawn;
+static char last_text_drawn[128];
+
+// Format contains %L (milliseconds) or %f (frame number)
+static int is_subsecond_format = 0;
+
+// Number of frames timestamp_update() has been called for
+static long long frame_number = 0;
+
+// Whether the characters in the format are pre-rendered
+static int is_atlas_ready = 0;
+
+/**
+ * strftime() with additional conversions:
+ * %L is replaced with milliseconds (000-999) and %f with the frame number.
+ */
+static void format_time(char *str, size_t size, const struct tm *timeinfo,
+    int msec, long long frame) {
+  char format[256];
+  int i = 0;
+  const char *p;
+  for (p = time_format; *p != '\0' && i < sizeof(format) - 24; p++) {
+    if (*p == '%' && *(p + 1) == 'L') {
+      i += snprintf(format + i, sizeof(format) - i, "%03d", msec);
+      p++;
+    } else if (*p == '%' && *(p + 1) == 'f') {
+      i += snprintf(format + i, sizeof(format) - i, "%lld", frame);
+      p++;
+    } else if (*p == '%' && *(p + 1) != '\0') {
+      // copy other conversions including %% as is
+      format[i++] = *p++;
+      format[i++] = *p;
+    } else {
+      format[i++] = *p;
+    }
+  }
+  format[i] = '\0';
+
+  if (strftime(str, size, format, timeinfo) == 0) {
+    str[0] = '\0';
+  }
+}
+
+/**
+ * Pre-renders every character that the format can produce so that
+ * timestamp_update() can compose the text without rasterizing glyphs.
+ */
+static void timestamp_build_atlas() {
+  char chars[128];
+  int is_included[128];
+  int num_chars = 0;
+  char str[128];
+  const char *c;
+  struct tm timeinfo;
+  time_t rawtime;
+  int month, wday, hour;
+
+  memset(is_included, 0, sizeof(is_included));
+
+  // Numeric conversions may produce any digit, and space for padding
+  for (c = "0123456789 "; *c != '\0'; c++) {
+    is_included[(unsigned char) *c] = 1;
+    chars[num_chars++] = *c;
+  }
+
+  // Collect names of months, weekdays and AM/PM
+  time(&rawtime);
+  localtime_r(&rawtime, &timeinfo);
+  for (month = 0; month < 12; month++) {
+    for (wday = 0; wday < 7; wday++) {
+      for (hour = 0; hour < 24; hour += 12) {
+        timeinfo.tm_mon = month;
+        timeinfo.tm_wday = wday;
+        timeinfo.tm_hour = hour;
+        format_time(str, sizeof(str), &timeinfo, 0, 0);
+        for (c = str; *c != '\0'; c++) {
+          unsigned char ch = *c;
+          if (ch < 128 && !is_included[ch] && num_chars < sizeof(chars) - 1) {
+            is_included[ch] = 1;
+            chars[num_chars++] = ch;
+          }
+        }
+      }
+    }
+  }
+  chars[num_chars] = '\0';
+
+  // If this fails, every update falls back to redraw_text()
+  text_build_atlas(text_id, chars);
+  is_atlas_ready = 1;
+}
 
 /**
  * Initializes the timestamp library with a font name.
@@ -48,6 +138,8 @@ void timestamp_init(const char *font_file, long face_index, int points, int dpi)
       5); // vertical margin from the bottom edge
   text_set_align(text_id, TEXT_ALIGN_LEFT); // text alignment inside the box
   last_time_drawn = 0;
+  last_text_drawn[0] = '\0';
+  frame_number = 0;
 }
 
 /**
@@ -56,6 +148,9 @@ void timestamp_init(const char *font_file, long face_index, int points, int dpi)
 void timestamp_set_format(const char *format) {
   strncpy(time_format, format, sizeof(time_format) - 1);
   time_format[sizeof(time_format) - 1] = '\0';
+  is_subsecond_format = (strstr(time_format, "%L") != NULL ||
+      strstr(time_format, "%f") != NULL);
+  is_atlas_ready = 0;
 }
 
 /**
@@ -63,6 +158,7 @@ void timestamp_set_format(const char *format) {
  */
 void timestamp_set_color(int color) {
   text_set_color(text_id, color);
+  is_atlas_ready = 0;
 }
 
 /**
@@ -70,6 +166,7 @@ void timestamp_set_color(int color) {
  */
 void timestamp_set_stroke_color(uint32_t color) {
   text_set_stroke_color(text_id, color);
+  is_atlas_ready = 0;
 }
 
 /**
@@ -77,6 +174,7 @@ void timestamp_set_stroke_color(uint32_t color) {
  */
 void timestamp_set_stroke_width(float stroke_width) {
   text_set_stroke_width(text_id, stroke_width);
+  is_atlas_ready = 0;
 }
 
 /**
@@ -84,6 +182,7 @@ void timestamp_set_stroke_width(float stroke_width) {
  */
 void timestamp_set_letter_spacing(int pixels) {
   text_set_letter_spacing(text_id, pixels);
+  is_atlas_ready = 0;
 }
 
 /**
@@ -125,34 +224,44 @@ void timestamp_fix_position(int canvas_width, int canvas_height) {
 
   time_t rawtime = 0;
   timeinfo = gmtime(&rawtime);
-  strftime(str, sizeof(str)-1, time_format, timeinfo);
-  str[sizeof(str)-1] = '\0';
+  format_time(str, sizeof(str), timeinfo, 0, 0);
 
   text_set_text(text_id, str, strlen(str));
-  redraw_text(text_id);
+  redraw_text_sync(text_id);
   text_fix_position(text_id, canvas_width, canvas_height);
   text_clear(text_id);
 }
 
+void timestamp_finish_init() {
+  timestamp_build_atlas();
+}
+
 /**
- * Call this function before calling text_draw_all().
+ * Call this function once per frame before calling text_draw_all().
+ * Without the atlas built by timestamp_finish_init(), the text is
+ * rendered by the render worker so that the caller never rasterizes.
  */
 void timestamp_update() {
-  time_t rawtime;
-  struct tm *timeinfo;
+  struct timespec ts;
+  struct tm timeinfo;
   char str[128];
 
-  time(&rawtime);
+  clock_gettime(CLOCK_REALTIME, &ts);
 
-  if (rawtime > last_time_drawn) {
-    timeinfo = localtime(&rawtime);
-    strftime(str, sizeof(str)-1, time_format, timeinfo);
-    str[sizeof(str)-1] = '\0';
+  if (is_subsecond_format || ts.tv_sec > last_time_drawn) {
+    localtime_r(&ts.tv_sec, &timeinfo);
+    format_time(str, sizeof(str), &timeinfo, ts.tv_nsec / 1000000, frame_number);
 
-    text_set_text(text_id, str, strlen(str));
-    redraw_text(text_id);
-    last_time_drawn = rawtime;
+    if (strcmp(str, last_text_drawn) != 0) {
+      text_set_text(text_id, str, strlen(str));
+      if (!is_atlas_ready || redraw_text_from_atlas(text_id) != 0) {
+        redraw_text(text_id);
+      }
+      strcpy(last_text_drawn, str);
+    }
+    last_time_drawn = ts.tv_sec;
   }
+  frame_number++;
 }
 
 /**
@@ -71,7 +71,14 @@ void timestamp_set_align(TEXT_ALIGN text_align);
 void timestamp_fix_position(int canvas_width, int canvas_height);
 
 /**
- * Call this function before calling text_draw_all().
+ * Pre-renders the characters of the timestamp. Call this once after
+ * the format and the style have been set, before timestamp_update()
+ * is called. The setters discard the pre-rendered characters.
+ */
+void timestamp_finish_init();
+
+/**
+ * Call this function once per frame before calling text_draw_all().
  */
 void timestamp_update();
 
@@ -0,0 +1,173 @@
+// Replays a bandwidth trace through the adaptive bitrate controller (--abr)
+// and prints its decisions. Build with "make sim" on any host:
+//
+//   $ ./tools/abr_sim <trace file> [min bitrate] [max bitrate] [fps]
+//
+// Each line of the trace file is "<seconds> <bits per second>", which sets
+// the bandwidth of the link from that time on. Lines starting with # are
+// ignored. The simulation ends at the time of the last line, e.g.
+//
+//   0 8000000
+//   10 1500000
+//   20 8000000
+//   40 8000000
+//
+// Frames are written into a send buffer of SEND_BUFFER_BYTES which is
+// drained at the bandwidth of the link. A write blocks until the frame
+// fits into the buffer, and the blocked time is reported to the controller
+// as the write time of the frame.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../abr.h"
+
+#define NSEC_PER_SEC INT64_C(1000000000)
+
+// Like the default socket send buffer on Linux
+#define SEND_BUFFER_BYTES (208 * 1024)
+
+#define MAX_TRACE_POINTS 4096
+
+typedef struct trace_point {
+  int64_t time; // in nanoseconds
+  double bandwidth; // in bits per second
+} trace_point;
+
+static trace_point trace[MAX_TRACE_POINTS];
+static int num_trace_points = 0;
+
+/**
+ * Reads the trace file into trace.
+ * Returns 0 on success, -1 on error.
+ */
+static int read_trace(const char *path) {
+  FILE *fp;
+  char line[256];
+  int line_number = 0;
+
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    perror(path);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    double seconds, bandwidth;
+    line_number++;
+    if (line[0] == '#' || strspn(line, " \t\r\n") == strlen(line)) {
+      continue;
+    }
+    if (sscanf(line, "%lf %lf", &seconds, &bandwidth) != 2 ||
+        seconds < 0 || bandwidth <= 0) {
+      fprintf(stderr, "error: %s:%d: invalid line: %s", path, line_number, line);
+      fclose(fp);
+      return -1;
+    }
+    if (num_trace_points > 0 &&
+        seconds * NSEC_PER_SEC < trace[num_trace_points-1].time) {
+      fprintf(stderr, "error: %s:%d: time goes backwards\n", path, line_number);
+      fclose(fp);
+      return -1;
+    }
+    if (num_trace_points == MAX_TRACE_POINTS) {
+      fprintf(stderr, "error: %s: too many lines (max %d)\n", path, MAX_TRACE_POINTS);
+      fclose(fp);
+      return -1;
+    }
+    trace[num_trace_points].time = seconds * NSEC_PER_SEC;
+    trace[num_trace_points].bandwidth = bandwidth;
+    num_trace_points++;
+  }
+  fclose(fp);
+  if (num_trace_points < 2) {
+    fprintf(stderr, "error: %s: at least two lines are needed\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Returns the bandwidth of the link at time.
+ */
+static double get_bandwidth(int64_t time) {
+  int i;
+  for (i = num_trace_points - 1; i > 0; i--) {
+    if (trace[i].time <= time) {
+      break;
+    }
+  }
+  return trace[i].bandwidth;
+}
+
+int main(int argc, char **argv) {
+  long min_bitrate = (argc >= 3) ? atol(argv[2]) : 500000;
+  long max_bitrate = (argc >= 4) ? atol(argv[3]) : 4000000;
+  float fps = (argc >= 5) ? atof(argv[4]) : 30.0f;
+  long bitrate;
+  int64_t frame_interval;
+  int64_t now;
+  int64_t end_time;
+  double buffered_bytes = 0.0;
+  int decreases = 0;
+  int increases = 0;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <trace file> [min bitrate] [max bitrate] [fps]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (min_bitrate <= 0 || max_bitrate < min_bitrate || fps <= 0.0f) {
+    fprintf(stderr, "error: invalid bitrates or fps\n");
+    return EXIT_FAILURE;
+  }
+  if (read_trace(argv[1]) != 0) {
+    return EXIT_FAILURE;
+  }
+
+  abr_init(min_bitrate, max_bitrate, fps);
+  bitrate = max_bitrate;
+  frame_interval = NSEC_PER_SEC / fps;
+  end_time = trace[num_trace_points-1].time;
+
+  printf("# time(s) bandwidth(bps) bitrate(bps) write(ms/frame) decision\n");
+  for (now = trace[0].time; now < end_time; now += frame_interval) {
+    double bandwidth = get_bandwidth(now);
+    double frame_bytes = bitrate / fps / 8.0;
+    int64_t write_nsec = 0;
+
+    // The link has drained the buffer since the last frame
+    buffered_bytes -= bandwidth / 8.0 * frame_interval / NSEC_PER_SEC;
+    if (buffered_bytes < 0.0) {
+      buffered_bytes = 0.0;
+    }
+    // Block until the frame fits into the buffer
+    if (buffered_bytes + frame_bytes > SEND_BUFFER_BYTES) {
+      double excess_bytes = buffered_bytes + frame_bytes - SEND_BUFFER_BYTES;
+      write_nsec = excess_bytes * 8.0 / bandwidth * NSEC_PER_SEC;
+      buffered_bytes = SEND_BUFFER_BYTES;
+    } else {
+      buffered_bytes += frame_bytes;
+    }
+    // A blocked write delays the next frame
+    now += write_nsec;
+
+    ABR_DECISION decision = abr_end_frame(bitrate, now, write_nsec);
+    if (decision != ABR_DECISION_NONE) {
+      bitrate = abr_get_bitrate();
+      abr_commit(bitrate);
+      if (decision == ABR_DECISION_DECREASE) {
+        decreases++;
+      } else {
+        increases++;
+      }
+      printf("%.3f %.0f %ld %.2f %s%s\n",
+          now / (double) NSEC_PER_SEC, bandwidth, bitrate,
+          abr_get_write_time() / 1000000.0,
+          decision == ABR_DECISION_DECREASE ? "decrease" : "increase",
+          abr_needs_keyframe() ? " keyframe" : "");
+    }
+  }
+  printf("# %d decreases, %d increases, final bitrate %ld\n",
+      decreases, increases, bitrate);
+  return EXIT_SUCCESS;
+}
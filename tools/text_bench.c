@@ -0,0 +1,159 @@
+// Measures the cost of redrawing a text object, and of blending a
+// full-width subtitle into a 1080p video frame. It also checks that
+// a colored image overlay changes the U and V planes of the frame.
+// Build with "make bench" and run on the Raspberry Pi:
+//
+//   $ ./tools/text_bench [font name] [iterations]
+//   $ ./tools/text_bench_scalar [font name] [iterations]
+//
+// text_bench_scalar is built without NEON for comparison.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../text.h"
+
+#define CANVAS_WIDTH 1920
+#define CANVAS_HEIGHT 1080
+
+static int64_t get_monotonic_nsec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+/**
+ * Draws an opaque red image at an even position onto a gray frame.
+ * Returns 0 if both U and V under the image have changed, -1 otherwise.
+ */
+static int check_image_chroma(uint8_t *canvas) {
+  int width = 32;
+  int height = 32;
+  int x = 100;
+  int y = 100;
+  uint32_t *argb = malloc(width * height * sizeof(uint32_t));
+  int i, image_id;
+
+  if (argb == NULL) {
+    fprintf(stderr, "error: cannot allocate image\n");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < width * height; i++) {
+    argb[i] = 0xffff0000;
+  }
+  memset(canvas, 128, CANVAS_WIDTH * CANVAS_HEIGHT * 3 / 2);
+  image_id = text_create_image(argb, width, height); // takes over argb
+  text_set_position(image_id, x, y);
+  text_show_image(image_id);
+  text_draw_all(canvas, CANVAS_WIDTH, CANVAS_HEIGHT, 1);
+
+  uint8_t *canvas_u = canvas + CANVAS_WIDTH * CANVAS_HEIGHT;
+  uint8_t *canvas_v = canvas_u + CANVAS_WIDTH * CANVAS_HEIGHT / 4;
+  int offset = (y / 2 + height / 4) * (CANVAS_WIDTH / 2) + x / 2 + width / 4;
+  int ret = (canvas_u[offset] != 128 && canvas_v[offset] != 128) ? 0 : -1;
+  text_destroy(image_id);
+  text_draw_all(canvas, CANVAS_WIDTH, CANVAS_HEIGHT, 1);
+  return ret;
+}
+
+int main(int argc, char **argv) {
+  const char *font_name = (argc >= 2) ? argv[1] : "sans-serif";
+  int iterations = (argc >= 3) ? atoi(argv[2]) : 1000;
+  char *font_file;
+  int face_index;
+  int text_id;
+  int i;
+  char text[64];
+  int64_t start_time, cold_nsec, warm_nsec, blend_nsec;
+  uint8_t *canvas;
+  text_bounds bounds;
+  const char *subtitle = "The quick brown fox jumps over the lazy dog, "
+    "and then the lazy dog jumps over the fox.";
+
+  if (iterations <= 0) {
+    fprintf(stderr, "error: invalid iterations: %s\n", argv[2]);
+    return EXIT_FAILURE;
+  }
+
+  text_init();
+  if (text_select_font_file(font_name, &font_file, &face_index) != 0) {
+    fprintf(stderr, "error: font not found: %s\n", font_name);
+    return EXIT_FAILURE;
+  }
+  text_id = text_create(font_file, face_index, 28.0f, 96);
+  if (text_id <= 0) {
+    fprintf(stderr, "error: cannot create text with %s\n", font_file);
+    return EXIT_FAILURE;
+  }
+  text_set_stroke_width(text_id, 1.0f);
+
+  // The first redraw fills the glyph cache
+  snprintf(text, sizeof(text), "2024-01-01 00:00:00 camera 1");
+  text_set_text(text_id, text, strlen(text));
+  start_time = get_monotonic_nsec();
+  redraw_text_sync(text_id);
+  cold_nsec = get_monotonic_nsec() - start_time;
+
+  // Like a timestamp, only a few digits change on each redraw
+  start_time = get_monotonic_nsec();
+  for (i = 0; i < iterations; i++) {
+    snprintf(text, sizeof(text), "2024-01-01 00:%02d:%02d camera 1",
+        (i / 60) % 60, i % 60);
+    text_set_text(text_id, text, strlen(text));
+    redraw_text_sync(text_id);
+  }
+  warm_nsec = get_monotonic_nsec() - start_time;
+
+  // A subtitle line spanning the width of a 1080p frame
+  text_destroy(text_id);
+  text_id = text_create(font_file, face_index, 64.0f, 96);
+  if (text_id <= 0) {
+    fprintf(stderr, "error: cannot create text with %s\n", font_file);
+    return EXIT_FAILURE;
+  }
+  text_set_text(text_id, subtitle, strlen(subtitle));
+  text_set_layout(text_id, LAYOUT_ALIGN_CENTER | LAYOUT_ALIGN_BOTTOM, 0, 40);
+  redraw_text_sync(text_id);
+  text_get_bounds(text_id, subtitle, strlen(subtitle), &bounds);
+  canvas = calloc(CANVAS_WIDTH * CANVAS_HEIGHT * 3 / 2, 1);
+  if (canvas == NULL) {
+    fprintf(stderr, "error: cannot allocate canvas\n");
+    return EXIT_FAILURE;
+  }
+  text_draw_all(canvas, CANVAS_WIDTH, CANVAS_HEIGHT, 1); // applies the bitmap
+  start_time = get_monotonic_nsec();
+  for (i = 0; i < iterations; i++) {
+    text_draw_all(canvas, CANVAS_WIDTH, CANVAS_HEIGHT, 1);
+  }
+  blend_nsec = get_monotonic_nsec() - start_time;
+
+  printf("font: %s\n", font_file);
+#ifdef __ARM_NEON__
+  printf("blending: NEON\n");
+#else
+  printf("blending: scalar\n");
+#endif
+  printf("first redraw: %.1f us\n", cold_nsec / 1000.0);
+  printf("redraw: %.1f us per call (%d calls)\n",
+      warm_nsec / 1000.0 / iterations, iterations);
+  printf("blend %dx%d subtitle into %dx%d frame: %.0f ns per frame (%d frames)\n",
+      bounds.width, bounds.height, CANVAS_WIDTH, CANVAS_HEIGHT,
+      (double)blend_nsec / iterations, iterations);
+
+  text_destroy(text_id);
+  text_draw_all(canvas, CANVAS_WIDTH, CANVAS_HEIGHT, 1); // destroys the text
+
+  // A red image at an even position must be drawn with its chroma
+  if (check_image_chroma(canvas) != 0) {
+    fprintf(stderr, "error: image overlay did not change U and V planes\n");
+    return EXIT_FAILURE;
+  }
+  printf("image chroma: ok\n");
+
+  free(canvas);
+  free(font_file);
+  text_teardown();
+  return EXIT_SUCCESS;
+}
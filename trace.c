@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+// Number of events in the ring (must be a power of 2).
+// About 10 events are recorded per frame, so this holds
+// more than 100 seconds at 30 fps.
+#define TRACE_RING_SIZE 32768
+
+typedef struct trace_event {
+  uint32_t sequence; // index of the event + 1, or 0 while being written
+  int32_t tid;
+  int64_t time; // CLOCK_MONOTONIC in nanoseconds
+  int64_t frame;
+  uint8_t stage;
+  char phase; // 'B', 'E', or 'i'
+} trace_event;
+
+static const char *stage_names[TRACE_STAGE_COUNT] = {
+  "camera_buffer_done",
+  "overlay",
+  "encoder_input",
+  "encoded_nal",
+  "record_write",
+  "hls_write",
+  "hls_segment_publish",
+  "tcp_write",
+  "rtsp_write",
+};
+
+int is_trace_enabled = 0;
+static trace_event *ring = NULL;
+static uint32_t write_index = 0;
+static __thread int32_t thread_id = 0;
+
+int trace_init() {
+  ring = calloc(TRACE_RING_SIZE, sizeof(trace_event));
+  if (ring == NULL) {
+    perror("calloc trace ring");
+    return -1;
+  }
+  is_trace_enabled = 1;
+  return 0;
+}
+
+void trace_teardown() {
+  is_trace_enabled = 0;
+  free(ring);
+  ring = NULL;
+}
+
+/**
+ * Appends an event to the ring. Any thread can call this without a lock.
+ */
+void trace_record(trace_stage stage, char phase, int64_t frame) {
+  struct timespec ts;
+  uint32_t index;
+  trace_event *event;
+
+  if (thread_id == 0) {
+    thread_id = syscall(SYS_gettid);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  index = __atomic_fetch_add(&write_index, 1, __ATOMIC_RELAXED);
+  event = &ring[index & (TRACE_RING_SIZE - 1)];
+  __atomic_store_n(&event->sequence, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  event->tid = thread_id;
+  event->time = ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+  event->frame = frame;
+  event->stage = stage;
+  event->phase = phase;
+  __atomic_store_n(&event->sequence, index + 1, __ATOMIC_RELEASE);
+}
+
+int trace_dump(const char *path, int seconds) {
+  struct timespec ts;
+  int64_t since;
+  uint32_t end, i;
+  int is_first = 1;
+  int count = 0;
+  FILE *fp;
+
+  if (!is_trace_enabled) {
+    fprintf(stderr, "trace: tracing is not enabled\n");
+    return -1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  since = ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec - seconds * INT64_C(1000000000);
+
+  fp = fopen(path, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "trace: cannot open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+  end = __atomic_load_n(&write_index, __ATOMIC_ACQUIRE);
+  i = (end > TRACE_RING_SIZE) ? end - TRACE_RING_SIZE : 0;
+  for (; i != end; i++) {
+    trace_event *slot = &ring[i & (TRACE_RING_SIZE - 1)];
+    trace_event event;
+
+    // Skip the event if a writer has overwritten it while copying
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != i + 1) {
+      continue;
+    }
+    memcpy(&event, slot, sizeof(event));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != i + 1) {
+      continue;
+    }
+    if (event.time < since || event.stage >= TRACE_STAGE_COUNT) {
+      continue;
+    }
+
+    fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"picam\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d",
+        is_first ? "" : ",", stage_names[event.stage], event.phase,
+        event.time / 1000.0, getpid(), event.tid);
+    if (event.phase == 'i') {
+      fprintf(fp, ",\"s\":\"t\"");
+    }
+    if (event.frame >= 0) {
+      fprintf(fp, ",\"args\":{\"frame\":%lld}", (long long)event.frame);
+    }
+    fprintf(fp, "}");
+    is_first = 0;
+    count++;
+  }
+
+  fprintf(fp, "\n]}\n");
+  if (fclose(fp) != 0) {
+    fprintf(stderr, "trace: cannot write %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  fprintf(stderr, "trace: wrote %d events to %s\n", count, path);
+  return 0;
+}
@@ -0,0 +1,69 @@
+#ifndef PICAM_TRACE_H
+#define PICAM_TRACE_H
+
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+typedef enum trace_stage {
+  TRACE_CAMERA_BUFFER_DONE,
+  TRACE_OVERLAY,
+  TRACE_ENCODER_INPUT, // OMX_EmptyThisBuffer
+  TRACE_ENCODED_NAL,
+  TRACE_RECORD_WRITE,
+  TRACE_HLS_WRITE,
+  TRACE_HLS_SEGMENT_PUBLISH,
+  TRACE_TCP_WRITE,
+  TRACE_RTSP_WRITE,
+  TRACE_STAGE_COUNT
+} trace_stage;
+
+extern int is_trace_enabled;
+
+/**
+ * Allocates the trace ring and starts recording trace events.
+ * Returns 0 on success, -1 on error.
+ */
+int trace_init();
+
+/**
+ * Stops recording trace events and frees the trace ring.
+ */
+void trace_teardown();
+
+void trace_record(trace_stage stage, char phase, int64_t frame);
+
+/**
+ * Records the start of stage for the frame. frame is -1 if the
+ * stage is not tied to a video frame. This costs only a branch
+ * when tracing is disabled.
+ */
+#define trace_begin(stage, frame) \
+  do { if (is_trace_enabled) trace_record(stage, 'B', frame); } while (0)
+
+/**
+ * Records the end of stage started by trace_begin() on the same thread.
+ */
+#define trace_end(stage, frame) \
+  do { if (is_trace_enabled) trace_record(stage, 'E', frame); } while (0)
+
+/**
+ * Records an instant event.
+ */
+#define trace_instant(stage, frame) \
+  do { if (is_trace_enabled) trace_record(stage, 'i', frame); } while (0)
+
+/**
+ * Writes the events of the last seconds to path as Chrome trace event
+ * JSON, which can be opened in chrome://tracing or Perfetto UI.
+ * Returns 0 on success, -1 on error.
+ */
+int trace_dump(const char *path, int seconds);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // PICAM_TRACE_H